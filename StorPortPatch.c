@@ -154,6 +154,25 @@ ULONG StorpFreeTimer(__in PVOID HwDeviceExtension,__in PVOID TimerHandle)
 }
 
 
+//------------------------------------------------------------------------------
+// StorpQueryPerformanceCounter -> function code 47
+//------------------------------------------------------------------------------
+ULONG StorpQueryPerformanceCounter(__in PVOID HwDeviceExtension,__out_opt PLARGE_INTEGER PerformanceFrequency,__out PLARGE_INTEGER PerformanceCounter)
+{
+	UNREFERENCED_PARAMETER(HwDeviceExtension);
+
+	if(PerformanceCounter == NULL)
+	{
+		return STOR_STATUS_INVALID_PARAMETER;
+	}
+
+	// KeQueryPerformanceCounter can be called at any IRQL
+	*PerformanceCounter = KeQueryPerformanceCounter(PerformanceFrequency);
+
+	return STOR_STATUS_SUCCESS;
+}
+
+
 //------------------------------------------------------------------------------
 // StorPortExtendedFunction
 //------------------------------------------------------------------------------
@@ -255,6 +274,18 @@ ULONG StorPortPatchExtendedFunction(__in STORPORT_FUNCTION_CODE FunctionCode,__i
 			status = StorpFreeTimer(HwDeviceExtension,TimerHandle);
 			break;
 		}
+		// without handling this function code there are no timestamps for command duration and link idle time
+		// function code 47
+		case ExtFunctionQueryPerformanceCounter:
+		{
+			PLARGE_INTEGER PerformanceFrequency;
+			PLARGE_INTEGER PerformanceCounter;
+			PerformanceFrequency = va_arg(argptr,PLARGE_INTEGER);
+			PerformanceCounter = va_arg(argptr,PLARGE_INTEGER);
+
+			status = StorpQueryPerformanceCounter(HwDeviceExtension,PerformanceFrequency,PerformanceCounter);
+			break;
+		}
 		// all other function codes go here
 		default:
 		{
@@ -163,7 +163,7 @@ typedef struct _AHCI_SET_DEVICE_BITS_FIS {
 
     UCHAR Error;
 
-    UCHAR Reserved5[4];
+    ULONG SActive;   //Native Command Queuing: a bit set for each tag completed by this FIS
 }  AHCI_SET_DEVICE_BITS_FIS, *PAHCI_SET_DEVICE_BITS_FIS;
 typedef struct _AHCI_UNKNOWN_FIS {
   UCHAR Raw[64];
@@ -549,6 +549,26 @@ typedef union _AHCI_DEVICE_SLEEP {
 
 }  AHCI_DEVICE_SLEEP, *PAHCI_DEVICE_SLEEP;
 
+//FIS-based Switching Control as defined in AHCI1.3.1 section 3.3.16: Offset 40h: PxFBS - Port x FIS-based Switching Control
+typedef union _AHCI_FIS_BASED_SWITCHING_CONTROL {
+
+    struct {
+        //LSB
+        ULONG EN    :1;     // Enable (EN): When set to '1', an HBA shall enable FIS-based switching for this port. Software shall only change this bit while PxCMD.ST is cleared to '0' and PxCMD.PMA is set to '1'.
+        ULONG DEC   :1;     // Device Error Clear (DEC): Software writes '1' to clear the error for the device specified in DWE; the HBA clears it when done.
+        ULONG SDE   :1;     // Single Device Error (SDE): When set to '1', the error reported is limited to the device specified in DWE.
+        ULONG Reserved0 :5;
+        ULONG DEV   :4;     // Device To Issue (DEV): Port Multiplier port of the device that software is issuing the next command to.
+        ULONG ADO   :4;     // Active Device Optimization (ADO): Number of devices the HBA has been optimized to have active concurrently.
+        ULONG DWE   :4;     // Device With Error (DWE): Port Multiplier port of the device that experienced a fatal error when SDE is set.
+        ULONG Reserved1 :12;
+        //MSB
+    };
+
+    ULONG AsUlong;
+
+}  AHCI_FIS_BASED_SWITCHING_CONTROL, *PAHCI_FIS_BASED_SWITCHING_CONTROL;
+
 //Status of the Task File Data as defined in AHCI1.0 section 3.3.8
 typedef union _AHCI_TASK_FILE_DATA_STATUS {
 
@@ -742,7 +762,7 @@ typedef struct _AHCI_PORT {
 
     AHCI_SNOTIFICATION SNTF;
 
-    ULONG ReservedForFIS_Based_Switching;
+    AHCI_FIS_BASED_SWITCHING_CONTROL FBS;
 
     AHCI_DEVICE_SLEEP DEVSLP;
 
@@ -69,6 +69,12 @@ BuildHybridEvictCommand(
     __in USHORT                 BlockCount
     );
 
+VOID
+HotLbaPromoteCompletion(
+    __in PAHCI_CHANNEL_EXTENSION ChannelExtension,
+    __in PSCSI_REQUEST_BLOCK_EX  Srb
+    );
+
 ULONG
 SCSItoATA(
     __in PAHCI_CHANNEL_EXTENSION ChannelExtension,
@@ -720,6 +726,16 @@ SrbConvertToATACommand(
         status = AtaUnmapRequest(ChannelExtension, Srb);
         break;
 
+    case SCSIOP_WRITE_SAME:
+    case SCSIOP_WRITE_SAME16:
+        status = AtaWriteSameRequest(ChannelExtension, Srb, Cdb);
+        break;
+
+    case SCSIOP_ZBC_IN:
+    case SCSIOP_ZBC_OUT:
+        status = AtaZonedBlockDeviceRequest(ChannelExtension, Srb, Cdb);
+        break;
+
     default:
 
         Srb->SrbStatus = SRB_STATUS_INVALID_REQUEST;
@@ -919,229 +935,6 @@ Return Value:
     return;
 }
 
-__inline
-UCHAR
-GetReadWriteRequestAtaCommand (
-    __in PAHCI_CHANNEL_EXTENSION ChannelExtension,
-    __in PSCSI_REQUEST_BLOCK_EX  Srb,
-    __in PCDB                    Cdb
-    )
-/*++
-
-Routine Description:
-
-
-Arguments:
-
-    ChannelExtension -
-    Srb -
-    Cdb -
-
-Return Value:
-
-    The translated ATA command.
-
---*/
-{
-    PAHCI_SRB_EXTENSION srbExtension = GetSrbExtension(Srb);
-    UCHAR               commandReg = IDE_COMMAND_NOT_VALID;
-
-    if (IsSupportedReadCdb(Cdb)) {
-        if( ChannelExtension->StateFlags.NCQ_Activated ) {
-            // use NCQ command as preferred command.
-            commandReg = IDE_COMMAND_READ_FPDMA_QUEUED;
-        } else {
-            // SATA device, use DMA read command.
-            if (Is48BitCommand(srbExtension->Flags)) {
-                commandReg = IDE_COMMAND_READ_DMA_EXT;
-            } else {
-                commandReg = IDE_COMMAND_READ_DMA;
-            }
-        }
-    } else {
-        if( ChannelExtension->StateFlags.NCQ_Activated ) {
-            // change the command to be NCQ command
-            commandReg = IDE_COMMAND_WRITE_FPDMA_QUEUED;
-        } else {
-            // Make all writes into WRITE_DMA
-            // If FUA, keep track of FUA even there is nothing to do with this bit later
-            if (Is48BitCommand(srbExtension->Flags)) {
-                if ( (Cdb->CDB10.ForceUnitAccess == 1) && IsFuaSupported(ChannelExtension) ) {
-                    // DMA write ext FUA (48 bit)
-                    commandReg = IDE_COMMAND_WRITE_DMA_FUA_EXT;
-                } else {
-                    // DMA write ext (48 bit)
-                    commandReg = IDE_COMMAND_WRITE_DMA_EXT;
-                }
-            } else {
-                // DMA write
-                commandReg = IDE_COMMAND_WRITE_DMA;
-            }
-        }
-    }
-
-    return commandReg;
-}
-
-VOID
-BuildReadWriteCommand (
-    __in PAHCI_CHANNEL_EXTENSION ChannelExtension,
-    __in PSCSI_REQUEST_BLOCK_EX  Srb,
-    __in PCDB                    Cdb,
-    __in ULONG                   CdbLength
-    )
-/*++
-
-Routine Description:
-
-    Sets up SATA CFIS data structure for read/write. The routine shall not
-    modify any other field in the srb or device extension.
-
-Arguments:
-
-    ChannelExtension
-    Srb
-    Cdb
-    CdbLength
-
-Return Value:
-
-    None.
-
-Notes:
-
-    All the other fields in the srb should be set before calling this routine.
-
---*/
-{
-    LARGE_INTEGER   startingSector;
-    ULONG           bytesPerSector;
-    ULONG           sectorCount;
-    BOOLEAN         hybridPriorityPassedIn = FALSE;
-
-    PAHCI_SRB_EXTENSION     srbExtension = GetSrbExtension(Srb);
-    ULONG                   srbDataBufferLength = SrbGetDataTransferLength(Srb);
-    PAHCI_H2D_REGISTER_FIS  cfis = &srbExtension->Cfis;
-
-    bytesPerSector = BytesPerLogicalSector(&ChannelExtension->DeviceExtension->DeviceParameters);
-
-    //
-    // Calculate sector count. Round up to next block.
-    //
-    sectorCount = (srbDataBufferLength + bytesPerSector - 1) / bytesPerSector;
-
-    //
-    // Get starting sector number from CDB.
-    //
-    startingSector.QuadPart = GetLbaFromCdb(Cdb, CdbLength);
-
-    NT_ASSERT(sectorCount != 0);
-    NT_ASSERT(sectorCount <= 0x10000);  // transfer length should not over ATA physical transfer limitation.
-
-    //
-    // Command and AtaFunction should be set first. It will be referenced later in this function.
-    //
-    srbExtension->AtaFunction = ATA_FUNCTION_ATA_CFIS_PAYLOAD;
-
-    cfis->Command = GetReadWriteRequestAtaCommand(ChannelExtension, Srb, Cdb);
-
-    //
-    // Set LBA bits 0 - 23 first.
-    //
-    cfis->LBA7_0 = (UCHAR)(((startingSector.LowPart) & 0x000000ff) >> 0);
-    cfis->LBA15_8 = (UCHAR)(((startingSector.LowPart) & 0x0000ff00) >> 8);
-    cfis->LBA23_16 = (UCHAR)(((startingSector.LowPart) & 0x00ff0000) >> 16);
-
-    if (IsNCQCommand(srbExtension) || Support48Bit(&ChannelExtension->DeviceExtension->DeviceParameters)) {
-        //
-        // Set LBA bits 24 - 47 for devices that support 48bits commands.
-        //
-        cfis->LBA31_24 = (UCHAR)(((startingSector.LowPart) & 0xff000000) >> 24);
-        cfis->LBA39_32 = (UCHAR)(((startingSector.HighPart) & 0x000000ff) >> 0);
-        cfis->LBA47_40 = (UCHAR)(((startingSector.HighPart) & 0x0000ff00) >> 8);
-    } else {
-        //
-        // Set LBA bits 24 - 27 for devices that support 28bits commands only.
-        //
-        cfis->Device = (UCHAR)(((startingSector.LowPart) & 0x0f000000) >> 24);
-    }
-
-    //
-    // Set Sector Counts and Device fields.
-    //
-    if (IsNCQCommand(srbExtension)) {
-        cfis->Feature7_0 = (UCHAR)((sectorCount & 0x000000ff) >> 0);
-        cfis->Feature15_8 = (UCHAR)((sectorCount & 0x0000ff00) >> 8);
-
-        cfis->Device |= IDE_LBA_MODE;
-
-        if( (Cdb->CDB10.ForceUnitAccess == 1) && IsFuaSupported(ChannelExtension) ){
-            cfis->Device |= ATA_NCQ_FUA_BIT;
-        } else {
-            cfis->Device &= ~ATA_NCQ_FUA_BIT;
-        }
-
-    } else {
-        cfis->Count7_0 = (UCHAR)((sectorCount & 0x000000ff) >> 0);
-
-        if (Support48Bit(&ChannelExtension->DeviceExtension->DeviceParameters)) {
-            cfis->Count15_8 = (UCHAR)((sectorCount & 0x0000ff00) >> 8);
-        } else {
-            // we cannot handle more than 256 sectors
-            NT_ASSERT(sectorCount <= 0x100);
-
-            // The starting LBA should be less than 28 bits wide
-            NT_ASSERT(startingSector.HighPart == 0);
-
-            // The upper layers could still send us sectors beyond the
-            // end of the disk. Do not assert. Let the device fail it.
-            //
-            //NT_ASSERT((startingSector.LowPart & 0xF0000000) == 0);
-        }
-
-        cfis->Device |= (0xA0 | IDE_LBA_MODE);
-    }
-
-    //
-    // Normal Stack, cache priority info can be passed with READ or WRITE request.
-    // For Hiberfile, only pass cache priority info for WRITE request.
-    //
-    if ((!IsDumpMode(ChannelExtension->AdapterExtension) && IsDeviceHybridInfoEnabled(ChannelExtension) && IsNcqReadWriteCommand(srbExtension)) ||
-        ((ChannelExtension->StateFlags.HybridInfoEnabledOnHiberFile == 1) && IsNCQWriteCommand(srbExtension))) {
-
-        PSRBEX_DATA_IO_INFO_EX srbExInfo = (PSRBEX_DATA_IO_INFO_EX)SrbGetSrbExDataByType((PSTORAGE_REQUEST_BLOCK)Srb, SrbExDataTypeIoInfo);
-
-        if ((srbExInfo != NULL) &&
-            ((srbExInfo->Flags & REQUEST_INFO_VALID_CACHEPRIORITY_FLAG) != 0) &&
-            (srbExInfo->CachePriority <= ChannelExtension->DeviceExtension->HybridInfo.MaximumHybridPriorityLevel)) {
-
-            ATA_HYBRID_INFO_FIELDS hybridInfo = {0};
-
-            hybridInfo.InfoValid = 1;
-            hybridInfo.HybridPriority = srbExInfo->CachePriority;
-
-            cfis->Auxiliary23_16 = hybridInfo.AsUchar;
-
-            //
-            // For WRITE request that requires HybridPassThrough, assign completion routine
-            // to issue EVICT command for evicting data out of caching medium.
-            //
-            if (!IsDumpMode(ChannelExtension->AdapterExtension) && IsNCQWriteCommand(srbExtension) &&
-                ((srbExInfo->Flags & REQUEST_INFO_HYBRID_WRITE_THROUGH_FLAG) != 0) &&
-                (ChannelExtension->DeviceExtension->SupportedCommands.HybridEvict == 1)) {
-
-                srbExtension->CompletionRoutine = HybridWriteThroughCompletion;
-            }
-
-            hybridPriorityPassedIn = TRUE;
-        }
-    }
-
-
-    return;
-}
-
-
 VOID
 AtaSetWriteCommand (
     __in PAHCI_CHANNEL_EXTENSION ChannelExtension,
@@ -1239,6 +1032,61 @@ Return Value:
     return;
 }
 
+VOID
+AtaSetStreamCommand (
+    __in PAHCI_CHANNEL_EXTENSION ChannelExtension,
+    __in PSCSI_REQUEST_BLOCK_EX Srb,
+    __in UCHAR StreamFeatures,
+    __in UCHAR StreamTimeLimit
+    )
+/*++
+
+Routine Description:
+
+    Sets READ STREAM DMA EXT or WRITE STREAM DMA EXT in the TaskFile for a request inside the LBA range of a stream.
+    Streaming commands have no NCQ form, they go out as non-queued commands.
+
+Arguments:
+
+    ChannelExtension
+    Srb
+    StreamFeatures - stream ID and Read/Write Continuous, see GetStreamForRequest()
+    StreamTimeLimit - completion time limit (CCTL) of the command
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PAHCI_SRB_EXTENSION srbExtension = GetSrbExtension(Srb);
+    PAHCI_STREAM_STATISTICS streamStatistics = &ChannelExtension->StreamStatistics[StreamFeatures & IDE_STREAM_ID_MASK];
+
+    // stream ID and Read/Write Continuous in FEATURE 7:0, completion time limit (CCTL) in FEATURE 15:8.
+    SetFeaturesReg((&srbExtension->TaskFile.Current), StreamFeatures);
+    SetFeaturesReg((&srbExtension->TaskFile.Previous), StreamTimeLimit);
+
+    if (srbExtension->AtaFunction == ATA_FUNCTION_ATA_READ) {
+        SetCommandReg((&srbExtension->TaskFile.Current), IDE_COMMAND_READ_STREAM_DMA_EXT);
+
+        AhciUlongIncrement(&streamStatistics->ReadCount);
+        streamStatistics->ReadBytes += Srb->DataTransferLength;
+    } else {
+        SetCommandReg((&srbExtension->TaskFile.Current), IDE_COMMAND_WRITE_STREAM_DMA_EXT);
+
+        // WRITE STREAM DMA EXT has no FUA form, the Flush bit writes the data to media before the command completes.
+        if ( (((PCDB)Srb->Cdb)->CDB10.ForceUnitAccess) &&
+             IsFuaSupported(ChannelExtension) ) {
+            srbExtension->TaskFile.Current.bFeaturesReg |= IDE_STREAM_FLUSH;
+        }
+
+        AhciUlongIncrement(&streamStatistics->WriteCount);
+        streamStatistics->WriteBytes += Srb->DataTransferLength;
+    }
+
+    return;
+}
+
 VOID
 AtaConstructReadWriteTaskFile (
     __in PAHCI_CHANNEL_EXTENSION ChannelExtension,
@@ -1269,6 +1117,9 @@ Notes:
     LARGE_INTEGER   startingSector;
     ULONG           bytesPerSector;
     ULONG           sectorCount;
+    UCHAR           streamId = AHCI_STREAM_ID_NONE;
+    UCHAR           streamFeatures;
+    UCHAR           streamTimeLimit;
 
     PAHCI_SRB_EXTENSION srbExtension = GetSrbExtension(Srb);
 
@@ -1286,7 +1137,16 @@ Notes:
                             sectorCount
                             );
 
-    if (srbExtension->AtaFunction == ATA_FUNCTION_ATA_READ) {
+    // streaming commands are 48 bit, requests inside the LBA range of a stream are sent as READ/WRITE STREAM DMA EXT.
+    if (Is48BitCommand(srbExtension->Flags)) {
+        streamId = GetStreamForRequest(ChannelExtension, startingSector.QuadPart, sectorCount, &streamFeatures, &streamTimeLimit);
+    }
+
+    if (streamId != AHCI_STREAM_ID_NONE) {
+        AtaSetStreamCommand(ChannelExtension, Srb, streamFeatures, streamTimeLimit);
+
+        NT_ASSERT(IsStreamingCommand(srbExtension));
+    } else if (srbExtension->AtaFunction == ATA_FUNCTION_ATA_READ) {
         AtaSetReadCommand(ChannelExtension, Srb);
     } else {
         AtaSetWriteCommand(ChannelExtension, Srb);
@@ -1347,8 +1207,30 @@ AtaReadWriteRequest (
         return STOR_STATUS_INVALID_PARAMETER;
     }
 
+    // high priority requests are issued first, NCQ commands also carry the priority to device.
+    if (IsHighPriorityIo(ChannelExtension, Srb, (srbExtension->AtaFunction == ATA_FUNCTION_ATA_READ))) {
+        srbExtension->Flags |= ATA_FLAGS_HIGH_PRIORITY;
+    }
+
+    // reads of a hybrid device feed the heat map used to promote hot extents to the caching medium.
+    if ( (ChannelExtension->HotLba.Budget != 0) &&
+         (srbExtension->AtaFunction == ATA_FUNCTION_ATA_READ) &&
+         !IsDumpMode(ChannelExtension->AdapterExtension) &&
+         IsDeviceHybridInfoEnabled(ChannelExtension) ) {
+        HotLbaTrackRead(ChannelExtension, GetLbaFromCdb(Cdb, Srb->CdbLength));
+    }
+
     AtaConstructReadWriteTaskFile(ChannelExtension, Srb);
 
+    // Command Duration Limits descriptor index goes with NCQ reads and writes, see SRBtoATA_CFIS().
+    if (IsNcqReadWriteCommand(srbExtension)) {
+        srbExtension->CommandDurationLimitIndex = GetCommandDurationLimitIndex(ChannelExtension, Srb, Cdb, Srb->CdbLength);
+
+        if (srbExtension->CommandDurationLimitIndex != 0) {
+            AhciUlongIncrement(&ChannelExtension->CdlStatistics.CommandCount);
+        }
+    }
+
     return STOR_STATUS_SUCCESS;
 }
 
@@ -2134,89 +2016,332 @@ AtaGenerateInquiryData (
 }
 
 VOID
-IssueIdentifyCommand(
+AtaBuildInquiryCache (
     __in PAHCI_CHANNEL_EXTENSION ChannelExtension,
-    __in PSCSI_REQUEST_BLOCK_EX Srb
+    __out PAHCI_INQUIRY_CACHE    InquiryCache
     )
 /*++
-    This could be a macro.  broken out here to make the logic easier to read
+    Builds INQUIRY data and all supported VPD pages of an ATA device from IDENTIFY DEVICE data and device parameters.
 It assumes:
-    nothing
+    IDENTIFY DEVICE data has been digested by UpdateDeviceParameters()
 Called by:
-    AtaInquiryRequest
-    AtaReportLunsCommand
-
+    AtaGetInquiryCache
 
 It performs:
-    1 Fills in the local SRB with the SetFeatures command
-    2 Starts processing the command
-Affected Variables/Registers:
-    none
-
+    1 Standard INQUIRY data
+    2 VPD pages: Supported Pages, Block Limits, Block Device Characteristics, Logical Block Provisioning, Unit Serial Number, ATA Information
 --*/
 {
-    PAHCI_SRB_EXTENSION srbExtension = GetSrbExtension(Srb);
+    UCHAR   deviceType = ChannelExtension->DeviceExtension->DeviceParameters.ScsiDeviceType;
 
-  //1 Fills in the local SRB
-    srbExtension->AtaFunction = ATA_FUNCTION_ATA_IDENTIFY;
-    srbExtension->Flags |= ATA_FLAGS_DATA_IN;
-    srbExtension->CompletionRoutine = AhciPortIdentifyDevice;
+    AhciZeroMemory((PCHAR)InquiryCache, sizeof(AHCI_INQUIRY_CACHE));
 
-    //setup TaskFile
-    srbExtension->TaskFile.Current.bFeaturesReg = 0;
-    srbExtension->TaskFile.Current.bSectorCountReg = 0;
-    srbExtension->TaskFile.Current.bSectorNumberReg = 0;
-    srbExtension->TaskFile.Current.bCylLowReg = 0;
-    srbExtension->TaskFile.Current.bCylHighReg = 0;
-    srbExtension->TaskFile.Current.bDriveHeadReg = 0xA0;
-    srbExtension->TaskFile.Current.bCommandReg = IDE_COMMAND_NOT_VALID; //the command will be set when we can read PxSIG register.
-    srbExtension->TaskFile.Current.bReserved = 0;
-    srbExtension->TaskFile.Previous.bFeaturesReg = 0;
-    srbExtension->TaskFile.Previous.bSectorCountReg = 0;
-    srbExtension->TaskFile.Previous.bSectorNumberReg = 0;
-    srbExtension->TaskFile.Previous.bCylLowReg = 0;
-    srbExtension->TaskFile.Previous.bCylHighReg = 0;
-    srbExtension->TaskFile.Previous.bDriveHeadReg = 0;
-    srbExtension->TaskFile.Previous.bCommandReg = 0;
-    srbExtension->TaskFile.Previous.bReserved = 0;
+  //1 Standard INQUIRY data
+    AtaGenerateInquiryData(ChannelExtension, (PINQUIRYDATA)InquiryCache->StandardInquiry);
 
-    Srb->SrbStatus = SRB_STATUS_PENDING;
-    srbExtension->DataBuffer = (PVOID)ChannelExtension->DeviceExtension->IdentifyDeviceData;
+  //2.1 Supported VPD Pages
+    {
+        PVPD_SUPPORTED_PAGES_PAGE outputBuffer = (PVPD_SUPPORTED_PAGES_PAGE)InquiryCache->SupportedPages;
 
-    srbExtension->LocalSgl.NumberOfElements = 1;
-    srbExtension->LocalSgl.List[0].PhysicalAddress.LowPart = ChannelExtension->DeviceExtension->IdentifyDataPhysicalAddress.LowPart;
-    srbExtension->LocalSgl.List[0].PhysicalAddress.HighPart = ChannelExtension->DeviceExtension->IdentifyDataPhysicalAddress.HighPart;
-    srbExtension->LocalSgl.List[0].Length = sizeof(IDENTIFY_DEVICE_DATA);
-    srbExtension->Sgl = &srbExtension->LocalSgl;
-    srbExtension->DataTransferLength = sizeof(IDENTIFY_DEVICE_DATA);
-    return;
-}
+        outputBuffer->DeviceType = deviceType;
+        outputBuffer->DeviceTypeQualifier = 0;
+        outputBuffer->PageCode = VPD_SUPPORTED_PAGES;
+        outputBuffer->PageLength = AHCI_VPD_SUPPORTED_PAGES_COUNT;
+        outputBuffer->SupportedPageList[0] = VPD_SUPPORTED_PAGES;
+        outputBuffer->SupportedPageList[1] = VPD_SERIAL_NUMBER;
+        outputBuffer->SupportedPageList[2] = VPD_ATA_INFORMATION;
+        outputBuffer->SupportedPageList[3] = VPD_BLOCK_LIMITS;
+        outputBuffer->SupportedPageList[4] = VPD_BLOCK_DEVICE_CHARACTERISTICS;
+        outputBuffer->SupportedPageList[5] = VPD_LOGICAL_BLOCK_PROVISIONING;
+    }
 
-ULONG
-InquiryComplete(
-    __in PAHCI_CHANNEL_EXTENSION ChannelExtension,
-    __in PSCSI_REQUEST_BLOCK_EX Srb
-    )
-/*++
-    This is the completion point of INQUIRY command for ATA devices.
+  //2.2 Block Limits, the short form leaves all descriptors '0' indicating 'not supported'.
+    {
+        PVPD_BLOCK_LIMITS_PAGE outputBuffer = (PVPD_BLOCK_LIMITS_PAGE)InquiryCache->BlockLimitsShort;
 
-Arguments:
+        outputBuffer->DeviceType = deviceType;
+        outputBuffer->DeviceTypeQualifier = 0;
+        outputBuffer->PageCode = VPD_BLOCK_LIMITS;
+        outputBuffer->PageLength[1] = 0x10;
 
-    ChannelExtension
-    Srb
+        outputBuffer = (PVPD_BLOCK_LIMITS_PAGE)InquiryCache->BlockLimits;
 
-Return Value:
-    ULONG - status
---*/
-{
-    ULONG   status = STOR_STATUS_SUCCESS;
-    ULONG   dataTransferLength = 0;
-    // this is a standard INQUIRY
-    UCHAR   inquiryData[ATA_INQUIRYDATA_SIZE] = {0};
-    PCDB    cdb = SrbGetCdb(Srb);
-    PVOID   srbDataBuffer = SrbGetDataBuffer(Srb);
+        outputBuffer->DeviceType = deviceType;
+        outputBuffer->DeviceTypeQualifier = 0;
+        outputBuffer->PageCode = VPD_BLOCK_LIMITS;
 
-    UCHAR   pathId = 0;
+        //
+        // leave outputBuffer->Descriptors[0 : 15] as '0' indicating 'not supported' for those fields.
+        //
+
+        if (IsDeviceSupportsTrim(ChannelExtension) || IsDeviceSupportsSctWriteSame(ChannelExtension)) {
+
+            // UNMAP and WRITE SAME information.
+            outputBuffer->PageLength[1] = 0x3C;        // must be 0x3C per spec
+
+            if (IsDeviceSupportsTrim(ChannelExtension)) {
+                // not worry about multiply overflow as max of DsmCapBlockCount is min(AHCI_MAX_TRANSFER_LENGTH / ATA_BLOCK_SIZE, 0xFFFF)
+                // calculate how many LBA ranges can be associated with one DSM - Trim command
+                ULONG   maxLbaRangeEntryCountPerCmd = ChannelExtension->DeviceExtension[0].DeviceParameters.DsmCapBlockCount * (ATA_BLOCK_SIZE / sizeof(ATA_LBA_RANGE));
+                // calculate how many LBA can be associated with one DSM - Trim command
+                ULONG   maxLbaCountPerCmd = maxLbaRangeEntryCountPerCmd * MAX_ATA_LBA_RANGE_SECTOR_COUNT_VALUE;
+
+                NT_ASSERT (maxLbaCountPerCmd > 0);
+
+                // (16:19) MAXIMUM UNMAP LBA COUNT
+                REVERSE_BYTES(&outputBuffer->Descriptors[16], &maxLbaCountPerCmd);
+
+                // (20:23) MAXIMUM UNMAP BLOCK DESCRIPTOR COUNT
+                REVERSE_BYTES(&outputBuffer->Descriptors[20], &maxLbaRangeEntryCountPerCmd);
+
+                // (24:27) OPTIMAL UNMAP GRANULARITY
+                // (28:31) UNMAP GRANULARITY ALIGNMENT; (28) bit7: UGAVALID
+                    //leave '0' indicates un-supported.
+            }
+
+            if ( IsDeviceSupportsWriteSameUnmap(ChannelExtension) ||
+                 IsDeviceSupportsSctWriteSame(ChannelExtension) ) {
+                ULONG64 maxWriteSameLength = GetWriteSameMaxBlockCount(ChannelExtension);
+
+                // (0) bit0: WSNZ, WRITE SAME with NUMBER OF LOGICAL BLOCKS 0 is not supported
+                outputBuffer->Descriptors[0] = 0x01;
+
+                // (32:39) MAXIMUM WRITE SAME LENGTH
+                REVERSE_BYTES_QUAD(&outputBuffer->Descriptors[32], &maxWriteSameLength);
+            }
+        } else {
+            outputBuffer->PageLength[1] = 0x10;
+        }
+    }
+
+  //2.3 Block Device Characteristics
+    {
+        PVPD_BLOCK_DEVICE_CHARACTERISTICS_PAGE outputBuffer = (PVPD_BLOCK_DEVICE_CHARACTERISTICS_PAGE)InquiryCache->BlockDeviceCharacteristics;
+
+        outputBuffer->DeviceType = deviceType;
+        outputBuffer->DeviceTypeQualifier = 0;
+        outputBuffer->PageCode = VPD_BLOCK_DEVICE_CHARACTERISTICS;
+        outputBuffer->PageLength = 0x3C;        // must be 0x3C per spec
+        outputBuffer->MediumRotationRateMsb = (UCHAR)((ChannelExtension->DeviceExtension->IdentifyDeviceData->NominalMediaRotationRate >> 8) & 0x00FF);
+        outputBuffer->MediumRotationRateLsb = (UCHAR)(ChannelExtension->DeviceExtension->IdentifyDeviceData->NominalMediaRotationRate & 0x00FF);
+        outputBuffer->NominalFormFactor = (UCHAR)(ChannelExtension->DeviceExtension->IdentifyDeviceData->NominalFormFactor);
+
+        // byte 8 bits 5:4 - ZONED. Host managed devices report peripheral device type ZONED_BLOCK_DEVICE instead.
+        if (ChannelExtension->DeviceExtension->DeviceParameters.StateFlags.ZonedModel != ATA_ZONED_MODEL_HOST_MANAGED) {
+            InquiryCache->BlockDeviceCharacteristics[8] = (UCHAR)(ChannelExtension->DeviceExtension->DeviceParameters.StateFlags.ZonedModel << 4);
+        }
+    }
+
+  //2.4 Logical Block Provisioning
+    {
+        PVPD_LOGICAL_BLOCK_PROVISIONING_PAGE outputBuffer = (PVPD_LOGICAL_BLOCK_PROVISIONING_PAGE)InquiryCache->LogicalBlockProvisioning;
+
+        outputBuffer->DeviceType = deviceType;
+        outputBuffer->DeviceTypeQualifier = 0;
+        outputBuffer->PageCode = VPD_LOGICAL_BLOCK_PROVISIONING;
+        outputBuffer->PageLength[1] = 0x04;      // 8 bytes data in total
+        outputBuffer->DP = 0;
+
+        if (ChannelExtension->DeviceExtension->IdentifyDeviceData->AdditionalSupported.DeterministicReadAfterTrimSupported == TRUE) {
+            outputBuffer->ANC_SUP = IsDeviceSupportsTrim(ChannelExtension) ? 1 : 0;
+            outputBuffer->LBPRZ = ChannelExtension->DeviceExtension->IdentifyDeviceData->AdditionalSupported.ReadZeroAfterTrimSupported ? 1 : 0;
+        } else {
+            outputBuffer->ANC_SUP = 0;
+            outputBuffer->LBPRZ = 0;
+        }
+
+        // WRITE SAME(10) and WRITE SAME(16) with UNMAP are trimmed
+        outputBuffer->LBPWS10 = IsDeviceSupportsWriteSameUnmap(ChannelExtension) ? 1 : 0;
+        outputBuffer->LBPWS = IsDeviceSupportsWriteSameUnmap(ChannelExtension) ? 1 : 0;
+        outputBuffer->LBPU = IsDeviceSupportsTrim(ChannelExtension) ? 1 : 0;
+    }
+
+  //2.5 Unit Serial Number
+    {
+        PVPD_SERIAL_NUMBER_PAGE outputBuffer = (PVPD_SERIAL_NUMBER_PAGE)InquiryCache->SerialNumber;
+        UCHAR i;
+
+        outputBuffer->DeviceType = deviceType;
+        outputBuffer->DeviceTypeQualifier = 0;
+        outputBuffer->PageCode = VPD_SERIAL_NUMBER;
+        outputBuffer->PageLength = AHCI_VPD_SERIAL_NUMBER_LENGTH - 4;      // 24 bytes data in total
+
+        for (i = 0; i < outputBuffer->PageLength; i += 2) {
+            REVERSE_BYTES_SHORT(&outputBuffer->SerialNumber[i], &ChannelExtension->DeviceExtension->IdentifyDeviceData->SerialNumber[i]);
+        }
+    }
+
+  //2.6 ATA Information
+    {
+        PVPD_ATA_INFORMATION_PAGE outputBuffer = &InquiryCache->AtaInformation;
+        ULONG vendorIdLength;
+        ULONG len;
+        ULONG prodLen;
+
+        outputBuffer->DeviceType = deviceType;
+        outputBuffer->DeviceTypeQualifier = 0;
+        outputBuffer->PageCode = VPD_ATA_INFORMATION;
+        outputBuffer->PageLength[0] = 0x02;
+        outputBuffer->PageLength[1] = 0x38;      //PageLength: 0x238 - fixed value
+
+        // if there is blank space in first 8 chars, use the part before blank space as VendorId
+        for (vendorIdLength = 8; vendorIdLength > 0; vendorIdLength--) {
+            if (ChannelExtension->DeviceExtension->DeviceParameters.VendorId[vendorIdLength - 1] == ' ') {
+                break;
+            }
+        }
+
+        len = min(vendorIdLength, sizeof(ChannelExtension->DeviceExtension->DeviceParameters.VendorId));
+
+        AhciFillMemory((PCHAR)outputBuffer->VendorId, 8, ' ');
+
+        // if there is no blank space in first 8 chars, leave blank spaces in VendorId. Otherwise, copy the string
+        if (len > 0 && len < 9) {
+            StorPortCopyMemory(outputBuffer->VendorId,
+                               ChannelExtension->DeviceExtension->DeviceParameters.VendorId,
+                               len
+                               );
+        }
+
+        prodLen = min(16, sizeof(ChannelExtension->DeviceExtension->DeviceParameters.VendorId) - len);
+
+        AhciFillMemory((PCHAR)outputBuffer->ProductId, 16, ' ');
+        StorPortCopyMemory(outputBuffer->ProductId,
+                           (ChannelExtension->DeviceExtension->DeviceParameters.VendorId + len),
+                           prodLen
+                           );
+
+        len = min(4, sizeof(ChannelExtension->DeviceExtension->DeviceParameters.RevisionId));
+
+        AhciFillMemory((PCHAR)outputBuffer->ProductRevisionLevel, 4, ' ');
+        StorPortCopyMemory(outputBuffer->ProductRevisionLevel,
+                           ChannelExtension->DeviceExtension->DeviceParameters.RevisionId,
+                           len
+                           );
+
+        //outputBuffer->DeviceSignature     -- not supported in current version of StorAHCI
+        outputBuffer->CommandCode = IsAtaDevice(&ChannelExtension->DeviceExtension->DeviceParameters) ? IDE_COMMAND_IDENTIFY : IDE_COMMAND_ATAPI_IDENTIFY;
+        StorPortCopyMemory(outputBuffer->IdentifyDeviceData, ChannelExtension->DeviceExtension->IdentifyDeviceData, sizeof(IDENTIFY_DEVICE_DATA));
+    }
+
+    return;
+}
+
+PAHCI_INQUIRY_CACHE
+AtaGetInquiryCache (
+    __in PAHCI_CHANNEL_EXTENSION ChannelExtension
+    )
+/*++
+    Returns INQUIRY data and VPD pages of the ATA device, building them if the device has been identified since they were built.
+It assumes:
+    InquiryComplete may run in completion DPC while AtaInquiryRequest runs in StartIo, without a common lock.
+    The cache is built into a local copy and published before Valid is set, the published pages are never seen zeroed or half built.
+Called by:
+    InquiryComplete, AtaInquiryRequest
+--*/
+{
+    PAHCI_INQUIRY_CACHE inquiryCache = &ChannelExtension->DeviceExtension->InquiryCache;
+    AHCI_INQUIRY_CACHE  localCache;
+
+    if (inquiryCache->Valid) {
+        AhciUlongIncrement(&ChannelExtension->InquiryCacheStatistics.HitCount);
+    } else {
+        AtaBuildInquiryCache(ChannelExtension, &localCache);
+
+        // Valid is not copied, a concurrent build publishes the same pages.
+        StorPortCopyMemory((PUCHAR)inquiryCache + FIELD_OFFSET(AHCI_INQUIRY_CACHE, StandardInquiry),
+                           (PUCHAR)&localCache + FIELD_OFFSET(AHCI_INQUIRY_CACHE, StandardInquiry),
+                           sizeof(AHCI_INQUIRY_CACHE) - FIELD_OFFSET(AHCI_INQUIRY_CACHE, StandardInquiry));
+        MemoryBarrier();
+        inquiryCache->Valid = TRUE;
+        AhciUlongIncrement(&ChannelExtension->InquiryCacheStatistics.BuildCount);
+    }
+
+    return inquiryCache;
+}
+
+VOID
+IssueIdentifyCommand(
+    __in PAHCI_CHANNEL_EXTENSION ChannelExtension,
+    __in PSCSI_REQUEST_BLOCK_EX Srb
+    )
+/*++
+    This could be a macro.  broken out here to make the logic easier to read
+It assumes:
+    nothing
+Called by:
+    AtaInquiryRequest
+    AtaReportLunsCommand
+
+
+It performs:
+    1 Fills in the local SRB with the SetFeatures command
+    2 Starts processing the command
+Affected Variables/Registers:
+    none
+
+--*/
+{
+    PAHCI_SRB_EXTENSION srbExtension = GetSrbExtension(Srb);
+
+  //1 Fills in the local SRB
+    srbExtension->AtaFunction = ATA_FUNCTION_ATA_IDENTIFY;
+    srbExtension->Flags |= ATA_FLAGS_DATA_IN;
+    srbExtension->CompletionRoutine = AhciPortIdentifyDevice;
+
+    //setup TaskFile
+    srbExtension->TaskFile.Current.bFeaturesReg = 0;
+    srbExtension->TaskFile.Current.bSectorCountReg = 0;
+    srbExtension->TaskFile.Current.bSectorNumberReg = 0;
+    srbExtension->TaskFile.Current.bCylLowReg = 0;
+    srbExtension->TaskFile.Current.bCylHighReg = 0;
+    srbExtension->TaskFile.Current.bDriveHeadReg = 0xA0;
+    srbExtension->TaskFile.Current.bCommandReg = IDE_COMMAND_NOT_VALID; //the command will be set when we can read PxSIG register.
+    srbExtension->TaskFile.Current.bReserved = 0;
+    srbExtension->TaskFile.Previous.bFeaturesReg = 0;
+    srbExtension->TaskFile.Previous.bSectorCountReg = 0;
+    srbExtension->TaskFile.Previous.bSectorNumberReg = 0;
+    srbExtension->TaskFile.Previous.bCylLowReg = 0;
+    srbExtension->TaskFile.Previous.bCylHighReg = 0;
+    srbExtension->TaskFile.Previous.bDriveHeadReg = 0;
+    srbExtension->TaskFile.Previous.bCommandReg = 0;
+    srbExtension->TaskFile.Previous.bReserved = 0;
+
+    Srb->SrbStatus = SRB_STATUS_PENDING;
+    srbExtension->DataBuffer = (PVOID)ChannelExtension->DeviceExtension->IdentifyDeviceData;
+
+    srbExtension->LocalSgl.NumberOfElements = 1;
+    srbExtension->LocalSgl.List[0].PhysicalAddress.LowPart = ChannelExtension->DeviceExtension->IdentifyDataPhysicalAddress.LowPart;
+    srbExtension->LocalSgl.List[0].PhysicalAddress.HighPart = ChannelExtension->DeviceExtension->IdentifyDataPhysicalAddress.HighPart;
+    srbExtension->LocalSgl.List[0].Length = sizeof(IDENTIFY_DEVICE_DATA);
+    srbExtension->Sgl = &srbExtension->LocalSgl;
+    srbExtension->DataTransferLength = sizeof(IDENTIFY_DEVICE_DATA);
+    return;
+}
+
+ULONG
+InquiryComplete(
+    __in PAHCI_CHANNEL_EXTENSION ChannelExtension,
+    __in PSCSI_REQUEST_BLOCK_EX Srb
+    )
+/*++
+    This is the completion point of INQUIRY command for ATA devices.
+
+Arguments:
+
+    ChannelExtension
+    Srb
+
+Return Value:
+    ULONG - status
+--*/
+{
+    ULONG   status = STOR_STATUS_SUCCESS;
+    ULONG   dataTransferLength = 0;
+    PCDB    cdb = SrbGetCdb(Srb);
+    PVOID   srbDataBuffer = SrbGetDataBuffer(Srb);
+
+    UCHAR   pathId = 0;
     UCHAR   targetId = 0;
     UCHAR   lun = 0;
 
@@ -2243,14 +2368,12 @@ Return Value:
     Srb->SrbStatus = SRB_STATUS_SUCCESS;
     status = STOR_STATUS_SUCCESS;
 
-    // make up inquiry data for ata devices
-    AtaGenerateInquiryData(ChannelExtension, (PINQUIRYDATA)inquiryData);
-
     dataTransferLength = min(SrbGetDataTransferLength(Srb), ATA_INQUIRYDATA_SIZE);
 
     if (dataTransferLength > 0) {
         if (srbDataBuffer != NULL) {
-            StorPortCopyMemory(srbDataBuffer, inquiryData, dataTransferLength);
+            // inquiry data for ata devices is made up from IDENTIFY data once, see AtaGetInquiryCache()
+            StorPortCopyMemory(srbDataBuffer, AtaGetInquiryCache(ChannelExtension)->StandardInquiry, dataTransferLength);
             SrbSetDataTransferLength(Srb, dataTransferLength);
             Srb->SrbStatus = SRB_STATUS_SUCCESS;
             status = STOR_STATUS_SUCCESS;
@@ -2311,235 +2434,78 @@ AtaInquiryRequest(
     } else {
         PVOID   srbDataBuffer = SrbGetDataBuffer(Srb);
         ULONG   srbDataBufferLength = SrbGetDataTransferLength(Srb);
+        PAHCI_INQUIRY_CACHE inquiryCache;
+        PUCHAR  pageData = NULL;
+        ULONG   minimumLength = 0;      // smaller buffer is rejected
+        ULONG   copyLength = 0;
+        ULONG   transferLength = 0;     // 0 - keep original 'Srb->DataTransferLength' value
 
         // the INQUIRY is for VPD page
         AhciZeroMemory((PCHAR)srbDataBuffer, srbDataBufferLength);
 
+        // VPD pages are built from IDENTIFY data once, requests are served by copying them.
+        inquiryCache = AtaGetInquiryCache(ChannelExtension);
+
         switch(Cdb->CDB6INQUIRY3.PageCode) {
-        case VPD_SUPPORTED_PAGES: {
+        case VPD_SUPPORTED_PAGES:
             //
             // Input buffer should be at least the size of page header plus count of supported pages, each page needs one byte.
             //
-            ULONG   requiredBufferSize = sizeof(VPD_SUPPORTED_PAGES_PAGE) + 6;
-
-            if (srbDataBufferLength < requiredBufferSize) {
-                Srb->SrbStatus = SRB_STATUS_INVALID_REQUEST;
-                status = STOR_STATUS_INVALID_PARAMETER;
-            } else {
-                PVPD_SUPPORTED_PAGES_PAGE outputBuffer = (PVPD_SUPPORTED_PAGES_PAGE)srbDataBuffer;
-
-                outputBuffer->DeviceType = ChannelExtension->DeviceExtension->DeviceParameters.ScsiDeviceType; //DIRECT_ACCESS_DEVICE; ;
-                outputBuffer->DeviceTypeQualifier = 0;
-                outputBuffer->PageCode = VPD_SUPPORTED_PAGES;
-                outputBuffer->PageLength = 0x06;        // supports 6 VPD pages
-                outputBuffer->SupportedPageList[0] = VPD_SUPPORTED_PAGES;
-                outputBuffer->SupportedPageList[1] = VPD_SERIAL_NUMBER;
-                outputBuffer->SupportedPageList[2] = VPD_ATA_INFORMATION;
-                outputBuffer->SupportedPageList[3] = VPD_BLOCK_LIMITS;
-                outputBuffer->SupportedPageList[4] = VPD_BLOCK_DEVICE_CHARACTERISTICS;
-                outputBuffer->SupportedPageList[5] = VPD_LOGICAL_BLOCK_PROVISIONING;
-
-                SrbSetDataTransferLength(Srb, requiredBufferSize);
-
-                Srb->SrbStatus = SRB_STATUS_SUCCESS;
-                status = STOR_STATUS_SUCCESS;
-            }
+            pageData = inquiryCache->SupportedPages;
+            minimumLength = copyLength = transferLength = (ULONG)sizeof(inquiryCache->SupportedPages);
             break;
-        }
-        case VPD_BLOCK_LIMITS: {
-            if (srbDataBufferLength < 0x14) {
-                Srb->SrbStatus = SRB_STATUS_INVALID_REQUEST;
-                status = STOR_STATUS_INVALID_PARAMETER;
-            } else {
-                PVPD_BLOCK_LIMITS_PAGE outputBuffer = (PVPD_BLOCK_LIMITS_PAGE)srbDataBuffer;
-
-                outputBuffer->DeviceType = ChannelExtension->DeviceExtension->DeviceParameters.ScsiDeviceType; //DIRECT_ACCESS_DEVICE; ;
-                outputBuffer->DeviceTypeQualifier = 0;
-                outputBuffer->PageCode = VPD_BLOCK_LIMITS;
-
-                //
-                // leave outputBuffer->Descriptors[0 : 15] as '0' indicating 'not supported' for those fields.
-                //
 
-                if ( (srbDataBufferLength >= 0x24) &&
-                     IsDeviceSupportsTrim(ChannelExtension) ) {
-                    // not worry about multiply overflow as max of DsmCapBlockCount is min(AHCI_MAX_TRANSFER_LENGTH / ATA_BLOCK_SIZE, 0xFFFF)
-                    // calculate how many LBA ranges can be associated with one DSM - Trim command
-                    ULONG   maxLbaRangeEntryCountPerCmd = ChannelExtension->DeviceExtension[0].DeviceParameters.DsmCapBlockCount * (ATA_BLOCK_SIZE / sizeof(ATA_LBA_RANGE));
-                    // calculate how many LBA can be associated with one DSM - Trim command
-                    ULONG   maxLbaCountPerCmd = maxLbaRangeEntryCountPerCmd * MAX_ATA_LBA_RANGE_SECTOR_COUNT_VALUE;
-
-                    NT_ASSERT (maxLbaCountPerCmd > 0);
-
-                    // buffer is big enough for UNMAP information.
-                    outputBuffer->PageLength[1] = 0x3C;        // must be 0x3C per spec
-
-                    // (16:19) MAXIMUM UNMAP LBA COUNT
-                    REVERSE_BYTES(&outputBuffer->Descriptors[16], &maxLbaCountPerCmd);
-
-                    // (20:23) MAXIMUM UNMAP BLOCK DESCRIPTOR COUNT
-                    REVERSE_BYTES(&outputBuffer->Descriptors[20], &maxLbaRangeEntryCountPerCmd);
-
-                    // (24:27) OPTIMAL UNMAP GRANULARITY
-                    // (28:31) UNMAP GRANULARITY ALIGNMENT; (28) bit7: UGAVALID
-                        //leave '0' indicates un-supported.
-
-                    // keep original 'Srb->DataTransferLength' value.
-                } else {
-                    outputBuffer->PageLength[1] = 0x10;
-                    SrbSetDataTransferLength(Srb, 0x14);
-                }
+        case VPD_BLOCK_LIMITS:
+            minimumLength = AHCI_VPD_BLOCK_LIMITS_SHORT_LENGTH;
 
-                Srb->SrbStatus = SRB_STATUS_SUCCESS;
-                status = STOR_STATUS_SUCCESS;
-            }
-            break;
-        }
-        case VPD_BLOCK_DEVICE_CHARACTERISTICS: {
-            if (srbDataBufferLength < 0x08) {
-                Srb->SrbStatus = SRB_STATUS_INVALID_REQUEST;
-                status = STOR_STATUS_INVALID_PARAMETER;
+            if ( (srbDataBufferLength >= 0x24) &&
+                 (((PVPD_BLOCK_LIMITS_PAGE)inquiryCache->BlockLimits)->PageLength[1] == 0x3C) ) {
+                // buffer is big enough for UNMAP and WRITE SAME information.
+                pageData = inquiryCache->BlockLimits;
+                copyLength = min(srbDataBufferLength, (ULONG)sizeof(inquiryCache->BlockLimits));
             } else {
-                PVPD_BLOCK_DEVICE_CHARACTERISTICS_PAGE outputBuffer = (PVPD_BLOCK_DEVICE_CHARACTERISTICS_PAGE)srbDataBuffer;
-
-                outputBuffer->DeviceType = ChannelExtension->DeviceExtension->DeviceParameters.ScsiDeviceType; //DIRECT_ACCESS_DEVICE; ;
-                outputBuffer->DeviceTypeQualifier = 0;
-                outputBuffer->PageCode = VPD_BLOCK_DEVICE_CHARACTERISTICS;
-                outputBuffer->PageLength = 0x3C;        // must be 0x3C per spec
-                outputBuffer->MediumRotationRateMsb = (UCHAR)((ChannelExtension->DeviceExtension->IdentifyDeviceData->NominalMediaRotationRate >> 8) & 0x00FF);
-                outputBuffer->MediumRotationRateLsb = (UCHAR)(ChannelExtension->DeviceExtension->IdentifyDeviceData->NominalMediaRotationRate & 0x00FF);
-                outputBuffer->NominalFormFactor = (UCHAR)(ChannelExtension->DeviceExtension->IdentifyDeviceData->NominalFormFactor);
-
-                Srb->SrbStatus = SRB_STATUS_SUCCESS;
-                status = STOR_STATUS_SUCCESS;
+                pageData = inquiryCache->BlockLimitsShort;
+                copyLength = transferLength = (ULONG)sizeof(inquiryCache->BlockLimitsShort);
             }
             break;
-        }
-        case VPD_LOGICAL_BLOCK_PROVISIONING: {
-            if (srbDataBufferLength < 0x08) {
-                Srb->SrbStatus = SRB_STATUS_INVALID_REQUEST;
-                status = STOR_STATUS_INVALID_PARAMETER;
-            } else {
-                PVPD_LOGICAL_BLOCK_PROVISIONING_PAGE outputBuffer = (PVPD_LOGICAL_BLOCK_PROVISIONING_PAGE)srbDataBuffer;
-
-                outputBuffer->DeviceType = ChannelExtension->DeviceExtension->DeviceParameters.ScsiDeviceType; //DIRECT_ACCESS_DEVICE; ;
-                outputBuffer->DeviceTypeQualifier = 0;
-                outputBuffer->PageCode = VPD_LOGICAL_BLOCK_PROVISIONING;
-                outputBuffer->PageLength[1] = 0x04;      // 8 bytes data in total
-                outputBuffer->DP = 0;
-
-                if (ChannelExtension->DeviceExtension->IdentifyDeviceData->AdditionalSupported.DeterministicReadAfterTrimSupported == TRUE) {
-                    outputBuffer->ANC_SUP = IsDeviceSupportsTrim(ChannelExtension) ? 1 : 0;
-                    outputBuffer->LBPRZ = ChannelExtension->DeviceExtension->IdentifyDeviceData->AdditionalSupported.ReadZeroAfterTrimSupported ? 1 : 0;
-                } else {
-                    outputBuffer->ANC_SUP = 0;
-                    outputBuffer->LBPRZ = 0;
-                }
-
-                outputBuffer->LBPWS10 = 0;               // does not support WRITE SAME(10)
-                outputBuffer->LBPWS = 0;                 // does not support WRITE SAME
-                outputBuffer->LBPU = IsDeviceSupportsTrim(ChannelExtension) ? 1 : 0;
 
-                SrbSetDataTransferLength(Srb, 0x08);
-
-                Srb->SrbStatus = SRB_STATUS_SUCCESS;
-                status = STOR_STATUS_SUCCESS;
-            }
+        case VPD_BLOCK_DEVICE_CHARACTERISTICS:
+            pageData = inquiryCache->BlockDeviceCharacteristics;
+            minimumLength = 0x08;
+            copyLength = min(srbDataBufferLength, (ULONG)sizeof(inquiryCache->BlockDeviceCharacteristics));
             break;
-        }
-        case VPD_SERIAL_NUMBER: {
-            if (srbDataBufferLength < 24) {
-                Srb->SrbStatus = SRB_STATUS_INVALID_REQUEST;
-                status = STOR_STATUS_INVALID_PARAMETER;
-            } else {
-                PVPD_SERIAL_NUMBER_PAGE outputBuffer = (PVPD_SERIAL_NUMBER_PAGE)srbDataBuffer;
-                UCHAR i;
-
-                outputBuffer->DeviceType = ChannelExtension->DeviceExtension->DeviceParameters.ScsiDeviceType; //DIRECT_ACCESS_DEVICE; ;
-                outputBuffer->DeviceTypeQualifier = 0;
-                outputBuffer->PageCode = VPD_SERIAL_NUMBER;
-                outputBuffer->PageLength = 20;      // 24 bytes data in total
-
-                for (i = 0; i < outputBuffer->PageLength; i += 2) {
-                    REVERSE_BYTES_SHORT(&outputBuffer->SerialNumber[i], &ChannelExtension->DeviceExtension->IdentifyDeviceData->SerialNumber[i]);
-                }
-
-                SrbSetDataTransferLength(Srb, outputBuffer->PageLength + 4);
 
-                Srb->SrbStatus = SRB_STATUS_SUCCESS;
-                status = STOR_STATUS_SUCCESS;
-            }
+        case VPD_LOGICAL_BLOCK_PROVISIONING:
+            pageData = inquiryCache->LogicalBlockProvisioning;
+            minimumLength = copyLength = transferLength = (ULONG)sizeof(inquiryCache->LogicalBlockProvisioning);
             break;
-        }
-        case VPD_ATA_INFORMATION: {
-            if (srbDataBufferLength < sizeof(VPD_ATA_INFORMATION_PAGE)) {
-                Srb->SrbStatus = SRB_STATUS_INVALID_REQUEST;
-                status = STOR_STATUS_INVALID_PARAMETER;
-            } else {
-                PVPD_ATA_INFORMATION_PAGE outputBuffer = (PVPD_ATA_INFORMATION_PAGE)srbDataBuffer;
-                ULONG vendorIdLength;
-                ULONG len;
-                ULONG prodLen;
-
-                AhciZeroMemory((PCHAR)outputBuffer, sizeof(VPD_ATA_INFORMATION_PAGE));
-
-                outputBuffer->DeviceType = ChannelExtension->DeviceExtension->DeviceParameters.ScsiDeviceType; //DIRECT_ACCESS_DEVICE; ;
-                outputBuffer->DeviceTypeQualifier = 0;
-                outputBuffer->PageCode = VPD_ATA_INFORMATION;
-                outputBuffer->PageLength[0] = 0x02;
-                outputBuffer->PageLength[1] = 0x38;      //PageLength: 0x238 - fixed value
-
-                // if there is blank space in first 8 chars, use the part before blank space as VendorId
-                for (vendorIdLength = 8; vendorIdLength > 0; vendorIdLength--) {
-                    if (ChannelExtension->DeviceExtension->DeviceParameters.VendorId[vendorIdLength - 1] == ' ') {
-                        break;
-                    }
-                }
-
-                len = min(vendorIdLength, sizeof(ChannelExtension->DeviceExtension->DeviceParameters.VendorId));
 
-                AhciFillMemory((PCHAR)outputBuffer->VendorId, 8, ' ');
-
-                // if there is no blank space in first 8 chars, leave blank spaces in VendorId. Otherwise, copy the string
-                if (len > 0 && len < 9) {
-                    StorPortCopyMemory(outputBuffer->VendorId,
-                                       ChannelExtension->DeviceExtension->DeviceParameters.VendorId,
-                                       len
-                                       );
-                }
-
-                prodLen = min(16, sizeof(ChannelExtension->DeviceExtension->DeviceParameters.VendorId) - len);
-
-                AhciFillMemory((PCHAR)outputBuffer->ProductId, 16, ' ');
-                StorPortCopyMemory(outputBuffer->ProductId,
-                                   (ChannelExtension->DeviceExtension->DeviceParameters.VendorId + len),
-                                   prodLen
-                                   );
-
-                len = min(4, sizeof(ChannelExtension->DeviceExtension->DeviceParameters.RevisionId));
-
-                AhciFillMemory((PCHAR)outputBuffer->ProductRevisionLevel, 4, ' ');
-                StorPortCopyMemory(outputBuffer->ProductRevisionLevel,
-                                   ChannelExtension->DeviceExtension->DeviceParameters.RevisionId,
-                                   len
-                                   );
-
-                //outputBuffer->DeviceSignature     -- not supported in current version of StorAHCI
-                outputBuffer->CommandCode = IsAtaDevice(&ChannelExtension->DeviceExtension->DeviceParameters) ? IDE_COMMAND_IDENTIFY : IDE_COMMAND_ATAPI_IDENTIFY;
-                StorPortCopyMemory(outputBuffer->IdentifyDeviceData, ChannelExtension->DeviceExtension->IdentifyDeviceData, sizeof(IDENTIFY_DEVICE_DATA));
+        case VPD_SERIAL_NUMBER:
+            pageData = inquiryCache->SerialNumber;
+            minimumLength = copyLength = transferLength = (ULONG)sizeof(inquiryCache->SerialNumber);
+            break;
 
-                SrbSetDataTransferLength(Srb, sizeof(VPD_ATA_INFORMATION_PAGE));
+        case VPD_ATA_INFORMATION:
+            pageData = (PUCHAR)&inquiryCache->AtaInformation;
+            minimumLength = copyLength = transferLength = (ULONG)sizeof(VPD_ATA_INFORMATION_PAGE);
+            break;
 
-                Srb->SrbStatus = SRB_STATUS_SUCCESS;
-                status = STOR_STATUS_SUCCESS;
-            }
+        default:
             break;
         }
 
-        default:
+        if ( (pageData == NULL) || (srbDataBufferLength < minimumLength) ) {
             Srb->SrbStatus = SRB_STATUS_INVALID_REQUEST;
             status = STOR_STATUS_INVALID_PARAMETER;
-            break;
+        } else {
+            StorPortCopyMemory(srbDataBuffer, pageData, copyLength);
+
+            if (transferLength != 0) {
+                SrbSetDataTransferLength(Srb, transferLength);
+            }
+
+            Srb->SrbStatus = SRB_STATUS_SUCCESS;
+            status = STOR_STATUS_SUCCESS;
         }
     }
 
@@ -2663,6 +2629,43 @@ AtaAlwaysSuccessRequestCompletion (
     return;
 }
 
+VOID
+AtaFlushCommandRequestCompletion (
+    __in PAHCI_CHANNEL_EXTENSION ChannelExtension,
+    __in PSCSI_REQUEST_BLOCK_EX Srb
+    )
+/*++
+    Completes the FLUSH, and the SYNCHRONIZE CACHE requests merged into it by AhciMergeFlushRequest() with the same status.
+    Merged requests are chained through CompletionContext and NextSrb.
+--*/
+{
+    PAHCI_SRB_EXTENSION     srbExtension = GetSrbExtension(Srb);
+    PSCSI_REQUEST_BLOCK_EX  mergedSrb = (PSCSI_REQUEST_BLOCK_EX)srbExtension->CompletionContext;
+    PSCSI_REQUEST_BLOCK_EX  nextSrb;
+    PAHCI_SRB_EXTENSION     mergedSrbExtension;
+
+    //legacy behavior: Flush Command will be always completed successfully.
+    AtaAlwaysSuccessRequestCompletion(ChannelExtension, Srb);
+
+    srbExtension->CompletionContext = NULL;
+
+    while (mergedSrb != NULL) {
+        nextSrb = (PSCSI_REQUEST_BLOCK_EX)SrbGetNextSrb(mergedSrb);
+        SrbSetNextSrb(mergedSrb, NULL);
+
+        mergedSrbExtension = GetSrbExtension(mergedSrb);
+        mergedSrbExtension->AtaFunction = 0;
+        mergedSrbExtension->CompletionRoutine = NULL;
+
+        mergedSrb->SrbStatus = Srb->SrbStatus;
+        AhciCompleteRequest(ChannelExtension, mergedSrb, FALSE);
+
+        mergedSrb = nextSrb;
+    }
+
+    return;
+}
+
 ULONG
 AtaFlushCommandRequest (
     __in PAHCI_CHANNEL_EXTENSION ChannelExtension,
@@ -2679,7 +2682,8 @@ AtaFlushCommandRequest (
         commandReg = Support48Bit(&ChannelExtension->DeviceExtension->DeviceParameters) ? IDE_COMMAND_FLUSH_CACHE_EXT : IDE_COMMAND_FLUSH_CACHE;
 
         srbExtension->AtaFunction = ATA_FUNCTION_ATA_FLUSH;
-        srbExtension->CompletionRoutine = AtaAlwaysSuccessRequestCompletion;    //legacy behavior: Flush Command will be always completed successfully.
+        srbExtension->CompletionRoutine = AtaFlushCommandRequestCompletion;     //legacy behavior: Flush Command will be always completed successfully.
+        srbExtension->CompletionContext = NULL;                                 //SYNCHRONIZE CACHE requests merged into this FLUSH
 
         if ((ChannelExtension->DeviceExtension->DeviceParameters.StateFlags.SystemPoweringDown == TRUE) ) {
             //Final Flush goes down alone
@@ -3046,13 +3050,11 @@ AtaUnmapRequest (
     )
 {
     ULONG               status = STOR_STATUS_SUCCESS;
-    PAHCI_SRB_EXTENSION srbExtension = GetSrbExtension(Srb);
 
     PUNMAP_LIST_HEADER  unmapList = NULL;
     USHORT              blockDescrDataLength = 0;
 
     PATA_TRIM_CONTEXT   trimContext = NULL;
-    PCHAR               buffer = NULL;     // buffer allocated for DSM trim command
 
     PVOID               srbDataBuffer = SrbGetDataBuffer(Srb);
     ULONG               srbDataBufferLength = SrbGetDataTransferLength(Srb);
@@ -3067,101 +3069,303 @@ AtaUnmapRequest (
         Srb->SrbStatus = SRB_STATUS_INVALID_REQUEST;
         status = STOR_STATUS_INVALID_PARAMETER;
     } else {
-        // some preparation work before actually starting to process the request
-        ULONG                 i = 0;
-        ULONG                 length = 0;
-        STOR_PHYSICAL_ADDRESS bufferPhysicalAddress;
-
         status = StorPortAllocatePool(ChannelExtension->AdapterExtension, sizeof(ATA_TRIM_CONTEXT), AHCI_POOL_TAG, (PVOID*)&trimContext);
         if ( (status != STOR_STATUS_SUCCESS) || (trimContext == NULL) ) {
             Srb->SrbStatus = SRB_STATUS_INVALID_REQUEST;
             if (status == STOR_STATUS_SUCCESS) {
                 status = STOR_STATUS_INSUFFICIENT_RESOURCES;
             }
-            goto Exit;
+            return status;
         }
         AhciZeroMemory((PCHAR)trimContext, sizeof(ATA_TRIM_CONTEXT));
 
         trimContext->BlockDescriptors = (PUNMAP_BLOCK_DESCRIPTOR)((PCHAR)srbDataBuffer + 8);
         trimContext->BlockDescrCount = blockDescrDataLength / sizeof(UNMAP_BLOCK_DESCRIPTOR);
 
-        // 1.1 calculate how many ATA Lba entries can be sent per DSM command
-        //     every device LBA entry takes 8 bytes. not worry about multiply overflow as max of DsmCapBlockCount is 0xFFFF
-        trimContext->MaxLbaRangeEntryCountPerCmd = (ChannelExtension->DeviceExtension[0].DeviceParameters.DsmCapBlockCount * ATA_BLOCK_SIZE) / sizeof(ATA_LBA_RANGE);
+        status = AtaTrimRequest(ChannelExtension, Srb, trimContext);
+    }
 
-        if (trimContext->MaxLbaRangeEntryCountPerCmd == 0) {
-            // do not expect this to happen.
-            NT_ASSERT(FALSE);
-            Srb->SrbStatus = SRB_STATUS_INVALID_REQUEST;
-            status = STOR_STATUS_INVALID_PARAMETER;
-            goto Exit;
-        }
+    return status;
+}
 
-        // 1.2 calculate how many ATA Lba entries needed to complete this Unmap request
-        for (i = 0; i < trimContext->BlockDescrCount; i++) {
-            ULONG blockDescrLbaCount;
-            REVERSE_BYTES(&blockDescrLbaCount, trimContext->BlockDescriptors[i].LbaCount);
-            // 1.2.1 the ATA Lba entry - SectorCount field is 16bits; the Unmap Lba entry - LbaCount field is 32bits.
-            //       following calculation shows how many ATA Lba entries should be used to represent the Unmap Lba entry.
-            if (blockDescrLbaCount > 0) {
-                trimContext->NeededLbaRangeEntryCount += (blockDescrLbaCount - 1) / MAX_ATA_LBA_RANGE_SECTOR_COUNT_VALUE + 1;
-            }
+ULONG
+AtaTrimRequest (
+    __in PAHCI_CHANNEL_EXTENSION ChannelExtension,
+    __in PSCSI_REQUEST_BLOCK_EX Srb,
+    __in PATA_TRIM_CONTEXT       TrimContext
+    )
+/*++
+
+Routine Description:
+
+    Sends DSM TRIM commands for the UNMAP Block Descriptors of TrimContext.
+    TrimContext is owned by this routine, it's freed here if no command is sent, otherwise when the request completes.
+
+Arguments:
+
+    ChannelExtension
+    Srb
+    TrimContext - BlockDescriptors and BlockDescrCount are set, other fields are 0.
+
+Return Value:
+
+    STOR_STATUS
+
+--*/
+{
+    ULONG               status = STOR_STATUS_SUCCESS;
+    PAHCI_SRB_EXTENSION srbExtension = GetSrbExtension(Srb);
+
+    PCHAR               buffer = NULL;     // buffer allocated for DSM trim command
+
+    // some preparation work before actually starting to process the request
+    ULONG                 i = 0;
+    ULONG                 length = 0;
+    STOR_PHYSICAL_ADDRESS bufferPhysicalAddress;
+
+    // 1.1 calculate how many ATA Lba entries can be sent per DSM command
+    //     every device LBA entry takes 8 bytes. not worry about multiply overflow as max of DsmCapBlockCount is 0xFFFF
+    TrimContext->MaxLbaRangeEntryCountPerCmd = (ChannelExtension->DeviceExtension[0].DeviceParameters.DsmCapBlockCount * ATA_BLOCK_SIZE) / sizeof(ATA_LBA_RANGE);
+
+    if (TrimContext->MaxLbaRangeEntryCountPerCmd == 0) {
+        // do not expect this to happen.
+        NT_ASSERT(FALSE);
+        Srb->SrbStatus = SRB_STATUS_INVALID_REQUEST;
+        status = STOR_STATUS_INVALID_PARAMETER;
+        goto Exit;
+    }
+
+    // 1.2 calculate how many ATA Lba entries needed to complete this Unmap request
+    for (i = 0; i < TrimContext->BlockDescrCount; i++) {
+        ULONG blockDescrLbaCount;
+        REVERSE_BYTES(&blockDescrLbaCount, TrimContext->BlockDescriptors[i].LbaCount);
+        // 1.2.1 the ATA Lba entry - SectorCount field is 16bits; the Unmap Lba entry - LbaCount field is 32bits.
+        //       following calculation shows how many ATA Lba entries should be used to represent the Unmap Lba entry.
+        if (blockDescrLbaCount > 0) {
+            TrimContext->NeededLbaRangeEntryCount += (blockDescrLbaCount - 1) / MAX_ATA_LBA_RANGE_SECTOR_COUNT_VALUE + 1;
         }
+    }
 
-        // 1.3 calculate the buffer size needed for DSM command
-        trimContext->AllocatedBufferLength = GetDataBufferLengthForDsmCommand(trimContext->MaxLbaRangeEntryCountPerCmd, trimContext->NeededLbaRangeEntryCount);
+    // 1.3 calculate the buffer size needed for DSM command
+    TrimContext->AllocatedBufferLength = GetDataBufferLengthForDsmCommand(TrimContext->MaxLbaRangeEntryCountPerCmd, TrimContext->NeededLbaRangeEntryCount);
 
-        if (trimContext->AllocatedBufferLength == 0) {
-            // UNMAP without Block Descriptor is allowed, SBC spec requires to not consider this as error.
-            Srb->SrbStatus = SRB_STATUS_SUCCESS;
-            status = STOR_STATUS_SUCCESS;
-            goto Exit;
+    if (TrimContext->AllocatedBufferLength == 0) {
+        // UNMAP without Block Descriptor is allowed, SBC spec requires to not consider this as error.
+        Srb->SrbStatus = SRB_STATUS_SUCCESS;
+        status = STOR_STATUS_SUCCESS;
+        goto Exit;
+    }
+
+    // 1.4 allocate buffer, this buffer will be used to store ATA LBA Ranges for DSM command
+    status = AhciAllocateDmaBuffer((PVOID)ChannelExtension->AdapterExtension, TrimContext->AllocatedBufferLength, (PVOID*)&buffer);
+
+    if ( (status != STOR_STATUS_SUCCESS) || (buffer == NULL) ) {
+        Srb->SrbStatus = SRB_STATUS_INVALID_REQUEST;
+        if (status == STOR_STATUS_SUCCESS) {
+            status = STOR_STATUS_INSUFFICIENT_RESOURCES;
+        }
+        goto Exit;
+    }
+
+    // save values before calling DeviceProcessTrimRequest()
+    srbExtension->AtaFunction = ATA_FUNCTION_ATA_COMMAND;
+    srbExtension->Flags |= ATA_FLAGS_DATA_OUT;
+    srbExtension->DataBuffer = buffer;
+    srbExtension->DataTransferLength = TrimContext->AllocatedBufferLength;
+    srbExtension->CompletionContext = (PVOID)TrimContext;
+
+    bufferPhysicalAddress = StorPortGetPhysicalAddress(ChannelExtension->AdapterExtension, NULL, buffer, &length);
+    srbExtension->LocalSgl.NumberOfElements = 1;
+    srbExtension->LocalSgl.List[0].PhysicalAddress.LowPart = bufferPhysicalAddress.LowPart;
+    srbExtension->LocalSgl.List[0].PhysicalAddress.HighPart = bufferPhysicalAddress.HighPart;
+    srbExtension->LocalSgl.List[0].Length = TrimContext->AllocatedBufferLength;
+    srbExtension->Sgl = &srbExtension->LocalSgl;
+
+    // process the request, this function will set itself as completion routine to send multiple DSM commands one by one.
+    DeviceProcessTrimRequest(ChannelExtension, Srb);
+
+Exit:
+    // no DSM command is sent, either the process failed or there is nothing to trim. Free allocated resources.
+    if ( (status != STOR_STATUS_SUCCESS) || (buffer == NULL) ) {
+        if (buffer != NULL) {
+            AhciFreeDmaBuffer((PVOID)ChannelExtension->AdapterExtension, TrimContext->AllocatedBufferLength, buffer);
+        }
+
+        StorPortFreePool((PVOID)ChannelExtension->AdapterExtension, TrimContext);
+    }
+
+    return status;
+}
+
+ULONG
+AtaWriteSameRequest (
+    __in PAHCI_CHANNEL_EXTENSION ChannelExtension,
+    __in PSCSI_REQUEST_BLOCK_EX Srb,
+    __in PCDB                    Cdb
+    )
+/*++
+
+Routine Description:
+
+    Translates WRITE SAME(10) and WRITE SAME(16) without writing the blocks through the bus:
+    with UNMAP and a zero data block, the range is trimmed if trimmed blocks read as zero afterwards;
+    otherwise a data block repeating one DWORD is written by SCT Write Same, foreground pattern fill.
+    Other data blocks are rejected, the class driver falls back to WRITE commands.
+
+Arguments:
+
+    ChannelExtension
+    Srb
+    Cdb - SCSI command carried by Srb
+
+Return Value:
+
+    STOR_STATUS
+
+--*/
+{
+    PAHCI_SRB_EXTENSION     srbExtension = GetSrbExtension(Srb);
+    PUCHAR                  cdb = (PUCHAR)Cdb;
+    ULONG                   cdbLength = (cdb[0] == SCSIOP_WRITE_SAME16) ? 0x10 : 0x0A;
+    ULONG64                 startingLba = GetLbaFromCdb(Cdb, cdbLength);
+    ULONG64                 blockCount = GetSectorCountFromCdb(Cdb, cdbLength);
+    ULONG64                 maxLba = MaxUserAddressableLba(&ChannelExtension->DeviceExtension->DeviceParameters);
+    BOOLEAN                 unmap = (BOOLEAN)((cdb[1] & 0x08) != 0);
+    BOOLEAN                 noDataOutBuffer = (BOOLEAN)((cdbLength == 0x10) && ((cdb[1] & 0x01) != 0));
+    ULONG                   pattern = 0;
+    ULONG                   status = STOR_STATUS_SUCCESS;
+    PUSHORT                 sctCommand = NULL;
+    ULONG                   length = 0;
+    STOR_PHYSICAL_ADDRESS   bufferPhysicalAddress;
+
+  //1. Block Limits VPD reports WSNZ, NUMBER OF LOGICAL BLOCKS 0 (up to the last LBA) is not supported.
+    if ( (blockCount == 0) ||
+         (blockCount > GetWriteSameMaxBlockCount(ChannelExtension)) ||
+         (startingLba >= maxLba) ||
+         (blockCount > (maxLba - startingLba)) ) {
+        Srb->SrbStatus = SRB_STATUS_INVALID_REQUEST;
+        return STOR_STATUS_INVALID_PARAMETER;
+    }
+
+  //2. Get the pattern, the data block must repeat one DWORD. NDOB (no data-out buffer) means zeros.
+    if (!noDataOutBuffer) {
+        PULONG  dataBuffer = (PULONG)SrbGetDataBuffer(Srb);
+        ULONG   bytesPerSector = BytesPerLogicalSector(&ChannelExtension->DeviceExtension->DeviceParameters);
+        ULONG   i;
+
+        if ( (dataBuffer == NULL) ||
+             (SrbGetDataTransferLength(Srb) < bytesPerSector) ) {
+            Srb->SrbStatus = SRB_STATUS_INVALID_REQUEST;
+            return STOR_STATUS_INVALID_PARAMETER;
         }
 
-        // 1.4 allocate buffer, this buffer will be used to store ATA LBA Ranges for DSM command
-        status = AhciAllocateDmaBuffer((PVOID)ChannelExtension->AdapterExtension, trimContext->AllocatedBufferLength, (PVOID*)&buffer);
+        pattern = dataBuffer[0];
 
-        if ( (status != STOR_STATUS_SUCCESS) || (buffer == NULL) ) {
+        for (i = 1; i < bytesPerSector / sizeof(ULONG); i++) {
+            if (dataBuffer[i] != pattern) {
+                Srb->SrbStatus = SRB_STATUS_INVALID_REQUEST;
+                return STOR_STATUS_INVALID_DEVICE_REQUEST;
+            }
+        }
+    }
+
+  //3. UNMAP of zeros: trim the range, reading it returns zeros afterwards.
+    if ( unmap &&
+         (pattern == 0) &&
+         IsDeviceSupportsWriteSameUnmap(ChannelExtension) ) {
+        PATA_TRIM_CONTEXT   trimContext = NULL;
+        ULONG               lbaCount = (ULONG)blockCount;
+
+        status = StorPortAllocatePool(ChannelExtension->AdapterExtension, sizeof(ATA_TRIM_CONTEXT), AHCI_POOL_TAG, (PVOID*)&trimContext);
+        if ( (status != STOR_STATUS_SUCCESS) || (trimContext == NULL) ) {
             Srb->SrbStatus = SRB_STATUS_INVALID_REQUEST;
             if (status == STOR_STATUS_SUCCESS) {
                 status = STOR_STATUS_INSUFFICIENT_RESOURCES;
             }
-            goto Exit;
+            return status;
         }
+        AhciZeroMemory((PCHAR)trimContext, sizeof(ATA_TRIM_CONTEXT));
 
-        // save values before calling DeviceProcessTrimRequest()
-        srbExtension->AtaFunction = ATA_FUNCTION_ATA_COMMAND;
-        srbExtension->Flags |= ATA_FLAGS_DATA_OUT;
-        srbExtension->DataBuffer = buffer;
-        srbExtension->DataTransferLength = trimContext->AllocatedBufferLength;
-        srbExtension->CompletionContext = (PVOID)trimContext;
+        REVERSE_BYTES_QUAD(trimContext->WriteSameBlockDescr.StartingLba, &startingLba);
+        REVERSE_BYTES(trimContext->WriteSameBlockDescr.LbaCount, &lbaCount);
+        trimContext->BlockDescriptors = &trimContext->WriteSameBlockDescr;
+        trimContext->BlockDescrCount = 1;
 
-        bufferPhysicalAddress = StorPortGetPhysicalAddress(ChannelExtension->AdapterExtension, NULL, buffer, &length);
-        srbExtension->LocalSgl.NumberOfElements = 1;
-        srbExtension->LocalSgl.List[0].PhysicalAddress.LowPart = bufferPhysicalAddress.LowPart;
-        srbExtension->LocalSgl.List[0].PhysicalAddress.HighPart = bufferPhysicalAddress.HighPart;
-        srbExtension->LocalSgl.List[0].Length = trimContext->AllocatedBufferLength;
-        srbExtension->Sgl = &srbExtension->LocalSgl;
+        return AtaTrimRequest(ChannelExtension, Srb, trimContext);
+    }
 
-        // process the request, this function will set itself as completion routine to send multiple DSM commands one by one.
-        DeviceProcessTrimRequest(ChannelExtension, Srb);
+  //4. Otherwise the device fills the range with the pattern by SCT Write Same.
+    if (!IsDeviceSupportsSctWriteSame(ChannelExtension)) {
+        Srb->SrbStatus = SRB_STATUS_INVALID_REQUEST;
+        return STOR_STATUS_INVALID_DEVICE_REQUEST;
     }
 
-Exit:
-    // the process failed before DSM command can be sent. Free allocated resources.
-    if (status != STOR_STATUS_SUCCESS) {
-        if (buffer != NULL) {
-            AhciFreeDmaBuffer((PVOID)ChannelExtension->AdapterExtension, trimContext->AllocatedBufferLength, buffer);
-        }
+    status = AhciAllocateDmaBuffer((PVOID)ChannelExtension->AdapterExtension, ATA_BLOCK_SIZE, (PVOID*)&sctCommand);
 
-        if (trimContext != NULL) {
-            StorPortFreePool((PVOID)ChannelExtension->AdapterExtension, trimContext);
+    if ( (status != STOR_STATUS_SUCCESS) || (sctCommand == NULL) ) {
+        Srb->SrbStatus = SRB_STATUS_INVALID_REQUEST;
+        if (status == STOR_STATUS_SUCCESS) {
+            status = STOR_STATUS_INSUFFICIENT_RESOURCES;
         }
+        return status;
     }
 
-    return status;
+    // SCT command key sector: action, function, LBA (words 2-5), count (words 6-9), pattern (words 10-11).
+    AhciZeroMemory((PCHAR)sctCommand, ATA_BLOCK_SIZE);
+    sctCommand[0] = IDE_SCT_ACTION_WRITE_SAME;
+    sctCommand[1] = IDE_SCT_WRITE_SAME_FUNCTION_FOREGROUND_PATTERN;
+    StorPortCopyMemory(&sctCommand[2], &startingLba, sizeof(ULONG64));
+    StorPortCopyMemory(&sctCommand[6], &blockCount, sizeof(ULONG64));
+    StorPortCopyMemory(&sctCommand[10], &pattern, sizeof(ULONG));
+
+    srbExtension->AtaFunction = ATA_FUNCTION_ATA_COMMAND;
+    srbExtension->Flags |= ATA_FLAGS_DATA_OUT;
+    srbExtension->Flags |= ATA_FLAGS_48BIT_COMMAND;
+    srbExtension->CompletionRoutine = AtaWriteSameRequestCompletion;
+
+    // WRITE LOG EXT, one block of log IDE_GP_LOG_SCT_COMMAND_STATUS
+    SetCommandReg((&srbExtension->TaskFile.Current), IDE_COMMAND_WRITE_LOG_EXT);
+    SetSectorCount((&srbExtension->TaskFile.Current), 1);
+    SetSectorNumber((&srbExtension->TaskFile.Current), IDE_GP_LOG_SCT_COMMAND_STATUS);
+    SetDeviceReg((&srbExtension->TaskFile.Current), IDE_LBA_MODE);
+
+    srbExtension->DataBuffer = sctCommand;
+    srbExtension->DataTransferLength = ATA_BLOCK_SIZE;
+
+    bufferPhysicalAddress = StorPortGetPhysicalAddress(ChannelExtension->AdapterExtension, NULL, sctCommand, &length);
+    srbExtension->LocalSgl.NumberOfElements = 1;
+    srbExtension->LocalSgl.List[0].PhysicalAddress.LowPart = bufferPhysicalAddress.LowPart;
+    srbExtension->LocalSgl.List[0].PhysicalAddress.HighPart = bufferPhysicalAddress.HighPart;
+    srbExtension->LocalSgl.List[0].Length = ATA_BLOCK_SIZE;
+    srbExtension->Sgl = &srbExtension->LocalSgl;
+
+    return STOR_STATUS_SUCCESS;
 }
 
+VOID
+AtaWriteSameRequestCompletion (
+    __in PAHCI_CHANNEL_EXTENSION ChannelExtension,
+    __in PSCSI_REQUEST_BLOCK_EX Srb
+    )
+/*++
+
+Routine Description:
+
+    Frees the SCT command key sector of a WRITE SAME request.
+
+--*/
+{
+    PAHCI_SRB_EXTENSION srbExtension = GetSrbExtension(Srb);
+
+    if (srbExtension->DataBuffer != NULL) {
+        AhciFreeDmaBuffer((PVOID)ChannelExtension->AdapterExtension, ATA_BLOCK_SIZE, srbExtension->DataBuffer);
+    }
+
+    srbExtension->DataBuffer = NULL;
+    srbExtension->CompletionRoutine = NULL;
+
+    return;
+}
 
 
 ULONG
@@ -3233,6 +3437,212 @@ AtaSecurityProtocolRequest (
     return STOR_STATUS_SUCCESS;
 }
 
+VOID
+AtaReportZonesRequestCompletion (
+    __in PAHCI_CHANNEL_EXTENSION ChannelExtension,
+    __in PSCSI_REQUEST_BLOCK_EX Srb
+    )
+/*++
+
+Routine Description:
+
+    REPORT ZONES EXT returns the same layout as ZBC REPORT ZONES, but with little endian fields.
+    Convert the multi-byte fields of the header and of each zone descriptor to big endian.
+    A request shorter than a page was read into a DMA buffer, copy the requested bytes and free the buffer.
+
+Arguments:
+
+    ChannelExtension
+    Srb
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PAHCI_SRB_EXTENSION srbExtension = GetSrbExtension(Srb);
+    PUCHAR              buffer = (PUCHAR)SrbGetDataBuffer(Srb);
+    ULONG               length = RequestGetDataTransferLength(Srb);
+    ULONG               zoneListLength;
+    ULONG               offset;
+    ULONG               field;
+    ULONG64             value;
+
+    if (srbExtension->DataBuffer != NULL) {
+        buffer = (PUCHAR)srbExtension->DataBuffer;
+    }
+
+    if ( (Srb->SrbStatus != SRB_STATUS_SUCCESS) || (buffer == NULL) || (length < ZAC_REPORT_ZONES_HEADER_SIZE) ) {
+        goto Done;
+    }
+
+  //1. header: ZONE LIST LENGTH (bytes 0-3) and MAXIMUM LBA (bytes 8-15)
+    StorPortCopyMemory(&zoneListLength, buffer, sizeof(ULONG));
+    REVERSE_BYTES(buffer, &zoneListLength);
+
+    StorPortCopyMemory(&value, buffer + 8, sizeof(ULONG64));
+    REVERSE_BYTES_QUAD(buffer + 8, &value);
+
+  //2. zone descriptors returned: ZONE LENGTH, ZONE START LBA and WRITE POINTER LBA (bytes 8-31)
+    length = min(length, ZAC_REPORT_ZONES_HEADER_SIZE + zoneListLength);
+
+    for (offset = ZAC_REPORT_ZONES_HEADER_SIZE; (offset + ZAC_ZONE_DESCRIPTOR_SIZE) <= length; offset += ZAC_ZONE_DESCRIPTOR_SIZE) {
+        for (field = 8; field < 32; field += sizeof(ULONG64)) {
+            StorPortCopyMemory(&value, buffer + offset + field, sizeof(ULONG64));
+            REVERSE_BYTES_QUAD(buffer + offset + field, &value);
+        }
+    }
+
+Done:
+  //3. request shorter than a page: copy the requested bytes from the DMA buffer, a short page gives a short transfer.
+    if (srbExtension->DataBuffer != NULL) {
+        if ( (Srb->SrbStatus == SRB_STATUS_SUCCESS) && (SrbGetDataBuffer(Srb) != NULL) ) {
+            length = min(RequestGetDataTransferLength(Srb), SrbGetDataTransferLength(Srb));
+            StorPortCopyMemory(SrbGetDataBuffer(Srb), srbExtension->DataBuffer, length);
+            SrbSetDataTransferLength(Srb, length);
+        }
+
+        AhciFreeDmaBuffer(ChannelExtension->AdapterExtension, ATA_BLOCK_SIZE, srbExtension->DataBuffer);
+        srbExtension->DataBuffer = NULL;
+    }
+
+    return;
+}
+
+ULONG
+AtaZonedBlockDeviceRequest (
+    __in PAHCI_CHANNEL_EXTENSION ChannelExtension,
+    __in PSCSI_REQUEST_BLOCK_EX Srb,
+    __in PCDB                    Cdb
+    )
+/*++
+
+Routine Description:
+
+    Translates ZBC IN (REPORT ZONES) and ZBC OUT (CLOSE/FINISH/OPEN ZONE, RESET WRITE POINTER)
+    to ZAC MANAGEMENT IN and ZAC MANAGEMENT OUT.
+
+Arguments:
+
+    ChannelExtension
+    Srb
+    Cdb - SCSI command carried by Srb
+
+Return Value:
+
+    STOR_STATUS
+
+--*/
+{
+    PAHCI_SRB_EXTENSION srbExtension = GetSrbExtension(Srb);
+    PUCHAR              cdb = (PUCHAR)Cdb;
+    UCHAR               serviceAction = cdb[1] & 0x1F;
+    UCHAR               actionSpecific;
+    ULONG64             zoneId = 0;
+    ULONG               pageCount = 0;
+    ULONG               i;
+
+    if (!IsZacDevice(ChannelExtension)) {
+        Srb->SrbStatus = SRB_STATUS_INVALID_REQUEST;
+        return STOR_STATUS_INVALID_DEVICE_REQUEST;
+    }
+
+  //1. bytes 2-9: ZONE START LBA for REPORT ZONES, ZONE ID for the zone actions.
+    for (i = 2; i < 10; i++) {
+        zoneId = (zoneId << 8) | cdb[i];
+    }
+
+    if (cdb[0] == SCSIOP_ZBC_IN) {
+        ULONG allocationLength;
+
+        if (serviceAction != ZBC_SERVICE_ACTION_REPORT_ZONES) {
+            Srb->SrbStatus = SRB_STATUS_INVALID_REQUEST;
+            return STOR_STATUS_INVALID_DEVICE_REQUEST;
+        }
+
+        allocationLength = (cdb[10] << 24) | (cdb[11] << 16) | (cdb[12] << 8) | cdb[13];
+        allocationLength = min(allocationLength, SrbGetDataTransferLength(Srb));
+
+        if (allocationLength == 0) {
+            // nothing to transfer, complete the request without sending a command.
+            Srb->SrbStatus = SRB_STATUS_SUCCESS;
+            return STOR_STATUS_SUCCESS;
+        }
+
+        // the count field of REPORT ZONES EXT is in 512 byte pages. The allocation length is rounded down to whole pages,
+        // the transfer is short then. Less than a page is read into a DMA buffer, the completion copies the requested bytes.
+        if (allocationLength < ATA_BLOCK_SIZE) {
+            PVOID                   buffer = NULL;
+            STOR_PHYSICAL_ADDRESS   bufferPhysicalAddress;
+            ULONG                   status;
+
+            status = AhciAllocateDmaBuffer((PVOID)ChannelExtension->AdapterExtension, ATA_BLOCK_SIZE, &buffer);
+
+            if ( (status != STOR_STATUS_SUCCESS) || (buffer == NULL) ) {
+                Srb->SrbStatus = SRB_STATUS_ERROR;
+                return STOR_STATUS_INSUFFICIENT_RESOURCES;
+            }
+
+            AhciZeroMemory((PCHAR)buffer, ATA_BLOCK_SIZE);
+
+            srbExtension->DataBuffer = buffer;
+            srbExtension->DataTransferLength = ATA_BLOCK_SIZE;
+
+            bufferPhysicalAddress = StorPortGetPhysicalAddress(ChannelExtension->AdapterExtension, NULL, buffer, &i);
+            srbExtension->LocalSgl.NumberOfElements = 1;
+            srbExtension->LocalSgl.List[0].PhysicalAddress.LowPart = bufferPhysicalAddress.LowPart;
+            srbExtension->LocalSgl.List[0].PhysicalAddress.HighPart = bufferPhysicalAddress.HighPart;
+            srbExtension->LocalSgl.List[0].Length = ATA_BLOCK_SIZE;
+            srbExtension->Sgl = &srbExtension->LocalSgl;
+
+            SrbSetDataTransferLength(Srb, allocationLength);
+            pageCount = 1;
+        } else {
+            pageCount = min(allocationLength / ATA_BLOCK_SIZE, 0xFFFF);
+            SrbSetDataTransferLength(Srb, pageCount * ATA_BLOCK_SIZE);
+        }
+
+        // byte 14: PARTIAL (bit 7) and REPORTING OPTIONS (bits 5:0), carried in FEATURE 15:8.
+        actionSpecific = cdb[14] & 0xBF;
+
+        srbExtension->Flags |= (ATA_FLAGS_DATA_IN | ATA_FLAGS_USE_DMA);
+        srbExtension->CompletionRoutine = AtaReportZonesRequestCompletion;
+    } else {
+        if ((serviceAction < ZBC_SERVICE_ACTION_CLOSE_ZONE) ||
+            (serviceAction > ZBC_SERVICE_ACTION_RESET_WRITE_POINTER)) {
+            Srb->SrbStatus = SRB_STATUS_INVALID_REQUEST;
+            return STOR_STATUS_INVALID_DEVICE_REQUEST;
+        }
+
+        // byte 14: ALL (bit 0), carried in FEATURE 15:8. Zone ID is ignored when ALL is set.
+        actionSpecific = cdb[14] & 0x01;
+    }
+
+  //2. set up ZAC MANAGEMENT IN/OUT task file. The action field uses the same value as the ZBC service action.
+    srbExtension->AtaFunction = ATA_FUNCTION_ATA_COMMAND;
+    srbExtension->Flags |= ATA_FLAGS_48BIT_COMMAND;
+
+    SetCommandReg((&srbExtension->TaskFile.Current), (cdb[0] == SCSIOP_ZBC_IN) ? IDE_COMMAND_ZAC_MANAGEMENT_IN : IDE_COMMAND_ZAC_MANAGEMENT_OUT);
+
+    SetFeaturesReg((&srbExtension->TaskFile.Current), serviceAction);
+    SetFeaturesReg((&srbExtension->TaskFile.Previous), actionSpecific);
+
+    SetSectorCount((&srbExtension->TaskFile.Current), (UCHAR)(pageCount & 0xFF));
+    SetSectorCount((&srbExtension->TaskFile.Previous), (UCHAR)((pageCount >> 8) & 0xFF));
+
+    SetSectorNumber((&srbExtension->TaskFile.Current), (UCHAR)(zoneId & 0xFF));
+    SetCylinderLow((&srbExtension->TaskFile.Current), (UCHAR)((zoneId >> 8) & 0xFF));
+    SetCylinderHigh((&srbExtension->TaskFile.Current), (UCHAR)((zoneId >> 16) & 0xFF));
+    SetSectorNumber((&srbExtension->TaskFile.Previous), (UCHAR)((zoneId >> 24) & 0xFF));
+    SetCylinderLow((&srbExtension->TaskFile.Previous), (UCHAR)((zoneId >> 32) & 0xFF));
+    SetCylinderHigh((&srbExtension->TaskFile.Previous), (UCHAR)((zoneId >> 40) & 0xFF));
+
+    SetDeviceReg((&srbExtension->TaskFile.Current), IDE_LBA_MODE);
+
+    return STOR_STATUS_SUCCESS;
+}
+
 UCHAR
 AtaMapError(
     __in PAHCI_CHANNEL_EXTENSION ChannelExtension,
@@ -3295,6 +3705,17 @@ Return Value:
         }
     }
 
+    // 1.1 account streaming commands to their streams. Status SE: completed within the time limit, data may be in error.
+    if (IsStreamingCommand(srbExtension)) {
+        PAHCI_STREAM_STATISTICS streamStatistics = &ChannelExtension->StreamStatistics[srbExtension->TaskFile.Current.bFeaturesReg & IDE_STREAM_ID_MASK];
+
+        if (Srb->SrbStatus != SRB_STATUS_SUCCESS) {
+            AhciUlongIncrement(&streamStatistics->FailedCount);
+        } else if ((srbExtension->AtaStatus & IDE_STATUS_STREAM_ERROR) != 0) {
+            AhciUlongIncrement(&streamStatistics->StreamErrorCount);
+        }
+    }
+
     if (Srb->SrbStatus != SRB_STATUS_ERROR) {
         // non device errors. Don't care
         ChannelExtension->DeviceExtension[0].IoRecord.SuccessCount++;
@@ -3302,6 +3723,25 @@ Return Value:
         return Srb->SrbStatus;
     }
 
+    // 1.2 sense data returned by the device in the NCQ Command Error log, no need to guess it from the error register
+    if ( (senseBuffer.Valid == 0) &&
+         ((srbExtension->Flags & ATA_FLAGS_NCQ_ERROR_LOG) != 0) &&
+         (srbExtension->SenseKey != 0) ) {
+
+        senseBuffer.ErrorCode = SCSI_SENSE_ERRORCODE_FIXED_CURRENT;
+        senseBuffer.Valid     = 1;
+        senseBuffer.AdditionalSenseLength = 0xb;
+        senseBuffer.SenseKey = srbExtension->SenseKey;
+        senseBuffer.AdditionalSenseCode = srbExtension->AdditionalSenseCode;
+        senseBuffer.AdditionalSenseCodeQualifier = srbExtension->AdditionalSenseCodeQualifier;
+
+        if (srbExtension->SenseKey == SCSI_SENSE_MEDIUM_ERROR) {
+            ChannelExtension->DeviceExtension[0].IoRecord.MediaErrorCount++;
+        } else {
+            ChannelExtension->DeviceExtension[0].IoRecord.OtherErrorCount++;
+        }
+    }
+
     // 2. general process
     removableMedia = IsRemovableMedia(&ChannelExtension->DeviceExtension->DeviceParameters);
 
@@ -3383,6 +3823,21 @@ Return Value:
 
             ChannelExtension->DeviceExtension[0].IoRecord.OtherErrorCount++;
 
+        } else if (IsCommandDurationLimitExceeded(srbExtension)) {
+            // bit 2: Command Aborted, by the policy of the Command Duration Limits descriptor the command carried.
+
+            Srb->SrbStatus = SRB_STATUS_ABORTED;
+
+            senseBuffer.ErrorCode = SCSI_SENSE_ERRORCODE_FIXED_CURRENT;
+            senseBuffer.Valid     = 1;
+            senseBuffer.AdditionalSenseLength = 0xb;
+            senseBuffer.SenseKey =  SCSI_SENSE_ABORTED_COMMAND;
+            senseBuffer.AdditionalSenseCode = SCSI_ADSENSE_COMMAND_TIMEOUT;
+            senseBuffer.AdditionalSenseCodeQualifier = SCSI_SENSEQ_COMMAND_TIMEOUT_DURING_PROCESSING;
+
+            ChannelExtension->DeviceExtension[0].IoRecord.AbortedCommandCount++;
+            AhciUlongIncrement(&ChannelExtension->CdlStatistics.LimitExceededCount);
+
         } else if (srbExtension->AtaError & IDE_ERROR_COMMAND_ABORTED) {
 
             // bit 2: Command Aborted
@@ -3746,6 +4201,9 @@ Return Value:
     //PINQUIRYDATA           inquiryData = (PINQUIRYDATA)ChannelExtension->DeviceExtension->InquiryData;
 
     //1. re-initialize device specific information to avoid the values being reused after device switched.
+    ChannelExtension->DeviceExtension->InquiryCache.Valid = FALSE;
+    SmartCacheInvalidate(ChannelExtension);
+    HotLbaReset(ChannelExtension);
     ChannelExtension->StateFlags.NCQ_Activated = 0;
     ChannelExtension->StateFlags.NCQ_Succeeded = 0;
     ChannelExtension->StateFlags.HybridInfoEnabledOnHiberFile = 0;
@@ -3754,6 +4212,12 @@ Return Value:
 
     AhciZeroMemory((PCHAR)&ChannelExtension->DeviceExtension->SupportedGPLPages, sizeof(ATA_SUPPORTED_GPL_PAGES));
 
+    // Command Duration Limits support and descriptors are rediscovered from log pages.
+    ChannelExtension->DeviceExtension->SupportedCommands.CommandDurationLimits = 0;
+    ChannelExtension->CommandDurationLimits.DeviceEnabled = FALSE;
+    ChannelExtension->CommandDurationLimits.ReadDescriptors = 0;
+    ChannelExtension->CommandDurationLimits.WriteDescriptors = 0;
+
     if (IsAtapiDevice(deviceParameters)) {
         deviceParameters->MaximumLun = 0;
         // following two fields are not used for ATAPI device.
@@ -3771,7 +4235,22 @@ Return Value:
         deviceParameters->ScsiDeviceType = DIRECT_ACCESS_DEVICE;
         deviceParameters->StateFlags.RemovableMedia = identifyDeviceData->GeneralConfiguration.RemovableMedia;
 
-        deviceParameters->MaxDeviceQueueDepth = min(ChannelExtension->MaxPortQueueDepth, (UCHAR)identifyDeviceData->QueueDepth);
+        // host managed zoned devices are only known by their signature, the other zoned models are reported in IDENTIFY word 69.
+        if (deviceParameters->StateFlags.HostManagedZoned == 1) {
+            deviceParameters->ScsiDeviceType = ZONED_BLOCK_DEVICE;
+            deviceParameters->StateFlags.ZonedModel = ATA_ZONED_MODEL_HOST_MANAGED;
+        } else {
+            ULONG zonedCapabilities = ((PUSHORT)identifyDeviceData)[IDENTIFY_WORD_ADDITIONAL_SUPPORTED] & 0x3;
+
+            // value 3 is reserved
+            deviceParameters->StateFlags.ZonedModel = (zonedCapabilities == ATA_ZONED_MODEL_HOST_MANAGED) ? ATA_ZONED_MODEL_NONE : zonedCapabilities;
+        }
+
+        // IDENTIFY Queue Depth is a 0 based value (i.e. 0x1F == 32).
+        deviceParameters->MaxDeviceQueueDepth = min(ChannelExtension->MaxPortQueueDepth, (UCHAR)(identifyDeviceData->QueueDepth + 1));
+
+        deviceParameters->StateFlags.FuaSupported = 0;
+        deviceParameters->StateFlags.NcqFuaSupported = 0;
 
         if (identifyDeviceData->CommandSetSupport.WriteFua && identifyDeviceData->CommandSetActive.WriteFua) {
           // FUA support
@@ -3808,19 +4287,26 @@ Return Value:
             if (!IsDumpMode(ChannelExtension->AdapterExtension)) {
                 ChannelExtension->StateFlags.NCQ_Activated = 1;
                 deviceParameters->AddressTranslation = Lba48BitMode;
-                deviceParameters->StateFlags.FuaSupported = 1;
+                // FUA bit is defined for all FPDMA QUEUED writes, it doesn't depend on WRITE DMA FUA EXT support.
+                deviceParameters->StateFlags.NcqFuaSupported = 1;
             } else if (IsDumpHiberMode(ChannelExtension->AdapterExtension) && IsDeviceHybridInfoEnabled(ChannelExtension)) {
                 // allow NCQ and Hybrid Info conveyed by NCQ Write command during hibernation.
                 ChannelExtension->StateFlags.NCQ_Activated = 1;
                 ChannelExtension->StateFlags.HybridInfoEnabledOnHiberFile = 1;
                 deviceParameters->AddressTranslation = Lba48BitMode;
-                deviceParameters->StateFlags.FuaSupported = 1;
+                deviceParameters->StateFlags.NcqFuaSupported = 1;
             }
         }
     }
 
     DeviceInitAtaIds(ChannelExtension, identifyDeviceData);
 
+    //3. FUA opt-out by model number. Without FUA support reported in MODE SENSE, class driver follows write-through writes with FLUSH.
+    if (IsAtaDevice(deviceParameters) && IsFuaOptOutDevice(ChannelExtension)) {
+        deviceParameters->StateFlags.FuaSupported = 0;
+        deviceParameters->StateFlags.NcqFuaSupported = 0;
+    }
+
     SelectDeviceGeometry(ChannelExtension, deviceParameters, identifyDeviceData);
 
     return;
@@ -3918,6 +4404,22 @@ IOCTLtoATA(
             status = HybridIoctlProcess(ChannelExtension, Srb);
             break;
 
+        case IOCTL_SCSI_MINIPORT_AHCI_PORT_STATISTICS:
+            status = PortStatisticsIoctlProcess(ChannelExtension, Srb);
+            break;
+
+        case IOCTL_SCSI_MINIPORT_AHCI_PORT_THROTTLE:
+            status = PortThrottleIoctlProcess(ChannelExtension, Srb);
+            break;
+
+        case IOCTL_SCSI_MINIPORT_AHCI_PORT_SCT_ERC:
+            status = PortSctErcIoctlProcess(ChannelExtension, Srb);
+            break;
+
+        case IOCTL_SCSI_MINIPORT_AHCI_PORT_STREAMING:
+            status = PortStreamingIoctlProcess(ChannelExtension, Srb);
+            break;
+
         default:
 
             Srb->SrbStatus = SRB_STATUS_INVALID_REQUEST;
@@ -4049,14 +4551,151 @@ FillClippedSGL(
         }
     }
 
-    //record the number of elements left
-    LocalSgl->NumberOfElements = j;
+    //record the number of elements left
+    LocalSgl->NumberOfElements = j;
+
+    if ((LocalSgl->NumberOfElements > 33) || (BytesLeft != 0) || (BytesNeeded != 0)) {
+        return FALSE;
+    } else {
+        return TRUE;
+    }
+}
+
+ULONG
+SmartCacheEntryIndex(
+    __in UCHAR Command,
+    __in UCHAR Features,
+    __in UCHAR CylLow,
+    __in UCHAR CylHigh
+    )
+/*++
+    Returns the SMART cache entry of a command, AhciSmartCacheEntryCount if the command's data is not cached.
+--*/
+{
+    if (Command == IDE_COMMAND_IDENTIFY) {
+        return AhciSmartCacheIdentify;
+    }
+
+    // SMART READ DATA and SMART READ THRESHOLDS, with the SMART signature in LBA Mid/High.
+    if ( (Command == SMART_CMD) && (CylLow == SMART_CYL_LOW) && (CylHigh == SMART_CYL_HI) ) {
+        if (Features == READ_ATTRIBUTES) {
+            return AhciSmartCacheAttributes;
+        } else if (Features == READ_THRESHOLDS) {
+            return AhciSmartCacheThresholds;
+        }
+    }
+
+    return AhciSmartCacheEntryCount;
+}
+
+BOOLEAN
+SmartCacheRead(
+    __in PAHCI_CHANNEL_EXTENSION ChannelExtension,
+    __in PSCSI_REQUEST_BLOCK_EX Srb,
+    __in ULONG EntryIndex
+    )
+/*++
+    Completes a SMART IOCTL with data from the SMART cache if it has been read from the device within the configured timeout.
+    SMART commands are non-queued, serving the frequent polls of monitoring tools from the cache spares the drain of NCQ commands.
+
+It assumes:
+    The IOCTL buffer has been validated to hold SENDCMDOUTPARAMS
+Called by:
+    SmartIdentifyData, SmartGeneric
+
+Return Value:
+    TRUE - the request is completed, no command is sent to device.
+--*/
+{
+    PAHCI_SMART_CACHE_ENTRY entry;
+    PSENDCMDOUTPARAMS       outParams;
+    STOR_LOCK_HANDLE        lockhandle = {0};
+    LARGE_INTEGER           perfCounter = {0};
+    LARGE_INTEGER           perfFrequency = {0};
+    ULONGLONG               age;
+    BOOLEAN                 hit = FALSE;
+
+    if ( (EntryIndex >= AhciSmartCacheEntryCount) ||
+         (ChannelExtension->SmartCache.Timeout == 0) ||
+         (SrbGetDataTransferLength(Srb) < (sizeof(SRB_IO_CONTROL) + sizeof(SENDCMDOUTPARAMS) - 1 + ATA_BLOCK_SIZE)) ) {
+        return FALSE;
+    }
+
+    outParams = (PSENDCMDOUTPARAMS)((PUCHAR)SrbGetDataBuffer(Srb) + sizeof(SRB_IO_CONTROL));
+    entry = &ChannelExtension->SmartCache.Entry[EntryIndex];
+
+    StorPortQueryPerformanceCounter((PVOID)ChannelExtension->AdapterExtension, &perfFrequency, &perfCounter);
+
+    StorPortAcquireSpinLock(ChannelExtension->AdapterExtension, InterruptLock, NULL, &lockhandle);
+
+    if ( (entry->Timestamp != 0) && (perfFrequency.QuadPart != 0) ) {
+        age = (((ULONGLONG)perfCounter.QuadPart - entry->Timestamp) * 1000) / (ULONGLONG)perfFrequency.QuadPart;
+
+        if (age < ChannelExtension->SmartCache.Timeout) {
+            StorPortCopyMemory(outParams->bBuffer, entry->Data, ATA_BLOCK_SIZE);
+            hit = TRUE;
+        }
+    }
+
+    AhciUlongIncrement(hit ? &ChannelExtension->SmartCacheStatistics.HitCount : &ChannelExtension->SmartCacheStatistics.MissCount);
 
-    if ((LocalSgl->NumberOfElements > 33) || (BytesLeft != 0) || (BytesNeeded != 0)) {
-        return FALSE;
-    } else {
-        return TRUE;
+    StorPortReleaseSpinLock(ChannelExtension->AdapterExtension, &lockhandle);
+
+    if (hit) {
+        outParams->DriverStatus.bDriverError = 0;
+        outParams->DriverStatus.bIDEError = 0;
+        Srb->SrbStatus = SRB_STATUS_SUCCESS;
+    }
+
+    return hit;
+}
+
+VOID
+SmartCacheUpdate(
+    __in PAHCI_CHANNEL_EXTENSION ChannelExtension,
+    __in PSCSI_REQUEST_BLOCK_EX Srb
+    )
+/*++
+    Keeps the data of a successful SMART READ DATA, SMART READ THRESHOLDS or IDENTIFY DEVICE IOCTL in the SMART cache.
+Called by:
+    AhciPortSmartCompletion
+--*/
+{
+    PAHCI_SRB_EXTENSION     srbExtension = GetSrbExtension(Srb);
+    PSENDCMDOUTPARAMS       outParams;
+    STOR_LOCK_HANDLE        lockhandle = {0};
+    LARGE_INTEGER           perfCounter = {0};
+    LARGE_INTEGER           perfFrequency = {0};
+    ULONG                   entryIndex;
+
+    entryIndex = SmartCacheEntryIndex(srbExtension->TaskFile.Current.bCommandReg,
+                                      srbExtension->TaskFile.Current.bFeaturesReg,
+                                      srbExtension->TaskFile.Current.bCylLowReg,
+                                      srbExtension->TaskFile.Current.bCylHighReg);
+
+    if ( (entryIndex >= AhciSmartCacheEntryCount) ||
+         (ChannelExtension->SmartCache.Timeout == 0) ||
+         (Srb->SrbStatus != SRB_STATUS_SUCCESS) ||
+         (srbExtension->DataTransferLength < ATA_BLOCK_SIZE) ) {
+        return;
+    }
+
+    StorPortQueryPerformanceCounter((PVOID)ChannelExtension->AdapterExtension, &perfFrequency, &perfCounter);
+
+    if ( (perfFrequency.QuadPart == 0) || (perfCounter.QuadPart == 0) ) {
+        return;
     }
+
+    outParams = (PSENDCMDOUTPARAMS)((PUCHAR)SrbGetDataBuffer(Srb) + sizeof(SRB_IO_CONTROL));
+
+    StorPortAcquireSpinLock(ChannelExtension->AdapterExtension, InterruptLock, NULL, &lockhandle);
+
+    StorPortCopyMemory(ChannelExtension->SmartCache.Entry[entryIndex].Data, outParams->bBuffer, ATA_BLOCK_SIZE);
+    ChannelExtension->SmartCache.Entry[entryIndex].Timestamp = (ULONGLONG)perfCounter.QuadPart;
+
+    StorPortReleaseSpinLock(ChannelExtension->AdapterExtension, &lockhandle);
+
+    return;
 }
 
 ULONG
@@ -4092,6 +4731,12 @@ SmartIdentifyData(
         Srb->SrbStatus = SRB_STATUS_INVALID_REQUEST;
         return STOR_STATUS_INVALID_DEVICE_REQUEST;
     }
+
+    // IDENTIFY data read recently is returned without sending the command.
+    if (SmartCacheRead(ChannelExtension, Srb, AhciSmartCacheIdentify)) {
+        return STOR_STATUS_SUCCESS;
+    }
+
   //1 Fills in the local SGL
     srbExtension = GetSrbExtension(Srb);
     srbExtension->AtaFunction = ATA_FUNCTION_ATA_IDENTIFY;
@@ -4155,6 +4800,18 @@ SmartGeneric(
                     return STOR_STATUS_BUFFER_TOO_SMALL;
                 }
 
+              //SMART data read recently is returned without sending the command, writing a log page changes it.
+                if (inParams->irDriveRegs.bFeaturesReg == SMART_WRITE_LOG) {
+                    SmartCacheInvalidate(ChannelExtension);
+                } else if (SmartCacheRead(ChannelExtension,
+                                          Srb,
+                                          SmartCacheEntryIndex(inParams->irDriveRegs.bCommandReg,
+                                                               inParams->irDriveRegs.bFeaturesReg,
+                                                               inParams->irDriveRegs.bCylLowReg,
+                                                               inParams->irDriveRegs.bCylHighReg))) {
+                    return STOR_STATUS_SUCCESS;
+                }
+
               //Setup the outbuffer to hold the data transfered
                 //Ensure the PRDT will get set up
                 if (inParams->irDriveRegs.bFeaturesReg == SMART_WRITE_LOG) {
@@ -4203,7 +4860,8 @@ SmartGeneric(
                     return STOR_STATUS_INVALID_DEVICE_REQUEST;
                 }
               //there is no data transfer.
-                //Nothing to do for these
+                //The self-test status in SMART data changes
+                SmartCacheInvalidate(ChannelExtension);
                 break;
 
             case ENABLE_SMART:
@@ -4212,7 +4870,8 @@ SmartGeneric(
             case ENABLE_DISABLE_AUTOSAVE:
             case ENABLE_DISABLE_AUTO_OFFLINE:
               //there is no data transfer.
-                //Nothing to do for these
+                //These change SMART data or its state in IDENTIFY data
+                SmartCacheInvalidate(ChannelExtension);
                 break;
 
             default:
@@ -5583,115 +6242,470 @@ Return Value:
     srbExtension = GetSrbExtension(Srb);
     logicalSectorSize = BytesPerLogicalSector(&ChannelExtension->DeviceExtension->DeviceParameters);
 
-    srbControl = (PSRB_IO_CONTROL)SrbGetDataBuffer(Srb);
-    dsmAttributes = (PDEVICE_MANAGE_DATA_SET_ATTRIBUTES)((PUCHAR)srbControl + ALIGN_UP(sizeof(SRB_IO_CONTROL), PVOID));
-    changePriorty = (PDEVICE_DSM_NVCACHE_CHANGE_PRIORITY_PARAMETERS)((PUCHAR)dsmAttributes + dsmAttributes->ParameterBlockOffset);
-    dataSetRange = (PDEVICE_DATA_SET_RANGE)((PUCHAR)dsmAttributes + dsmAttributes->DataSetRangesOffset);
+    srbControl = (PSRB_IO_CONTROL)SrbGetDataBuffer(Srb);
+    dsmAttributes = (PDEVICE_MANAGE_DATA_SET_ATTRIBUTES)((PUCHAR)srbControl + ALIGN_UP(sizeof(SRB_IO_CONTROL), PVOID));
+    changePriorty = (PDEVICE_DSM_NVCACHE_CHANGE_PRIORITY_PARAMETERS)((PUCHAR)dsmAttributes + dsmAttributes->ParameterBlockOffset);
+    dataSetRange = (PDEVICE_DATA_SET_RANGE)((PUCHAR)dsmAttributes + dsmAttributes->DataSetRangesOffset);
+
+    if (dsmAttributes->ParameterBlockLength < sizeof(DEVICE_DSM_NVCACHE_CHANGE_PRIORITY_PARAMETERS)) {
+        srbControl->ReturnCode = HYBRID_STATUS_INVALID_PARAMETER;
+        Srb->SrbStatus = SRB_STATUS_BAD_SRB_BLOCK_LENGTH;
+        return STOR_STATUS_INVALID_PARAMETER;
+    }
+
+    if ((dsmAttributes->DataSetRangesOffset < sizeof(DEVICE_MANAGE_DATA_SET_ATTRIBUTES)) ||
+        (dsmAttributes->DataSetRangesLength < sizeof(DEVICE_DATA_SET_RANGE))) {
+
+        srbControl->ReturnCode = HYBRID_STATUS_ILLEGAL_REQUEST;
+        Srb->SrbStatus = SRB_STATUS_BAD_FUNCTION;
+        return STOR_STATUS_INVALID_PARAMETER;
+    }
+
+    if (dsmAttributes->DataSetRangesLength / sizeof(DEVICE_DATA_SET_RANGE) > GetHybridMaxLbaRangeCountForChangeLba(ChannelExtension)) {
+        srbControl->ReturnCode = HYBRID_STATUS_ILLEGAL_REQUEST;
+        Srb->SrbStatus = SRB_STATUS_BAD_FUNCTION;
+        return STOR_STATUS_INVALID_PARAMETER;
+    }
+
+    if (changePriorty->TargetPriority > ChannelExtension->DeviceExtension->HybridInfo.MaximumHybridPriorityLevel) {
+        srbControl->ReturnCode = HYBRID_STATUS_INVALID_PARAMETER;
+        Srb->SrbStatus = SRB_STATUS_BAD_SRB_BLOCK_LENGTH;
+        return STOR_STATUS_INVALID_PARAMETER;
+    }
+
+    //
+    // Fail the request if NCQ is not supported.
+    //
+    if (!IsNCQSupported(ChannelExtension) ||
+        (ChannelExtension->StateFlags.NCQ_Activated == 0)) {
+
+        srbControl->ReturnCode = HYBRID_STATUS_ILLEGAL_REQUEST;
+        Srb->SrbStatus = SRB_STATUS_BAD_FUNCTION;
+        return STOR_STATUS_INVALID_PARAMETER;
+    }
+
+    //
+    // If device doesn't support Hybrid or the feature is disabled, fail the request.
+    //
+    if (!IsDeviceHybridInfoSupported(ChannelExtension) ||
+        !IsDeviceHybridInfoEnabled(ChannelExtension) ||
+        (ChannelExtension->DeviceExtension->SupportedCommands.HybridChangeByLbaRange == 0)) {
+
+        srbControl->ReturnCode = HYBRID_STATUS_ILLEGAL_REQUEST;
+        Srb->SrbStatus = SRB_STATUS_BAD_FUNCTION;
+        return STOR_STATUS_INVALID_PARAMETER;
+    }
+
+    //
+    // If device is not recognized yet, fail the request.
+    //
+    if (logicalSectorSize == 0) {
+        srbControl->ReturnCode = HYBRID_STATUS_ILLEGAL_REQUEST;
+        Srb->SrbStatus = SRB_STATUS_BAD_FUNCTION;
+        return STOR_STATUS_INVALID_PARAMETER;
+    }
+
+    //
+    // The request has LBA range less than 1 sector, nothing to do.
+    //
+    if ((dataSetRange->LengthInBytes / logicalSectorSize) == 0) {
+        Srb->SrbStatus = SRB_STATUS_SUCCESS;
+        return STOR_STATUS_SUCCESS;
+    }
+
+    StorPortAllocatePool(ChannelExtension->AdapterExtension, sizeof(HYBRID_CHANGE_BY_LBA_CONTEXT), AHCI_POOL_TAG, (PVOID*)&lbaRangeContext);
+    if (lbaRangeContext == NULL) {
+        Srb->SrbStatus = SRB_STATUS_INVALID_REQUEST;
+        return STOR_STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    AhciZeroMemory((PCHAR)lbaRangeContext, sizeof(HYBRID_CHANGE_BY_LBA_CONTEXT));
+
+    lbaRangeContext->TargetPriority = changePriorty->TargetPriority;
+
+    lbaRangeContext->DataSetRanges = dataSetRange;
+    lbaRangeContext->DataSetRangeCount = dsmAttributes->DataSetRangesLength / sizeof(DEVICE_DATA_SET_RANGE);
+
+    //
+    // calculate how many ATA Lba entries needed to complete this request
+    //
+    for (i = 0; i < lbaRangeContext->DataSetRangeCount; i++) {
+        ULONGLONG   dataSetRangeLbaCount = dataSetRange[i].LengthInBytes / logicalSectorSize;
+
+        //
+        // the ATA Lba entry - SectorCount field is 16bits;
+        // following calculation shows how many ATA Lba entries should be used to represent the dataset range entry.
+        //
+        if (dataSetRangeLbaCount > 0) {
+            lbaRangeContext->NeededLbaRangeEntryCount += (ULONG)((dataSetRangeLbaCount - 1) / MAX_ATA_LBA_RANGE_SECTOR_COUNT_VALUE + 1);
+        }
+    }
+
+    //
+    // Prepare necessary data fields before directly calling HybridChangeByLbaCompletion().
+    //
+    srbExtension->AtaFunction = ATA_FUNCTION_ATA_CFIS_PAYLOAD;
+    srbExtension->CompletionRoutine = HybridChangeByLbaCompletion;
+    srbExtension->CompletionContext = (PVOID)lbaRangeContext;
+
+    HybridChangeByLbaCompletion(ChannelExtension, Srb);
+
+    return STOR_STATUS_SUCCESS;
+}
+
+//
+// Multipliers of the rows of the hot LBA sketch, each row hashes an extent to a different counter.
+//
+static const ULONGLONG HotLbaSketchSeed[AHCI_HOT_LBA_SKETCH_ROWS] = {
+    0x9E3779B97F4A7C15ui64,
+    0xC2B2AE3D27D4EB4Fui64,
+    0x165667B19E3779F9ui64,
+    0xD6E8FEB86659FD93ui64
+};
+
+__inline
+ULONG
+HotLbaSketchIndex(
+    __in ULONGLONG  Extent,
+    __in ULONG      Row
+    )
+{
+    // the high bits of the product depend on all bits of the extent.
+    return (ULONG)((Extent * HotLbaSketchSeed[Row]) >> 56) % AHCI_HOT_LBA_SKETCH_WIDTH;
+}
+
+__inline
+BOOLEAN
+HotLbaPromotionAllowed(
+    __in PAHCI_CHANNEL_EXTENSION ChannelExtension
+    )
+{
+    // the same requirements as a Change by LBA request, see HybridChangeByLba().
+    return ( IsNCQSupported(ChannelExtension) &&
+             (ChannelExtension->StateFlags.NCQ_Activated == 1) &&
+             IsDeviceHybridInfoEnabled(ChannelExtension) &&
+             (ChannelExtension->DeviceExtension->SupportedCommands.HybridChangeByLbaRange == 1) &&
+             (BytesPerLogicalSector(&ChannelExtension->DeviceExtension->DeviceParameters) != 0) );
+}
+
+__inline
+BOOLEAN
+HotLbaIntervalElapsed(
+    __in PAHCI_HOT_LBA  HotLba,
+    __in ULONGLONG      PerfCounter,
+    __in ULONGLONG      PerfFrequency
+    )
+{
+    // another processor may have started a new interval after PerfCounter was read.
+    return ( (HotLba->IntervalStart != 0) &&
+             (PerfCounter > HotLba->IntervalStart) &&
+             (((PerfCounter - HotLba->IntervalStart) / PerfFrequency) >= HotLba->Interval) );
+}
+
+VOID
+HotLbaIssuePromoteCommand(
+    __in PAHCI_CHANNEL_EXTENSION ChannelExtension
+    )
+/*++
+    Uses the local SRB to send HYBRID CHANGE BY LBA RANGE for the next extent picked for promotion.
+It assumes:
+    The local SRB is owned by the promotion (ReservedSlotInUse) and HotLba.NextCandidate is less than HotLba.CandidateCount
+Called by:
+    HotLbaPromote
+    HotLbaPromoteCompletion
+
+It performs:
+    1 Take the next extent, the last extent of the device may be shorter
+    2 Fill in the local SRB with the command, the extent goes to the caching medium with the configured priority
+--*/
+{
+    PAHCI_HOT_LBA           hotLba = &ChannelExtension->HotLba;
+    PSCSI_REQUEST_BLOCK_EX  srb = &ChannelExtension->Local.Srb;
+    PAHCI_SRB_EXTENSION     srbExtension = ChannelExtension->Local.SrbExtension;
+    ULONGLONG               maxLba = MaxUserAddressableLba(&ChannelExtension->DeviceExtension->DeviceParameters);
+    ULONGLONG               startLba;
+    ULONG                   lbaCount = 1 << AHCI_HOT_LBA_EXTENT_SHIFT;
+
+  //1 Take the next extent
+    hotLba->InProgress = hotLba->Candidates[hotLba->NextCandidate];
+    hotLba->NextCandidate++;
+
+    startLba = hotLba->InProgress << AHCI_HOT_LBA_EXTENT_SHIFT;
+
+    NT_ASSERT(startLba < maxLba);
+
+    if ((startLba + lbaCount) > maxLba) {
+        lbaCount = (ULONG)(maxLba - startLba);
+    }
+
+  //2 Fill in the local SRB, see BuildLocalCommand()
+    srb->SrbStatus = SRB_STATUS_PENDING;
+    srb->SrbExtension = (PVOID)srbExtension;
+    srb->TimeOutValue = 1;      //as it's sent by miniport, no one monitors the timeout value.
+
+    AhciZeroMemory((PCHAR)srbExtension, sizeof(AHCI_SRB_EXTENSION));
+
+    BuildHybridChangeByLbaCommand(&srbExtension->Cfis,
+                                  (UCHAR)min(hotLba->Priority, ChannelExtension->DeviceExtension->HybridInfo.MaximumHybridPriorityLevel),
+                                  startLba,
+                                  (USHORT)lbaCount,
+                                  (ChannelExtension->DeviceExtension->HybridInfo.SupportedOptions.SupportCacheBehavior == 1));
+
+    srbExtension->AtaFunction = ATA_FUNCTION_ATA_CFIS_PAYLOAD;
+    srbExtension->CompletionRoutine = HotLbaPromoteCompletion;
+
+    return;
+}
+
+VOID
+HotLbaPromoteCompletion(
+    __in PAHCI_CHANNEL_EXTENSION ChannelExtension,
+    __in PSCSI_REQUEST_BLOCK_EX  Srb
+    )
+/*++
+    Completion of HYBRID CHANGE BY LBA RANGE sent for a hot extent, sends the next one.
+Called by:
+    Local SRB completion
+
+It performs:
+    1 Keep the promoted extent for the hit counter
+    2 Send the next extent. Preserved settings to restore after a reset go first, IssuePreservedSettingCommands()
+      sends them or releases the local SRB.
+--*/
+{
+    PAHCI_HOT_LBA   hotLba = &ChannelExtension->HotLba;
+
+  //1 Keep the promoted extent for the hit counter
+    if (Srb->SrbStatus == SRB_STATUS_SUCCESS) {
+        AhciUlongIncrement(&ChannelExtension->HotLbaStatistics.PromotedExtents);
+
+        // HotLbaReset() may have dropped the candidates meanwhile.
+        if (hotLba->PromotedCount < hotLba->NextCandidate) {
+            hotLba->Promoted[hotLba->PromotedCount] = hotLba->InProgress;
+            hotLba->PromotedCount++;
+        }
+    } else {
+        AhciUlongIncrement(&ChannelExtension->HotLbaStatistics.FailedPromotions);
+        hotLba->CandidateCount = hotLba->NextCandidate;
+
+        StorPortDebugPrint(3, "StorAHCI - Hybrid: Port %02d - promotion of extent at LBA 0x%I64x failed, SrbStatus 0x%02X\n",
+                           ChannelExtension->PortNumber, (hotLba->InProgress << AHCI_HOT_LBA_EXTENT_SHIFT), Srb->SrbStatus);
+    }
+
+  //2 Send the next extent
+    if ( (hotLba->NextCandidate < hotLba->CandidateCount) &&
+         (ChannelExtension->PersistentSettings.SlotsToSend == 0) &&
+         (ChannelExtension->SctErc.CommandsToSend == 0) &&
+         (ChannelExtension->Streaming.StreamsToConfigure == 0) &&
+         HotLbaPromotionAllowed(ChannelExtension) ) {
+
+        HotLbaIssuePromoteCommand(ChannelExtension);
+    } else {
+        hotLba->CandidateCount = hotLba->NextCandidate;
+        IssuePreservedSettingCommands(ChannelExtension, NULL);
+    }
+
+    return;
+}
+
+VOID
+HotLbaPromote(
+    __in PAHCI_CHANNEL_EXTENSION ChannelExtension
+    )
+/*++
+    Ends the interval of hot LBA tracking once it has elapsed and starts promoting the hottest extents to the caching medium.
+    A hybrid device has no idle timer here, the interval is checked from the read path instead.
+It assumes:
+    Called from StartIo while a read is started, the port is active
+Called by:
+    HotLbaTrackRead
+
+It performs:
+    1 Check if the interval has elapsed, the first check starts it
+    2 Halve the read counters, recent reads weigh more than older ones
+    3 Pick the hottest extents within the budget. Skip the interval if the local SRB is in use
+    4 Send the first one with the local SRB, its completion sends the others
+--*/
+{
+    PAHCI_HOT_LBA       hotLba = &ChannelExtension->HotLba;
+    STOR_LOCK_HANDLE    lockhandle = {0};
+    LARGE_INTEGER       perfCounter = {0};
+    LARGE_INTEGER       perfFrequency = {0};
+    ULONGLONG           maxLba = MaxUserAddressableLba(&ChannelExtension->DeviceExtension->DeviceParameters);
+    ULONG               picked = 0;
+    ULONG               hottest;
+    ULONG               i, j;
+    BOOLEAN             referenced;
+    BOOLEAN             issued = FALSE;
+
+  //1 Check if the interval has elapsed
+    StorPortQueryPerformanceCounter((PVOID)ChannelExtension->AdapterExtension, &perfFrequency, &perfCounter);
+
+    if ( (perfFrequency.QuadPart == 0) || (perfCounter.QuadPart == 0) ) {
+        return;
+    }
+
+    if (hotLba->IntervalStart == 0) {
+        hotLba->IntervalStart = (ULONGLONG)perfCounter.QuadPart;
+        return;
+    }
+
+    if (!HotLbaIntervalElapsed(hotLba, (ULONGLONG)perfCounter.QuadPart, (ULONGLONG)perfFrequency.QuadPart)) {
+        return;
+    }
+
+    // the promotion keeps the port active until its last command completes, see IssuePreservedSettingCommands().
+    referenced = PortAcquireActiveReference(ChannelExtension, NULL, NULL);
+
+    StorPortAcquireSpinLock(ChannelExtension->AdapterExtension, InterruptLock, NULL, &lockhandle);
+
+    if (HotLbaIntervalElapsed(hotLba, (ULONGLONG)perfCounter.QuadPart, (ULONGLONG)perfFrequency.QuadPart)) {
+
+      //2 Halve the read counters
+        hotLba->IntervalStart = (ULONGLONG)perfCounter.QuadPart;
+        AhciUlongIncrement(&ChannelExtension->HotLbaStatistics.Intervals);
+
+        for (i = 0; i < AHCI_HOT_LBA_SKETCH_ROWS; i++) {
+            for (j = 0; j < AHCI_HOT_LBA_SKETCH_WIDTH; j++) {
+                hotLba->Sketch[i][j] >>= 1;
+            }
+        }
+
+        for (i = 0; i < AHCI_HOT_LBA_TOP_COUNT; i++) {
+            hotLba->Top[i].Count >>= 1;
+        }
+
+      //3 Pick the hottest extents within the budget
+        if ( HotLbaPromotionAllowed(ChannelExtension) &&
+             (InterlockedBitTestAndSet((LONG*)&ChannelExtension->StateFlags, 3) == 0) ) {    //ReservedSlotInUse field is at bit 3
+
+            hotLba->CandidateCount = 0;
+            hotLba->NextCandidate = 0;
+            hotLba->PromotedCount = 0;
 
-    if (dsmAttributes->ParameterBlockLength < sizeof(DEVICE_DSM_NVCACHE_CHANGE_PRIORITY_PARAMETERS)) {
-        srbControl->ReturnCode = HYBRID_STATUS_INVALID_PARAMETER;
-        Srb->SrbStatus = SRB_STATUS_BAD_SRB_BLOCK_LENGTH;
-        return STOR_STATUS_INVALID_PARAMETER;
-    }
+            while (hotLba->CandidateCount < hotLba->Budget) {
+                hottest = AHCI_HOT_LBA_TOP_COUNT;
 
-    if ((dsmAttributes->DataSetRangesOffset < sizeof(DEVICE_MANAGE_DATA_SET_ATTRIBUTES)) ||
-        (dsmAttributes->DataSetRangesLength < sizeof(DEVICE_DATA_SET_RANGE))) {
+                for (i = 0; i < AHCI_HOT_LBA_TOP_COUNT; i++) {
+                    if ( ((picked & (1 << i)) == 0) &&
+                         (hotLba->Top[i].Count != 0) &&
+                         ((hotLba->Top[i].Extent << AHCI_HOT_LBA_EXTENT_SHIFT) < maxLba) &&
+                         ((hottest == AHCI_HOT_LBA_TOP_COUNT) || (hotLba->Top[i].Count > hotLba->Top[hottest].Count)) ) {
+                        hottest = i;
+                    }
+                }
 
-        srbControl->ReturnCode = HYBRID_STATUS_ILLEGAL_REQUEST;
-        Srb->SrbStatus = SRB_STATUS_BAD_FUNCTION;
-        return STOR_STATUS_INVALID_PARAMETER;
-    }
+                if (hottest == AHCI_HOT_LBA_TOP_COUNT) {
+                    break;
+                }
 
-    if (dsmAttributes->DataSetRangesLength / sizeof(DEVICE_DATA_SET_RANGE) > GetHybridMaxLbaRangeCountForChangeLba(ChannelExtension)) {
-        srbControl->ReturnCode = HYBRID_STATUS_ILLEGAL_REQUEST;
-        Srb->SrbStatus = SRB_STATUS_BAD_FUNCTION;
-        return STOR_STATUS_INVALID_PARAMETER;
-    }
+                picked |= (1 << hottest);
+                hotLba->Candidates[hotLba->CandidateCount] = hotLba->Top[hottest].Extent;
+                hotLba->CandidateCount++;
+            }
 
-    if (changePriorty->TargetPriority > ChannelExtension->DeviceExtension->HybridInfo.MaximumHybridPriorityLevel) {
-        srbControl->ReturnCode = HYBRID_STATUS_INVALID_PARAMETER;
-        Srb->SrbStatus = SRB_STATUS_BAD_SRB_BLOCK_LENGTH;
-        return STOR_STATUS_INVALID_PARAMETER;
-    }
+          //4 Send the first one
+            if (hotLba->CandidateCount != 0) {
+                ChannelExtension->StateFlags.RestorePreservedSettingsActiveReferenced = referenced ? 1 : 0;
+                referenced = FALSE;
 
-    //
-    // Fail the request if NCQ is not supported.
-    //
-    if (!IsNCQSupported(ChannelExtension) ||
-        (ChannelExtension->StateFlags.NCQ_Activated == 0)) {
+                HotLbaIssuePromoteCommand(ChannelExtension);
+                AhciProcessIo(ChannelExtension, &ChannelExtension->Local.Srb, TRUE);
+                issued = TRUE;
+            } else {
+                InterlockedBitTestAndReset((LONG*)&ChannelExtension->StateFlags, 3);    //ReservedSlotInUse field is at bit 3
+            }
+        }
 
-        srbControl->ReturnCode = HYBRID_STATUS_ILLEGAL_REQUEST;
-        Srb->SrbStatus = SRB_STATUS_BAD_FUNCTION;
-        return STOR_STATUS_INVALID_PARAMETER;
+        if (!issued) {
+            AhciUlongIncrement(&ChannelExtension->HotLbaStatistics.SkippedIntervals);
+        }
     }
 
-    //
-    // If device doesn't support Hybrid or the feature is disabled, fail the request.
-    //
-    if (!IsDeviceHybridInfoSupported(ChannelExtension) ||
-        !IsDeviceHybridInfoEnabled(ChannelExtension) ||
-        (ChannelExtension->DeviceExtension->SupportedCommands.HybridChangeByLbaRange == 0)) {
+    StorPortReleaseSpinLock(ChannelExtension->AdapterExtension, &lockhandle);
 
-        srbControl->ReturnCode = HYBRID_STATUS_ILLEGAL_REQUEST;
-        Srb->SrbStatus = SRB_STATUS_BAD_FUNCTION;
-        return STOR_STATUS_INVALID_PARAMETER;
+    if (referenced) {
+        PortReleaseActiveReference(ChannelExtension, NULL);
     }
 
-    //
-    // If device is not recognized yet, fail the request.
-    //
-    if (logicalSectorSize == 0) {
-        srbControl->ReturnCode = HYBRID_STATUS_ILLEGAL_REQUEST;
-        Srb->SrbStatus = SRB_STATUS_BAD_FUNCTION;
-        return STOR_STATUS_INVALID_PARAMETER;
-    }
+    return;
+}
 
-    //
-    // The request has LBA range less than 1 sector, nothing to do.
-    //
-    if ((dataSetRange->LengthInBytes / logicalSectorSize) == 0) {
-        Srb->SrbStatus = SRB_STATUS_SUCCESS;
-        return STOR_STATUS_SUCCESS;
-    }
+VOID
+HotLbaTrackRead(
+    __in PAHCI_CHANNEL_EXTENSION ChannelExtension,
+    __in ULONGLONG StartingLba
+    )
+/*++
+    Counts a read in the heat map of a hybrid device. The count-min sketch estimates the reads of the extent holding
+    StartingLba, the hottest extents are kept in HotLba.Top.
+It assumes:
+    HotLba.Budget is not 0
+    Called in StartIo, reads are counted one at a time
+Called by:
+    AtaReadWriteRequest
 
-    StorPortAllocatePool(ChannelExtension->AdapterExtension, sizeof(HYBRID_CHANGE_BY_LBA_CONTEXT), AHCI_POOL_TAG, (PVOID*)&lbaRangeContext);
-    if (lbaRangeContext == NULL) {
-        Srb->SrbStatus = SRB_STATUS_INVALID_REQUEST;
-        return STOR_STATUS_INSUFFICIENT_RESOURCES;
+It performs:
+    1 Count the read in each row of the sketch, the estimate is the smallest counter of the extent
+    2 Update the extent in the hottest extents, or let it replace the coldest one
+    3 Count the reads inside the promoted extents
+    4 Check the interval once every few reads
+--*/
+{
+    PAHCI_HOT_LBA   hotLba = &ChannelExtension->HotLba;
+    ULONGLONG       extent = StartingLba >> AHCI_HOT_LBA_EXTENT_SHIFT;
+    PUSHORT         counter;
+    ULONG           count = MAXULONG;
+    ULONG           coldest = 0;
+    ULONG           i;
+
+  //1 Count the read in each row of the sketch
+    for (i = 0; i < AHCI_HOT_LBA_SKETCH_ROWS; i++) {
+        counter = &hotLba->Sketch[i][HotLbaSketchIndex(extent, i)];
+
+        if (*counter != MAXUSHORT) {
+            (*counter)++;
+        }
+
+        count = min(count, (ULONG)*counter);
     }
 
-    AhciZeroMemory((PCHAR)lbaRangeContext, sizeof(HYBRID_CHANGE_BY_LBA_CONTEXT));
+  //2 Update the extent in the hottest extents
+    for (i = 0; i < AHCI_HOT_LBA_TOP_COUNT; i++) {
+        if ( (hotLba->Top[i].Count != 0) && (hotLba->Top[i].Extent == extent) ) {
+            break;
+        }
 
-    lbaRangeContext->TargetPriority = changePriorty->TargetPriority;
+        if (hotLba->Top[i].Count < hotLba->Top[coldest].Count) {
+            coldest = i;
+        }
+    }
 
-    lbaRangeContext->DataSetRanges = dataSetRange;
-    lbaRangeContext->DataSetRangeCount = dsmAttributes->DataSetRangesLength / sizeof(DEVICE_DATA_SET_RANGE);
+    if (i < AHCI_HOT_LBA_TOP_COUNT) {
+        hotLba->Top[i].Count = count;
+    } else if (count > hotLba->Top[coldest].Count) {
+        hotLba->Top[coldest].Extent = extent;
+        hotLba->Top[coldest].Count = count;
+    }
 
-    //
-    // calculate how many ATA Lba entries needed to complete this request
-    //
-    for (i = 0; i < lbaRangeContext->DataSetRangeCount; i++) {
-        ULONGLONG   dataSetRangeLbaCount = dataSetRange[i].LengthInBytes / logicalSectorSize;
+  //3 Count the reads inside the promoted extents
+    AhciUlongIncrement(&ChannelExtension->HotLbaStatistics.TrackedReads);
 
-        //
-        // the ATA Lba entry - SectorCount field is 16bits;
-        // following calculation shows how many ATA Lba entries should be used to represent the dataset range entry.
-        //
-        if (dataSetRangeLbaCount > 0) {
-            lbaRangeContext->NeededLbaRangeEntryCount += (ULONG)((dataSetRangeLbaCount - 1) / MAX_ATA_LBA_RANGE_SECTOR_COUNT_VALUE + 1);
+    for (i = 0; i < hotLba->PromotedCount; i++) {
+        if (hotLba->Promoted[i] == extent) {
+            AhciUlongIncrement(&ChannelExtension->HotLbaStatistics.PromotedReads);
+            break;
         }
     }
 
-    //
-    // Prepare necessary data fields before directly calling HybridChangeByLbaCompletion().
-    //
-    srbExtension->AtaFunction = ATA_FUNCTION_ATA_CFIS_PAYLOAD;
-    srbExtension->CompletionRoutine = HybridChangeByLbaCompletion;
-    srbExtension->CompletionContext = (PVOID)lbaRangeContext;
+  //4 Check the interval once every few reads
+    hotLba->ReadCount++;
 
-    HybridChangeByLbaCompletion(ChannelExtension, Srb);
+    if ((hotLba->ReadCount & AHCI_HOT_LBA_CHECK_MASK) == 0) {
+        HotLbaPromote(ChannelExtension);
+    }
 
-    return STOR_STATUS_SUCCESS;
+    return;
 }
 
 __inline
@@ -6107,6 +7121,309 @@ Return Value:
     return status;
 }
 
+ULONG
+PortStatisticsIoctlProcess(
+    __in PAHCI_CHANNEL_EXTENSION ChannelExtension,
+    __in PSCSI_REQUEST_BLOCK_EX Srb
+    )
+/*++
+    Returns AHCI_PORT_STATISTICS of the port the device is connected to. No command is sent to device.
+--*/
+{
+    PAHCI_PORT_STATISTICS   portStatistics;
+    STOR_LOCK_HANDLE        lockhandle = {0};
+    ULONG                   i;
+
+    if (SrbGetDataTransferLength(Srb) < (sizeof(SRB_IO_CONTROL) + sizeof(AHCI_PORT_STATISTICS))) {
+        Srb->SrbStatus = SRB_STATUS_BAD_SRB_BLOCK_LENGTH;
+        return STOR_STATUS_BUFFER_TOO_SMALL;
+    }
+
+    portStatistics = (PAHCI_PORT_STATISTICS)(((PUCHAR)SrbGetDataBuffer(Srb)) + sizeof(SRB_IO_CONTROL));
+
+    AhciZeroMemory((PCHAR)portStatistics, sizeof(AHCI_PORT_STATISTICS));
+
+    portStatistics->Version = AHCI_PORT_STATISTICS_VERSION;
+    portStatistics->Size = sizeof(AHCI_PORT_STATISTICS);
+    portStatistics->PortNumber = ChannelExtension->PortNumber;
+
+    // counters are updated with InterruptLock held, take a consistent snapshot.
+    StorPortAcquireSpinLock(ChannelExtension->AdapterExtension, InterruptLock, NULL, &lockhandle);
+
+    portStatistics->LpmWakeLatencyBudget = ChannelExtension->LpmAdaptivePolicy.WakeLatencyBudget;
+    StorPortCopyMemory(&portStatistics->Lpm, &ChannelExtension->LpmStatistics, sizeof(AHCI_LPM_STATISTICS));
+    StorPortCopyMemory(&portStatistics->NonQueued, &ChannelExtension->NonQueuedStatistics, sizeof(AHCI_NONQUEUED_STATISTICS));
+    portStatistics->NonQueued.BatchWindow = ChannelExtension->NonQueuedScheduler.BatchWindow;
+    portStatistics->NonQueued.BatchLimit = ChannelExtension->NonQueuedScheduler.BatchLimit;
+    StorPortCopyMemory(&portStatistics->Flush, &ChannelExtension->FlushStatistics, sizeof(AHCI_FLUSH_STATISTICS));
+    StorPortCopyMemory(portStatistics->SrbQueue, ChannelExtension->SrbQueueStatistics, sizeof(portStatistics->SrbQueue));
+
+    for (i = 0; i < AhciSrbQueueClassCount; i++) {
+        portStatistics->SrbQueue[i].Weight = ChannelExtension->SrbQueueScheduler.Weight[i];
+        portStatistics->SrbQueue[i].CurrentDepth = ChannelExtension->SrbQueue[i].CurrentDepth;
+        portStatistics->SrbQueue[i].DeepestDepth = ChannelExtension->SrbQueue[i].DeepestDepth;
+    }
+
+    StorPortCopyMemory(&portStatistics->Throttle, &ChannelExtension->ThrottleStatistics, sizeof(AHCI_THROTTLE_STATISTICS));
+    StorPortCopyMemory(&portStatistics->AdaptiveQueueDepth, &ChannelExtension->AdaptiveQueueDepthStatistics, sizeof(AHCI_ADAPTIVE_QD_STATISTICS));
+    portStatistics->AdaptiveQueueDepth.QueueDepth = GetEffectiveQueueDepth(ChannelExtension);
+    StorPortCopyMemory(&portStatistics->Interrupt, &ChannelExtension->InterruptStatistics, sizeof(AHCI_INTERRUPT_STATISTICS));
+    StorPortCopyMemory(&portStatistics->Polling, &ChannelExtension->PollingStatistics, sizeof(AHCI_POLLING_STATISTICS));
+
+    StorPortCopyMemory(&portStatistics->Cdl, &ChannelExtension->CdlStatistics, sizeof(AHCI_CDL_STATISTICS));
+    portStatistics->Cdl.Flags = (ChannelExtension->DeviceExtension->SupportedCommands.CommandDurationLimits ? AHCI_CDL_FLAG_SUPPORTED : 0) |
+                                (IsCommandDurationLimitsEnabled(ChannelExtension) ? AHCI_CDL_FLAG_ENABLED : 0);
+    portStatistics->Cdl.ReadDescriptors = ChannelExtension->CommandDurationLimits.ReadDescriptors;
+    portStatistics->Cdl.WriteDescriptors = ChannelExtension->CommandDurationLimits.WriteDescriptors;
+
+    StorPortCopyMemory(&portStatistics->Autosense, &ChannelExtension->AutosenseStatistics, sizeof(AHCI_AUTOSENSE_STATISTICS));
+    if (ChannelExtension->NcqAutosense.Enabled) {
+        portStatistics->Autosense.Flags = (IsDeviceSupportsSenseDataReporting(ChannelExtension) ? AHCI_AUTOSENSE_FLAG_SENSE_DATA_REPORTING : 0) |
+                                          (IsDeviceSupportsNcqAutosense(ChannelExtension) ? AHCI_AUTOSENSE_FLAG_NCQ_AUTOSENSE : 0) |
+                                          (ChannelExtension->DeviceExtension->SupportedGPLPages.SinglePage.NcqCommandError ? AHCI_AUTOSENSE_FLAG_NCQ_ERROR_RECOVERY : 0);
+    }
+
+    StorPortCopyMemory(&portStatistics->InquiryCache, &ChannelExtension->InquiryCacheStatistics, sizeof(AHCI_INQUIRY_CACHE_STATISTICS));
+    StorPortCopyMemory(&portStatistics->SmartCache, &ChannelExtension->SmartCacheStatistics, sizeof(AHCI_SMART_CACHE_STATISTICS));
+    portStatistics->SmartCache.Timeout = ChannelExtension->SmartCache.Timeout;
+
+    StorPortCopyMemory(&portStatistics->HotLba, &ChannelExtension->HotLbaStatistics, sizeof(AHCI_HOT_LBA_STATISTICS));
+    portStatistics->HotLba.Budget = ChannelExtension->HotLba.Budget;
+    portStatistics->HotLba.Interval = ChannelExtension->HotLba.Interval;
+    portStatistics->HotLba.ExtentSize = 1 << AHCI_HOT_LBA_EXTENT_SHIFT;
+    if (IsDeviceHybridInfoSupported(ChannelExtension)) {
+        portStatistics->HotLba.HybridEnabled = ChannelExtension->DeviceExtension->HybridInfo.Enabled;
+        portStatistics->HotLba.HybridHealth = ChannelExtension->DeviceExtension->HybridInfo.HybridHealth;
+        portStatistics->HotLba.NvmSize = ChannelExtension->DeviceExtension->HybridInfo.NVMSize;
+    }
+
+    StorPortReleaseSpinLock(ChannelExtension->AdapterExtension, &lockhandle);
+
+    Srb->SrbStatus = SRB_STATUS_SUCCESS;
+    return STOR_STATUS_SUCCESS;
+}
+
+ULONG
+PortThrottleIoctlProcess(
+    __in PAHCI_CHANNEL_EXTENSION ChannelExtension,
+    __in PSCSI_REQUEST_BLOCK_EX Srb
+    )
+/*++
+    Sets and returns the throttle limits of the port the device is connected to. No command is sent to device.
+--*/
+{
+    PAHCI_PORT_THROTTLE     portThrottle;
+    STOR_LOCK_HANDLE        lockhandle = {0};
+
+    if (SrbGetDataTransferLength(Srb) < (sizeof(SRB_IO_CONTROL) + sizeof(AHCI_PORT_THROTTLE))) {
+        Srb->SrbStatus = SRB_STATUS_BAD_SRB_BLOCK_LENGTH;
+        return STOR_STATUS_BUFFER_TOO_SMALL;
+    }
+
+    portThrottle = (PAHCI_PORT_THROTTLE)(((PUCHAR)SrbGetDataBuffer(Srb)) + sizeof(SRB_IO_CONTROL));
+
+    if ( (portThrottle->Version != AHCI_PORT_THROTTLE_VERSION) ||
+         (portThrottle->Size < sizeof(AHCI_PORT_THROTTLE)) ) {
+        Srb->SrbStatus = SRB_STATUS_INVALID_REQUEST;
+        return STOR_STATUS_INVALID_PARAMETER;
+    }
+
+    StorPortAcquireSpinLock(ChannelExtension->AdapterExtension, InterruptLock, NULL, &lockhandle);
+
+    if ((portThrottle->Flags & AHCI_PORT_THROTTLE_FLAG_SET) != 0) {
+        AhciThrottleSetLimits(ChannelExtension, &portThrottle->Limits);
+
+        StorPortDebugPrint(3, "StorAHCI - Throttle: Port %02d - limits set to %u IOPS, %u KB/s\n",
+                           ChannelExtension->PortNumber, portThrottle->Limits.IopsLimit, portThrottle->Limits.BandwidthLimit);
+
+        // requests held back by the old limits may go now.
+        AhciGetNextIos(ChannelExtension, TRUE);
+    }
+
+    portThrottle->Flags = 0;
+    portThrottle->Size = sizeof(AHCI_PORT_THROTTLE);
+    portThrottle->PortNumber = ChannelExtension->PortNumber;
+    StorPortCopyMemory(&portThrottle->Limits, &ChannelExtension->ThrottleStatistics.Limits, sizeof(AHCI_THROTTLE_LIMITS));
+
+    StorPortReleaseSpinLock(ChannelExtension->AdapterExtension, &lockhandle);
+
+    Srb->SrbStatus = SRB_STATUS_SUCCESS;
+    return STOR_STATUS_SUCCESS;
+}
+
+ULONG
+PortSctErcIoctlProcess(
+    __in PAHCI_CHANNEL_EXTENSION ChannelExtension,
+    __in PSCSI_REQUEST_BLOCK_EX Srb
+    )
+/*++
+    Sets and returns the SCT Error Recovery Control timers of the device. New timers are sent with the preserved settings.
+--*/
+{
+    PAHCI_PORT_SCT_ERC      portSctErc;
+    STOR_LOCK_HANDLE        lockhandle = {0};
+
+    if (SrbGetDataTransferLength(Srb) < (sizeof(SRB_IO_CONTROL) + sizeof(AHCI_PORT_SCT_ERC))) {
+        Srb->SrbStatus = SRB_STATUS_BAD_SRB_BLOCK_LENGTH;
+        return STOR_STATUS_BUFFER_TOO_SMALL;
+    }
+
+    portSctErc = (PAHCI_PORT_SCT_ERC)(((PUCHAR)SrbGetDataBuffer(Srb)) + sizeof(SRB_IO_CONTROL));
+
+    if ( (portSctErc->Version != AHCI_PORT_SCT_ERC_VERSION) ||
+         (portSctErc->Size < sizeof(AHCI_PORT_SCT_ERC)) ||
+         (portSctErc->ReadTimeout > 0xFFFF) ||
+         (portSctErc->WriteTimeout > 0xFFFF) ) {
+        Srb->SrbStatus = SRB_STATUS_INVALID_REQUEST;
+        return STOR_STATUS_INVALID_PARAMETER;
+    }
+
+    if ((portSctErc->Flags & AHCI_PORT_SCT_ERC_FLAG_SET) != 0) {
+        BOOLEAN restore;
+
+      // the timers are sent and their results recorded with InterruptLock held.
+      // A timer keeps its APPLIED state if its value doesn't change.
+        StorPortAcquireSpinLock(ChannelExtension->AdapterExtension, InterruptLock, NULL, &lockhandle);
+
+        if (ChannelExtension->SctErc.ReadTimeout != (USHORT)portSctErc->ReadTimeout) {
+            ChannelExtension->SctErc.ReadTimeout = (USHORT)portSctErc->ReadTimeout;
+            ChannelExtension->SctErc.Applied &= (UCHAR)~AHCI_SCT_ERC_READ;
+        }
+        if (ChannelExtension->SctErc.WriteTimeout != (USHORT)portSctErc->WriteTimeout) {
+            ChannelExtension->SctErc.WriteTimeout = (USHORT)portSctErc->WriteTimeout;
+            ChannelExtension->SctErc.Applied &= (UCHAR)~AHCI_SCT_ERC_WRITE;
+        }
+        SctErcUpdateCommands(ChannelExtension);
+        ChannelExtension->SctErc.Applied &= ChannelExtension->SctErc.Commands;
+
+        restore = (BOOLEAN)((ChannelExtension->SctErc.Commands & ~ChannelExtension->SctErc.Applied) != 0);
+
+        StorPortReleaseSpinLock(ChannelExtension->AdapterExtension, &lockhandle);
+
+        StorPortDebugPrint(3, "StorAHCI - SCT ERC: Port %02d - timers set to read %u, write %u (100ms)\n",
+                           ChannelExtension->PortNumber, portSctErc->ReadTimeout, portSctErc->WriteTimeout);
+
+      // as for the LPM settings, RestorePreservedSettings() acquires the active reference of the restore process,
+      // it's not called with InterruptLock held. The local SRB is started below.
+        if (restore) {
+            RestorePreservedSettings(ChannelExtension, FALSE);
+        }
+    }
+
+    StorPortAcquireSpinLock(ChannelExtension->AdapterExtension, InterruptLock, NULL, &lockhandle);
+
+    portSctErc->Flags = 0;
+    portSctErc->Size = sizeof(AHCI_PORT_SCT_ERC);
+    portSctErc->PortNumber = ChannelExtension->PortNumber;
+    portSctErc->ReadTimeout = ChannelExtension->SctErc.ReadTimeout;
+    portSctErc->WriteTimeout = ChannelExtension->SctErc.WriteTimeout;
+    portSctErc->AppliedCount = ChannelExtension->SctErc.AppliedCount;
+    portSctErc->FailedCount = ChannelExtension->SctErc.FailedCount;
+
+    if ( IsDeviceGeneralPurposeLoggingSupported(ChannelExtension) &&
+         ((((PUSHORT)ChannelExtension->DeviceExtension->IdentifyDeviceData)[IDENTIFY_WORD_SCT_COMMAND_TRANSPORT] & 0x9) == 0x9) ) {
+        portSctErc->Flags |= AHCI_PORT_SCT_ERC_FLAG_SUPPORTED;
+    }
+    if ((ChannelExtension->SctErc.Applied & AHCI_SCT_ERC_READ) != 0) {
+        portSctErc->Flags |= AHCI_PORT_SCT_ERC_FLAG_READ_APPLIED;
+    }
+    if ((ChannelExtension->SctErc.Applied & AHCI_SCT_ERC_WRITE) != 0) {
+        portSctErc->Flags |= AHCI_PORT_SCT_ERC_FLAG_WRITE_APPLIED;
+    }
+    if ((ChannelExtension->SctErc.CommandsToSend | ChannelExtension->SctErc.CommandInProgress) != 0) {
+        portSctErc->Flags |= AHCI_PORT_SCT_ERC_FLAG_PENDING;
+    }
+
+    // the local SRB carrying the timers may go now.
+    AhciGetNextIos(ChannelExtension, TRUE);
+
+    StorPortReleaseSpinLock(ChannelExtension->AdapterExtension, &lockhandle);
+
+    Srb->SrbStatus = SRB_STATUS_SUCCESS;
+    return STOR_STATUS_SUCCESS;
+}
+
+ULONG
+PortStreamingIoctlProcess(
+    __in PAHCI_CHANNEL_EXTENSION ChannelExtension,
+    __in PSCSI_REQUEST_BLOCK_EX Srb
+    )
+/*++
+    Binds LBA ranges to the streams set up on the device and returns the per-stream statistics.
+    Read and write requests falling in a bound range are sent as READ/WRITE STREAM DMA EXT of that stream.
+--*/
+{
+    PAHCI_PORT_STREAMING    portStreaming;
+    STOR_LOCK_HANDLE        lockhandle = {0};
+    UCHAR                   i;
+
+    if (SrbGetDataTransferLength(Srb) < (sizeof(SRB_IO_CONTROL) + sizeof(AHCI_PORT_STREAMING))) {
+        Srb->SrbStatus = SRB_STATUS_BAD_SRB_BLOCK_LENGTH;
+        return STOR_STATUS_BUFFER_TOO_SMALL;
+    }
+
+    portStreaming = (PAHCI_PORT_STREAMING)(((PUCHAR)SrbGetDataBuffer(Srb)) + sizeof(SRB_IO_CONTROL));
+
+    if ( (portStreaming->Version != AHCI_PORT_STREAMING_VERSION) ||
+         (portStreaming->Size < sizeof(AHCI_PORT_STREAMING)) ) {
+        Srb->SrbStatus = SRB_STATUS_INVALID_REQUEST;
+        return STOR_STATUS_INVALID_PARAMETER;
+    }
+
+    if ((portStreaming->Flags & AHCI_PORT_STREAMING_FLAG_SET) != 0) {
+        for (i = 0; i < AHCI_STREAM_COUNT; i++) {
+            if ( (portStreaming->Streams[i].LbaCount != 0) &&
+                 ((portStreaming->Streams[i].StartingLba + portStreaming->Streams[i].LbaCount) < portStreaming->Streams[i].StartingLba) ) {
+                Srb->SrbStatus = SRB_STATUS_INVALID_REQUEST;
+                return STOR_STATUS_INVALID_PARAMETER;
+            }
+        }
+    }
+
+    StorPortAcquireSpinLock(ChannelExtension->AdapterExtension, InterruptLock, NULL, &lockhandle);
+
+    if ((portStreaming->Flags & AHCI_PORT_STREAMING_FLAG_SET) != 0) {
+        // requests are translated without InterruptLock, they read the settings again if the generation changed.
+        InterlockedIncrement(&ChannelExtension->Streaming.SettingsGeneration);
+
+        ChannelExtension->Streaming.StreamsBound = 0;
+
+        for (i = 0; i < AHCI_STREAM_COUNT; i++) {
+            ChannelExtension->Streaming.Settings[i] = portStreaming->Streams[i];
+            ChannelExtension->Streaming.CommandTimeLimit[i] = GetStreamCommandTimeLimit(ChannelExtension, portStreaming->Streams[i].TimeLimit);
+
+            if (portStreaming->Streams[i].LbaCount != 0) {
+                ChannelExtension->Streaming.StreamsBound |= (1 << i);
+            }
+        }
+
+        InterlockedIncrement(&ChannelExtension->Streaming.SettingsGeneration);
+
+        StorPortDebugPrint(3, "StorAHCI - Streaming: Port %02d - streams bound 0x%02x, configured 0x%02x\n",
+                           ChannelExtension->PortNumber, ChannelExtension->Streaming.StreamsBound, ChannelExtension->Streaming.StreamsConfigured);
+    }
+
+    portStreaming->Flags = 0;
+    portStreaming->Size = sizeof(AHCI_PORT_STREAMING);
+    portStreaming->PortNumber = ChannelExtension->PortNumber;
+    portStreaming->StreamsConfigured = ChannelExtension->Streaming.StreamsConfigured;
+    portStreaming->Granularity = ChannelExtension->Streaming.Granularity;
+
+    if (IsDeviceSupportsStreaming(ChannelExtension)) {
+        portStreaming->Flags |= AHCI_PORT_STREAMING_FLAG_SUPPORTED;
+    }
+
+    for (i = 0; i < AHCI_STREAM_COUNT; i++) {
+        portStreaming->Streams[i] = ChannelExtension->Streaming.Settings[i];
+        portStreaming->Statistics[i] = ChannelExtension->StreamStatistics[i];
+    }
+
+    StorPortReleaseSpinLock(ChannelExtension->AdapterExtension, &lockhandle);
+
+    Srb->SrbStatus = SRB_STATUS_SUCCESS;
+    return STOR_STATUS_SUCCESS;
+}
+
 
 
 #if _MSC_VER >= 1200
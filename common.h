@@ -84,6 +84,7 @@ Revision History:
 #define ATA_FLAGS_NEW_CDB               (1 << 8)    // new CDB in SrbExtension should be issued to device rather than CDB in Srb
 #define ATA_FLAGS_COMPLETE_SRB          (1 << 9)    // indicates the Srb should be completed, AhciCompleteRequest will not send command from SrbExtension.
 #define ATA_FLAGS_ACTIVE_REFERENCE      (1 << 10)   // indicates Active Reference needs to be acquired before processing the Srb and released after processing the Srb
+#define ATA_FLAGS_NCQ_ERROR_LOG         (1 << 11)   // AtaStatus, AtaError and sense data in SrbExtension are taken from the NCQ Command Error log
 
 //
 // helper macros
@@ -160,6 +161,20 @@ typedef struct _ATA_TASK_FILE {
 #define SetCommandReg(reg, val)       (reg->bCommandReg = val)
 
 #define ATA_NCQ_FUA_BIT         (1 << 7)
+#define ATA_NCQ_PRIO_HIGH       (2 << 6)    // PRIO field in Count(15:14) of FPDMA QUEUED commands: 10b - high priority
+
+#define ATA_STATUS_SENSE_DATA_AVAILABLE     (1 << 1)    // ACS-4 and later, obsolete INDEX bit before
+
+//
+// Sense data of a command aborted by the policy of its Command Duration Limits descriptor.
+//
+#ifndef SCSI_ADSENSE_COMMAND_TIMEOUT
+#define SCSI_ADSENSE_COMMAND_TIMEOUT                    0x2E
+#endif
+
+#ifndef SCSI_SENSEQ_COMMAND_TIMEOUT_DURING_PROCESSING
+#define SCSI_SENSEQ_COMMAND_TIMEOUT_DURING_PROCESSING   0x02
+#endif
 
 //
 // Device type
@@ -171,6 +186,67 @@ typedef enum  {
     DeviceNotExist
 } ATA_DEVICE_TYPE;
 
+//
+// PxSIG value reported by the control port of a Port Multiplier
+//
+#define ATA_PORT_MULTIPLIER_SIGNATURE   0x96690101
+
+//
+// Zoned ATA Command set (ZAC) and its SCSI counterpart (ZBC)
+//
+#define ATA_HOST_MANAGED_ZONED_SIGNATURE    0xABCD0101
+
+#define ATA_ZONED_MODEL_NONE                0x0
+#define ATA_ZONED_MODEL_HOST_AWARE          0x1     // same value as IDENTIFY word 69 and the ZONED field of VPD_BLOCK_DEVICE_CHARACTERISTICS
+#define ATA_ZONED_MODEL_DEVICE_MANAGED      0x2     // same value as IDENTIFY word 69 and the ZONED field of VPD_BLOCK_DEVICE_CHARACTERISTICS
+#define ATA_ZONED_MODEL_HOST_MANAGED        0x3     // reported as peripheral device type ZONED_BLOCK_DEVICE
+
+#define IDENTIFY_WORD_ADDITIONAL_SUPPORTED  69      // bits 1:0 - zoned capabilities
+#define IDENTIFY_WORD_SCT_COMMAND_TRANSPORT 206     // bit 0 - SCT Command Transport, bit 3 - SCT Error Recovery Control
+#define IDENTIFY_WORD_COMMAND_SET_SUPPORT_EXT   84  // bit 4 - Streaming feature set
+#define IDENTIFY_WORD_STREAM_MIN_REQUEST_SIZE   95  // in logical sectors
+#define IDENTIFY_WORD_STREAM_GRANULARITY        98  // words 98-99, in microseconds, unit of the streaming time limits
+#define IDENTIFY_WORD_SATA_FEATURES_SUPPORTED   78  // bit 7 - NCQ Autosense
+#define IDENTIFY_WORD_COMMAND_SET_SUPPORT_EXT2  119 // bit 6 - Sense Data Reporting, bits 15:14 are 01b when the word is valid
+#define IDENTIFY_WORD_COMMAND_SET_ENABLED_EXT2  120 // bit 6 - Sense Data Reporting enabled
+
+#define IDE_COMMAND_ZAC_MANAGEMENT_IN       0x4A    // REPORT ZONES EXT
+#define IDE_COMMAND_ZAC_MANAGEMENT_OUT      0x9F    // CLOSE/FINISH/OPEN ZONE EXT, RESET WRITE POINTER EXT
+
+#define ZAC_REPORT_ZONES_HEADER_SIZE        64
+#define ZAC_ZONE_DESCRIPTOR_SIZE            64
+
+#ifndef SCSIOP_ZBC_OUT
+#define SCSIOP_ZBC_OUT                      0x94
+#endif
+
+#ifndef SCSIOP_ZBC_IN
+#define SCSIOP_ZBC_IN                       0x95
+#endif
+
+#ifndef ZONED_BLOCK_DEVICE
+#define ZONED_BLOCK_DEVICE                  0x14
+#endif
+
+#ifndef SCSIOP_WRITE_SAME
+#define SCSIOP_WRITE_SAME                   0x41
+#endif
+
+#ifndef SCSIOP_WRITE_SAME16
+#define SCSIOP_WRITE_SAME16                 0x93
+#endif
+
+// MAXIMUM WRITE SAME LENGTH in Block Limits VPD, in bytes, see GetWriteSameMaxBlockCount(). SCT Write Same runs
+// in foreground, the limit keeps one command well within the request timeout of the class driver.
+#define AHCI_WRITE_SAME_MAX_BYTES           0x20000000  // 512MB
+
+// ZBC service actions, ZAC uses the same values for its action field.
+#define ZBC_SERVICE_ACTION_REPORT_ZONES         0x00
+#define ZBC_SERVICE_ACTION_CLOSE_ZONE           0x01
+#define ZBC_SERVICE_ACTION_FINISH_ZONE          0x02
+#define ZBC_SERVICE_ACTION_OPEN_ZONE            0x03
+#define ZBC_SERVICE_ACTION_RESET_WRITE_POINTER  0x04
+
 //
 // addressing mode
 //
@@ -195,6 +271,9 @@ typedef struct _ATA_DEVICE_PARAMETERS {
         ULONG   SystemPoweringDown: 1;
         ULONG   FuaSupported: 1;
         ULONG   FuaSucceeded: 1;
+        ULONG   NcqFuaSupported: 1;     // FUA bit of WRITE FPDMA QUEUED can be used; FuaSupported is for WRITE DMA FUA EXT
+        ULONG   HostManagedZoned: 1;    // PxSIG reported a host managed zoned device
+        ULONG   ZonedModel: 2;          // ATA_ZONED_MODEL_*, see UpdateDeviceParameters()
 
     } StateFlags;
 
@@ -249,6 +328,9 @@ typedef struct _ATA_TRIM_CONTEXT {
     // current UNMAP Block Descriptor being processed
     UNMAP_BLOCK_DESCRIPTOR  CurrentBlockDescr;
 
+    // the range of a WRITE SAME request with UNMAP, BlockDescriptors points to it.
+    UNMAP_BLOCK_DESCRIPTOR  WriteSameBlockDescr;
+
 } ATA_TRIM_CONTEXT, *PATA_TRIM_CONTEXT;
 
 typedef struct _HYBRID_CHANGE_BY_LBA_CONTEXT {
@@ -303,6 +385,351 @@ typedef struct _HYBRID_EVICT_CONTEXT {
 
 } HYBRID_EVICT_CONTEXT, *PHYBRID_EVICT_CONTEXT;
 
+//
+// GenAHCI private miniport IOCTL, SRB_IO_CONTROL.ControlCode values.
+// The request is addressed to the port through the device it is sent to.
+//
+#define IOCTL_SCSI_MINIPORT_AHCI_PORT_STATISTICS    ((FILE_DEVICE_SCSI << 16) + 0x0A00)
+#define IOCTL_SCSI_MINIPORT_AHCI_PORT_THROTTLE      ((FILE_DEVICE_SCSI << 16) + 0x0A01)
+#define IOCTL_SCSI_MINIPORT_AHCI_PORT_SCT_ERC       ((FILE_DEVICE_SCSI << 16) + 0x0A02)
+#define IOCTL_SCSI_MINIPORT_AHCI_PORT_STREAMING     ((FILE_DEVICE_SCSI << 16) + 0x0A03)
+
+//
+// Link state chosen by the adaptive link power management policy
+//
+typedef enum _AHCI_LPM_POLICY_STATE {
+    LpmPolicyActive = 0,        // link stays Active while idle
+    LpmPolicyPartial,           // link enters Partial while idle
+    LpmPolicySlumber,           // link enters Slumber while idle
+    LpmPolicyDevSleep           // link enters Slumber, HBA asserts DEVSLP after PxDEVSLP idle timeout
+} AHCI_LPM_POLICY_STATE, *PAHCI_LPM_POLICY_STATE;
+
+typedef struct _AHCI_LPM_STATISTICS {
+    ULONG       PolicyState;            // AHCI_LPM_POLICY_STATE currently applied
+    ULONG       PolicyChangeCount;      // times the adaptive policy switched link state
+    ULONG       PredictedIdleTime;      // in microseconds, idle time exceeded by 3 of 4 idle periods at last evaluation
+    ULONG       IdlePeriodCount;
+
+    // Idle time is accounted to the link state observed when the port leaves idle.
+    ULONGLONG   ActiveIdleTime;         // in microseconds
+    ULONGLONG   PartialResidency;       // in microseconds
+    ULONGLONG   SlumberResidency;       // in microseconds
+
+    ULONG       PartialWakeCount;       // commands issued while link was in Partial
+    ULONG       SlumberWakeCount;       // commands issued while link was in Slumber
+    ULONGLONG   WakePenalty;            // in microseconds, link exit latency charged to the commands above
+
+    // Measured from issuing commands to an idle port until the first of them completes. The exit latency of a link state
+    // is that time after leaving it, less the time with an active link. Running averages.
+    ULONG       ActiveResponseTime;     // in microseconds, first completion after idle with an active link
+    ULONG       PartialExitLatency;     // in microseconds, AHCI_LPM_PARTIAL_EXIT_LATENCY_US until measured
+    ULONG       SlumberExitLatency;     // in microseconds, AHCI_LPM_SLUMBER_EXIT_LATENCY_US until measured
+
+    ULONGLONG   DevSleepResidency;      // in microseconds
+    ULONG       DevSleepWakeCount;      // commands issued while device was in DevSleep
+    ULONG       DevSleepExitCost;       // in microseconds, measured like the exit latencies above, DETO until measured. Compared against predicted idle time
+} AHCI_LPM_STATISTICS, *PAHCI_LPM_STATISTICS;
+
+//
+// Non-queued command batching. A drain is the wait for outstanding NCQ commands to complete
+// before non-queued commands (e.g. FLUSH, SMART, IDENTIFY) can be issued.
+//
+typedef struct _AHCI_NONQUEUED_STATISTICS {
+    ULONG       BatchWindow;            // in microseconds, configured batch window. 0: commands are not batched
+    ULONG       BatchLimit;             // configured non-queued commands issued in one drain before NCQ commands get their turn
+    ULONG       DrainCount;             // drains of outstanding NCQ commands
+    ULONG       DrainsPerSecond;        // drains counted in the last full second in which drains happened
+    ULONG       BatchedCommandCount;    // non-queued commands issued within a drain
+    ULONG       DeferredCount;          // times non-queued commands waited for the batch window while NCQ commands were issued
+    ULONG       BatchLimitReached;      // times NCQ commands were resumed before all non-queued commands were issued
+} AHCI_NONQUEUED_STATISTICS, *PAHCI_NONQUEUED_STATISTICS;
+
+//
+// FLUSH coalescing. A SYNCHRONIZE CACHE arriving while another FLUSH is waiting to be issued completes with that FLUSH.
+//
+typedef struct _AHCI_FLUSH_STATISTICS {
+    ULONG       FlushCount;             // FLUSH commands issued for SYNCHRONIZE CACHE requests
+    ULONG       MergedFlushCount;       // SYNCHRONIZE CACHE requests completed by a FLUSH issued for another request
+} AHCI_FLUSH_STATISTICS, *PAHCI_FLUSH_STATISTICS;
+
+//
+// SRBs waiting for a slot are queued per class and dequeued in weighted round robin, see RemoveSrbQueue().
+//
+typedef enum _AHCI_SRB_QUEUE_CLASS {
+    AhciSrbQueueUrgent = 0,         // read/write mapped to high priority, see IsHighPriorityIo()
+    AhciSrbQueueNormal,             // everything else
+    AhciSrbQueueBackground,         // read/write with Low or Very Low IO priority hint
+    AhciSrbQueueClassCount
+} AHCI_SRB_QUEUE_CLASS;
+
+typedef struct _AHCI_SRB_QUEUE_STATISTICS {
+    ULONG       Weight;                 // configured SRBs dequeued from the class per round
+    ULONG       CurrentDepth;
+    ULONG       DeepestDepth;
+    ULONG       DequeueCount;
+    ULONG       WaitCount;              // SRBs that had to wait for a slot
+    ULONG       MaxWaitTime;            // in microseconds
+    ULONGLONG   TotalWaitTime;          // in microseconds, of the SRBs counted in WaitCount
+} AHCI_SRB_QUEUE_STATISTICS, *PAHCI_SRB_QUEUE_STATISTICS;
+
+//
+// Rate limits of read/write requests of a port, applied before the requests get a slot. 0: not limited.
+// Other requests are not limited.
+//
+typedef struct _AHCI_THROTTLE_LIMITS {
+    ULONG       IopsLimit;                                  // requests per second of the port
+    ULONG       BandwidthLimit;                             // KB per second of the port
+    ULONG       ClassIopsLimit[AhciSrbQueueClassCount];     // requests per second of each SRB queue class
+    ULONG       ClassBandwidthLimit[AhciSrbQueueClassCount];// KB per second of each SRB queue class
+} AHCI_THROTTLE_LIMITS, *PAHCI_THROTTLE_LIMITS;
+
+typedef struct _AHCI_THROTTLE_STATISTICS {
+    AHCI_THROTTLE_LIMITS    Limits;
+    ULONG       ThrottleCount;          // times queued requests were held back by the limits
+    ULONG       Reserved;
+    ULONGLONG   ThrottledTime;          // in microseconds, time queued requests were held back by the limits
+} AHCI_THROTTLE_STATISTICS, *PAHCI_THROTTLE_STATISTICS;
+
+//
+// Port interrupts handled by AhciHwInterrupt and the registers it read for them.
+// SdbCompletionCount interrupts took NCQ completions from the Set Device Bits FIS, SdbVerifyCount of them also read PxSACT.
+//
+typedef struct _AHCI_INTERRUPT_STATISTICS {
+    ULONG       InterruptCount;
+    ULONG       SdbCompletionCount;
+    ULONG       SdbVerifyCount;
+    ULONG       Reserved;
+    ULONGLONG   RegisterReadCount;
+} AHCI_INTERRUPT_STATISTICS, *PAHCI_INTERRUPT_STATISTICS;
+
+//
+// Hybrid polling of single commands issued to an idle port, see AhciPortPollDpcRoutine().
+// CPU cost per polled command: PollTime / PollCount. Latency saved: InterruptLatency / InterruptSampleCount
+// (every AHCI_POLL_SAMPLE_INTERVAL-th command is left to the interrupt as a baseline) minus PolledLatency / PollHitCount.
+//
+typedef struct _AHCI_POLLING_STATISTICS {
+    ULONG       BudgetLimit;            // in microseconds, 0: polling disabled
+    ULONG       DeviceLatency;          // in microseconds, learned average latency of single commands
+    ULONG       PollCount;              // commands polled
+    ULONG       PollHitCount;           // polled commands found completed within the budget
+    ULONG       InterruptSampleCount;   // commands left to the interrupt for the baseline
+    ULONG       Reserved;
+    ULONGLONG   PollTime;               // in microseconds, time spent polling
+    ULONGLONG   PolledLatency;          // in microseconds, sum of latency of PollHitCount commands
+    ULONGLONG   InterruptLatency;       // in microseconds, sum of latency of InterruptSampleCount commands
+} AHCI_POLLING_STATISTICS, *PAHCI_POLLING_STATISTICS;
+
+//
+// Command Duration Limits. The flags and descriptor masks are filled in when the statistics are queried.
+//
+#define AHCI_CDL_FLAG_SUPPORTED     0x1     // device supports the feature
+#define AHCI_CDL_FLAG_ENABLED       0x2     // descriptor indexes are sent to the device
+
+typedef struct _AHCI_CDL_STATISTICS {
+    ULONG       Flags;                  // AHCI_CDL_FLAG_*
+    ULONG       ReadDescriptors;        // bit n set: read descriptor n sets a limit
+    ULONG       WriteDescriptors;       // bit n set: write descriptor n sets a limit
+    ULONG       CommandCount;           // NCQ reads and writes sent with a descriptor index
+    ULONG       LimitExceededCount;     // commands the device aborted because they exceeded their limit
+} AHCI_CDL_STATISTICS, *PAHCI_CDL_STATISTICS;
+
+//
+// Sense Data Reporting and NCQ Autosense. The flags are filled in when the statistics are queried.
+//
+#define AHCI_AUTOSENSE_FLAG_SENSE_DATA_REPORTING    0x1     // device supports Sense Data Reporting, it's enabled with the preserved settings
+#define AHCI_AUTOSENSE_FLAG_NCQ_AUTOSENSE           0x2     // device reports sense data of failed NCQ commands in the NCQ Command Error log
+#define AHCI_AUTOSENSE_FLAG_NCQ_ERROR_RECOVERY      0x4     // NCQ errors are recovered by reading the NCQ Command Error log, no COMRESET
+
+typedef struct _AHCI_AUTOSENSE_STATISTICS {
+    ULONG       Flags;                  // AHCI_AUTOSENSE_FLAG_*
+    ULONG       NcqErrorCount;          // NCQ errors recovered by reading the NCQ Command Error log
+    ULONG       SenseDataCount;         // failed NCQ commands completed with sense data reported by device
+    ULONG       RequeuedCount;          // commands aborted by those NCQ errors and issued again
+    ULONG       ResetCount;             // NCQ errors that still needed COMRESET: log not read or not valid
+} AHCI_AUTOSENSE_STATISTICS, *PAHCI_AUTOSENSE_STATISTICS;
+
+typedef struct _AHCI_INQUIRY_CACHE_STATISTICS {
+    ULONG       HitCount;               // INQUIRY and VPD requests served from the cached data
+    ULONG       BuildCount;             // times the cached data was built from IDENTIFY data
+} AHCI_INQUIRY_CACHE_STATISTICS, *PAHCI_INQUIRY_CACHE_STATISTICS;
+
+//
+// SMART READ DATA, SMART READ THRESHOLDS and IDENTIFY DEVICE data of SMART IOCTLs, served again without sending a
+// command to the device until it's older than the configured timeout, see SmartCacheRead().
+//
+typedef enum _AHCI_SMART_CACHE_ENTRY_INDEX {
+    AhciSmartCacheAttributes = 0,       // SMART READ DATA
+    AhciSmartCacheThresholds,           // SMART READ THRESHOLDS
+    AhciSmartCacheIdentify,             // IDENTIFY DEVICE
+    AhciSmartCacheEntryCount
+} AHCI_SMART_CACHE_ENTRY_INDEX;
+
+typedef struct _AHCI_SMART_CACHE_STATISTICS {
+    ULONG       Timeout;                // in milliseconds, 0: SMART data is not cached
+    ULONG       HitCount;               // requests completed from the cache, no command sent to device
+    ULONG       MissCount;              // requests sent to device: nothing cached or cached data too old
+    ULONG       InvalidateCount;        // cached data dropped by SMART commands changing device state, identify or bus change
+} AHCI_SMART_CACHE_STATISTICS, *PAHCI_SMART_CACHE_STATISTICS;
+
+//
+// Hot LBA tracking of hybrid devices, see HotLbaTrackRead(). The hybrid information log has no caching medium hit counters,
+// the hit rate is the share of tracked reads inside the extents promoted by the driver. Health and NVM size come from the log.
+//
+typedef struct _AHCI_HOT_LBA_STATISTICS {
+    ULONG       Budget;                 // extents promoted per interval, 0: hot LBA tracking is disabled
+    ULONG       Interval;               // in seconds
+    ULONG       ExtentSize;             // in logical sectors
+    ULONG       TrackedReads;
+    ULONG       PromotedReads;          // tracked reads inside the extents promoted at the start of the current interval
+    ULONG       Intervals;              // intervals elapsed, each halves the read counters
+    ULONG       SkippedIntervals;       // nothing promoted: no hot extent, local SRB busy or device not ready for the command
+    ULONG       PromotedExtents;        // HYBRID CHANGE BY LBA RANGE commands completed successfully
+    ULONG       FailedPromotions;       // commands failed, the other extents of the interval are not sent
+    UCHAR       HybridEnabled;          // from the hybrid information log
+    UCHAR       HybridHealth;
+    USHORT      Reserved;
+    ULONGLONG   NvmSize;                // in logical sectors, from the hybrid information log
+} AHCI_HOT_LBA_STATISTICS, *PAHCI_HOT_LBA_STATISTICS;
+
+//
+// Adaptive NCQ depth: the number of NCQ commands the device may have outstanding follows the measured completion latency,
+// between Floor and Ceiling, see AhciAdaptiveQueueDepthSample().
+//
+typedef struct _AHCI_ADAPTIVE_QD_STATISTICS {
+    ULONG       Enabled;
+    ULONG       Floor;
+    ULONG       Ceiling;
+    ULONG       QueueDepth;             // effective queue depth, the device's own limit applies too
+    ULONG       BaseLatency;            // in microseconds, lowest average completion latency of a window
+    ULONG       WindowLatency;          // in microseconds, average completion latency of the last window
+    ULONG       WindowThroughput;       // NCQ commands completed per second in the last window
+    ULONG       IncreaseCount;
+    ULONG       DecreaseCount;
+} AHCI_ADAPTIVE_QD_STATISTICS, *PAHCI_ADAPTIVE_QD_STATISTICS;
+
+//
+// Input and output of IOCTL_SCSI_MINIPORT_AHCI_PORT_THROTTLE, follows SRB_IO_CONTROL.
+// With AHCI_PORT_THROTTLE_FLAG_SET the limits are applied, the limits in effect are always returned.
+// Limits set this way last until the registry settings are read again, e.g. the device is restarted.
+//
+#define AHCI_PORT_THROTTLE_VERSION      1
+#define AHCI_PORT_THROTTLE_FLAG_SET     0x1
+
+typedef struct _AHCI_PORT_THROTTLE {
+    ULONG                   Version;
+    ULONG                   Size;
+    ULONG                   Flags;
+    ULONG                   PortNumber;
+    AHCI_THROTTLE_LIMITS    Limits;
+} AHCI_PORT_THROTTLE, *PAHCI_PORT_THROTTLE;
+
+//
+// Input and output of IOCTL_SCSI_MINIPORT_AHCI_PORT_SCT_ERC, follows SRB_IO_CONTROL.
+// Timeouts are in units of 100 milliseconds, 0: the driver doesn't set the timer and the device keeps its own value.
+// With AHCI_PORT_SCT_ERC_FLAG_SET the timeouts are sent to the device and re-sent after every reset, until the
+// registry settings are read again. A timeout is in effect when its APPLIED flag is returned. PENDING is returned while
+// timeouts are still being sent, query again for their APPLIED flags.
+//
+#define AHCI_PORT_SCT_ERC_VERSION               1
+#define AHCI_PORT_SCT_ERC_FLAG_SET              0x1
+#define AHCI_PORT_SCT_ERC_FLAG_SUPPORTED        0x2     // output: device supports SCT Error Recovery Control
+#define AHCI_PORT_SCT_ERC_FLAG_READ_APPLIED     0x4     // output: device accepted ReadTimeout
+#define AHCI_PORT_SCT_ERC_FLAG_WRITE_APPLIED    0x8     // output: device accepted WriteTimeout
+#define AHCI_PORT_SCT_ERC_FLAG_PENDING          0x10    // output: timeouts are being sent to the device
+
+typedef struct _AHCI_PORT_SCT_ERC {
+    ULONG       Version;
+    ULONG       Size;
+    ULONG       Flags;
+    ULONG       PortNumber;
+    ULONG       ReadTimeout;
+    ULONG       WriteTimeout;
+    ULONG       AppliedCount;           // timers accepted by device
+    ULONG       FailedCount;            // timers rejected by device
+} AHCI_PORT_SCT_ERC, *PAHCI_PORT_SCT_ERC;
+
+//
+// ATA Streaming. A stream gets the reads and writes that fall entirely inside its LBA range.
+//
+#define AHCI_STREAM_COUNT                   8
+#define AHCI_STREAM_FLAG_CONTINUOUS         0x1     // device completes the command within the time limit, even if data is in error
+
+typedef struct _AHCI_STREAM_SETTINGS {
+    ULONGLONG   StartingLba;
+    ULONGLONG   LbaCount;               // 0: no request goes to the stream
+    ULONG       TimeLimit;              // in microseconds, completion time limit of each command. 0: limit set up by CONFIGURE STREAM
+    ULONG       Flags;                  // AHCI_STREAM_FLAG_*
+} AHCI_STREAM_SETTINGS, *PAHCI_STREAM_SETTINGS;
+
+typedef struct _AHCI_STREAM_STATISTICS {
+    ULONG       ReadCount;
+    ULONG       WriteCount;
+    ULONGLONG   ReadBytes;
+    ULONGLONG   WriteBytes;
+    ULONG       StreamErrorCount;       // commands completed within the time limit with data that may be in error
+    ULONG       FailedCount;
+} AHCI_STREAM_STATISTICS, *PAHCI_STREAM_STATISTICS;
+
+//
+// Input and output of IOCTL_SCSI_MINIPORT_AHCI_PORT_STREAMING, follows SRB_IO_CONTROL.
+// With AHCI_PORT_STREAMING_FLAG_SET the settings of all streams are replaced. Settings of a stream the device
+// didn't accept are kept but not used. Settings last until the device is started again.
+//
+#define AHCI_PORT_STREAMING_VERSION         1
+#define AHCI_PORT_STREAMING_FLAG_SET        0x1
+#define AHCI_PORT_STREAMING_FLAG_SUPPORTED  0x2     // output: device supports the Streaming feature set
+
+typedef struct _AHCI_PORT_STREAMING {
+    ULONG                   Version;
+    ULONG                   Size;
+    ULONG                   Flags;
+    ULONG                   PortNumber;
+    ULONG                   StreamsConfigured;      // output: bit n - device accepted CONFIGURE STREAM of stream n
+    ULONG                   Granularity;            // output: in microseconds, time limits are rounded up to it
+    AHCI_STREAM_SETTINGS    Streams[AHCI_STREAM_COUNT];
+    AHCI_STREAM_STATISTICS  Statistics[AHCI_STREAM_COUNT];
+} AHCI_PORT_STREAMING, *PAHCI_PORT_STREAMING;
+
+//
+// Output of IOCTL_SCSI_MINIPORT_AHCI_PORT_STATISTICS, follows SRB_IO_CONTROL.
+// New fields are only appended, Size tells the caller how much is valid.
+//
+#define AHCI_PORT_STATISTICS_VERSION    1
+
+typedef struct _AHCI_PORT_STATISTICS {
+    ULONG               Version;
+    ULONG               Size;
+    ULONG               PortNumber;
+
+    ULONG               LpmWakeLatencyBudget;   // in microseconds, 0: adaptive link power management is disabled
+    AHCI_LPM_STATISTICS Lpm;
+
+    AHCI_NONQUEUED_STATISTICS   NonQueued;
+
+    AHCI_FLUSH_STATISTICS       Flush;
+
+    AHCI_SRB_QUEUE_STATISTICS   SrbQueue[AhciSrbQueueClassCount];
+
+    AHCI_THROTTLE_STATISTICS    Throttle;
+
+    AHCI_ADAPTIVE_QD_STATISTICS AdaptiveQueueDepth;
+
+    AHCI_INTERRUPT_STATISTICS   Interrupt;
+
+    AHCI_POLLING_STATISTICS     Polling;
+
+    AHCI_CDL_STATISTICS         Cdl;
+
+    AHCI_AUTOSENSE_STATISTICS   Autosense;
+
+    AHCI_INQUIRY_CACHE_STATISTICS   InquiryCache;
+
+    AHCI_SMART_CACHE_STATISTICS     SmartCache;
+
+    AHCI_HOT_LBA_STATISTICS         HotLba;
+
+} AHCI_PORT_STATISTICS, *PAHCI_PORT_STATISTICS;
+
 __inline
 BOOLEAN
 IsUnknownDevice(
@@ -828,6 +1255,12 @@ AtaFlushCommandRequest (
     __in PSCSI_REQUEST_BLOCK_EX Srb
     );
 
+VOID
+AtaFlushCommandRequestCompletion (
+    __in PAHCI_CHANNEL_EXTENSION ChannelExtension,
+    __in PSCSI_REQUEST_BLOCK_EX Srb
+    );
+
 ULONG
 AtaPassThroughRequest (
     __in PAHCI_CHANNEL_EXTENSION ChannelExtension,
@@ -841,6 +1274,26 @@ AtaUnmapRequest (
     __in PSCSI_REQUEST_BLOCK_EX Srb
     );
 
+ULONG
+AtaTrimRequest (
+    __in PAHCI_CHANNEL_EXTENSION ChannelExtension,
+    __in PSCSI_REQUEST_BLOCK_EX Srb,
+    __in PATA_TRIM_CONTEXT       TrimContext
+    );
+
+ULONG
+AtaWriteSameRequest (
+    __in PAHCI_CHANNEL_EXTENSION ChannelExtension,
+    __in PSCSI_REQUEST_BLOCK_EX  Srb,
+    __in PCDB                    Cdb
+    );
+
+VOID
+AtaWriteSameRequestCompletion (
+    __in PAHCI_CHANNEL_EXTENSION ChannelExtension,
+    __in PSCSI_REQUEST_BLOCK_EX Srb
+    );
+
 ULONG
 AtaSecurityProtocolRequest (
     __in PAHCI_CHANNEL_EXTENSION ChannelExtension,
@@ -848,6 +1301,19 @@ AtaSecurityProtocolRequest (
     __in PCDB                    Cdb
     );
 
+ULONG
+AtaZonedBlockDeviceRequest (
+    __in PAHCI_CHANNEL_EXTENSION ChannelExtension,
+    __in PSCSI_REQUEST_BLOCK_EX  Srb,
+    __in PCDB                    Cdb
+    );
+
+VOID
+AtaReportZonesRequestCompletion (
+    __in PAHCI_CHANNEL_EXTENSION ChannelExtension,
+    __in PSCSI_REQUEST_BLOCK_EX Srb
+    );
+
 ULONG
 AtaReportLunsCommand(
     __in PAHCI_CHANNEL_EXTENSION ChannelExtension,
@@ -910,6 +1376,12 @@ SmartGeneric(
     __in PSCSI_REQUEST_BLOCK_EX Srb
     );
 
+VOID
+SmartCacheUpdate(
+    __in PAHCI_CHANNEL_EXTENSION ChannelExtension,
+    __in PSCSI_REQUEST_BLOCK_EX Srb
+    );
+
 ULONG
 NVCacheGeneric(
     __in PAHCI_CHANNEL_EXTENSION ChannelExtension,
@@ -923,6 +1395,12 @@ HybridIoctlProcess(
     __in PSCSI_REQUEST_BLOCK_EX Srb
     );
 
+VOID
+HotLbaTrackRead(
+    __in PAHCI_CHANNEL_EXTENSION ChannelExtension,
+    __in ULONGLONG StartingLba
+    );
+
 ULONG
 DsmGeneralIoctlProcess(
     __in PAHCI_CHANNEL_EXTENSION ChannelExtension,
@@ -935,6 +1413,30 @@ DatasetManagementIoctl(
     __in PSCSI_REQUEST_BLOCK_EX Srb
     );
 
+ULONG
+PortStatisticsIoctlProcess(
+    __in PAHCI_CHANNEL_EXTENSION ChannelExtension,
+    __in PSCSI_REQUEST_BLOCK_EX Srb
+    );
+
+ULONG
+PortThrottleIoctlProcess(
+    __in PAHCI_CHANNEL_EXTENSION ChannelExtension,
+    __in PSCSI_REQUEST_BLOCK_EX Srb
+    );
+
+ULONG
+PortSctErcIoctlProcess(
+    __in PAHCI_CHANNEL_EXTENSION ChannelExtension,
+    __in PSCSI_REQUEST_BLOCK_EX Srb
+    );
+
+ULONG
+PortStreamingIoctlProcess(
+    __in PAHCI_CHANNEL_EXTENSION ChannelExtension,
+    __in PSCSI_REQUEST_BLOCK_EX Srb
+    );
+
 
 #if _MSC_VER >= 1200
 #pragma warning(pop)
@@ -195,6 +195,8 @@ AllocateResourcesForAdapter(
                              paddedSrbExtensionSize * 2 +                   // align to 128 bytes. Local.SrbExtension and SenseSrbExtension
                              sizeof(IDENTIFY_DEVICE_DATA) +                 // 512 bytes
                              ATA_BLOCK_SIZE +                               // ReadLogExtPageData --- 512 bytes
+                             ATA_BLOCK_SIZE +                               // SctErc.CommandData --- 512 bytes
+                             ATA_BLOCK_SIZE +                               // NcqAutosense.ErrorLog --- 512 bytes
                              INQUIRYDATABUFFERSIZE;                         // Inquiry Data
     // round up to KiloBytes if it's not dump mode. this makes sure that NonCachedExtension for next port can align to 1K.
     if (!IsDumpMode(AdapterExtension)) {
@@ -265,7 +267,9 @@ AllocateResourcesForAdapter(
             AdapterExtension->PortExtension[i]->Sense.SrbExtension = (PAHCI_SRB_EXTENSION)((PCHAR)AdapterExtension->PortExtension[i]->Local.SrbExtension + paddedSrbExtensionSize);
             AdapterExtension->PortExtension[i]->DeviceExtension[0].IdentifyDeviceData = (PIDENTIFY_DEVICE_DATA)((PCHAR)AdapterExtension->PortExtension[i]->Sense.SrbExtension + paddedSrbExtensionSize);
             AdapterExtension->PortExtension[i]->DeviceExtension[0].ReadLogExtPageData = (PUSHORT)((PCHAR)AdapterExtension->PortExtension[i]->DeviceExtension[0].IdentifyDeviceData + sizeof(IDENTIFY_DEVICE_DATA));
-            AdapterExtension->PortExtension[i]->DeviceExtension[0].InquiryData = (PUCHAR)((PCHAR)AdapterExtension->PortExtension[i]->DeviceExtension[0].ReadLogExtPageData + ATA_BLOCK_SIZE);
+            AdapterExtension->PortExtension[i]->SctErc.CommandData = (PUSHORT)((PCHAR)AdapterExtension->PortExtension[i]->DeviceExtension[0].ReadLogExtPageData + ATA_BLOCK_SIZE);
+            AdapterExtension->PortExtension[i]->NcqAutosense.ErrorLog = (PUCHAR)((PCHAR)AdapterExtension->PortExtension[i]->SctErc.CommandData + ATA_BLOCK_SIZE);
+            AdapterExtension->PortExtension[i]->DeviceExtension[0].InquiryData = (PUCHAR)((PCHAR)AdapterExtension->PortExtension[i]->NcqAutosense.ErrorLog + ATA_BLOCK_SIZE);
             //
             j++;
         }
@@ -722,12 +726,22 @@ AhciHwPassiveInitialize (
         if (adapterExtension->PortExtension[i] != NULL) {
             StorPortInitializeDpc(AdapterExtension, &adapterExtension->PortExtension[i]->CompletionDpc, AhciPortSrbCompletionDpcRoutine);
             StorPortInitializeDpc(AdapterExtension, &adapterExtension->PortExtension[i]->BusChangeDpc, AhciPortBusChangeDpcRoutine);
+            StorPortInitializeDpc(AdapterExtension, &adapterExtension->PortExtension[i]->PollDpc, AhciPortPollDpcRoutine);
         }
     }
+    StorPortInitializeDpc(AdapterExtension, &adapterExtension->ThrottleDpc, AhciThrottleDpcRoutine);
 
     // 2. check if ACPI supports turning off power on link
     AhciAdapterEvaluateDSMMethod(adapterExtension);
 
+    // 2.1 read port settings from registry. This is the passive level call every Windows version makes,
+    //     AhciHwUnitControl() is not called before Windows 8. AhciDeviceStart() reads them again when it's called.
+    for (i = 0; i <= adapterExtension->HighestPort; i++) {
+        if (adapterExtension->PortExtension[i] != NULL) {
+            AhciPortReadRegistrySettings(adapterExtension->PortExtension[i]);
+        }
+    }
+
 
     // 3. allocate STOR_POFX_DEVICE data structure for adapter, initialize the structure and register for runtime power management.
     status = StorPortAllocatePool(AdapterExtension,
@@ -1494,7 +1508,7 @@ AhciHwStartIo (
         }
 
         StorPortAcquireSpinLock(adapterExtension, InterruptLock, NULL, &lockhandle);
-        AddQueue(adapterExtension->PortExtension[pathId], &adapterExtension->PortExtension[pathId]->SrbQueue, Srb, 0xDEADBEEF, 0x11);
+        AddSrbQueue(adapterExtension->PortExtension[pathId], Srb);
         AhciGetNextIos(adapterExtension->PortExtension[pathId], TRUE);
         StorPortReleaseSpinLock(adapterExtension, &lockhandle);
     }
@@ -1511,6 +1525,7 @@ AhciGetNextIos (
     get Srb from queue and program it to adapter.
 
     assumption: internal request doesn't call this routine. Otherwise, the check of available slot should be changed.
+                The local Srb waiting for slot 0 (lent to IO from Storport) is started here once slot 0 is released.
 */
 {
     PSCSI_REQUEST_BLOCK_EX Srb;
@@ -1535,13 +1550,24 @@ AhciGetNextIos (
   //1.1 Initialize Variables
     commandSlotMask = 0;
 
+  //1.2 Internal command has been waiting for slot 0, start it before any other IO.
+    if ( (ChannelExtension->StateFlags.LocalSrbWaitingForSlot == 1) &&
+         ((GetOccupiedSlots(ChannelExtension) & (1 << 0)) == 0) ) {
+        ChannelExtension->StateFlags.LocalSrbWaitingForSlot = 0;
+        AhciProcessIo(ChannelExtension, &ChannelExtension->Local.Srb, AtDIRQL);
+    }
+
     //If there is a command in the Srb Queue ...
-    if (ChannelExtension->SrbQueue.Head != NULL) {
+    if (ChannelExtension->SrbQueueScheduler.QueuedCount != 0) {
         keepFilling = TRUE;
         //get a mask of all slots expect slot 0, which is reserved for internal use
         for (i = 1; i <= ChannelExtension->AdapterExtension->CAP.NCS; i++) {
             commandSlotMask |= ( 1 << i );
         }
+        //slot 0 can be lent if no internal command is in process
+        if (IsReservedSlotLendable(ChannelExtension)) {
+            commandSlotMask |= ( 1 << 0 );
+        }
     } else {
         keepFilling = FALSE;
     }
@@ -1552,7 +1578,7 @@ AhciGetNextIos (
 
         if ((~allocated & commandSlotMask) != 0) {
             //there is empty slot. get the next IO
-            Srb = RemoveQueue(ChannelExtension, &ChannelExtension->SrbQueue, 0xDEADC0DE, 0x1F);
+            Srb = RemoveSrbQueue(ChannelExtension, TRUE);
             if (Srb != NULL) {
                 NT_ASSERT(SrbGetPathId(Srb) == ChannelExtension->PortNumber);
                 keepFilling = TRUE;
@@ -1661,6 +1687,8 @@ Return Values:
     ULONG                   i;
     ULONG                   storStatus;
     ULONGLONG               asyncNotifyFlags;
+    BOOLEAN                 sdbFisCompletion;
+    ULONG                   registerReads;
 
     adapterExtension = (PAHCI_ADAPTER_EXTENSION)AdapterExtension;
 
@@ -1702,8 +1730,20 @@ Return Values:
     ssts.AsUlong = 0;
     pxisMask.AsUlong = serrMask.AsUlong = 0;
 
+    registerReads = 2;  // IS and PxIS
+
     pxis.AsUlong = StorPortReadRegisterUlong(AdapterExtension, &channelExtension->Px->IS.AsUlong);
-    serr.AsUlong = StorPortReadRegisterUlong(AdapterExtension, &channelExtension->Px->SERR.AsUlong);
+
+  //1.4 An error free Set Device Bits interrupt while only NCQ commands are outstanding needs no other register to find
+  //    the completed commands, they are in the Set Device Bits FIS. PxIS has no error or hot plug bit, PxSERR is not read.
+    sdbFisCompletion = IsSdbFisCompletionAllowed(channelExtension, pxis);
+
+    if (sdbFisCompletion) {
+        serr.AsUlong = 0;
+    } else {
+        serr.AsUlong = StorPortReadRegisterUlong(AdapterExtension, &channelExtension->Px->SERR.AsUlong);
+        registerReads++;
+    }
 
   //2.1 Understand interrupts on this channel
     //2.1.1 Handle Fatal Errors: Interface Fatal Error Status || Host Bus Data Error Status || Host Bus Fatal Error Status || Task File Error Status
@@ -1714,11 +1754,17 @@ Return Values:
 
       //call the correct error handling based on current hw queue workload type
         sact = StorPortReadRegisterUlong(AdapterExtension, &channelExtension->Px->SACT);
+        registerReads++;
 
 
         if(sact != 0) {
-          //5.1 NCQ, Handle error processing
-            channelExtension->StateFlags.CallAhciReset = 1;
+          //5.1 NCQ, Handle error processing. A device error alone is recovered from the NCQ Command Error log without COMRESET.
+            if ( pxis.TFES && !pxis.IFS && !pxis.HBDS && !pxis.HBFS &&
+                 IsNcqErrorRecoveryAllowed(channelExtension) ) {
+                channelExtension->StateFlags.CallAhciNcqErrorRecovery = 1;
+            } else {
+                channelExtension->StateFlags.CallAhciReset = 1;
+            }
 
 
           //Give NCQ one chance
@@ -1743,6 +1789,7 @@ Return Values:
 
     if (pxis.DMPS || pxis.PCS) {
         cmd.AsUlong = StorPortReadRegisterUlong(AdapterExtension, &channelExtension->Px->CMD.AsUlong);
+        registerReads++;
 
         // Device Mechanical Presence Status
         if (pxis.DMPS) {
@@ -1779,6 +1826,7 @@ Return Values:
         StorPortWriteRegisterUlong(AdapterExtension, &channelExtension->Px->SERR.AsUlong, serrMask.AsUlong);
 
         ssts.AsUlong = StorPortReadRegisterUlong(AdapterExtension, &channelExtension->Px->SSTS.AsUlong);
+        registerReads++;
 
         if (!IgnoreHotPlug(channelExtension)) {
             //If a ZPODD drive has already been found and it is a ZPODD system
@@ -1898,11 +1946,41 @@ Return Values:
     StorPortWriteRegisterUlong(AdapterExtension, adapterExtension->IS, is);
 
   //4. Complete outstanding commands
-    ci = StorPortReadRegisterUlong(AdapterExtension, &channelExtension->Px->CI);
-    sact = StorPortReadRegisterUlong(AdapterExtension, &channelExtension->Px->SACT);
+    if (sdbFisCompletion) {
+        PAHCI_SET_DEVICE_BITS_FIS   sdbFis = &channelExtension->ReceivedFIS->SetDeviceBitsFis;
+        ULONG                       completedTags;
+
+      //4.0 The tags are taken from the FIS atomically, a FIS posted meanwhile sets PxIS.SDBS again (cleared in 2.3) and is seen in next interrupt.
+      //    The HBA overwrites the FIS in place, so if commands remain outstanding a FIS may have been lost: confirm them with PxSACT.
+        completedTags = (ULONG)InterlockedExchange((LONG volatile *)&sdbFis->SActive, 0);
+
+        ci = 0;
+        sact = channelExtension->SlotManager.CommandsIssued & ~completedTags;
+
+        if (sact != 0) {
+            sact = StorPortReadRegisterUlong(AdapterExtension, &channelExtension->Px->SACT);
+            registerReads++;
+            AhciUlongIncrement(&channelExtension->InterruptStatistics.SdbVerifyCount);
+        }
+
+        // preserve taskfile for using in command completion process, an error free FIS carries no BSY or DRQ.
+        channelExtension->TaskFileData.STS.AsUchar = (UCHAR)(sdbFis->Status_Lo | (sdbFis->Status_Hi << 4));
+        channelExtension->TaskFileData.ERR = sdbFis->Error;
+
+        AhciUlongIncrement(&channelExtension->InterruptStatistics.SdbCompletionCount);
+    } else {
+        ci = StorPortReadRegisterUlong(AdapterExtension, &channelExtension->Px->CI);
+        sact = StorPortReadRegisterUlong(AdapterExtension, &channelExtension->Px->SACT);
+
+        // preserve taskfile for using in command completion process
+        channelExtension->TaskFileData.AsUlong = StorPortReadRegisterUlong(channelExtension->AdapterExtension, &channelExtension->Px->TFD.AsUlong);
+        registerReads += 3;
 
-    // preserve taskfile for using in command completion process
-    channelExtension->TaskFileData.AsUlong = StorPortReadRegisterUlong(channelExtension->AdapterExtension, &channelExtension->Px->TFD.AsUlong);
+        if (channelExtension->SdbFisCompletion == TRUE) {
+            // keep the FIS from reporting these completions again.
+            InterlockedExchange((LONG volatile *)&channelExtension->ReceivedFIS->SetDeviceBitsFis.SActive, 0);
+        }
+    }
 
     outstanding = ci | sact;
 
@@ -1911,6 +1989,16 @@ Return Values:
         channelExtension->SlotManager.CommandsToComplete |= (channelExtension->SlotManager.CommandsIssued & ~outstanding);
         channelExtension->SlotManager.CommandsIssued &= outstanding;
 
+        if ((channelExtension->Polling.SlotMask & channelExtension->SlotManager.CommandsToComplete) != 0) {
+            AhciPollingCommandCompleted(channelExtension);
+        }
+
+      // the first completion after the port left idle measures the link wake.
+        if ( (channelExtension->LpmAdaptivePolicy.WakeStartTime != 0) &&
+             IsLinkIdleAccountingEnabled(channelExtension) ) {
+            AhciLpmAdaptiveWakeComplete(channelExtension);
+        }
+
       // recording execution history for completing SRB
         RecordInterruptHistory(channelExtension, pxis.AsUlong, ssts.AsUlong, serr.AsUlong, ci, sact, 0x20000005);   //AhciHwInterrupt complete IO
 
@@ -1920,18 +2008,29 @@ Return Values:
         RecordInterruptHistory(channelExtension, pxis.AsUlong, ssts.AsUlong, serr.AsUlong, ci, sact, 0x20010005);   //AhciHwInterrupt No IO completed
     }
 
-   //6.1 Partial to Slumber auto transit
-    cmd.AsUlong = StorPortReadRegisterUlong(AdapterExtension, &channelExtension->Px->CMD.AsUlong);
-
-    if (PartialToSlumberTransitionIsAllowed(channelExtension, cmd, ci, sact)) {
-        ULONG status;
-        // convert inverval value from ms to us. allow 20ms of coalescing with other timers
-        status = StorPortRequestTimer(AdapterExtension, channelExtension->WorkerTimer, AhciAutoPartialToSlumber, channelExtension, channelExtension->AutoPartialToSlumberInterval * 1000, 20000);
-        if (status == STOR_STATUS_SUCCESS) {
-            StorPortDebugPrint(3, "StorAHCI - LPM: Port %02d - Transit into Slumber from Partial - Scheduled \n", channelExtension->PortNumber);
+   //6.1 Link state is managed by adaptive policy or by the HBA (CAP2.APST), no software Partial to Slumber transit. Port becomes idle.
+    if (IsLinkIdleAccountingEnabled(channelExtension)) {
+        if (channelExtension->SlotManager.CommandsIssued == 0) {
+            AhciLpmAdaptiveIdleBegin(channelExtension);
+        }
+    } else {
+   //6.2 Partial to Slumber auto transit
+        cmd.AsUlong = StorPortReadRegisterUlong(AdapterExtension, &channelExtension->Px->CMD.AsUlong);
+        registerReads++;
+
+        if (PartialToSlumberTransitionIsAllowed(channelExtension, cmd, ci, sact)) {
+            ULONG status;
+            // convert inverval value from ms to us. allow 20ms of coalescing with other timers
+            status = StorPortRequestTimer(AdapterExtension, channelExtension->WorkerTimer, AhciAutoPartialToSlumber, channelExtension, channelExtension->AutoPartialToSlumberInterval * 1000, 20000);
+            if (status == STOR_STATUS_SUCCESS) {
+                StorPortDebugPrint(3, "StorAHCI - LPM: Port %02d - Transit into Slumber from Partial - Scheduled \n", channelExtension->PortNumber);
+            }
         }
     }
 
+    AhciUlongIncrement(&channelExtension->InterruptStatistics.InterruptCount);
+    channelExtension->InterruptStatistics.RegisterReadCount += registerReads;
+
     if (LogExecuteFullDetail(adapterExtension->LogFlags)) {
         RecordExecutionHistory(channelExtension, 0x10000005);//Exit AhciHwInterrupt
     }
@@ -1992,6 +2091,9 @@ Return Value:
             // get pointer to control type list
             controlTypeList = (PSCSI_SUPPORTED_CONTROL_TYPE_LIST)Parameters;
 
+            // devices are started by ScsiUnitStart, not when they are enumerated, see ReportLunsComplete().
+            adapterExtension->StateFlags.UnitControlSupported = 1;
+
             // Report ScsiQuerySupportedUnitControlTypes, ScsiUnitStart and ScsiUnitPower are supported.
             if (ScsiQuerySupportedControlTypes < controlTypeList->MaxControlType) {
                 controlTypeList->SupportedTypeList[ScsiQuerySupportedUnitControlTypes] = TRUE;
@@ -2069,6 +2171,13 @@ Return Value:
                 PAHCI_CHANNEL_EXTENSION channelExtension = adapterExtension->PortExtension[storAddrBtl8->Path];
                 BOOLEAN                 reportF1State = FALSE;
 
+                //
+                // With DevSleep the device has an idle state with known exit latency, report it as F1.
+                // The HBA enters DevSleep by itself (PxDEVSLP.ADSE), F1 is informational for the power manager.
+                //
+                if (channelExtension->StateFlags.DevSleepEnabled == 1) {
+                    reportF1State = TRUE;
+                }
 
                 //
                 // IdlePowerEnabled == TRUE indicates this unit is being
@@ -2130,6 +2239,16 @@ Return Value:
                         component->FStates[0].ResidencyRequirement = 0;
                         component->FStates[0].NominalPower = STOR_POFX_UNKNOWN_POWER;
 
+                        if (reportF1State) {
+                            // F1 State, latency and residency are in 100ns units.
+                            component->FStates[1].Version = STOR_POFX_COMPONENT_IDLE_STATE_VERSION_V1;
+                            component->FStates[1].Size = STOR_POFX_COMPONENT_IDLE_STATE_SIZE;
+                            component->FStates[1].TransitionLatency = (ULONGLONG)channelExtension->LpmStatistics.DevSleepExitCost * 10;
+                            component->FStates[1].ResidencyRequirement = ((ULONGLONG)channelExtension->LpmAdaptivePolicy.DevSleepIdleTimeout * 1000 +
+                                                                          channelExtension->LpmStatistics.DevSleepExitCost) * 10;
+                            component->FStates[1].NominalPower = STOR_POFX_UNKNOWN_POWER;
+                        }
+
 
                         // registry runtime power management for Unit
                         storStatus = StorPortInitializePoFxPower(AdapterExtension,
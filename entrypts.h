@@ -108,6 +108,14 @@ typedef struct _CHANNEL_STATE_FLAGS {
     ULONG PoFxActive : 1;
     ULONG D3ColdEnabled : 1;
 
+    ULONG LpmSettingReceived : 1;   // LPM power setting has been delivered by OS through power setting notification
+    ULONG HostAutoPartialToSlumber : 1; // PxCMD.APSTE is set, HBA performs Partial to Slumber transition (CAP2.APST)
+    ULONG DevSleepEnabled : 1;          // HBA, platform and device support DevSleep and it's enabled on device. PxDEVSLP.ADSE is set by adaptive policy
+    ULONG DevSleepTimingSet : 1;        // PxDEVSLP.DITO/DM/MDAT/DETO are programmed
+    ULONG LocalSrbWaitingForSlot : 1;   // slot 0 is lent to an IO from Storport, local Srb is started by AhciGetNextIos() when it's released
+    ULONG CallAhciNcqErrorRecovery : 1; // NCQ error is recovered by reading the NCQ Command Error log instead of COMRESET
+    ULONG NcqErrorLogPending : 1;       // READ LOG EXT of the NCQ Command Error log is the only command ActivateQueue() issues
+
     ULONG Reserved1;
 } CHANNEL_STATE_FLAGS, *PCHANNEL_STATE_FLAGS;
 
@@ -164,7 +172,9 @@ typedef struct _ATA_SUPPORTED_GPL_PAGES {
     struct {
         ULONG  LogAddressSupported : 1;     // Log Address 0x30
         ULONG  SATA : 1;                        // Log Page 0x08
-        ULONG  Reserved : 30;
+        ULONG  SupportedCapabilities : 1;       // Log Page 0x03
+        ULONG  CurrentSettings : 1;             // Log Page 0x04
+        ULONG  Reserved : 28;
     } IdentifyDeviceData;
 
     struct {
@@ -174,8 +184,9 @@ typedef struct _ATA_SUPPORTED_GPL_PAGES {
         ULONG  HybridInfo                       : 1;         // Log Address 0x14
         ULONG  CurrentDeviceInternalStatusData  : 1;         // Log Address 0x24
         ULONG  SavedDeviceInternalStatusData    : 1;         // Log Address 0x25
+        ULONG  CommandDurationLimits            : 1;         // Log Address 0x18
 
-        ULONG  Reserved : 26;
+        ULONG  Reserved : 25;
     } SinglePage;
 
 } ATA_SUPPORTED_GPL_PAGES, *PATA_SUPPORTED_GPL_PAGES;
@@ -189,10 +200,36 @@ typedef struct _ATA_COMMAND_SUPPORTED {
 
     ULONG  SetDateAndTime           : 1;
 
-    ULONG  Reserved                 : 27;
+    ULONG  CommandDurationLimits    : 1;
+
+    ULONG  Reserved                 : 26;
 
 } ATA_COMMAND_SUPPORTED, *PATA_COMMAND_SUPPORTED;
 
+//
+// INQUIRY data and VPD pages of an ATA device, built from IDENTIFY DEVICE data by the first request after the device is
+// identified and then served by copying, see AtaGetInquiryCache(). Valid is cleared when the device is identified again or on bus change.
+//
+#define AHCI_VPD_SUPPORTED_PAGES_COUNT              6
+#define AHCI_VPD_BLOCK_LIMITS_LENGTH                0x40
+#define AHCI_VPD_BLOCK_LIMITS_SHORT_LENGTH          0x14
+#define AHCI_VPD_BLOCK_DEVICE_CHARACTERISTICS_LENGTH 0x40
+#define AHCI_VPD_LOGICAL_BLOCK_PROVISIONING_LENGTH  0x08
+#define AHCI_VPD_SERIAL_NUMBER_LENGTH               24
+
+typedef struct _AHCI_INQUIRY_CACHE {
+    BOOLEAN     Valid;
+    UCHAR       Reserved[3];
+
+    UCHAR       StandardInquiry[ATA_INQUIRYDATA_SIZE];
+    UCHAR       SupportedPages[sizeof(VPD_SUPPORTED_PAGES_PAGE) + AHCI_VPD_SUPPORTED_PAGES_COUNT];
+    UCHAR       BlockLimits[AHCI_VPD_BLOCK_LIMITS_LENGTH];                  // page length 0x3C if UNMAP or WRITE SAME is supported
+    UCHAR       BlockLimitsShort[AHCI_VPD_BLOCK_LIMITS_SHORT_LENGTH];       // page length 0x10, returned to small buffers
+    UCHAR       BlockDeviceCharacteristics[AHCI_VPD_BLOCK_DEVICE_CHARACTERISTICS_LENGTH];
+    UCHAR       LogicalBlockProvisioning[AHCI_VPD_LOGICAL_BLOCK_PROVISIONING_LENGTH];
+    UCHAR       SerialNumber[AHCI_VPD_SERIAL_NUMBER_LENGTH];
+    VPD_ATA_INFORMATION_PAGE    AtaInformation;
+} AHCI_INQUIRY_CACHE, *PAHCI_INQUIRY_CACHE;
 
 typedef struct _AHCI_DEVICE_EXTENSION {
     STOR_ADDR_BTL8          DeviceAddress;
@@ -218,6 +255,8 @@ typedef struct _AHCI_DEVICE_EXTENSION {
     PUSHORT                 ReadLogExtPageData;
     STOR_PHYSICAL_ADDRESS   ReadLogExtPageDataPhysicalAddress;
 
+    AHCI_INQUIRY_CACHE      InquiryCache;
+
 } AHCI_DEVICE_EXTENSION, *PAHCI_DEVICE_EXTENSION;
 
 typedef struct _COMMAND_HISTORY {
@@ -342,7 +381,12 @@ typedef struct _AHCI_SRB_EXTENSION {
     PVOID                   CompletionContext;   // context information for completionRoutine
     UCHAR              QueueTag;            // for AHCI controller slots
     UCHAR              RetryCount;          // how many times the command has been retired
+    UCHAR              SenseKey;            // with ATA_FLAGS_NCQ_ERROR_LOG, 0 if device reported no sense data
+    UCHAR              AdditionalSenseCode;
+    UCHAR              AdditionalSenseCodeQualifier;
+    UCHAR              CommandDurationLimitIndex;   // NCQ reads and writes, sent in AUXILIARY 3:0. 0 - no limit
     ULONGLONG          StartTime;
+    ULONGLONG          QueuedTime;          // when the Srb was queued waiting for a slot, 0 if a slot was free
 
     PVOID               ResultBuffer;       // for requests marked with ATA_FLAGS_RETURN_RESULTS
     ULONG               ResultBufferLength;
@@ -377,6 +421,305 @@ typedef struct _STORAHCI_QUEUE {
     ULONG DepthHistory[100];
 } STORAHCI_QUEUE, *PSTORAHCI_QUEUE;
 
+//
+// Weighted round robin of SRB queues. Weights are read from registry "UrgentQueueWeight", "NormalQueueWeight"
+// and "BackgroundQueueWeight".
+//
+#define AHCI_SRB_QUEUE_DEFAULT_WEIGHT_URGENT        8
+#define AHCI_SRB_QUEUE_DEFAULT_WEIGHT_NORMAL        4
+#define AHCI_SRB_QUEUE_DEFAULT_WEIGHT_BACKGROUND    1
+#define AHCI_SRB_QUEUE_MAX_WEIGHT                   255
+
+//
+// Token buckets limiting read/write requests taken from SRB queues, see AhciThrottleAdmit().
+// A bucket holds up to AHCI_THROTTLE_BURST_TIME worth of its rate. A request is admitted while the buckets
+// it is charged to are not empty, so a bucket may go negative after a large request.
+// Throttled requests stay queued; the adapter timer resumes them every AHCI_THROTTLE_TIMER_INTERVAL.
+//
+#define AHCI_THROTTLE_BURST_TIME            100000      // in microseconds
+#define AHCI_THROTTLE_TIMER_INTERVAL        1000        // in microseconds
+#define AHCI_THROTTLE_TOKEN_UNIT            1000000     // tokens are kept in millionths of a request or a byte
+
+typedef struct _AHCI_TOKEN_BUCKET {
+    ULONGLONG   Rate;                   // requests or bytes per second, 0: not limited
+    LONGLONG    Tokens;                 // in AHCI_THROTTLE_TOKEN_UNIT of a request or byte
+} AHCI_TOKEN_BUCKET, *PAHCI_TOKEN_BUCKET;
+
+typedef struct _AHCI_THROTTLE {
+    BOOLEAN             Enabled;        // any limit is set
+    BOOLEAN             Throttled;      // queued requests are held back, waiting for the adapter timer
+    UCHAR               Reserved[2];
+    ULONGLONG           LastRefillTime;
+    ULONGLONG           ThrottleStartTime;
+    AHCI_TOKEN_BUCKET   PortIops;
+    AHCI_TOKEN_BUCKET   PortBandwidth;
+    AHCI_TOKEN_BUCKET   ClassIops[AhciSrbQueueClassCount];
+    AHCI_TOKEN_BUCKET   ClassBandwidth[AhciSrbQueueClassCount];
+} AHCI_THROTTLE, *PAHCI_THROTTLE;
+
+//
+// Adaptive NCQ depth works like delay based congestion control: completion latency is averaged over windows of
+// AHCI_ADAPTIVE_QD_WINDOW NCQ commands. The lowest window average is the base latency of the device.
+// When a window average exceeds AHCI_ADAPTIVE_QD_LATENCY_FACTOR times the base without a throughput gain,
+// the device is past its knee and the depth is cut by a quarter; otherwise it grows by one while commands wait for it.
+// The base latency is raised by an eighth every AHCI_ADAPTIVE_QD_BASE_AGE windows so it follows workload changes.
+//
+#define AHCI_ADAPTIVE_QD_WINDOW             32
+#define AHCI_ADAPTIVE_QD_LATENCY_FACTOR     3
+#define AHCI_ADAPTIVE_QD_BASE_AGE           64
+#define AHCI_ADAPTIVE_QD_DEFAULT_FLOOR      4
+
+typedef struct _AHCI_ADAPTIVE_QUEUE_DEPTH {
+    BOOLEAN     Enabled;
+    UCHAR       QueueDepth;             // current depth, between Floor and Ceiling
+    UCHAR       Floor;
+    UCHAR       Ceiling;
+    BOOLEAN     Limited;                // NCQ commands were held back by QueueDepth in this window
+    UCHAR       Reserved[3];
+    ULONG       WindowCount;
+    ULONG       BaseAge;                // windows since the base latency was last lowered
+    ULONGLONG   WindowLatency;          // in 100ns, sum of completion latency in this window
+    ULONGLONG   WindowStartTime;
+    ULONGLONG   BaseLatency;            // in 100ns
+    ULONGLONG   LastThroughput;         // NCQ commands per second of the last window
+} AHCI_ADAPTIVE_QUEUE_DEPTH, *PAHCI_ADAPTIVE_QUEUE_DEPTH;
+
+//
+// Hybrid polling: a single command issued to an idle port is polled from PollDpc for up to the budget, one and a half
+// times the learned device latency but at most BudgetLimit, then left to the interrupt.
+//
+#define AHCI_POLL_MAX_BUDGET            1000    // in microseconds
+#define AHCI_POLL_STALL_INTERVAL        2       // in microseconds, between reads of PxCI/PxSACT
+#define AHCI_POLL_SAMPLE_INTERVAL       16      // every 16th command is not polled, its interrupt latency is the baseline
+
+typedef struct _AHCI_POLLING {
+    ULONG       SlotMask;               // slot of the single command being tracked, 0 if none
+    ULONG       IssueCount;
+    ULONGLONG   IssueTime;
+    BOOLEAN     InterruptSample;        // the tracked command is left to the interrupt
+    BOOLEAN     Polled;                 // the tracked command was found completed by polling
+} AHCI_POLLING, *PAHCI_POLLING;
+
+//
+// Command Duration Limits: NCQ reads and writes carry the index (1-7) of a limit descriptor in the AUXILIARY field.
+// The index comes from the DLD bits of READ(16)/WRITE(16), or from the IO priority hint, see GetCommandDurationLimitIndex().
+//
+typedef struct _AHCI_COMMAND_DURATION_LIMITS {
+    BOOLEAN     Configured;             // registry "CommandDurationLimits"
+    BOOLEAN     DeviceEnabled;          // Current Settings page of the Identify Device Data log reports the feature enabled
+    UCHAR       HighPriorityIndex;      // registry "CdlHighPriorityDescriptor", 0: none
+    UCHAR       LowPriorityIndex;       // registry "CdlLowPriorityDescriptor", 0: none
+    UCHAR       ReadDescriptors;        // bit n set: read descriptor n sets a limit
+    UCHAR       WriteDescriptors;       // bit n set: write descriptor n sets a limit
+} AHCI_COMMAND_DURATION_LIMITS, *PAHCI_COMMAND_DURATION_LIMITS;
+
+#define AHCI_CDL_MAX_INDEX              7
+
+//
+// SCT Error Recovery Control: read and write recovery time limits, in units of 100 milliseconds, 0: not set by driver.
+// The timers are volatile in the device, they are sent by SCT command transport after the preserved settings
+// every time those are restored, see IssueSctErcCommand().
+//
+#define AHCI_SCT_ERC_READ               0x1
+#define AHCI_SCT_ERC_WRITE              0x2
+
+typedef struct _AHCI_SCT_ERC {
+    USHORT                  ReadTimeout;            // registry "SctErcReadTimeout"
+    USHORT                  WriteTimeout;           // registry "SctErcWriteTimeout"
+    UCHAR                   Commands;               // AHCI_SCT_ERC_* timers to send with the preserved settings
+    UCHAR                   CommandsToSend;
+    UCHAR                   CommandInProgress;
+    UCHAR                   Applied;                // AHCI_SCT_ERC_* timers accepted by device the last time they were sent
+    ULONG                   AppliedCount;
+    ULONG                   FailedCount;
+    PUSHORT                 CommandData;            // SCT command key sector, 512 bytes
+    STOR_PHYSICAL_ADDRESS   CommandDataPhysicalAddress;
+} AHCI_SCT_ERC, *PAHCI_SCT_ERC;
+
+//
+// ATA Streaming: streams 0 to StreamCount - 1 are set up by CONFIGURE STREAM after the preserved settings,
+// see IssueConfigureStreamCommand(). Reads and writes inside the LBA range of a set up stream use
+// READ/WRITE STREAM DMA EXT instead of NCQ, see GetStreamForRequest().
+//
+#define AHCI_STREAM_ID_NONE             0xFF
+
+typedef struct _AHCI_STREAMING {
+    UCHAR                   StreamCount;            // registry "StreamCount"
+    UCHAR                   DefaultTimeLimit;       // CCTL of CONFIGURE STREAM, from registry "StreamTimeLimit"
+    USHORT                  AllocationUnit;         // in logical sectors, registry "StreamAllocationUnit"
+    ULONG                   TimeLimit;              // in milliseconds, registry "StreamTimeLimit"
+    ULONG                   Granularity;            // in microseconds, unit of CCTL
+    UCHAR                   Streams;                // bit n: CONFIGURE STREAM of stream n is sent with the preserved settings
+    UCHAR                   StreamsToConfigure;
+    UCHAR                   StreamInProgress;
+    UCHAR                   StreamsConfigured;      // bit n: device accepted CONFIGURE STREAM of stream n
+    UCHAR                   StreamsBound;           // bit n: stream n has an LBA range
+    UCHAR                   CommandTimeLimit[AHCI_STREAM_COUNT];    // CCTL of the commands of each stream
+    AHCI_STREAM_SETTINGS    Settings[AHCI_STREAM_COUNT];
+    volatile LONG           SettingsGeneration;     // odd while StreamsBound, CommandTimeLimit and Settings are being changed
+} AHCI_STREAMING, *PAHCI_STREAMING;
+
+//
+// NCQ error recovery from the NCQ Command Error log: after an NCQ error the port is restarted without COMRESET and the
+// log is read by the Sense SRB before any other command. The failed command is completed with the sense data of the log
+// (NCQ Autosense), the other commands aborted by the device are issued again, see AhciNcqErrorRecovery().
+//
+typedef struct _AHCI_NCQ_AUTOSENSE {
+    BOOLEAN                 Enabled;                // registry "SenseDataReporting"
+    UCHAR                   LogReadSlot;            // slot of the Sense SRB while StateFlags.NcqErrorLogPending is set
+    UCHAR                   BorrowedSlot;           // slot BorrowedSrb was moved out of for the log read
+    UCHAR                   Reserved;
+    ULONG                   AbortedSlots;           // commands aborted by the NCQ error, waiting in NCQueueSlice for the log
+    PSCSI_REQUEST_BLOCK_EX  BorrowedSrb;            // aborted command that gave its slot to the log read, NULL: a free slot was used
+    PUCHAR                  ErrorLog;               // NCQ Command Error log, 512 bytes
+    STOR_PHYSICAL_ADDRESS   ErrorLogPhysicalAddress;
+} AHCI_NCQ_AUTOSENSE, *PAHCI_NCQ_AUTOSENSE;
+
+typedef struct _AHCI_SMART_CACHE_ENTRY {
+    ULONGLONG               Timestamp;              // performance counter when Data was read from device, 0: not valid
+    UCHAR                   Data[ATA_BLOCK_SIZE];
+} AHCI_SMART_CACHE_ENTRY, *PAHCI_SMART_CACHE_ENTRY;
+
+#define AHCI_SMART_CACHE_DEFAULT_TIMEOUT    5000    // in milliseconds
+
+typedef struct _AHCI_SMART_CACHE {
+    ULONG                   Timeout;                // in milliseconds, registry "SmartCacheTimeout". 0: not cached
+    AHCI_SMART_CACHE_ENTRY  Entry[AhciSmartCacheEntryCount];
+} AHCI_SMART_CACHE, *PAHCI_SMART_CACHE;
+
+//
+// Hot LBA tracking of hybrid devices: reads are counted per extent of logical sectors in a count-min sketch and the hottest
+// extents are kept in Top. Once per interval the counters are halved and up to Budget of the hottest extents are promoted
+// to the caching medium by HYBRID CHANGE BY LBA RANGE, sent one by one with the local SRB, see HotLbaPromote().
+//
+#define AHCI_HOT_LBA_EXTENT_SHIFT           11      // 2048 logical sectors, fits the 16 bits count of HYBRID CHANGE BY LBA RANGE
+#define AHCI_HOT_LBA_SKETCH_ROWS            4
+#define AHCI_HOT_LBA_SKETCH_WIDTH           256
+#define AHCI_HOT_LBA_TOP_COUNT              16
+#define AHCI_HOT_LBA_CHECK_MASK             0x3F    // the interval is checked once every 64 tracked reads
+#define AHCI_HOT_LBA_DEFAULT_BUDGET         4       // extents promoted per interval
+#define AHCI_HOT_LBA_DEFAULT_INTERVAL       60      // in seconds
+#define AHCI_HOT_LBA_DEFAULT_PRIORITY       1
+
+typedef struct _AHCI_HOT_LBA_EXTENT {
+    ULONGLONG               Extent;                 // LBA >> AHCI_HOT_LBA_EXTENT_SHIFT
+    ULONG                   Count;                  // estimated reads, 0: entry not used
+} AHCI_HOT_LBA_EXTENT, *PAHCI_HOT_LBA_EXTENT;
+
+typedef struct _AHCI_HOT_LBA {
+    ULONG                   Budget;                 // extents promoted per interval, registry "HybridPromoteBudget". 0: not tracked
+    ULONG                   Interval;               // in seconds, registry "HybridPromoteInterval"
+    UCHAR                   Priority;               // hybrid priority of promoted extents, registry "HybridPromotePriority"
+    UCHAR                   CandidateCount;         // extents picked for promotion in this interval
+    UCHAR                   NextCandidate;          // next extent of Candidates to send
+    UCHAR                   PromotedCount;          // extents of Candidates the device accepted
+    ULONG                   ReadCount;              // wraps, only used to check the interval every few reads
+    ULONGLONG               IntervalStart;          // performance counter, 0: not started
+    ULONGLONG               InProgress;             // extent of the command being sent
+    ULONGLONG               Candidates[AHCI_HOT_LBA_TOP_COUNT];
+    ULONGLONG               Promoted[AHCI_HOT_LBA_TOP_COUNT];
+    AHCI_HOT_LBA_EXTENT     Top[AHCI_HOT_LBA_TOP_COUNT];
+    USHORT                  Sketch[AHCI_HOT_LBA_SKETCH_ROWS][AHCI_HOT_LBA_SKETCH_WIDTH];
+} AHCI_HOT_LBA, *PAHCI_HOT_LBA;
+
+typedef struct _AHCI_SRB_QUEUE_SCHEDULER {
+    ULONG       Weight[AhciSrbQueueClassCount];     // SRBs each class may dequeue per round
+    ULONG       QueuedCount;                        // SRBs in all queues
+    ULONG       CurrentClass;                       // class being served in this round
+    ULONG       Credit[AhciSrbQueueClassCount];     // SRBs each class may still dequeue in this round
+} AHCI_SRB_QUEUE_SCHEDULER, *PAHCI_SRB_QUEUE_SCHEDULER;
+
+//
+// Adaptive link power management.
+// Idle periods of the port are collected in a histogram, bucket n counts idle periods of [2^n, 2^(n+1)) microseconds,
+// the last bucket is open ended. The policy is re-evaluated and the histogram aged (halved) every AHCI_LPM_IDLE_SAMPLE_WINDOW idle periods.
+//
+#define AHCI_LPM_IDLE_HISTOGRAM_BUCKETS     32      // the last bucket starts at 2^31 us, long enough for DevSleep idle timeouts
+#define AHCI_LPM_IDLE_SAMPLE_WINDOW         64
+
+// exit latency from SATA spec: Partial -> Active within 10us, Slumber -> Active within 10ms.
+// Used until the exit latency of the link is measured, see AhciLpmAdaptiveWakeComplete().
+#define AHCI_LPM_PARTIAL_EXIT_LATENCY_US    10
+#define AHCI_LPM_SLUMBER_EXIT_LATENCY_US    10000
+
+// minimal idle time for a link state to save more than it costs to enter and leave it, with the exit latency above.
+// The exit latency part is replaced by the measured one, see AhciLpmIdleThreshold().
+#define AHCI_LPM_PARTIAL_BREAK_EVEN_US      100
+#define AHCI_LPM_SLUMBER_BREAK_EVEN_US      16000
+
+// a first completion later than this after leaving idle is not taken as a wake sample (e.g. spin up, long FLUSH)
+#define AHCI_LPM_WAKE_SAMPLE_LIMIT_US       1000000
+
+typedef struct _AHCI_LPM_ADAPTIVE_POLICY {
+    ULONG       WakeLatencyBudget;      // in microseconds, registry "LpmWakeLatencyBudget". 0: adaptive policy disabled
+    ULONG       IdleSampleCount;        // idle periods collected since last evaluation
+    ULONG       IdleHistogram[AHCI_LPM_IDLE_HISTOGRAM_BUCKETS];
+    ULONGLONG   IdleStartTime;          // performance counter value when the port became idle. 0: port is busy
+    ULONGLONG   CounterFrequency;
+
+    // DevSleep, used only when adaptive policy predicts idle periods longer than DevSleepIdleTimeout plus the exit cost.
+    ULONG       DevSleepIdleTimeout;    // in milliseconds, registry "DevSleepIdleTimeout", PxDEVSLP.DITO * (PxDEVSLP.DM + 1). 0: DevSleep is not used
+    UCHAR       DevSleepMinAssertTime;  // in milliseconds, registry "DevSleepMinAssertTime", PxDEVSLP.MDAT
+    UCHAR       DevSleepExitTimeout;    // in milliseconds, registry "DevSleepExitTimeout", PxDEVSLP.DETO
+    UCHAR       DevSleepTimingStep;     // AHCI_DEVSLEEP_TIMING_*, PxDEVSLP of a running port is programmed by AhciDevSleepTimingCallback()
+    UCHAR       DevSleepTimingPolls;    // PxCMD.CR checks since PxCMD.ST was cleared
+
+    // wake measurement: time from issuing commands to the idle port until the first of them completes
+    ULONGLONG   WakeStartTime;          // performance counter value when commands were issued to the idle port. 0: no wake measured
+    UCHAR       WakeLinkState;          // PxSSTS.IPM when they were issued
+} AHCI_LPM_ADAPTIVE_POLICY, *PAHCI_LPM_ADAPTIVE_POLICY;
+
+// DevSleep timing defaults (SATA 3.2 section 8.5.2) and limits of PxDEVSLP fields
+#define AHCI_DEVSLEEP_DEFAULT_EXIT_TIMEOUT      20      // DETO, in milliseconds
+#define AHCI_DEVSLEEP_DEFAULT_MIN_ASSERT_TIME   10      // MDAT, in milliseconds
+#define AHCI_DEVSLEEP_MAX_EXIT_TIMEOUT          255
+#define AHCI_DEVSLEEP_MAX_MIN_ASSERT_TIME       31
+#define AHCI_DEVSLEEP_MAX_IDLE_TIMEOUT          (1023 * 16)     // DITO: 10 bits, DM: 4 bits
+
+// PxDEVSLP of a running port is programmed from StartPortTimer: wait for the port to be idle, clear PxCMD.ST,
+// wait for PxCMD.CR to clear without holding InterruptLock, then program PxDEVSLP and set PxCMD.ST again.
+#define AHCI_DEVSLEEP_TIMING_IDLE               0
+#define AHCI_DEVSLEEP_TIMING_WAIT_PORT_IDLE     1
+#define AHCI_DEVSLEEP_TIMING_WAIT_CR            2
+#define AHCI_DEVSLEEP_TIMING_IDLE_INTERVAL      100000  // in microseconds, port busy, check again
+#define AHCI_DEVSLEEP_TIMING_CR_INTERVAL        5000    // in microseconds
+#define AHCI_DEVSLEEP_TIMING_CR_POLL_COUNT      100     // AHCI 10.1.2 - 3: wait at least 500 milliseconds for PxCMD.CR to clear
+
+//
+// Non-queued command batching. While NCQ commands are pending, non-queued commands wait up to the batch window
+// so that the ones arriving meanwhile are issued back to back in one drain. At most BatchLimit of them are issued
+// per drain before pending NCQ commands are resumed.
+//
+#define AHCI_NONQUEUED_DEFAULT_BATCH_LIMIT  8
+#define AHCI_NONQUEUED_MAX_BATCH_WINDOW     100000      // in microseconds
+
+typedef struct _AHCI_NONQUEUED_SCHEDULER {
+    ULONG       BatchWindow;            // in microseconds, registry "NonQueuedBatchWindow". 0: commands are not batched
+    ULONG       BatchLimit;             // registry "NonQueuedBatchLimit", non-queued commands issued in one drain before NCQ commands get their turn
+    BOOLEAN     DrainInProcess;         // NCQ commands are not issued, non-queued commands of this batch are issued
+    UCHAR       Reserved[3];
+    ULONG       BatchIssued;            // non-queued commands issued in current drain
+    ULONGLONG   WindowStartTime;        // performance counter value when the batch window opened. 0: window is not open
+    ULONGLONG   RateStartTime;          // performance counter value when current one second interval of drain counting started
+    ULONG       RateDrainCount;         // drains in current one second interval
+} AHCI_NONQUEUED_SCHEDULER, *PAHCI_NONQUEUED_SCHEDULER;
+
+//
+// Devices whose FUA writes should not be used, registry "FuaOptOutDevices" (REG_MULTI_SZ of model numbers).
+//
+#define AHCI_FUA_OPT_OUT_LIST_LENGTH        256
+
+//
+// Requests mapped to high priority are issued first and, if the device supports NCQ priority, carry PRIO = high.
+// Registry "NcqPriorityClass".
+//
+typedef enum _AHCI_IO_PRIORITY_CLASS {
+    AhciIoPriorityClassNone = 0,        // IO priority hints are ignored
+    AhciIoPriorityClassHint = 1,        // requests with High or Critical IO priority hint
+    AhciIoPriorityClassReads = 2,       // above, plus reads with Normal IO priority hint: reads go ahead of writes and background IO
+    AhciIoPriorityClassMax = AhciIoPriorityClassReads
+} AHCI_IO_PRIORITY_CLASS;
+
 typedef struct _AHCI_ADAPTER_EXTENSION  AHCI_ADAPTER_EXTENSION, *PAHCI_ADAPTER_EXTENSION;
 
 typedef struct _AHCI_CHANNEL_EXTENSION {
@@ -421,6 +764,33 @@ typedef struct _AHCI_CHANNEL_EXTENSION {
         ULONG SlumberSuccessCount;  // Number of times we succeeded in going to Slumber
     } AutoPartialToSlumberDbgStats;
 
+    //
+    // Adaptive link power management, chooses the link state from observed idle periods.
+    //
+    AHCI_LPM_ADAPTIVE_POLICY    LpmAdaptivePolicy;
+    AHCI_LPM_STATISTICS         LpmStatistics;
+
+    //
+    // Non-queued command batching, see NonQueuedCommandsDeferred().
+    //
+    AHCI_NONQUEUED_SCHEDULER    NonQueuedScheduler;
+    AHCI_NONQUEUED_STATISTICS   NonQueuedStatistics;
+
+    //
+    // FLUSH coalescing, see AhciMergeFlushRequest().
+    //
+    AHCI_FLUSH_STATISTICS       FlushStatistics;
+
+    //
+    // model numbers of devices not to use FUA writes, see IsFuaOptOutDevice().
+    //
+    CHAR                        FuaOptOutDevices[AHCI_FUA_OPT_OUT_LIST_LENGTH];
+
+    //
+    // read/write requests mapped to high priority, see IsHighPriorityIo().
+    //
+    AHCI_IO_PRIORITY_CLASS      IoPriorityClass;
+
 
     struct {
         ULONG RestorePreservedSettings :1;  //NOTE: this field is accessed in InterlockedBitTestAndReset, bit position (currently: 0) is used there.
@@ -433,8 +803,25 @@ typedef struct _AHCI_CHANNEL_EXTENSION {
     SLOT_MANAGER            SlotManager;
     SLOT_CONTENT            Slot[AHCI_MAX_NCQ_REQUEST_COUNT];
 
+//Shadow of port state programmed by the driver, so ActivateQueue doesn't read PxCMD, PxSACT and PxCI.
+    BOOLEAN                 ShadowStarted;      // PxCMD.ST as last set by the driver
+    ULONG                   ShadowNcqIssued;    // slots last issued as NCQ commands, outstanding only if also in SlotManager.CommandsIssued
+
+    BOOLEAN                 PortMultiplierAttached; // PxSIG reported a Port Multiplier at the last enumeration
+    UCHAR                   PortMultiplierPort;     // PMP field of every command, always 0: only device port 0 of an attached Port Multiplier is used
+
+//Interrupt handling, see AhciHwInterrupt()
+    BOOLEAN                 SdbFisCompletion;   // NCQ completions may be taken from the Set Device Bits FIS
+    AHCI_INTERRUPT_STATISTICS   InterruptStatistics;
+
 //Port IO Queue
-    STORAHCI_QUEUE          SrbQueue;
+    STORAHCI_QUEUE          SrbQueue[AhciSrbQueueClassCount];
+    AHCI_SRB_QUEUE_SCHEDULER    SrbQueueScheduler;
+    AHCI_SRB_QUEUE_STATISTICS   SrbQueueStatistics[AhciSrbQueueClassCount];
+    AHCI_THROTTLE               Throttle;
+    AHCI_THROTTLE_STATISTICS    ThrottleStatistics;
+    AHCI_ADAPTIVE_QUEUE_DEPTH   AdaptiveQueueDepth;
+    AHCI_ADAPTIVE_QD_STATISTICS AdaptiveQueueDepthStatistics;
 
 //IO Completion Queue and DPC
     STORAHCI_QUEUE          CompletionQueue;
@@ -443,6 +830,15 @@ typedef struct _AHCI_CHANNEL_EXTENSION {
 //DPC to handle hotplug notification
     STOR_DPC                BusChangeDpc;
 
+//Hybrid polling of single commands and its DPC
+    AHCI_POLLING            Polling;
+    AHCI_POLLING_STATISTICS PollingStatistics;
+    STOR_DPC                PollDpc;
+
+//Command Duration Limits of NCQ reads and writes
+    AHCI_COMMAND_DURATION_LIMITS    CommandDurationLimits;
+    AHCI_CDL_STATISTICS             CdlStatistics;
+
 //AHCI defined register interface structures
     PAHCI_PORT              Px;
     PAHCI_COMMAND_HEADER    CommandList;
@@ -456,6 +852,16 @@ typedef struct _AHCI_CHANNEL_EXTENSION {
 
     AHCI_DEVICE_INIT_COMMANDS   DeviceInitCommands;
     PERSISTENT_SETTINGS         PersistentSettings;
+    AHCI_SCT_ERC                SctErc;
+    AHCI_STREAMING              Streaming;
+    AHCI_STREAM_STATISTICS      StreamStatistics[AHCI_STREAM_COUNT];
+    AHCI_NCQ_AUTOSENSE          NcqAutosense;
+    AHCI_AUTOSENSE_STATISTICS   AutosenseStatistics;
+    AHCI_INQUIRY_CACHE_STATISTICS   InquiryCacheStatistics;
+    AHCI_SMART_CACHE                SmartCache;
+    AHCI_SMART_CACHE_STATISTICS     SmartCacheStatistics;
+    AHCI_HOT_LBA                    HotLba;
+    AHCI_HOT_LBA_STATISTICS         HotLbaStatistics;
 
 //Timer
     PVOID                   StartPortTimer;         // used for the Port Starting process
@@ -478,8 +884,9 @@ typedef struct _ADAPTER_STATE_FLAGS {
 
     ULONG SupportsAcpiDSM : 1;      // indicates if the system has _DSM method implemented to control port/device power. when the value is 1, the _DSM method at least supports powering on all connected devices.
     ULONG Removed : 1;
+    ULONG UnitControlSupported : 1; // Storport queried AhciHwUnitControl (Windows 8 and later), devices are started by AhciDeviceStart()
 
-    ULONG Reserved : 25;
+    ULONG Reserved : 24;
 
 } ADAPTER_STATE_FLAGS, *PADAPTER_STATE_FLAGS;
 
@@ -550,6 +957,10 @@ typedef struct _AHCI_ADAPTER_EXTENSION {
 //nonCacheExtension
     PVOID                   NonCachedExtension;
 
+//Throttled requests are resumed by the adapter timer, requested from ThrottleDpc as it can't be requested at DIRQL.
+    STOR_DPC                ThrottleDpc;
+    LONG                    ThrottleTimerPending;
+
 } AHCI_ADAPTER_EXTENSION, *PAHCI_ADAPTER_EXTENSION;
 
 // information that will be transferred to dump/hibernate environment
@@ -286,6 +286,7 @@ Return value:
     //System software places a port into the idle state by clearing PxCMD.ST and waiting for PxCMD.CR to return 0 when read.
     cmd.ST = 0;
     StorPortWriteRegisterUlong(adapterExtension, &Px->CMD.AsUlong, cmd.AsUlong);
+    ChannelExtension->ShadowStarted = FALSE;
 
   //1.1.1 Update the Channel Start State after we ask the channel to stop
     ChannelExtension->StartState.ChannelNextStartState = Stopped;
@@ -632,6 +633,7 @@ Return Values:
   //1.2 Next, is the port somehow already running?
     cmd.AsUlong = StorPortReadRegisterUlong(adapterExtension, &px->CMD.AsUlong);
     if( (cmd.ST == 1) && (cmd.CR == 1) && (cmd.FRE == 1) && (cmd.FR == 1) ) {
+        ChannelExtension->ShadowStarted = TRUE;
         ChannelExtension->StartState.ChannelNextStartState = StartComplete;
         RecordExecutionHistory(ChannelExtension, 0x30000015);//Channel Already Running
         RunNextPort(ChannelExtension, (!TimerCallbackProcess && ChannelExtension->StartState.AtDIRQL));
@@ -1121,10 +1123,22 @@ WaitOnBSYDRQ_Start:
         PortClearPendingInterrupt(ChannelExtension);
         Set_PxIE(ChannelExtension, &ChannelExtension->Px->IE);
 
-      //We made it!  Set ST and start the IO we have collected!
+      //3.3 PxDEVSLP timing can only be changed while PxCMD.ST is cleared, program it before the port is started.
+        if (ChannelExtension->StateFlags.DevSleepEnabled == 1) {
+            AhciDevSleepProgramTiming(ChannelExtension);
+        }
+
+      //3.4 Software tells the HBA a Port Multiplier is attached, PxCMD.PMA is only changed while PxCMD.ST is cleared.
+      //    Commands go to device port 0 with command-based switching, PxFBS is left disabled.
         cmd.AsUlong = StorPortReadRegisterUlong(adapterExtension, &ChannelExtension->Px->CMD.AsUlong);
+        if (adapterExtension->CAP.SPM == 1) {
+            cmd.PMA = (StorPortReadRegisterUlong(adapterExtension, &ChannelExtension->Px->SIG.AsUlong) == ATA_PORT_MULTIPLIER_SIGNATURE) ? 1 : 0;
+        }
+
+      //We made it!  Set ST and start the IO we have collected!
         cmd.ST = 1;
         StorPortWriteRegisterUlong(adapterExtension, &ChannelExtension->Px->CMD.AsUlong, cmd.AsUlong);
+        ChannelExtension->ShadowStarted = TRUE;
 
         ChannelExtension->StartState.ChannelNextStartState = StartComplete;
         ChannelExtension->StateFlags.IgnoreHotplugInterrupt = FALSE;
@@ -1498,6 +1512,275 @@ Affected Variables/Registers:
     RecordExecutionHistory(ChannelExtension, 0x10000013);//Exit AhciNonQueuedErrorRecovery
 }
 
+VOID
+NcqErrorLogCompletion(
+    __in PAHCI_CHANNEL_EXTENSION ChannelExtension,
+    __in_opt PSCSI_REQUEST_BLOCK_EX Srb
+    )
+/*++
+    Completion of READ LOG EXT of the NCQ Command Error log, issued by AhciNcqErrorRecovery with the Sense SRB.
+It assumes:
+    Called from the completion DPC, InterruptLock is not held
+Called by:
+    Sense SRB completion
+
+It performs:
+    1 Nothing to do if the port has been reset meanwhile, the commands waiting for the log were completed by the reset
+    1.1 The aborted command that gave its slot to the log read waits for the log with the other aborted commands again
+    2 Reset the port if the log doesn't name one of the aborted commands
+    3 Complete the failed command with status, error and sense data from the log
+    4 Issue the other aborted commands again
+
+Affected Variables/Registers:
+    SlotManager
+--*/
+{
+    STOR_LOCK_HANDLE        lockhandle = {0};
+    PUCHAR                  errorLog = ChannelExtension->NcqAutosense.ErrorLog;
+    PAHCI_SRB_EXTENSION     srbExtension;
+    PSCSI_REQUEST_BLOCK_EX  borrowedSrb;
+    ULONG                   aborted;
+    UCHAR                   tag;
+
+    StorPortAcquireSpinLock(ChannelExtension->AdapterExtension, InterruptLock, NULL, &lockhandle);
+
+  //1 Nothing to do if the port has been reset meanwhile
+    if (ChannelExtension->StateFlags.NcqErrorLogPending == 0) {
+        StorPortReleaseSpinLock(ChannelExtension->AdapterExtension, &lockhandle);
+        return;
+    }
+
+    tag = errorLog[IDE_NCQ_ERROR_LOG_TAG] & IDE_NCQ_ERROR_LOG_TAG_MASK;
+
+  //1.1 The aborted command that gave its slot to the log read gets a slot again, normally the one the log read released.
+  //    The log names it by its old slot. If no slot is available AhciProcessIo() completes it with busy status to be retried.
+    borrowedSrb = ChannelExtension->NcqAutosense.BorrowedSrb;
+
+    if (borrowedSrb != NULL) {
+        ChannelExtension->NcqAutosense.BorrowedSrb = NULL;
+        srbExtension = GetSrbExtension(borrowedSrb);
+
+        AhciProcessIo(ChannelExtension, borrowedSrb, TRUE);
+
+        if ( (srbExtension->QueueTag <= ChannelExtension->AdapterExtension->CAP.NCS) &&
+             (ChannelExtension->Slot[srbExtension->QueueTag].Srb == borrowedSrb) ) {
+            ChannelExtension->NcqAutosense.AbortedSlots |= (1 << srbExtension->QueueTag);
+
+            if (tag == ChannelExtension->NcqAutosense.BorrowedSlot) {
+                tag = srbExtension->QueueTag;
+            }
+        }
+    }
+
+    aborted = ChannelExtension->NcqAutosense.AbortedSlots & ChannelExtension->SlotManager.NCQueueSlice;
+
+  //2 Reset the port if the log doesn't name one of the aborted commands, AhciPortReset() completes them as before.
+    if ( (Srb == NULL) ||
+         (Srb->SrbStatus != SRB_STATUS_SUCCESS) ||
+         ((errorLog[IDE_NCQ_ERROR_LOG_TAG] & IDE_NCQ_ERROR_LOG_NQ) != 0) ||
+         ((aborted & (1 << tag)) == 0) ||
+         (ChannelExtension->Slot[tag].Srb == NULL) ) {
+
+        RecordExecutionHistory(ChannelExtension, 0x10030014);//NcqErrorLogCompletion, log not valid, reset port
+        StorPortDebugPrint(3, "StorAHCI - Autosense: Port %02d - NCQ Command Error log not valid, resetting port\n", ChannelExtension->PortNumber);
+
+        AhciUlongIncrement(&ChannelExtension->AutosenseStatistics.ResetCount);
+        AhciPortReset(ChannelExtension, FALSE);
+
+        StorPortReleaseSpinLock(ChannelExtension->AdapterExtension, &lockhandle);
+        return;
+    }
+
+    ChannelExtension->StateFlags.NcqErrorLogPending = 0;
+    ChannelExtension->NcqAutosense.AbortedSlots = 0;
+
+  //3 Complete the failed command with status, error and sense data from the log, AtaMapError() builds the sense data from them.
+    srbExtension = GetSrbExtension(ChannelExtension->Slot[tag].Srb);
+    srbExtension->Flags |= ATA_FLAGS_NCQ_ERROR_LOG;
+    srbExtension->AtaStatus = errorLog[IDE_NCQ_ERROR_LOG_STATUS];
+    srbExtension->AtaError = errorLog[IDE_NCQ_ERROR_LOG_ERROR];
+    srbExtension->SenseKey = errorLog[IDE_NCQ_ERROR_LOG_SENSE_KEY] & 0x0F;
+    srbExtension->AdditionalSenseCode = errorLog[IDE_NCQ_ERROR_LOG_ASC];
+    srbExtension->AdditionalSenseCodeQualifier = errorLog[IDE_NCQ_ERROR_LOG_ASCQ];
+
+    if (srbExtension->SenseKey != 0) {
+        AhciUlongIncrement(&ChannelExtension->AutosenseStatistics.SenseDataCount);
+    }
+
+    ChannelExtension->Slot[tag].Srb->SrbStatus = SRB_STATUS_ERROR;
+
+    ChannelExtension->SlotManager.NCQueueSlice &= ~(1 << tag);
+    ChannelExtension->SlotManager.CommandsToComplete |= (1 << tag);
+
+    AhciUlongIncrement(&ChannelExtension->AutosenseStatistics.NcqErrorCount);
+    ChannelExtension->AutosenseStatistics.RequeuedCount += NumberOfSetBits(aborted & ~(1 << tag));
+
+    StorPortDebugPrint(3, "StorAHCI - Autosense: Port %02d - NCQ tag %d failed, sense %02x/%02x/%02x, %d commands issued again\n",
+                       ChannelExtension->PortNumber, tag, srbExtension->SenseKey, srbExtension->AdditionalSenseCode,
+                       srbExtension->AdditionalSenseCodeQualifier, NumberOfSetBits(aborted & ~(1 << tag)));
+
+  //4 Issue the other aborted commands again, they are in NCQueueSlice. AhciCompleteIssuedSRBs() starts them.
+    AhciCompleteIssuedSRBs(ChannelExtension, SRB_STATUS_ERROR, TRUE);
+
+    StorPortReleaseSpinLock(ChannelExtension->AdapterExtension, &lockhandle);
+
+    return;
+}
+
+VOID
+AhciNcqErrorRecovery(
+    __in PAHCI_CHANNEL_EXTENSION ChannelExtension
+    )
+/*++
+    AHCI 6.2.2.2 Native Command Queuing Error Recovery, reading the NCQ Command Error log instead of COMRESET.
+    The device has aborted all outstanding NCQ commands. They wait in NCQueueSlice while READ LOG EXT of the
+    NCQ Command Error log is issued alone with the Sense SRB, see NcqErrorLogCompletion().
+
+It assumes:
+    Called with InterruptLock held. Only NCQ commands were issued, PxIS and PxSERR are cleared by the interrupt routine.
+
+Called by:
+    AhciPortErrorRecovery
+
+It performs:
+    1.1 Read PxSACT: commands no longer in it completed before the error, the others were aborted
+    1.2 Clear PxCMD.ST to reset PxCI and PxSACT
+    1.3 COMRESET is still needed if PxTFD.STS.BSY or PxTFD.STS.DRQ is set
+    2.1 Program READ LOG EXT of the NCQ Command Error log with the Sense SRB. If every slot holds a command,
+        an aborted command gives its slot to the log read and gets a slot again in NcqErrorLogCompletion()
+    2.2 Put the aborted commands back to NCQueueSlice, they wait for the log
+    2.3 Complete the commands that completed before the error
+    3.1 Start the channel, ActivateQueue() issues the log read before anything else
+
+Affected Variables/Registers:
+    CMD, SACT, CI
+    Channel Extension
+--*/
+{
+    ULONG                   sact;
+    ULONG                   aborted;
+    AHCI_TASK_FILE_DATA     tfd;
+    PSCSI_REQUEST_BLOCK_EX  senseSrb = &ChannelExtension->Sense.Srb;
+    PAHCI_SRB_EXTENSION     srbExtension = ChannelExtension->Sense.SrbExtension;
+    SLOT_CONTENT            borrowedSlotContent = {0};
+    UCHAR                   i;
+
+    RecordExecutionHistory(ChannelExtension, 0x00000014);//AhciNcqErrorRecovery
+
+  //1.1 Read PxSACT: commands no longer in it completed before the error, the others were aborted
+    sact = StorPortReadRegisterUlong(ChannelExtension->AdapterExtension, &ChannelExtension->Px->SACT);
+    aborted = ChannelExtension->SlotManager.CommandsIssued & sact;
+
+  //1.2 Clear PxCMD.ST to reset PxCI and PxSACT
+    if ( !P_NotRunning(ChannelExtension, ChannelExtension->Px) ) {
+        RecordExecutionHistory(ChannelExtension, 0x10010014);//AhciNcqErrorRecovery, Port Stop Failed
+        AhciUlongIncrement(&ChannelExtension->AutosenseStatistics.ResetCount);
+        AhciPortReset(ChannelExtension, FALSE);
+        return;
+    }
+
+  //1.3 COMRESET is still needed if PxTFD.STS.BSY or PxTFD.STS.DRQ is set
+    tfd.AsUlong = StorPortReadRegisterUlong(ChannelExtension->AdapterExtension, &ChannelExtension->Px->TFD.AsUlong);
+
+    if ( tfd.STS.BSY || tfd.STS.DRQ || (aborted == 0) ) {
+        RecordExecutionHistory(ChannelExtension, 0x10020014);//AhciNcqErrorRecovery, device busy or no aborted command
+        AhciUlongIncrement(&ChannelExtension->AutosenseStatistics.ResetCount);
+        AhciPortReset(ChannelExtension, FALSE);
+        return;
+    }
+
+  //2.1 Program READ LOG EXT of the NCQ Command Error log with the Sense SRB
+    AhciZeroMemory((PCHAR)senseSrb, sizeof(SCSI_REQUEST_BLOCK_EX));
+    AhciZeroMemory((PCHAR)srbExtension, sizeof(AHCI_SRB_EXTENSION));
+
+    senseSrb->Length = sizeof(SCSI_REQUEST_BLOCK_EX);
+    senseSrb->Function = SRB_FUNCTION_EXECUTE_SCSI;
+    senseSrb->PathId = (UCHAR)ChannelExtension->PortNumber;
+    senseSrb->SrbFlags = SRB_FLAGS_DATA_IN;
+    senseSrb->SrbExtension = (PVOID)srbExtension;
+    senseSrb->TimeOutValue = 1;
+
+    IssueReadLogExtCommand( ChannelExtension,
+                            senseSrb,
+                            IDE_GP_LOG_NCQ_COMMAND_ERROR_ADDRESS,
+                            0,
+                            1,
+                            0,
+                            &ChannelExtension->NcqAutosense.ErrorLogPhysicalAddress,
+                            (PVOID)ChannelExtension->NcqAutosense.ErrorLog,
+                            NcqErrorLogCompletion
+                            );
+
+    ChannelExtension->NcqAutosense.BorrowedSrb = NULL;
+
+    GetAvailableSlot(ChannelExtension, senseSrb);
+
+    if (srbExtension->QueueTag > ChannelExtension->AdapterExtension->CAP.NCS) {
+        // every slot holds a command. The port is stopped, so the slot of an aborted command is free in PxCI and PxSACT:
+        // move that command out of its slot, it waits for the log in NcqAutosense.BorrowedSrb. Slot 0 may not be lent.
+        for (i = ChannelExtension->AdapterExtension->CAP.NCS; i > 0; i--) {
+            if ( ((aborted & (1 << i)) != 0) && (ChannelExtension->Slot[i].Srb != NULL) ) {
+                break;
+            }
+        }
+
+        if (i > 0) {
+            borrowedSlotContent = ChannelExtension->Slot[i];
+            ChannelExtension->NcqAutosense.BorrowedSrb = ChannelExtension->Slot[i].Srb;
+            ChannelExtension->NcqAutosense.BorrowedSlot = i;
+
+            ChannelExtension->Slot[i].CmdHeader = NULL;
+            ChannelExtension->Slot[i].CommandHistoryIndex = 0;
+            ChannelExtension->Slot[i].Srb = NULL;
+            ChannelExtension->Slot[i].StateFlags.FUA = FALSE;
+            ChannelExtension->SlotManager.CommandsIssued &= ~(1 << i);
+            ChannelExtension->SlotManager.HighPriorityAttribute &= ~(1 << i);
+            aborted &= ~(1 << i);
+
+            RecordExecutionHistory(ChannelExtension, 0x10050014);//AhciNcqErrorRecovery, READ LOG EXT uses the slot of an aborted command
+        }
+    }
+
+    AhciProcessIo(ChannelExtension, senseSrb, TRUE);
+
+    if ( (srbExtension->QueueTag > ChannelExtension->AdapterExtension->CAP.NCS) ||
+         (ChannelExtension->Slot[srbExtension->QueueTag].Srb != senseSrb) ) {
+        // no slot for the log read, NcqErrorLogCompletion() finds nothing pending. The borrowed command is put back to its slot
+        // as issued, AhciPortReset() completes it with the other issued commands.
+        if (ChannelExtension->NcqAutosense.BorrowedSrb != NULL) {
+            ChannelExtension->Slot[ChannelExtension->NcqAutosense.BorrowedSlot] = borrowedSlotContent;
+            ChannelExtension->SlotManager.CommandsIssued |= (1 << ChannelExtension->NcqAutosense.BorrowedSlot);
+            ChannelExtension->NcqAutosense.BorrowedSrb = NULL;
+        }
+
+        RecordExecutionHistory(ChannelExtension, 0x10040014);//AhciNcqErrorRecovery, no slot for READ LOG EXT
+        AhciUlongIncrement(&ChannelExtension->AutosenseStatistics.ResetCount);
+        AhciPortReset(ChannelExtension, FALSE);
+        return;
+    }
+
+    ChannelExtension->NcqAutosense.LogReadSlot = srbExtension->QueueTag;
+    ChannelExtension->StateFlags.NcqErrorLogPending = 1;
+
+  //2.2 Put the aborted commands back to NCQueueSlice, they wait for the log
+    ChannelExtension->NcqAutosense.AbortedSlots = aborted;
+    ChannelExtension->SlotManager.NCQueueSlice |= aborted;
+    ChannelExtension->SlotManager.CommandsIssued &= ~aborted;
+
+  //2.3 Complete the commands that completed before the error
+    ChannelExtension->SlotManager.CommandsToComplete |= ChannelExtension->SlotManager.CommandsIssued;
+    ChannelExtension->SlotManager.CommandsIssued = 0;
+
+    if (ChannelExtension->SlotManager.CommandsToComplete) {
+        AhciCompleteIssuedSRBs(ChannelExtension, SRB_STATUS_SUCCESS, TRUE);
+    }
+
+  //3.1 Start the channel, ActivateQueue() issues the log read before anything else
+    P_Running_StartAttempt(ChannelExtension, TRUE);
+
+    RecordExecutionHistory(ChannelExtension, 0x10000014);//Exit AhciNcqErrorRecovery
+}
+
 VOID
 AhciPortErrorRecovery(
     __in PAHCI_CHANNEL_EXTENSION ChannelExtension
@@ -1523,6 +1806,7 @@ Return Values:
         // AhciPortBusChangeDpcRoutine() will issue RESET, ignore other error recovery marks.
         ChannelExtension->StateFlags.CallAhciReportBusChange = FALSE;
         ChannelExtension->StateFlags.CallAhciNonQueuedErrorRecovery = FALSE;
+        ChannelExtension->StateFlags.CallAhciNcqErrorRecovery = FALSE;
         ChannelExtension->StateFlags.CallAhciReset = FALSE;
 
         if (!IsDumpMode(ChannelExtension->AdapterExtension)) {
@@ -1535,11 +1819,19 @@ Return Values:
     if (ChannelExtension->StateFlags.CallAhciReset) {
         // Handle AHCI 6.2.2.2 Native Command Queuing Error Recovery and other events require RESET.
         ChannelExtension->StateFlags.CallAhciNonQueuedErrorRecovery = FALSE;
+        ChannelExtension->StateFlags.CallAhciNcqErrorRecovery = FALSE;
         ChannelExtension->StateFlags.CallAhciReset = FALSE;
 
         AhciPortReset(ChannelExtension, FALSE);
     }
 
+    if (ChannelExtension->StateFlags.CallAhciNcqErrorRecovery) {
+        // Handle AHCI 6.2.2.2 Native Command Queuing Error Recovery by reading the NCQ Command Error log
+        ChannelExtension->StateFlags.CallAhciNcqErrorRecovery = FALSE;
+
+        AhciNcqErrorRecovery(ChannelExtension);
+    }
+
     if (ChannelExtension->StateFlags.CallAhciNonQueuedErrorRecovery) {
         // Handle AHCI 6.2.2.1 Non-Queued Error Recovery
         ChannelExtension->StateFlags.CallAhciNonQueuedErrorRecovery = FALSE;
@@ -1582,7 +1874,8 @@ Return Values:
     If the reset failed the routine must return FALSE.
 --*/
 {
-    ULONG commandsToCompleteCount;
+    ULONG   commandsToCompleteCount;
+    BOOLEAN restartInitCommands = FALSE;
 
   //1.1 Initialize Variables
     RecordExecutionHistory(ChannelExtension, 0x00000050);//AhciPortReset
@@ -1599,9 +1892,48 @@ Return Values:
     if (ChannelExtension->StateFlags.ReservedSlotInUse == 1) {
         ChannelExtension->DeviceInitCommands.CommandToSend = 0;
         ChannelExtension->PersistentSettings.SlotsToSend = ChannelExtension->PersistentSettings.Slots;
+        ChannelExtension->SctErc.CommandsToSend = ChannelExtension->SctErc.Commands;
+        ChannelExtension->Streaming.StreamsToConfigure = ChannelExtension->Streaming.Streams;
     }
 
-  //3.1 Complete all issued commands
+  //2.4 A local Srb waiting for slot 0 is dropped, it would be issued later with a stale command.
+  //    Init Commands are started again at 4.2, other processes are restarted by RestorePreservedSettings at 4.1.
+    if (ChannelExtension->StateFlags.LocalSrbWaitingForSlot == 1) {
+        ChannelExtension->StateFlags.LocalSrbWaitingForSlot = 0;
+
+        if (ChannelExtension->Local.SrbExtension->CompletionRoutine == IssueInitCommands) {
+            restartInitCommands = TRUE;
+        } else {
+            InterlockedBitTestAndReset((LONG*)&ChannelExtension->StateFlags, 3);    //ReservedSlotInUse field is at bit 3
+        }
+
+        AhciZeroMemory((PCHAR)ChannelExtension->Local.SrbExtension, sizeof(AHCI_SRB_EXTENSION));
+        RecordExecutionHistory(ChannelExtension, 0x10060050);   //AhciPortReset dropped local Srb waiting for slot 0
+    }
+
+  //2.5 The NCQ Command Error log is not read after COMRESET. The commands waiting for it are completed with the issued ones.
+    if (ChannelExtension->StateFlags.NcqErrorLogPending == 1) {
+        ULONG aborted = ChannelExtension->NcqAutosense.AbortedSlots & ChannelExtension->SlotManager.NCQueueSlice;
+
+        ChannelExtension->StateFlags.NcqErrorLogPending = 0;
+        ChannelExtension->NcqAutosense.AbortedSlots = 0;
+        ChannelExtension->SlotManager.NCQueueSlice &= ~aborted;
+        ChannelExtension->SlotManager.CommandsIssued |= aborted;
+
+        // the aborted command that gave its slot to the log read has no slot, complete it here.
+        if (ChannelExtension->NcqAutosense.BorrowedSrb != NULL) {
+            PSCSI_REQUEST_BLOCK_EX borrowedSrb = ChannelExtension->NcqAutosense.BorrowedSrb;
+
+            ChannelExtension->NcqAutosense.BorrowedSrb = NULL;
+            borrowedSrb->SrbStatus = SRB_STATUS_BUS_RESET;
+            MarkSrbToBeCompleted(borrowedSrb);
+            AhciCompleteRequest(ChannelExtension, borrowedSrb, TRUE);
+        }
+    }
+
+  //3.1 Complete all issued commands, the tracked single command is not learned from.
+    AhciPollingReset(ChannelExtension);
+
     ChannelExtension->SlotManager.CommandsToComplete = ChannelExtension->SlotManager.CommandsIssued;
     ChannelExtension->SlotManager.CommandsIssued = 0;
     ChannelExtension->SlotManager.HighPriorityAttribute &= ~ChannelExtension->SlotManager.CommandsToComplete;
@@ -1634,6 +1966,14 @@ Return Values:
         RestorePreservedSettings(ChannelExtension, TRUE);
     }
 
+  //4.2 Start Init Commands again if the one waiting for slot 0 was dropped
+    if (restartInitCommands) {
+        IssueInitCommands(ChannelExtension, NULL);
+        if (ChannelExtension->Local.SrbExtension->AtaFunction != 0) {
+            AhciProcessIo(ChannelExtension, &ChannelExtension->Local.Srb, TRUE);
+        }
+    }
+
   //2.3 Start the channel
     P_Running_StartAttempt(ChannelExtension, TRUE); //AhciPortReset is under Interrupt spinlock
 
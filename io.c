@@ -51,27 +51,35 @@ Return Value:
     UCHAR emptyCount;
     UCHAR requestCount;
     UCHAR lastActiveSlot;
+    UCHAR queueDepth;
     ULONG slotToActivate = 0;
     UCHAR i;
 
   //1 Device's queue depth is smaller than Controller's
 
-    NT_ASSERT(ChannelExtension->DeviceExtension[0].DeviceParameters.MaxDeviceQueueDepth <= ChannelExtension->AdapterExtension->CAP.NCS);
+    NT_ASSERT(ChannelExtension->DeviceExtension[0].DeviceParameters.MaxDeviceQueueDepth <= (ChannelExtension->AdapterExtension->CAP.NCS + 1));
+
+    queueDepth = GetEffectiveQueueDepth(ChannelExtension);
 
     //count the number of slots already in use
     if (ChannelExtension->SlotManager.CommandsIssued > 0) {
         activeCount = NumberOfSetBits(ChannelExtension->SlotManager.CommandsIssued);
     }
     //1.1 Check if all slots are active.
-    if (activeCount >= ChannelExtension->DeviceExtension[0].DeviceParameters.MaxDeviceQueueDepth) {
+    if (activeCount >= queueDepth) {
         //if all possible slots are full, no matter what, return no work (0)
+        ChannelExtension->AdaptiveQueueDepth.Limited = TRUE;
         return 0;
     }
 
   //2 Look for any entry from last active slot
     requestCount = NumberOfSetBits(TargetSlots);
     lastActiveSlot = ChannelExtension->LastActiveSlot;
-    emptyCount = ChannelExtension->DeviceExtension[0].DeviceParameters.MaxDeviceQueueDepth - activeCount;
+    emptyCount = queueDepth - activeCount;
+
+    if (requestCount > emptyCount) {
+        ChannelExtension->AdaptiveQueueDepth.Limited = TRUE;
+    }
 
   //3.1 Look for any entry from last active slot
     for (i = lastActiveSlot; i <= ChannelExtension->AdapterExtension->CAP.NCS; i++) {
@@ -87,8 +95,8 @@ Return Value:
     }
 
   //3.2 Look for any entry from beginning to last active slot
-  //Slot 0 is reserved for internal command
-    for (i = 1 ; i <= lastActiveSlot; i++) {
+  //Slot 0 is reserved for internal command, but it may be lent to other IO
+    for (i = 0 ; i <= lastActiveSlot; i++) {
         if ((TargetSlots & (1 << i)) > 0) {
             slotToActivate |= (1 << i);
             emptyCount--;
@@ -283,6 +291,139 @@ RemoveQueue (
     return (PSCSI_REQUEST_BLOCK_EX)nextSrb;
 }
 
+PSCSI_REQUEST_BLOCK_EX
+RemoveAllQueue (
+    __in PAHCI_CHANNEL_EXTENSION ChannelExtension,
+    __inout PSTORAHCI_QUEUE Queue,
+    __in ULONG Signature,
+    __in UCHAR Tag
+    )
+/*
+    Detaches all SRBs from the queue at once. They stay linked through NextSrb in queue order,
+    the caller takes them off the list and clears NextSrb of each.
+*/
+{
+    PSCSI_REQUEST_BLOCK_EX headSrb;
+
+    UNREFERENCED_PARAMETER(ChannelExtension);
+
+    headSrb = (PSCSI_REQUEST_BLOCK_EX)Queue->Head;
+
+    if (headSrb == NULL) {
+        return NULL;
+    }
+
+    Queue->Head = NULL;
+    Queue->Tail = NULL;
+    Queue->CurrentDepth = 0;
+
+    Queue->DepthHistory[Queue->DepthHistoryIndex] = ( (Tag << 24) | Queue->CurrentDepth );
+    Queue->DepthHistoryIndex++;
+    Queue->DepthHistoryIndex %= 100;
+    Queue->DepthHistory[Queue->DepthHistoryIndex] = Signature;
+
+    return headSrb;
+}
+
+
+BOOLEAN
+NonQueuedCommandsDeferred(
+    __in PAHCI_CHANNEL_EXTENSION ChannelExtension,
+    __in ULONG                   Sact
+    )
+/*++
+    Decides if pending non-queued commands should wait, so that NCQ commands keep being issued.
+
+    Non-queued commands wait for the batch window while NCQ commands are pending, others arriving meanwhile join them.
+    When the window expires the drain starts: NCQ commands are held back until the batch is issued or
+    BatchLimit non-queued commands have been issued, then NCQ commands are resumed and a new window opens.
+
+It assumes:
+    Called with InterruptLock held
+
+Called by:
+    ActivateQueue
+
+Return Value:
+    TRUE if non-queued commands should not be issued now.
+--*/
+{
+    PAHCI_NONQUEUED_SCHEDULER   scheduler = &ChannelExtension->NonQueuedScheduler;
+    PAHCI_NONQUEUED_STATISTICS  statistics = &ChannelExtension->NonQueuedStatistics;
+    LARGE_INTEGER               perfCounter = {0};
+    LARGE_INTEGER               perfFrequency = {0};
+    ULONGLONG                   elapsed;
+
+  //1 No non-queued command pending, close the batch.
+    if ( (ChannelExtension->SlotManager.SingleIoSlice == 0) &&
+         (ChannelExtension->SlotManager.NormalQueueSlice == 0) ) {
+        scheduler->DrainInProcess = FALSE;
+        scheduler->WindowStartTime = 0;
+        return FALSE;
+    }
+
+  //2 Drain in process, keep issuing non-queued commands until NCQ commands have waited long enough.
+    if (scheduler->DrainInProcess) {
+        if ( (scheduler->BatchIssued < scheduler->BatchLimit) ||
+             (ChannelExtension->SlotManager.NCQueueSlice == 0) ) {
+            return FALSE;
+        }
+
+        scheduler->DrainInProcess = FALSE;
+        scheduler->WindowStartTime = 0;
+        AhciUlongIncrement(&statistics->BatchLimitReached);
+    }
+
+    StorPortQueryPerformanceCounter((PVOID)ChannelExtension->AdapterExtension, &perfFrequency, &perfCounter);
+
+  //3 Batching is not configured or there is no NCQ command to keep going with: drain now.
+  //  Without performance counter the window can't be measured, don't batch either.
+    if ( (scheduler->BatchWindow == 0) ||
+         (ChannelExtension->SlotManager.NCQueueSlice == 0) ||
+         (perfFrequency.QuadPart == 0) ) {
+        goto StartDrain;
+    }
+
+  //4 Open the window for the first non-queued command, wait until it expires.
+    if (scheduler->WindowStartTime == 0) {
+        scheduler->WindowStartTime = (ULONGLONG)perfCounter.QuadPart;
+        AhciUlongIncrement(&statistics->DeferredCount);
+        return TRUE;
+    }
+
+    elapsed = (ULONGLONG)perfCounter.QuadPart - scheduler->WindowStartTime;
+    if (((elapsed * 1000000) / (ULONGLONG)perfFrequency.QuadPart) < scheduler->BatchWindow) {
+        return TRUE;
+    }
+
+StartDrain:
+  //5 Start the drain, count it if NCQ commands are outstanding.
+    scheduler->DrainInProcess = TRUE;
+    scheduler->BatchIssued = 0;
+    scheduler->WindowStartTime = 0;
+
+    if (Sact != 0) {
+        AhciUlongIncrement(&statistics->DrainCount);
+
+        if (perfFrequency.QuadPart != 0) {
+            if ( (scheduler->RateStartTime == 0) ||
+                 (((ULONGLONG)perfCounter.QuadPart - scheduler->RateStartTime) >= (ULONGLONG)perfFrequency.QuadPart) ) {
+                // a new one second interval, report the previous one if it was the last second.
+                if ( (scheduler->RateStartTime != 0) &&
+                     (((ULONGLONG)perfCounter.QuadPart - scheduler->RateStartTime) < (2 * (ULONGLONG)perfFrequency.QuadPart)) ) {
+                    statistics->DrainsPerSecond = scheduler->RateDrainCount;
+                } else {
+                    statistics->DrainsPerSecond = 0;
+                }
+                scheduler->RateStartTime = (ULONGLONG)perfCounter.QuadPart;
+                scheduler->RateDrainCount = 0;
+            }
+            scheduler->RateDrainCount++;
+        }
+    }
+
+    return FALSE;
+}
 
 BOOLEAN
 ActivateQueue(
@@ -304,12 +445,19 @@ It performs:
     1.2 If the programming should not happen now, leave, ActivateQueue will be called again when these conditions are changed
     2.1 Choose the Queue with which to program the controller
         Algorithm:
+            2.1.0.1 Checked builds compare the shadow state with hardware
+            2.1.0.2 Single and Normal IO may be deferred to be batched in one drain of NCQ commands, see NonQueuedCommandsDeferred()
+            2.1.0.3 While the NCQ Command Error log is read, nothing but the log read is programmed, see AhciNcqErrorRecovery()
             2.1.1 Single IO SRBs (including Request Sense and non data control commands) have highest priority.
             2.1.2 When there are no Single IO commands, Normal IO get the next highest priority
             2.1.3 When there are no Single or Normal commands, NCQ commands get the next highest priority
             2.1.4 In the case that no IO is present in any Slices, program nothing
     2.2 Program all the IO from the chosen queue into the controller
 
+    PxCMD.ST, PxSACT and PxCI are not read: ShadowStarted, ShadowNcqIssued and SlotManager.CommandsIssued tell
+    what the driver programmed. They may still count commands the hardware has finished but the ISR hasn't processed,
+    which only delays programming until the completion calls ActivateQueue again. Checked builds compare them with hardware.
+
 Affected Variables/Registers:
     channelExtension
     CI
@@ -317,11 +465,11 @@ Affected Variables/Registers:
 Return Values:
 --*/
 {
-    AHCI_COMMAND    cmd;
     ULONG           sact;
     ULONG           ci;
     ULONG           slotsToActivate;
     BOOLEAN         activateNcq;
+    BOOLEAN         deferNonQueued;
     int             i;
 
     PAHCI_ADAPTER_EXTENSION adapterExtension = ChannelExtension->AdapterExtension;
@@ -336,166 +484,882 @@ Return Values:
     slotsToActivate = 0;
     activateNcq = FALSE;
 
-  //1.1.1 If there is no command to program, leave
-    if ( (ChannelExtension->SlotManager.SingleIoSlice == 0) &&
-         (ChannelExtension->SlotManager.NormalQueueSlice == 0) &&
-         (ChannelExtension->SlotManager.NCQueueSlice == 0) ) {
-        //
-        if (LogExecuteFullDetail(adapterExtension->LogFlags)) {
-            RecordExecutionHistory(ChannelExtension, 0x10040022);//ActivateQueue, No Commands to program
-        }
-        return FALSE;
-    }
+  //1.1.1 If there is no command to program, leave
+    if ( (ChannelExtension->SlotManager.SingleIoSlice == 0) &&
+         (ChannelExtension->SlotManager.NormalQueueSlice == 0) &&
+         (ChannelExtension->SlotManager.NCQueueSlice == 0) ) {
+        //
+        if (LogExecuteFullDetail(adapterExtension->LogFlags)) {
+            RecordExecutionHistory(ChannelExtension, 0x10040022);//ActivateQueue, No Commands to program
+        }
+        return FALSE;
+    }
+
+  //1.2 If the programming should not happen now, leave
+    if ( !IsPortStartCapable(ChannelExtension) ) {
+        RecordExecutionHistory(ChannelExtension, 0x10030022);//ActivateQueue, Channel Not Start Capable
+        return FALSE;
+    }
+
+    if ( ErrorRecoveryIsPending(ChannelExtension) ) {
+        RecordExecutionHistory(ChannelExtension, 0x10070022);//ActivateQueue, Error Recovery is pending.
+        return FALSE;
+    }
+
+    if (ChannelExtension->StateFlags.QueuePaused == TRUE) {
+        RecordExecutionHistory(ChannelExtension, 0x10020022);//ActivateQueue, Channel Queue Paused
+        return FALSE;
+    }
+
+    if (!ChannelExtension->ShadowStarted) {
+        RecordExecutionHistory(ChannelExtension, 0x10010022);//ActivateQueue, Channel Not Yet Started
+        return FALSE;
+    }
+
+  //2.1 Choose the Queue with which to program the controller
+    ci = ChannelExtension->SlotManager.CommandsIssued;
+    sact = ci & ChannelExtension->ShadowNcqIssued;
+
+#if DBG
+  //2.1.0.1 Shadow state must cover what hardware reports
+    {
+        AHCI_COMMAND    cmd;
+        ULONG           hwSact;
+        ULONG           hwCi;
+
+        cmd.AsUlong = StorPortReadRegisterUlong(adapterExtension, &ChannelExtension->Px->CMD.AsUlong);
+        hwSact = StorPortReadRegisterUlong(adapterExtension, &ChannelExtension->Px->SACT);
+        hwCi = StorPortReadRegisterUlong(adapterExtension, &ChannelExtension->Px->CI);
+
+        if ( (cmd.ST == 0) || ((hwSact & ~sact) != 0) || ((hwCi & ~ci) != 0) ) {
+            RecordInterruptHistory(ChannelExtension, hwCi, hwSact, cmd.AsUlong, ci, sact, 0x10080022); //ActivateQueue, shadow state mismatch
+            NT_ASSERT(FALSE);
+        }
+    }
+#endif
+
+  //2.1.0.2 Non-queued commands need outstanding NCQ commands drained, they may wait to be batched in one drain.
+    deferNonQueued = NonQueuedCommandsDeferred(ChannelExtension, sact);
+
+  //2.1.0.3 The NCQ Command Error log read goes alone, the aborted NCQ commands wait for it in NCQueueSlice.
+    if (ChannelExtension->StateFlags.NcqErrorLogPending == 1) {
+        slotsToActivate = (1 << ChannelExtension->NcqAutosense.LogReadSlot) &
+                          (ChannelExtension->SlotManager.SingleIoSlice | ChannelExtension->SlotManager.NormalQueueSlice);
+
+        if ( (ci == 0) && (slotsToActivate != 0) ) {
+            ChannelExtension->SlotManager.SingleIoSlice &= ~slotsToActivate;
+            ChannelExtension->SlotManager.NormalQueueSlice &= ~slotsToActivate;
+            ChannelExtension->StateFlags.QueuePaused = TRUE;
+        } else {
+            slotsToActivate = 0;
+        }
+  //2.1.2 Single IO SRBs have highest priority.
+    } else if ( (ChannelExtension->SlotManager.SingleIoSlice != 0) && !deferNonQueued ) {
+        if ( ( sact == 0 ) && ( ci == 0 ) ) {
+            //Safely get Single IO in round robin fashion
+            i = GetSingleIo(ChannelExtension);
+            if (i != 0xff) {
+                slotsToActivate = (1 << i);
+                ChannelExtension->SlotManager.SingleIoSlice &= ~slotsToActivate;
+                ChannelExtension->StateFlags.QueuePaused = TRUE;            //and pause the queue so no other IO get programmed
+                ChannelExtension->NonQueuedScheduler.BatchIssued++;
+                InterlockedExchangeAdd((LONG volatile *)&ChannelExtension->NonQueuedStatistics.BatchedCommandCount, (LONG)NumberOfSetBits(slotsToActivate));
+            }
+        }
+  //2.1.2 When there are no Single IO commands, Normal IO get the next highest priority
+    } else if ( (ChannelExtension->SlotManager.NormalQueueSlice != 0) && !deferNonQueued ) {
+        // Normal commands can not be sent when NCQ commands are outstanding.  When the NCQ commands complete ActivateQueue will get called again.
+        if (sact == 0) {
+            //Grab the High Priority Normal IO before the Low Priority Normal IO
+            slotsToActivate = ChannelExtension->SlotManager.HighPriorityAttribute & ChannelExtension->SlotManager.NormalQueueSlice;
+            //If there aren't any High Priority, grab everything else
+            if (slotsToActivate > 0) {
+                ChannelExtension->SlotManager.NormalQueueSlice &= ~slotsToActivate;
+            } else {
+                slotsToActivate = ChannelExtension->SlotManager.NormalQueueSlice;
+                ChannelExtension->SlotManager.NormalQueueSlice = 0;
+            }
+            ChannelExtension->NonQueuedScheduler.BatchIssued += NumberOfSetBits(slotsToActivate);
+            InterlockedExchangeAdd((LONG volatile *)&ChannelExtension->NonQueuedStatistics.BatchedCommandCount, (LONG)NumberOfSetBits(slotsToActivate));
+        }
+  //2.1.3 When there are no Single or Normal commands, NCQ commands get the next highest priority
+    } else if (ChannelExtension->SlotManager.NCQueueSlice != 0) {
+        // NCQ commands can not be sent when Normal commands are outstanding.  When the Normal commands complete, Activate Queue will get called again.
+        if ( ( ci != 0 ) && (sact == 0) ) {
+            slotsToActivate = 0;
+        } else {
+            //Grab the High Priority NCQ IO before the Low Priority NCQ IO
+            slotsToActivate = ChannelExtension->SlotManager.HighPriorityAttribute & ChannelExtension->SlotManager.NCQueueSlice;
+            //If there aren't any High Priority, grab everything else
+            if (slotsToActivate == 0) {
+                slotsToActivate = ChannelExtension->SlotManager.NCQueueSlice;
+            }
+            //and apply any device outstanding IO limits to filter down which IO to activate
+            if (slotsToActivate > 0) {
+                if (GetEffectiveQueueDepth(ChannelExtension) < ChannelExtension->MaxPortQueueDepth ) {
+                    // get allowed slots if the device queue depth is less than the port can support.
+                    slotsToActivate = GetSlotToActivate(ChannelExtension, slotsToActivate);
+                }
+                if (slotsToActivate > 0) {
+                    //and if there are any IO still selected, clear them from the NCQueue
+                    activateNcq = TRUE;     //Remember to program SACT for these commands
+                    ChannelExtension->SlotManager.NCQueueSlice &= ~slotsToActivate;
+                    //the selected IO will be activated at the end of this function
+                }
+            }
+        }
+  //2.1.4 In the case that no IO is present in any Slices, program nothing
+    }
+
+  //2.1 Program all the IO from the chosen queue into the controller
+    if (slotsToActivate != 0) {
+        //2.2 Get command start time, also used to measure latency for adaptive queue depth
+        if( adapterExtension->TracingEnabled ||
+            (activateNcq && ChannelExtension->AdaptiveQueueDepth.Enabled) ) {
+            LARGE_INTEGER perfCounter = {0};
+            ULONG pendingProgrammingCommands = slotsToActivate;
+
+            i = 0;
+
+            StorPortQueryPerformanceCounter((PVOID)adapterExtension, NULL, &perfCounter);
+
+            while (pendingProgrammingCommands) {
+                if (pendingProgrammingCommands & 1) {
+                    PAHCI_SRB_EXTENSION srbExtension = GetSrbExtension(ChannelExtension->Slot[i].Srb);
+                    srbExtension->StartTime = perfCounter.QuadPart;
+                }
+
+                i++;
+                pendingProgrammingCommands >>= 1;
+            }
+        }
+
+        //2.3 Port leaves idle, account the idle period to the link state
+        if ( (ChannelExtension->SlotManager.CommandsIssued == 0) &&
+             IsLinkIdleAccountingEnabled(ChannelExtension) ) {
+            AhciLpmAdaptiveIdleEnd(ChannelExtension);
+        }
+
+        ChannelExtension->SlotManager.CommandsIssued |= slotsToActivate;
+        if (activateNcq) {
+            ChannelExtension->ShadowNcqIssued |= slotsToActivate;
+        } else {
+            ChannelExtension->ShadowNcqIssued &= ~slotsToActivate;
+        }
+
+        // program registers
+        if (activateNcq) {
+            StorPortWriteRegisterUlong(adapterExtension, &ChannelExtension->Px->SACT, slotsToActivate);
+        }
+        StorPortWriteRegisterUlong(adapterExtension, &ChannelExtension->Px->CI, slotsToActivate);
+
+        //2.4 A single command issued to an idle port may be polled for completion
+        if ( (ChannelExtension->PollingStatistics.BudgetLimit != 0) &&
+             (ChannelExtension->SlotManager.CommandsIssued == slotsToActivate) &&
+             (NumberOfSetBits(slotsToActivate) == 1) ) {
+            AhciPollingCommandIssued(ChannelExtension, slotsToActivate);
+        }
+    }
+
+    if (LogExecuteFullDetail(adapterExtension->LogFlags)) {
+        RecordInterruptHistory(ChannelExtension, slotsToActivate, 0, 0, ci, sact, 0x10060022); //ActivateQueue, after getting IO slices,
+        RecordExecutionHistory(ChannelExtension, 0x10050022);//Exit ActivateQueue
+    }
+
+    return TRUE;
+}
+
+__inline
+ULONGLONG
+CalculateTimeDurationIn100ns (
+    __in ULONGLONG TimeDuration,
+    __in ULONGLONG CounterFrequency
+    )
+{
+    ULONGLONG timeIn100ns = 0;
+
+    // as the counter can hold more than 20,000 years for the same power cylce,
+    // the situation about the counter start over again is considered an error case of inputs.
+    if (CounterFrequency > 0) {
+        // difference between performance counters, needs to convert to 100ns.
+        ULONGLONG countersDiff = TimeDuration;
+
+        // get seconds
+        timeIn100ns = countersDiff / CounterFrequency;
+
+        // get milliseconds
+        countersDiff = (countersDiff % CounterFrequency) * 1000;
+        timeIn100ns *= 1000;
+        timeIn100ns += countersDiff / CounterFrequency;
+
+        // get 100 nanoseconds
+        countersDiff = (countersDiff % CounterFrequency) * 10000;
+        timeIn100ns *= 10000;
+        timeIn100ns += countersDiff / CounterFrequency;
+    }
+
+    return timeIn100ns;
+}
+
+VOID
+AhciAdaptiveQueueDepthSample (
+    __in PAHCI_CHANNEL_EXTENSION ChannelExtension,
+    __in ULONGLONG Latency,
+    __in ULONGLONG PerfCounter,
+    __in ULONGLONG PerfFrequency
+    )
+/*++
+    Accounts the completion latency (in 100ns) of an NCQ command. At the end of each window, moves the queue depth
+    towards the knee of the device's throughput/latency curve, see AHCI_ADAPTIVE_QUEUE_DEPTH.
+
+It assumes:
+    Called with InterruptLock held
+
+Called by:
+    AhciCompleteIssuedSRBs
+--*/
+{
+    PAHCI_ADAPTIVE_QUEUE_DEPTH  adaptive = &ChannelExtension->AdaptiveQueueDepth;
+    PAHCI_ADAPTIVE_QD_STATISTICS statistics = &ChannelExtension->AdaptiveQueueDepthStatistics;
+    ULONGLONG                   averageLatency;
+    ULONGLONG                   windowTime;
+    ULONGLONG                   throughput = 0;
+    UCHAR                       step;
+
+    if (adaptive->WindowStartTime == 0) {
+        adaptive->WindowStartTime = PerfCounter;
+    }
+
+    adaptive->WindowCount++;
+    adaptive->WindowLatency += Latency;
+
+    if (adaptive->WindowCount < AHCI_ADAPTIVE_QD_WINDOW) {
+        return;
+    }
+
+  //1 Average latency and throughput of the window
+    averageLatency = adaptive->WindowLatency / adaptive->WindowCount;
+    windowTime = CalculateTimeDurationIn100ns((PerfCounter - adaptive->WindowStartTime), PerfFrequency);
+    if (windowTime != 0) {
+        throughput = ((ULONGLONG)adaptive->WindowCount * 10000000) / windowTime;
+    }
+
+  //2 The lowest average is the base latency, let it age so it follows the workload.
+    if ( (adaptive->BaseLatency == 0) || (averageLatency < adaptive->BaseLatency) ) {
+        adaptive->BaseLatency = averageLatency;
+        adaptive->BaseAge = 0;
+    } else if (++adaptive->BaseAge >= AHCI_ADAPTIVE_QD_BASE_AGE) {
+        adaptive->BaseLatency += adaptive->BaseLatency / 8;
+        adaptive->BaseAge = 0;
+    }
+
+  //3 Latency grew without more throughput: back off. Commands waited for the depth: probe one deeper.
+    if ( (averageLatency > (adaptive->BaseLatency * AHCI_ADAPTIVE_QD_LATENCY_FACTOR)) &&
+         (throughput <= (adaptive->LastThroughput + (adaptive->LastThroughput / 16))) ) {
+        if (adaptive->QueueDepth > adaptive->Floor) {
+            step = (UCHAR)max(adaptive->QueueDepth / 4, 1);
+            adaptive->QueueDepth = (UCHAR)max(adaptive->QueueDepth - step, adaptive->Floor);
+            AhciUlongIncrement(&statistics->DecreaseCount);
+        }
+    } else if ( adaptive->Limited &&
+                (adaptive->QueueDepth < adaptive->Ceiling) &&
+                (adaptive->QueueDepth < ChannelExtension->DeviceExtension[0].DeviceParameters.MaxDeviceQueueDepth) ) {
+        adaptive->QueueDepth++;
+        AhciUlongIncrement(&statistics->IncreaseCount);
+    }
+
+    statistics->BaseLatency = (ULONG)min(adaptive->BaseLatency / 10, MAXULONG);
+    statistics->WindowLatency = (ULONG)min(averageLatency / 10, MAXULONG);
+    statistics->WindowThroughput = (ULONG)min(throughput, MAXULONG);
+
+  //4 Start the next window
+    adaptive->LastThroughput = throughput;
+    adaptive->WindowCount = 0;
+    adaptive->WindowLatency = 0;
+    adaptive->WindowStartTime = PerfCounter;
+    adaptive->Limited = FALSE;
+
+    return;
+}
+
+VOID
+AhciPollingCommandIssued (
+    __in PAHCI_CHANNEL_EXTENSION ChannelExtension,
+    __in ULONG SlotMask
+    )
+/*++
+    Tracks a single command issued to an idle port. It's polled from PollDpc, except every AHCI_POLL_SAMPLE_INTERVAL-th
+    command which is left to the interrupt to measure the latency polling saves.
+
+It assumes:
+    Called with InterruptLock held
+
+Called by:
+    ActivateQueue
+--*/
+{
+    PAHCI_POLLING   polling = &ChannelExtension->Polling;
+    LARGE_INTEGER   perfCounter = {0};
+
+    StorPortQueryPerformanceCounter((PVOID)ChannelExtension->AdapterExtension, NULL, &perfCounter);
+
+    polling->SlotMask = SlotMask;
+    polling->IssueTime = (ULONGLONG)perfCounter.QuadPart;
+    polling->Polled = FALSE;
+    polling->IssueCount++;
+    polling->InterruptSample = ((polling->IssueCount % AHCI_POLL_SAMPLE_INTERVAL) == 0) ? TRUE : FALSE;
+
+    if (!polling->InterruptSample) {
+        StorPortIssueDpc(ChannelExtension->AdapterExtension, &ChannelExtension->PollDpc, ChannelExtension, NULL);
+    }
+
+    return;
+}
+
+VOID
+AhciPollingCommandCompleted (
+    __in PAHCI_CHANNEL_EXTENSION ChannelExtension
+    )
+/*++
+    The tracked single command completed, learns the device latency from it.
+
+It assumes:
+    Called with InterruptLock held
+
+Called by:
+    AhciHwInterrupt
+--*/
+{
+    PAHCI_POLLING               polling = &ChannelExtension->Polling;
+    PAHCI_POLLING_STATISTICS    statistics = &ChannelExtension->PollingStatistics;
+    LARGE_INTEGER               perfCounter = {0};
+    LARGE_INTEGER               perfFrequency = {0};
+    ULONG                       latency;
+
+    StorPortQueryPerformanceCounter((PVOID)ChannelExtension->AdapterExtension, &perfFrequency, &perfCounter);
+    latency = (ULONG)min(CalculateTimeDurationIn100ns(((ULONGLONG)perfCounter.QuadPart - polling->IssueTime), (ULONGLONG)perfFrequency.QuadPart) / 10, MAXULONG);
+
+    // running average over 8 commands.
+    if (statistics->DeviceLatency == 0) {
+        statistics->DeviceLatency = latency;
+    } else {
+        statistics->DeviceLatency = (ULONG)(((ULONGLONG)statistics->DeviceLatency * 7 + latency) / 8);
+    }
+
+    if (polling->Polled) {
+        AhciUlongIncrement(&statistics->PollHitCount);
+        statistics->PolledLatency += latency;
+    } else if (polling->InterruptSample) {
+        AhciUlongIncrement(&statistics->InterruptSampleCount);
+        statistics->InterruptLatency += latency;
+    }
+
+    AhciPollingReset(ChannelExtension);
+
+    return;
+}
+
+VOID
+AhciPollingReset (
+    __in PAHCI_CHANNEL_EXTENSION ChannelExtension
+    )
+/*++
+    Stops tracking the single command without learning from it, e.g. it's completed by error recovery or reset.
+    A command issued later to the same slot starts a new measurement.
+
+It assumes:
+    Called with InterruptLock held
+
+Called by:
+    AhciPollingCommandCompleted
+    AhciCompleteIssuedSRBs
+    AhciPortReset
+--*/
+{
+    PAHCI_POLLING   polling = &ChannelExtension->Polling;
+
+    polling->SlotMask = 0;
+    polling->IssueTime = 0;
+    polling->Polled = FALSE;
+    polling->InterruptSample = FALSE;
+
+    return;
+}
+
+__inline
+VOID
+AhciThrottleInitBucket (
+    __inout PAHCI_TOKEN_BUCKET Bucket,
+    __in ULONGLONG Rate
+    )
+{
+    // Tokens are kept in millionths, so a bucket gains Rate tokens per microsecond. It starts full.
+    Bucket->Rate = Rate;
+    Bucket->Tokens = (LONGLONG)(Rate * AHCI_THROTTLE_BURST_TIME);
+}
+
+__inline
+VOID
+AhciThrottleRefillBucket (
+    __inout PAHCI_TOKEN_BUCKET Bucket,
+    __in ULONGLONG ElapsedTime
+    )
+{
+    LONGLONG capacity = (LONGLONG)(Bucket->Rate * AHCI_THROTTLE_BURST_TIME);
+
+    if (Bucket->Rate != 0) {
+        Bucket->Tokens += (LONGLONG)(Bucket->Rate * ElapsedTime);
+        if (Bucket->Tokens > capacity) {
+            Bucket->Tokens = capacity;
+        }
+    }
+}
+
+__inline
+BOOLEAN
+IsThrottleBucketEmpty (
+    __in PAHCI_TOKEN_BUCKET Bucket
+    )
+{
+    return ((Bucket->Rate != 0) && (Bucket->Tokens <= 0));
+}
+
+__inline
+BOOLEAN
+IsThrottledRequest (
+    __in PSCSI_REQUEST_BLOCK_EX Srb
+    )
+{
+    PAHCI_SRB_EXTENSION srbExtension = GetSrbExtension(Srb);
+
+    return ((srbExtension->AtaFunction == ATA_FUNCTION_ATA_READ) || (srbExtension->AtaFunction == ATA_FUNCTION_ATA_WRITE));
+}
+
+VOID
+AhciThrottleSetLimits (
+    __in PAHCI_CHANNEL_EXTENSION ChannelExtension,
+    __in PAHCI_THROTTLE_LIMITS Limits
+    )
+/*++
+    Applies the rate limits of read/write requests of the port. All buckets start full.
+
+It assumes:
+    Called with InterruptLock held
+
+Called by:
+    AhciPortReadRegistrySettings
+    PortThrottleIoctlProcess
+--*/
+{
+    PAHCI_THROTTLE  throttle = &ChannelExtension->Throttle;
+    LARGE_INTEGER   perfCounter = {0};
+    BOOLEAN         enabled;
+    ULONG           i;
+
+    ChannelExtension->ThrottleStatistics.Limits = *Limits;
+
+    AhciThrottleInitBucket(&throttle->PortIops, Limits->IopsLimit);
+    AhciThrottleInitBucket(&throttle->PortBandwidth, (ULONGLONG)Limits->BandwidthLimit * 1024);
+    enabled = (BOOLEAN)((Limits->IopsLimit != 0) || (Limits->BandwidthLimit != 0));
+
+    for (i = 0; i < AhciSrbQueueClassCount; i++) {
+        AhciThrottleInitBucket(&throttle->ClassIops[i], Limits->ClassIopsLimit[i]);
+        AhciThrottleInitBucket(&throttle->ClassBandwidth[i], (ULONGLONG)Limits->ClassBandwidthLimit[i] * 1024);
+        enabled = (BOOLEAN)(enabled || (Limits->ClassIopsLimit[i] != 0) || (Limits->ClassBandwidthLimit[i] != 0));
+    }
+
+    StorPortQueryPerformanceCounter((PVOID)ChannelExtension->AdapterExtension, NULL, &perfCounter);
+    throttle->LastRefillTime = (ULONGLONG)perfCounter.QuadPart;
+
+    // buckets are full, requests held back by the old limits can go.
+    AhciThrottleEnd(ChannelExtension);
+
+    throttle->Enabled = enabled;
+
+    return;
+}
+
+VOID
+AhciThrottleEnd (
+    __in PAHCI_CHANNEL_EXTENSION ChannelExtension
+    )
+/*++
+    Ends the period of queued requests being held back, accounts its time.
+
+It assumes:
+    Called with InterruptLock held
+--*/
+{
+    PAHCI_THROTTLE  throttle = &ChannelExtension->Throttle;
+    LARGE_INTEGER   perfCounter = {0};
+    LARGE_INTEGER   perfFrequency = {0};
+
+    if (throttle->Throttled) {
+        StorPortQueryPerformanceCounter((PVOID)ChannelExtension->AdapterExtension, &perfFrequency, &perfCounter);
+        ChannelExtension->ThrottleStatistics.ThrottledTime +=
+            CalculateTimeDurationIn100ns(((ULONGLONG)perfCounter.QuadPart - throttle->ThrottleStartTime), (ULONGLONG)perfFrequency.QuadPart) / 10;
+
+        throttle->Throttled = FALSE;
+    }
+
+    return;
+}
+
+VOID
+AhciThrottleRefill (
+    __in PAHCI_CHANNEL_EXTENSION ChannelExtension
+    )
+/*++
+    Adds the tokens earned since the last refill to all buckets of the port.
+
+It assumes:
+    Called with InterruptLock held
+--*/
+{
+    PAHCI_THROTTLE  throttle = &ChannelExtension->Throttle;
+    LARGE_INTEGER   perfCounter = {0};
+    LARGE_INTEGER   perfFrequency = {0};
+    ULONGLONG       elapsedTime;
+    ULONG           i;
+
+    StorPortQueryPerformanceCounter((PVOID)ChannelExtension->AdapterExtension, &perfFrequency, &perfCounter);
+    elapsedTime = CalculateTimeDurationIn100ns(((ULONGLONG)perfCounter.QuadPart - throttle->LastRefillTime), (ULONGLONG)perfFrequency.QuadPart) / 10;
+
+    if (elapsedTime == 0) {
+        return;
+    }
+
+    // advance by whole microseconds only, so frequent refills don't lose the remainders.
+    if (elapsedTime >= AHCI_THROTTLE_BURST_TIME) {
+        elapsedTime = AHCI_THROTTLE_BURST_TIME;
+        throttle->LastRefillTime = (ULONGLONG)perfCounter.QuadPart;
+    } else {
+        throttle->LastRefillTime += (elapsedTime * (ULONGLONG)perfFrequency.QuadPart) / 1000000;
+    }
+
+    AhciThrottleRefillBucket(&throttle->PortIops, elapsedTime);
+    AhciThrottleRefillBucket(&throttle->PortBandwidth, elapsedTime);
+
+    for (i = 0; i < AhciSrbQueueClassCount; i++) {
+        AhciThrottleRefillBucket(&throttle->ClassIops[i], elapsedTime);
+        AhciThrottleRefillBucket(&throttle->ClassBandwidth[i], elapsedTime);
+    }
+
+    return;
+}
+
+BOOLEAN
+AhciThrottleAdmit (
+    __in PAHCI_CHANNEL_EXTENSION ChannelExtension,
+    __in ULONG QueueClass
+    )
+/*++
+    Checks if the Srb at the head of the class queue can be taken.
+    Requests other than read/write are never held back.
+
+It assumes:
+    Called with InterruptLock held, the class queue is not empty
+--*/
+{
+    PAHCI_THROTTLE  throttle = &ChannelExtension->Throttle;
+
+    if (!IsThrottledRequest((PSCSI_REQUEST_BLOCK_EX)ChannelExtension->SrbQueue[QueueClass].Head)) {
+        return TRUE;
+    }
+
+    if ( IsThrottleBucketEmpty(&throttle->PortIops) ||
+         IsThrottleBucketEmpty(&throttle->PortBandwidth) ||
+         IsThrottleBucketEmpty(&throttle->ClassIops[QueueClass]) ||
+         IsThrottleBucketEmpty(&throttle->ClassBandwidth[QueueClass]) ) {
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+VOID
+AhciThrottleCharge (
+    __in PAHCI_CHANNEL_EXTENSION ChannelExtension,
+    __in PSCSI_REQUEST_BLOCK_EX  Srb,
+    __in ULONG QueueClass
+    )
+/*++
+    Takes the tokens of a read/write request from the buckets it is charged to.
+
+It assumes:
+    Called with InterruptLock held
+--*/
+{
+    PAHCI_THROTTLE  throttle = &ChannelExtension->Throttle;
+    LONGLONG        bytes;
+
+    if (!IsThrottledRequest(Srb)) {
+        return;
+    }
+
+    bytes = (LONGLONG)SrbGetDataTransferLength(Srb) * AHCI_THROTTLE_TOKEN_UNIT;
+
+    if (throttle->PortIops.Rate != 0) {
+        throttle->PortIops.Tokens -= AHCI_THROTTLE_TOKEN_UNIT;
+    }
+    if (throttle->PortBandwidth.Rate != 0) {
+        throttle->PortBandwidth.Tokens -= bytes;
+    }
+    if (throttle->ClassIops[QueueClass].Rate != 0) {
+        throttle->ClassIops[QueueClass].Tokens -= AHCI_THROTTLE_TOKEN_UNIT;
+    }
+    if (throttle->ClassBandwidth[QueueClass].Rate != 0) {
+        throttle->ClassBandwidth[QueueClass].Tokens -= bytes;
+    }
+
+    return;
+}
+
+VOID
+AhciThrottleRequestTimer (
+    __in PAHCI_CHANNEL_EXTENSION ChannelExtension
+    )
+/*++
+    Asks for the adapter timer to resume throttled ports. The timer can't be requested at DIRQL, a DPC requests it.
+    One timer serves all ports of the adapter.
+
+It assumes:
+    Called with InterruptLock held
+--*/
+{
+    PAHCI_ADAPTER_EXTENSION adapterExtension = ChannelExtension->AdapterExtension;
+
+    if (InterlockedExchange(&adapterExtension->ThrottleTimerPending, 1) == 0) {
+        StorPortIssueDpc(adapterExtension, &adapterExtension->ThrottleDpc, NULL, NULL);
+    }
+
+    return;
+}
+
+VOID
+AhciThrottleDpcRoutine(
+    __in PSTOR_DPC  Dpc,
+    __in PVOID      AdapterExtension,
+    __in_opt PVOID  SystemArgument1,
+    __in_opt PVOID  SystemArgument2
+  )
+{
+    UNREFERENCED_PARAMETER(Dpc);
+    UNREFERENCED_PARAMETER(SystemArgument1);
+    UNREFERENCED_PARAMETER(SystemArgument2);
+
+    StorPortNotification(RequestTimerCall, AdapterExtension, AhciThrottleTimerCallback, AHCI_THROTTLE_TIMER_INTERVAL);
+
+    return;
+}
+
+VOID
+AhciThrottleTimerCallback(
+    __in PVOID AdapterExtension
+    )
+/*++
+    Adapter timer callback, starts queued requests of throttled ports as their buckets have been refilled.
+    Ports still throttled request the timer again.
+--*/
+{
+    PAHCI_ADAPTER_EXTENSION adapterExtension = (PAHCI_ADAPTER_EXTENSION)AdapterExtension;
+    PAHCI_CHANNEL_EXTENSION channelExtension;
+    STOR_LOCK_HANDLE        lockhandle = {0};
+    UCHAR                   i;
+
+    InterlockedExchange(&adapterExtension->ThrottleTimerPending, 0);
+
+    for (i = 0; i <= adapterExtension->HighestPort; i++) {
+        channelExtension = adapterExtension->PortExtension[i];
+
+        if ( (channelExtension != NULL) && channelExtension->Throttle.Throttled ) {
+            StorPortAcquireSpinLock(AdapterExtension, InterruptLock, NULL, &lockhandle);
+            AhciGetNextIos(channelExtension, TRUE);
+            StorPortReleaseSpinLock(AdapterExtension, &lockhandle);
+        }
+    }
+
+    return;
+}
+
+VOID
+AddSrbQueue (
+    __in PAHCI_CHANNEL_EXTENSION ChannelExtension,
+    __in PSCSI_REQUEST_BLOCK_EX  Srb
+    )
+/*++
+    Queues a Srb from Storport to wait for a slot, in the queue of its class.
+
+It assumes:
+    Called with InterruptLock held
+
+Called by:
+    AhciHwStartIo
+--*/
+{
+    PAHCI_SRB_EXTENSION srbExtension = GetSrbExtension(Srb);
+    ULONG               queueClass = AhciSrbQueueNormal;
+    ULONG               slotMask;
+
+  //1 Classify: read/write mapped to high priority is urgent, read/write with a low priority hint is background.
+    if (IsHighPriorityCommand(srbExtension->Flags)) {
+        queueClass = AhciSrbQueueUrgent;
+    } else if ( (ChannelExtension->IoPriorityClass != AhciIoPriorityClassNone) &&
+                ((srbExtension->AtaFunction == ATA_FUNCTION_ATA_READ) || (srbExtension->AtaFunction == ATA_FUNCTION_ATA_WRITE)) &&
+                (SrbGetRequestPriority(Srb) <= IoPriorityLow) ) {
+        queueClass = AhciSrbQueueBackground;
+    }
+
+  //2 Wait time is only measured for SRBs that can't get a slot right away, so the common path doesn't read the counter.
+    slotMask = (ULONG)(((ULONGLONG)2 << ChannelExtension->AdapterExtension->CAP.NCS) - 2);    //slot 1 ~ NCS
+
+    if ( (ChannelExtension->SrbQueueScheduler.QueuedCount != 0) ||
+         ((GetOccupiedSlots(ChannelExtension) & slotMask) == slotMask) ) {
+        LARGE_INTEGER perfCounter = {0};
+
+        StorPortQueryPerformanceCounter((PVOID)ChannelExtension->AdapterExtension, NULL, &perfCounter);
+        srbExtension->QueuedTime = (ULONGLONG)perfCounter.QuadPart;
+    } else {
+        srbExtension->QueuedTime = 0;
+    }
+
+    AddQueue(ChannelExtension, &ChannelExtension->SrbQueue[queueClass], Srb, 0xDEADBEEF, 0x11);
+    ChannelExtension->SrbQueueScheduler.QueuedCount++;
+
+    return;
+}
+
+PSCSI_REQUEST_BLOCK_EX
+RemoveSrbQueue (
+    __in PAHCI_CHANNEL_EXTENSION ChannelExtension,
+    __in BOOLEAN ApplyThrottle
+    )
+/*++
+    Dequeues the next Srb waiting for a slot.
+
+    Classes are served in weighted round robin: each round starts from the urgent class and every class dequeues
+    up to its Weight SRBs. A new round starts when no class with credit left has SRBs queued, so a burst in one class
+    delays the others by at most its weight per round.
+
+    With ApplyThrottle, a class whose head Srb is held back by the port throttle is passed over as if it was empty.
+    If nothing can be taken, the port is marked throttled and the adapter timer resumes it. The throttled period ends
+    when no queued Srb is held back any more, not when another class dequeues an Srb.
+
+It assumes:
+    Called with InterruptLock held
+
+Return Value:
+    Srb dequeued, NULL if all queues are empty or all queued SRBs are held back.
+--*/
+{
+    PAHCI_SRB_QUEUE_SCHEDULER   scheduler = &ChannelExtension->SrbQueueScheduler;
+    PAHCI_SRB_QUEUE_STATISTICS  statistics;
+    PAHCI_SRB_EXTENSION         srbExtension;
+    PSCSI_REQUEST_BLOCK_EX      srb = NULL;
+    ULONG                       queueClass = AhciSrbQueueNormal;
+    ULONG                       round;
+    ULONG                       i;
+    BOOLEAN                     throttled = FALSE;
 
-  //1.2 If the programming should not happen now, leave
-    if ( !IsPortStartCapable(ChannelExtension) ) {
-        RecordExecutionHistory(ChannelExtension, 0x10030022);//ActivateQueue, Channel Not Start Capable
-        return FALSE;
+    if (scheduler->QueuedCount == 0) {
+        AhciThrottleEnd(ChannelExtension);
+        return NULL;
     }
 
-    if ( ErrorRecoveryIsPending(ChannelExtension) ) {
-        RecordExecutionHistory(ChannelExtension, 0x10070022);//ActivateQueue, Error Recovery is pending.
-        return FALSE;
+    ApplyThrottle = ApplyThrottle && ChannelExtension->Throttle.Enabled;
+    if (ApplyThrottle) {
+        AhciThrottleRefill(ChannelExtension);
     }
 
-    if (ChannelExtension->StateFlags.QueuePaused == TRUE) {
-        RecordExecutionHistory(ChannelExtension, 0x10020022);//ActivateQueue, Channel Queue Paused
-        return FALSE;
-    }
+  //1 Serve the current class while it has credit, then the following ones. Refill credit for a new round if nothing was found.
+    for (round = 0; (round < 2) && (srb == NULL); round++) {
+        for (i = 0; i < AhciSrbQueueClassCount; i++) {
+            queueClass = scheduler->CurrentClass;
 
-    cmd.AsUlong = StorPortReadRegisterUlong(adapterExtension, &ChannelExtension->Px->CMD.AsUlong);
-    if (cmd.ST == 0) {
-        RecordExecutionHistory(ChannelExtension, 0x10010022);//ActivateQueue, Channel Not Yet Started
-        return FALSE;
-    }
+            if ( (scheduler->Credit[queueClass] > 0) &&
+                 (ChannelExtension->SrbQueue[queueClass].Head != NULL) ) {
 
-  //2.1 Choose the Queue with which to program the controller
-    sact = StorPortReadRegisterUlong(adapterExtension, &ChannelExtension->Px->SACT);
-    ci = StorPortReadRegisterUlong(adapterExtension, &ChannelExtension->Px->CI);
-  //2.1.2 Single IO SRBs have highest priority.
-    if(ChannelExtension->SlotManager.SingleIoSlice != 0) {
-        if ( ( sact == 0 ) && ( ci == 0 ) ) {
-            //Safely get Single IO in round robin fashion
-            i = GetSingleIo(ChannelExtension);
-            if (i != 0xff) {
-                slotsToActivate = (1 << i);
-                ChannelExtension->SlotManager.SingleIoSlice &= ~slotsToActivate;
-                ChannelExtension->StateFlags.QueuePaused = TRUE;            //and pause the queue so no other IO get programmed
-            }
-        }
-  //2.1.2 When there are no Single IO commands, Normal IO get the next highest priority
-    } else if (ChannelExtension->SlotManager.NormalQueueSlice != 0) {
-        // Normal commands can not be sent when NCQ commands are outstanding.  When the NCQ commands complete ActivateQueue will get called again.
-        if (sact == 0) {
-            //Grab the High Priority Normal IO before the Low Priority Normal IO
-            slotsToActivate = ChannelExtension->SlotManager.HighPriorityAttribute & ChannelExtension->SlotManager.NormalQueueSlice;
-            //If there aren't any High Priority, grab everything else
-            if (slotsToActivate > 0) {
-                ChannelExtension->SlotManager.NormalQueueSlice &= ~slotsToActivate;
-            } else {
-                slotsToActivate = ChannelExtension->SlotManager.NormalQueueSlice;
-                ChannelExtension->SlotManager.NormalQueueSlice = 0;
+                if (ApplyThrottle && !AhciThrottleAdmit(ChannelExtension, queueClass)) {
+                    throttled = TRUE;
+                    scheduler->CurrentClass = (queueClass + 1) % AhciSrbQueueClassCount;
+                    continue;
+                }
+
+                scheduler->Credit[queueClass]--;
+                srb = RemoveQueue(ChannelExtension, &ChannelExtension->SrbQueue[queueClass], 0xDEADC0DE, 0x1F);
+                break;
             }
+
+            scheduler->CurrentClass = (queueClass + 1) % AhciSrbQueueClassCount;
         }
-  //2.1.3 When there are no Single or Normal commands, NCQ commands get the next highest priority
-    } else if (ChannelExtension->SlotManager.NCQueueSlice != 0) {
-        // NCQ commands can not be sent when Normal commands are outstanding.  When the Normal commands complete, Activate Queue will get called again.
-        if ( ( ci != 0 ) && (sact == 0) ) {
-            slotsToActivate = 0;
-        } else {
-            //Grab the High Priority NCQ IO before the Low Priority NCQ IO
-            slotsToActivate = ChannelExtension->SlotManager.HighPriorityAttribute & ChannelExtension->SlotManager.NCQueueSlice;
-            //If there aren't any High Priority, grab everything else
-            if (slotsToActivate == 0) {
-                slotsToActivate = ChannelExtension->SlotManager.NCQueueSlice;
-            }
-            //and apply any device outstanding IO limits to filter down which IO to activate
-            if (slotsToActivate > 0) {
-                if (ChannelExtension->DeviceExtension[0].DeviceParameters.MaxDeviceQueueDepth < ChannelExtension->MaxPortQueueDepth ) {
-                    // get allowed slots if the device queue depth is less than the port can support.
-                    slotsToActivate = GetSlotToActivate(ChannelExtension, slotsToActivate);
-                }
-                if (slotsToActivate > 0) {
-                    //and if there are any IO still selected, clear them from the NCQueue
-                    activateNcq = TRUE;     //Remember to program SACT for these commands
-                    ChannelExtension->SlotManager.NCQueueSlice &= ~slotsToActivate;
-                    //the selected IO will be activated at the end of this function
-                }
+
+        if (srb == NULL) {
+            for (i = 0; i < AhciSrbQueueClassCount; i++) {
+                scheduler->Credit[i] = scheduler->Weight[i];
             }
+            scheduler->CurrentClass = AhciSrbQueueUrgent;
         }
-  //2.1.4 In the case that no IO is present in any Slices, program nothing
     }
 
-  //2.1 Program all the IO from the chosen queue into the controller
-    if (slotsToActivate != 0) {
-        //2.2 Get command start time
-        if(adapterExtension->TracingEnabled) {
-            LARGE_INTEGER perfCounter = {0};
-            ULONG pendingProgrammingCommands = slotsToActivate;
+    if (srb == NULL) {
+        if (throttled) {
+          //1.1 All queued SRBs are held back, wait for the buckets to be refilled.
+            if (!ChannelExtension->Throttle.Throttled) {
+                LARGE_INTEGER perfCounter = {0};
 
-            i = 0;
+                StorPortQueryPerformanceCounter((PVOID)ChannelExtension->AdapterExtension, NULL, &perfCounter);
+                ChannelExtension->Throttle.ThrottleStartTime = (ULONGLONG)perfCounter.QuadPart;
+                ChannelExtension->Throttle.Throttled = TRUE;
+                AhciUlongIncrement(&ChannelExtension->ThrottleStatistics.ThrottleCount);
+            }
+            AhciThrottleRequestTimer(ChannelExtension);
+        } else {
+            // weights are never 0, a queued Srb is always found.
+            NT_ASSERT(FALSE);
+        }
+        return NULL;
+    }
 
-            StorPortQueryPerformanceCounter((PVOID)adapterExtension, NULL, &perfCounter);
+    scheduler->QueuedCount--;
 
-            while (pendingProgrammingCommands) {
-                if (pendingProgrammingCommands & 1) {
-                    PAHCI_SRB_EXTENSION srbExtension = GetSrbExtension(ChannelExtension->Slot[i].Srb);
-                    srbExtension->StartTime = perfCounter.QuadPart;
-                }
+    if (ApplyThrottle) {
+        AhciThrottleCharge(ChannelExtension, srb, queueClass);
 
-                i++;
-                pendingProgrammingCommands >>= 1;
+        for (i = 0; i < AhciSrbQueueClassCount; i++) {
+            if ( (ChannelExtension->SrbQueue[i].Head != NULL) && !AhciThrottleAdmit(ChannelExtension, i) ) {
+                break;
             }
         }
 
-        ChannelExtension->SlotManager.CommandsIssued |= slotsToActivate;
-
-        // program registers
-        if (activateNcq) {
-            StorPortWriteRegisterUlong(adapterExtension, &ChannelExtension->Px->SACT, slotsToActivate);
+        if (i == AhciSrbQueueClassCount) {
+            AhciThrottleEnd(ChannelExtension);
         }
-        StorPortWriteRegisterUlong(adapterExtension, &ChannelExtension->Px->CI, slotsToActivate);
-
-    }
-
-    if (LogExecuteFullDetail(adapterExtension->LogFlags)) {
-        RecordInterruptHistory(ChannelExtension, slotsToActivate, 0, 0, ci, sact, 0x10060022); //ActivateQueue, after getting IO slices,
-        RecordExecutionHistory(ChannelExtension, 0x10050022);//Exit ActivateQueue
     }
 
-    return TRUE;
-}
+  //2 Update statistics of the class
+    statistics = &ChannelExtension->SrbQueueStatistics[queueClass];
+    AhciUlongIncrement(&statistics->DequeueCount);
 
-__inline
-ULONGLONG
-CalculateTimeDurationIn100ns (
-    __in ULONGLONG TimeDuration,
-    __in ULONGLONG CounterFrequency
-    )
-{
-    ULONGLONG timeIn100ns = 0;
+    srbExtension = GetSrbExtension(srb);
 
-    // as the counter can hold more than 20,000 years for the same power cylce,
-    // the situation about the counter start over again is considered an error case of inputs.
-    if (CounterFrequency > 0) {
-        // difference between performance counters, needs to convert to 100ns.
-        ULONGLONG countersDiff = TimeDuration;
+    if (srbExtension->QueuedTime != 0) {
+        LARGE_INTEGER   perfCounter = {0};
+        LARGE_INTEGER   perfFrequency = {0};
+        ULONGLONG       waitTime;
 
-        // get seconds
-        timeIn100ns = countersDiff / CounterFrequency;
+        StorPortQueryPerformanceCounter((PVOID)ChannelExtension->AdapterExtension, &perfFrequency, &perfCounter);
+        waitTime = CalculateTimeDurationIn100ns(((ULONGLONG)perfCounter.QuadPart - srbExtension->QueuedTime), (ULONGLONG)perfFrequency.QuadPart) / 10;
 
-        // get milliseconds
-        countersDiff = (countersDiff % CounterFrequency) * 1000;
-        timeIn100ns *= 1000;
-        timeIn100ns += countersDiff / CounterFrequency;
+        AhciUlongIncrement(&statistics->WaitCount);
+        statistics->TotalWaitTime += waitTime;
+        if (waitTime > statistics->MaxWaitTime) {
+            statistics->MaxWaitTime = (ULONG)min(waitTime, MAXULONG);
+        }
 
-        // get 100 nanoseconds
-        countersDiff = (countersDiff % CounterFrequency) * 10000;
-        timeIn100ns *= 10000;
-        timeIn100ns += countersDiff / CounterFrequency;
+        srbExtension->QueuedTime = 0;
     }
 
-    return timeIn100ns;
+    return srb;
 }
 
 VOID
@@ -551,10 +1415,16 @@ Affected Variables/Registers:
         RecordExecutionHistory(ChannelExtension, 0x00000046);//AhciCompleteIssuedSRBs
     }
 
-    if( adapterExtension->TracingEnabled && (ChannelExtension->SlotManager.CommandsToComplete) ) {
+    if( (adapterExtension->TracingEnabled || ChannelExtension->AdaptiveQueueDepth.Enabled) &&
+        (ChannelExtension->SlotManager.CommandsToComplete) ) {
         StorPortQueryPerformanceCounter((PVOID)adapterExtension, &perfFrequency, &perfCounter);
     }
 
+  //1.2 The tracked single command is completed without being learned from when it didn't complete through the interrupt.
+    if ((ChannelExtension->Polling.SlotMask & ChannelExtension->SlotManager.CommandsToComplete) != 0) {
+        AhciPollingReset(ChannelExtension);
+    }
+
   //2.1 For every command marked as completed
     for (i = 0; i <= (adapterExtension->CAP.NCS); i++) {
         if( ( ChannelExtension->SlotManager.CommandsToComplete & (1 << i) ) > 0) {
@@ -593,6 +1463,18 @@ Affected Variables/Registers:
                 StorPortNotification(IoTargetRequestServiceTime, (PVOID)adapterExtension, durationTime, slotContent->Srb);
             }
 
+          //2.1.3 Feed completion latency of NCQ commands to adaptive queue depth
+            if ( ChannelExtension->AdaptiveQueueDepth.Enabled &&
+                 (SrbStatus == SRB_STATUS_SUCCESS) &&
+                 IsNCQCommand(srbExtension) &&
+                 (srbExtension->StartTime != 0) &&
+                 (perfCounter.QuadPart != 0) ) {
+                AhciAdaptiveQueueDepthSample(ChannelExtension,
+                                             CalculateTimeDurationIn100ns((perfCounter.QuadPart - srbExtension->StartTime), perfFrequency.QuadPart),
+                                             (ULONGLONG)perfCounter.QuadPart,
+                                             (ULONGLONG)perfFrequency.QuadPart);
+            }
+
           //2.2 Set the status
             if( (SrbStatus == SRB_STATUS_SUCCESS) &&
                 (!IsRequestSenseSrb(srbExtension->AtaFunction)) &&
@@ -654,7 +1536,7 @@ It performs:
     1 Fills in the CFIS structure
     (details)
     1.1 Map SRB fields to CFIS fields
-    1.2 Specail case mapping of NCQ
+    1.2 Specail case mapping of NCQ, including FUA, PRIO and the Command Duration Limits descriptor index
 
 Affected Variables/Registers:
     Command Table
@@ -663,11 +1545,9 @@ Affected Variables/Registers:
     PAHCI_SRB_EXTENSION srbExtension = GetSrbExtension(SlotContent->Srb);
     PAHCI_COMMAND_TABLE cmdTable = (PAHCI_COMMAND_TABLE)srbExtension;
 
-    UNREFERENCED_PARAMETER(ChannelExtension);
-
   //1.1 Map SRB fields to CFIS fields
     cmdTable->CFIS.FisType = 0x27;
-    cmdTable->CFIS.PMPort = 0;      // StorAHCI doesn't support Port Multiplier
+    cmdTable->CFIS.PMPort = ChannelExtension->PortMultiplierPort;
     cmdTable->CFIS.Reserved1 = 0;
     cmdTable->CFIS.C = 1;
     cmdTable->CFIS.Command = srbExtension->TaskFile.Current.bCommandReg;
@@ -685,12 +1565,22 @@ Affected Variables/Registers:
             cmdTable->CFIS.Dev_Head &= ~ATA_NCQ_FUA_BIT;
         }
 
+        if( IsHighPriorityCommand(srbExtension->Flags) && IsNcqPrioritySupported(ChannelExtension) ){
+            cmdTable->CFIS.SectorCount_Exp = ATA_NCQ_PRIO_HIGH;
+        } else {
+            cmdTable->CFIS.SectorCount_Exp = 0;
+        }
+
+        //AUXILIARY bits 3:0 carry the Command Duration Limits descriptor index, 0 for reads and writes without limit and other NCQ commands
+        cmdTable->CFIS.Auxiliary7_0 = srbExtension->CommandDurationLimitIndex;
+
     } else {
         cmdTable->CFIS.Features = srbExtension->TaskFile.Current.bFeaturesReg;
         cmdTable->CFIS.Features_Exp = srbExtension->TaskFile.Previous.bFeaturesReg;
         cmdTable->CFIS.SectorCount = srbExtension->TaskFile.Current.bSectorCountReg;
         cmdTable->CFIS.SectorCount_Exp = srbExtension->TaskFile.Previous.bSectorCountReg;
         cmdTable->CFIS.Dev_Head = srbExtension->TaskFile.Current.bDriveHeadReg;
+        cmdTable->CFIS.Auxiliary7_0 = 0;
     }
 
   //1.1 Map SRB fields to CFIS fields
@@ -706,7 +1596,6 @@ Affected Variables/Registers:
     cmdTable->CFIS.ICC = 0;
     cmdTable->CFIS.Control = 0; // Device control consists of the 48bit HighOrderByte, SRST and nIEN.  None apply here.
 
-    cmdTable->CFIS.Auxiliary7_0 = 0;
     cmdTable->CFIS.Auxiliary15_8 = 0;
     if ( (ChannelExtension->StateFlags.HybridInfoEnabledOnHiberFile == 1) && IsNCQWriteCommand(srbExtension) ) {
         cmdTable->CFIS.Auxiliary23_16 = 0x21;   //Hybrid Information valid, Priority 1
@@ -749,8 +1638,6 @@ Affected Variables/Registers:
     PAHCI_SRB_EXTENSION srbExtension = GetSrbExtension(SlotContent->Srb);
     PAHCI_COMMAND_TABLE cmdTable = (PAHCI_COMMAND_TABLE)srbExtension;
 
-    UNREFERENCED_PARAMETER(ChannelExtension);
-
     cdb = SrbGetCdb(SlotContent->Srb);
     dataLength = RequestGetDataTransferLength(SlotContent->Srb);
 
@@ -762,7 +1649,7 @@ Affected Variables/Registers:
 
   //2.1 Put the PACKET Command in the CFIS
     cmdTable->CFIS.FisType = 0x27;
-    cmdTable->CFIS.PMPort = 0;      // StorAHCI doesn't support Port Multiplier
+    cmdTable->CFIS.PMPort = ChannelExtension->PortMultiplierPort;
     cmdTable->CFIS.Reserved1 = 0;
     cmdTable->CFIS.C = 1;
     cmdTable->CFIS.Command = IDE_COMMAND_ATAPI_PACKET;   //A0 is the PACKET command
@@ -836,8 +1723,6 @@ Affected Variables/Registers:
     PAHCI_SRB_EXTENSION     srbExtension = GetSrbExtension(SlotContent->Srb);
     PAHCI_COMMAND_TABLE     cmdTable = (PAHCI_COMMAND_TABLE)srbExtension;
 
-    UNREFERENCED_PARAMETER(ChannelExtension);
-
     //
     // Copy CFIS data structure.
     //
@@ -861,7 +1746,7 @@ Affected Variables/Registers:
         cmdTable->CFIS.Count7_0 = (srbExtension->QueueTag << 3);
     }
     cmdTable->CFIS.FisType = 0x27;
-    cmdTable->CFIS.PMPort = 0;      // StorAHCI doesn't support Port Multiplier
+    cmdTable->CFIS.PMPort = ChannelExtension->PortMultiplierPort;
     cmdTable->CFIS.Reserved1 = 0;
     cmdTable->CFIS.C = 1;
 
@@ -990,8 +1875,6 @@ Affected Variables/Registers:
     PSCSI_REQUEST_BLOCK_EX srb = SlotContent->Srb;
     PAHCI_SRB_EXTENSION srbExtension = GetSrbExtension(srb);
 
-    UNREFERENCED_PARAMETER(ChannelExtension);
-
 //  a.  PRDTL containing the number of entries in the PRD table
     cmdHeader->DI.PRDTL = Length;
 //  b.  CFL set to the length of the command in the CFIS area
@@ -1004,7 +1887,7 @@ Affected Variables/Registers:
     //Some controllers have problems if P is set.
     cmdHeader->DI.P = 0;
 //  f.  If a Port Multiplier is attached, the PMP field set to the correct Port Multiplier port.
-    cmdHeader->DI.PMP = 0;
+    cmdHeader->DI.PMP = ChannelExtension->PortMultiplierPort;
 
     //Reset
     cmdHeader->DI.R = Reset;
@@ -1020,6 +1903,69 @@ Affected Variables/Registers:
     cmdHeader->Reserved[3] = 0;
 }
 
+BOOLEAN
+AhciMergeFlushRequest(
+    __in PAHCI_CHANNEL_EXTENSION ChannelExtension,
+    __in PSCSI_REQUEST_BLOCK_EX  Srb
+    )
+/*++
+    Merges a FLUSH from Storport into another FLUSH that has a slot but is not issued to device yet.
+
+    The pending FLUSH is issued after this Srb arrived, so it covers all writes completed before this Srb.
+    The Srb is chained to the pending FLUSH and completed with it by AtaFlushCommandRequestCompletion().
+
+It assumes:
+    Called with InterruptLock held
+
+Called by:
+    AhciProcessIo
+
+Return Value:
+    TRUE if the Srb is merged and should not be issued.
+--*/
+{
+    PAHCI_SRB_EXTENSION     srbExtension = GetSrbExtension(Srb);
+    PAHCI_SRB_EXTENSION     flushSrbExtension;
+    PSCSI_REQUEST_BLOCK_EX  flushSrb;
+    ULONG                   pendingSlots;
+    UCHAR                   i;
+
+  //1 Final Flush goes down alone; a FLUSH carrying merged requests (e.g. being retried) is not merged again.
+    if ( (ChannelExtension->DeviceExtension->DeviceParameters.StateFlags.SystemPoweringDown == TRUE) ||
+         (srbExtension->CompletionContext != NULL) ) {
+        return FALSE;
+    }
+
+  //2 FLUSH is a non-queued command, look for a pending one in Single and Normal slices.
+    pendingSlots = ChannelExtension->SlotManager.SingleIoSlice | ChannelExtension->SlotManager.NormalQueueSlice;
+
+    for (i = 0; (i <= ChannelExtension->AdapterExtension->CAP.NCS) && (pendingSlots != 0); i++) {
+        if ( (pendingSlots & (1 << i)) == 0 ) {
+            continue;
+        }
+        pendingSlots &= ~(1 << i);
+
+        flushSrb = ChannelExtension->Slot[i].Srb;
+        if ( (flushSrb == NULL) || (flushSrb == Srb) ) {
+            continue;
+        }
+
+        flushSrbExtension = GetSrbExtension(flushSrb);
+        if ( (flushSrbExtension->AtaFunction == ATA_FUNCTION_ATA_FLUSH) &&
+             (flushSrbExtension->CompletionRoutine == AtaFlushCommandRequestCompletion) ) {
+          //2.1 chain the Srb to the pending FLUSH.
+            SrbSetNextSrb(Srb, flushSrbExtension->CompletionContext);
+            flushSrbExtension->CompletionContext = (PVOID)Srb;
+
+            AhciUlongIncrement(&ChannelExtension->FlushStatistics.MergedFlushCount);
+            RecordExecutionHistory(ChannelExtension, 0x10090020);   //FLUSH merged into pending FLUSH
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
 BOOLEAN
 AhciProcessIo(
     __in PAHCI_CHANNEL_EXTENSION ChannelExtension,
@@ -1084,7 +2030,29 @@ Note: This routine can be called even the Port is stopped.
         ULONG   sig = 0;
         sig = StorPortReadRegisterUlong(ChannelExtension->AdapterExtension, &ChannelExtension->Px->SIG.AsUlong);
 
-        if (sig == 0x101) { //ATA
+        ChannelExtension->PortMultiplierAttached = (BOOLEAN)(sig == ATA_PORT_MULTIPLIER_SIGNATURE);
+        ChannelExtension->PortMultiplierPort = 0;
+
+        ChannelExtension->DeviceExtension->DeviceParameters.StateFlags.HostManagedZoned = (sig == ATA_HOST_MANAGED_ZONED_SIGNATURE) ? 1 : 0;
+
+        if (ChannelExtension->PortMultiplierAttached) {
+            // only one device per port is supported, other device ports of the Port Multiplier are not enumerated.
+            // Commands carrying PMP 0 are routed by the Port Multiplier to its device port 0, so use command-based switching
+            // to that device instead of sending ATAPI IDENTIFY to the Port Multiplier itself. PxCMD.PMA is set at port start.
+            AHCI_COMMAND cmd;
+
+            cmd.AsUlong = StorPortReadRegisterUlong(ChannelExtension->AdapterExtension, &ChannelExtension->Px->CMD.AsUlong);
+
+            RecordExecutionHistory(ChannelExtension, 0x10080023);   //Port Multiplier detected, using device port 0
+
+            StorPortDebugPrint(3, "StorAHCI - PMP: Port %02d - Port Multiplier attached (CAP.SPM %d, PxCMD.PMA %d, PxCMD.FBSCP %d), using device port 0\n",
+                               ChannelExtension->PortNumber,
+                               ChannelExtension->AdapterExtension->CAP.SPM,
+                               cmd.PMA,
+                               cmd.FBSCP);
+
+            srbExtension->TaskFile.Current.bCommandReg = IDE_COMMAND_IDENTIFY;
+        } else if ((sig == 0x101) || (sig == ATA_HOST_MANAGED_ZONED_SIGNATURE)) { //ATA
             srbExtension->TaskFile.Current.bCommandReg = IDE_COMMAND_IDENTIFY;
         } else {            //ATAPI
             srbExtension->TaskFile.Current.bCommandReg = IDE_COMMAND_ATAPI_IDENTIFY;
@@ -1096,11 +2064,27 @@ Note: This routine can be called even the Port is stopped.
         SetDeviceReg((&srbExtension->TaskFile.Current), 0);   //make sure set to device0
     }
 
+    //2.4 concurrent SYNCHRONIZE CACHE requests are completed by one FLUSH command.
+    if ( (srbExtension->AtaFunction == ATA_FUNCTION_ATA_FLUSH) &&
+         (srbExtension->CompletionRoutine == AtaFlushCommandRequestCompletion) ) {
+        if (AhciMergeFlushRequest(ChannelExtension, Srb)) {
+            return TRUE;
+        }
+    }
+
   //3 Find an available slot/tag (AHCI 1.1 Section 5.5.1)
     GetAvailableSlot(ChannelExtension, Srb);    //srbExtension->QueueTag will be set
 
     // 3.1 If no tag is available, reject the command to be retried later
     if ( srbExtension->QueueTag > ChannelExtension->AdapterExtension->CAP.NCS ) {
+        if (Srb == &ChannelExtension->Local.Srb) {
+            // slot 0 is lent to an IO from Storport. Slot 0 is not lent again while the internal command is in process,
+            // AhciGetNextIos() starts the local Srb once the IO completes.
+            ChannelExtension->StateFlags.LocalSrbWaitingForSlot = 1;
+            RecordExecutionHistory(ChannelExtension, 0x10050020);   //Local Srb waits for reserved slot
+            return TRUE;
+        }
+
         //wait for 8 IO (random picked number) being completed before re-starting sending IO to miniport for this device.
         // if filled up,
         if (!IsMiniportInternalSrb(ChannelExtension, Srb)) {
@@ -1138,6 +2122,10 @@ Note: This routine can be called even the Port is stopped.
 #endif
     //srbExtension->QueueTag and Slot[srbExtension->QueueTag] are now guaranteed ready.
 
+    if (srbExtension->CompletionRoutine == AtaFlushCommandRequestCompletion) {
+        AhciUlongIncrement(&ChannelExtension->FlushStatistics.FlushCount);
+    }
+
     return AhciFormIo (ChannelExtension, Srb, AtDIRQL);
 }
 
@@ -1360,12 +2348,12 @@ AhciPortFailAllIos(
     UCHAR i;
 
     // complete all rquests still in queue
-    srb = RemoveQueue(ChannelExtension, &ChannelExtension->SrbQueue, 0xDEADC0DE, 0x1F);
+    srb = RemoveSrbQueue(ChannelExtension, FALSE);
     while (srb != NULL) {
         srb->SrbStatus = SrbStatus;
         MarkSrbToBeCompleted(srb);
         AhciCompleteRequest(ChannelExtension, srb, AtDIRQL);
-        srb = RemoveQueue(ChannelExtension, &ChannelExtension->SrbQueue, 0xDEADC0DE, 0x1F);
+        srb = RemoveSrbQueue(ChannelExtension, FALSE);
     }
 
     // complete all requests in slots
@@ -1392,6 +2380,9 @@ AhciPortSrbCompletionDpcRoutine(
     PAHCI_CHANNEL_EXTENSION channelExtension = (PAHCI_CHANNEL_EXTENSION)SystemArgument1;
     STOR_LOCK_HANDLE        lockhandle = {0};
     PSCSI_REQUEST_BLOCK_EX     srb = NULL;
+    PSCSI_REQUEST_BLOCK_EX     completionList = NULL;
+    PSCSI_REQUEST_BLOCK_EX     reissueHead = NULL;
+    PSCSI_REQUEST_BLOCK_EX     reissueTail = NULL;
 
     UNREFERENCED_PARAMETER(Dpc);
     UNREFERENCED_PARAMETER(SystemArgument2);
@@ -1401,17 +2392,42 @@ AhciPortSrbCompletionDpcRoutine(
         return;
     }
 
+    //
+    // Each pass takes InterruptLock once: it issues the commands that completion routines of the previous pass
+    // associated with their requests, and detaches everything the ISR queued for completion meanwhile.
+    // The detached requests are processed without the lock.
+    //
     do {
         StorPortAcquireSpinLock(AdapterExtension, InterruptLock, NULL, &lockhandle);
-        srb = RemoveQueue(channelExtension, &channelExtension->CompletionQueue, 0xDEADC0DE, 0x9F);
+
+        if (reissueHead != NULL) {
+            while (reissueHead != NULL) {
+                srb = reissueHead;
+                reissueHead = (PSCSI_REQUEST_BLOCK_EX)SrbGetNextSrb(srb);
+                SrbSetNextSrb(srb, NULL);
+                AhciProcessIo(channelExtension, srb, TRUE);
+            }
+            reissueTail = NULL;
+            ActivateQueue(channelExtension, TRUE);
+        }
+
+        completionList = RemoveAllQueue(channelExtension, &channelExtension->CompletionQueue, 0xDEADC0DE, 0x9F);
+
         StorPortReleaseSpinLock(AdapterExtension, &lockhandle);
 
-        if (srb != NULL) {
-            PAHCI_SRB_EXTENSION     srbExtension = GetSrbExtension(srb);
-            PSRB_COMPLETION_ROUTINE completionRoutine = srbExtension->CompletionRoutine;
+        while (completionList != NULL) {
+            PAHCI_SRB_EXTENSION     srbExtension;
+            PSRB_COMPLETION_ROUTINE completionRoutine;
 
             BOOLEAN completeSrb = TRUE;
 
+            srb = completionList;
+            completionList = (PSCSI_REQUEST_BLOCK_EX)SrbGetNextSrb(srb);
+            SrbSetNextSrb(srb, NULL);
+
+            srbExtension = GetSrbExtension(srb);
+            completionRoutine = srbExtension->CompletionRoutine;
+
             srbExtension->AtaFunction = 0; // clear this field.
             srbExtension->CompletionRoutine = NULL;
 
@@ -1424,10 +2440,13 @@ AhciPortSrbCompletionDpcRoutine(
                      (!SrbShouldBeCompleted(srbExtension->Flags)) &&
                      (srb->SrbStatus != SRB_STATUS_BUS_RESET) ) {
                     // new command associated needs to be processed, do not complete the request.
-                    StorPortAcquireSpinLock(AdapterExtension, InterruptLock, NULL, &lockhandle);
-                    AhciProcessIo(channelExtension, srb, TRUE);
-                    ActivateQueue(channelExtension, TRUE);
-                    StorPortReleaseSpinLock(AdapterExtension, &lockhandle);
+                    // it is issued with the others at the beginning of next pass.
+                    if (reissueTail == NULL) {
+                        reissueHead = srb;
+                    } else {
+                        SrbSetNextSrb(reissueTail, srb);
+                    }
+                    reissueTail = srb;
                     // this Srb should not be completed yet
                     completeSrb = FALSE;
                 } else if (SrbShouldBeCompleted(srbExtension->Flags)) {
@@ -1451,7 +2470,113 @@ AhciPortSrbCompletionDpcRoutine(
             }
         }
 
-    } while (srb != NULL);
+    } while (reissueHead != NULL || channelExtension->CompletionQueue.Head != NULL);
+
+    return;
+}
+
+VOID
+AhciPortPollDpcRoutine(
+    __in PSTOR_DPC  Dpc,
+    __in PVOID      AdapterExtension,
+    __in_opt PVOID  SystemArgument1,
+    __in_opt PVOID  SystemArgument2
+  )
+/*++
+    Polls PxCI/PxSACT for the tracked single command until it completes or the budget since it was issued is used up.
+    A completed command is processed right away by the interrupt routine; the interrupt that follows finds nothing to do.
+    Otherwise the command is left to the interrupt.
+--*/
+{
+    PAHCI_CHANNEL_EXTENSION     channelExtension = (PAHCI_CHANNEL_EXTENSION)SystemArgument1;
+    PAHCI_ADAPTER_EXTENSION     adapterExtension = (PAHCI_ADAPTER_EXTENSION)AdapterExtension;
+    PAHCI_POLLING_STATISTICS    statistics;
+    STOR_LOCK_HANDLE            lockhandle = {0};
+    LARGE_INTEGER               perfCounter = {0};
+    LARGE_INTEGER               perfFrequency = {0};
+    ULONGLONG                   pollStartTime;
+    ULONGLONG                   issueTime;
+    ULONGLONG                   elapsed;
+    ULONG                       slotMask;
+    ULONG                       budget;
+    ULONG                       outstanding;
+    BOOLEAN                     completed = FALSE;
+    UCHAR                       i;
+
+    UNREFERENCED_PARAMETER(Dpc);
+    UNREFERENCED_PARAMETER(SystemArgument2);
+
+    if (channelExtension == NULL) {
+        NT_ASSERT(channelExtension != NULL);
+        return;
+    }
+
+    statistics = &channelExtension->PollingStatistics;
+
+    // the tracked command is set and cleared with InterruptLock held, take a consistent snapshot.
+    StorPortAcquireSpinLock(AdapterExtension, InterruptLock, NULL, &lockhandle);
+    slotMask = channelExtension->Polling.SlotMask;
+    issueTime = channelExtension->Polling.IssueTime;
+    StorPortReleaseSpinLock(AdapterExtension, &lockhandle);
+
+    if (slotMask == 0) {
+        // completed by interrupt already.
+        return;
+    }
+
+  //1 Budget is counted from the command issue: 1.5 times the learned latency, limited by BudgetLimit.
+    budget = statistics->BudgetLimit;
+    if ( (statistics->DeviceLatency != 0) && ((statistics->DeviceLatency + statistics->DeviceLatency / 2) < budget) ) {
+        budget = statistics->DeviceLatency + statistics->DeviceLatency / 2;
+    }
+
+    StorPortQueryPerformanceCounter(AdapterExtension, &perfFrequency, &perfCounter);
+    pollStartTime = (ULONGLONG)perfCounter.QuadPart;
+    elapsed = CalculateTimeDurationIn100ns((pollStartTime - issueTime), (ULONGLONG)perfFrequency.QuadPart) / 10;
+
+  //2 Poll
+    while (elapsed < budget) {
+        outstanding = StorPortReadRegisterUlong(adapterExtension, &channelExtension->Px->CI) |
+                      StorPortReadRegisterUlong(adapterExtension, &channelExtension->Px->SACT);
+
+        if ((outstanding & slotMask) == 0) {
+            completed = TRUE;
+            break;
+        }
+
+        StorPortStallExecution(AHCI_POLL_STALL_INTERVAL);
+
+        StorPortQueryPerformanceCounter(AdapterExtension, NULL, &perfCounter);
+        elapsed = CalculateTimeDurationIn100ns(((ULONGLONG)perfCounter.QuadPart - issueTime), (ULONGLONG)perfFrequency.QuadPart) / 10;
+    }
+
+    StorPortQueryPerformanceCounter(AdapterExtension, NULL, &perfCounter);
+
+  //3 Account and complete
+    StorPortAcquireSpinLock(AdapterExtension, InterruptLock, NULL, &lockhandle);
+
+    AhciUlongIncrement(&statistics->PollCount);
+    statistics->PollTime += CalculateTimeDurationIn100ns(((ULONGLONG)perfCounter.QuadPart - pollStartTime), (ULONGLONG)perfFrequency.QuadPart) / 10;
+
+    if ( completed &&
+         (channelExtension->Polling.SlotMask == slotMask) &&
+         (channelExtension->Polling.IssueTime == issueTime) ) {
+        channelExtension->Polling.Polled = TRUE;
+
+        // the interrupt routine serves one port per call, other ports may have interrupts pending too.
+        for (i = 0; (i <= adapterExtension->HighestPort) && (channelExtension->Polling.SlotMask == slotMask); i++) {
+            if (!AhciHwInterrupt(AdapterExtension)) {
+                break;
+            }
+        }
+
+        if (channelExtension->Polling.SlotMask == slotMask) {
+            // not processed, the interrupt completes it.
+            channelExtension->Polling.Polled = FALSE;
+        }
+    }
+
+    StorPortReleaseSpinLock(AdapterExtension, &lockhandle);
 
     return;
 }
@@ -31,6 +31,18 @@ GetSingleIo(
     PAHCI_CHANNEL_EXTENSION ChannelExtension
     );
 
+BOOLEAN
+NonQueuedCommandsDeferred(
+    __in PAHCI_CHANNEL_EXTENSION ChannelExtension,
+    __in ULONG                   Sact
+    );
+
+BOOLEAN
+AhciMergeFlushRequest(
+    __in PAHCI_CHANNEL_EXTENSION ChannelExtension,
+    __in PSCSI_REQUEST_BLOCK_EX  Srb
+    );
+
 BOOLEAN
 ActivateQueue(
     __in PAHCI_CHANNEL_EXTENSION ChannelExtension,
@@ -54,6 +66,89 @@ RemoveQueue (
     __in UCHAR Tag
     );
 
+PSCSI_REQUEST_BLOCK_EX
+RemoveAllQueue (
+    __in PAHCI_CHANNEL_EXTENSION ChannelExtension,
+    __inout PSTORAHCI_QUEUE Queue,
+    __in ULONG Signature,
+    __in UCHAR Tag
+    );
+
+VOID
+AddSrbQueue (
+    __in PAHCI_CHANNEL_EXTENSION ChannelExtension,
+    __in PSCSI_REQUEST_BLOCK_EX  Srb
+    );
+
+PSCSI_REQUEST_BLOCK_EX
+RemoveSrbQueue (
+    __in PAHCI_CHANNEL_EXTENSION ChannelExtension,
+    __in BOOLEAN ApplyThrottle
+    );
+
+VOID
+AhciAdaptiveQueueDepthSample (
+    __in PAHCI_CHANNEL_EXTENSION ChannelExtension,
+    __in ULONGLONG Latency,
+    __in ULONGLONG PerfCounter,
+    __in ULONGLONG PerfFrequency
+    );
+
+VOID
+AhciPollingCommandIssued (
+    __in PAHCI_CHANNEL_EXTENSION ChannelExtension,
+    __in ULONG SlotMask
+    );
+
+VOID
+AhciPollingCommandCompleted (
+    __in PAHCI_CHANNEL_EXTENSION ChannelExtension
+    );
+
+VOID
+AhciPollingReset (
+    __in PAHCI_CHANNEL_EXTENSION ChannelExtension
+    );
+
+VOID
+AhciThrottleSetLimits (
+    __in PAHCI_CHANNEL_EXTENSION ChannelExtension,
+    __in PAHCI_THROTTLE_LIMITS Limits
+    );
+
+VOID
+AhciThrottleEnd (
+    __in PAHCI_CHANNEL_EXTENSION ChannelExtension
+    );
+
+VOID
+AhciThrottleRefill (
+    __in PAHCI_CHANNEL_EXTENSION ChannelExtension
+    );
+
+BOOLEAN
+AhciThrottleAdmit (
+    __in PAHCI_CHANNEL_EXTENSION ChannelExtension,
+    __in ULONG QueueClass
+    );
+
+VOID
+AhciThrottleCharge (
+    __in PAHCI_CHANNEL_EXTENSION ChannelExtension,
+    __in PSCSI_REQUEST_BLOCK_EX  Srb,
+    __in ULONG QueueClass
+    );
+
+VOID
+AhciThrottleRequestTimer (
+    __in PAHCI_CHANNEL_EXTENSION ChannelExtension
+    );
+
+VOID
+AhciThrottleTimerCallback(
+    __in PVOID AdapterExtension
+    );
+
 VOID
 AhciCompleteIssuedSRBs(
     __in PAHCI_CHANNEL_EXTENSION ChannelExtension,
@@ -124,4 +219,8 @@ HW_DPC_ROUTINE AhciPortSrbCompletionDpcRoutine;
 
 HW_DPC_ROUTINE AhciPortBusChangeDpcRoutine;
 
+HW_DPC_ROUTINE AhciThrottleDpcRoutine;
+
+HW_DPC_ROUTINE AhciPortPollDpcRoutine;
+
 
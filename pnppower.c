@@ -198,6 +198,8 @@ NOTE: as this routine is invoked from FindAdapter where the adapter might not be
     ChannelExtension->DeviceExtension[0].InquiryDataPhysicalAddress = StorPortGetPhysicalAddress(adapterExtension, NULL, (PVOID)ChannelExtension->DeviceExtension[0].InquiryData, &mappedLength);
     // setup physical address correctly, otherwise we get a BSOD KERNEL_APC_PENDING_DURING_EXIT
     ChannelExtension->DeviceExtension[0].ReadLogExtPageDataPhysicalAddress = StorPortGetPhysicalAddress(adapterExtension, NULL, (PVOID)ChannelExtension->DeviceExtension[0].ReadLogExtPageData, &mappedLength);
+    ChannelExtension->SctErc.CommandDataPhysicalAddress = StorPortGetPhysicalAddress(adapterExtension, NULL, (PVOID)ChannelExtension->SctErc.CommandData, &mappedLength);
+    ChannelExtension->NcqAutosense.ErrorLogPhysicalAddress = StorPortGetPhysicalAddress(adapterExtension, NULL, (PVOID)ChannelExtension->NcqAutosense.ErrorLog, &mappedLength);
 
 
   //4.8 Setup STOR_ADDRESS for the device. StorAHCI uses Bus/Target/Lun addressing model, thus uses STOR_ADDRESS_TYPE_BTL8.
@@ -224,8 +226,10 @@ NOTE: as this routine is invoked from FindAdapter where the adapter might not be
   //5.1 Enable Command Processing
     ChannelExtension->StateFlags.Initialized = TRUE;
 
-    if (adapterExtension->CAP.NCS > 0) { //this leaves one emergency slot free if possible, as CAP.NCS is 0-based.
-        ChannelExtension->MaxPortQueueDepth = (UCHAR)adapterExtension->CAP.NCS;
+    if (adapterExtension->CAP.NCS > 0) {
+        //CAP.NCS is 0-based. Slot 0 is reserved for internal commands but lent to other IO while no internal command is in process,
+        //see IsReservedSlotLendable(), so all slots count for the queue depth.
+        ChannelExtension->MaxPortQueueDepth = (UCHAR)(adapterExtension->CAP.NCS + 1);
     } else {
         ChannelExtension->MaxPortQueueDepth = 1;
     }
@@ -237,6 +241,24 @@ NOTE: as this routine is invoked from FindAdapter where the adapter might not be
     ChannelExtension->LastActiveSlot = 0;
     ChannelExtension->DeviceExtension[0].DeviceParameters.MaxDeviceQueueDepth = ChannelExtension->MaxPortQueueDepth;
 
+    //5.1.1 SRB queue weights until registry settings are read, see AhciPortReadRegistrySettings()
+    ChannelExtension->SrbQueueScheduler.Weight[AhciSrbQueueUrgent] = AHCI_SRB_QUEUE_DEFAULT_WEIGHT_URGENT;
+    ChannelExtension->SrbQueueScheduler.Weight[AhciSrbQueueNormal] = AHCI_SRB_QUEUE_DEFAULT_WEIGHT_NORMAL;
+    ChannelExtension->SrbQueueScheduler.Weight[AhciSrbQueueBackground] = AHCI_SRB_QUEUE_DEFAULT_WEIGHT_BACKGROUND;
+
+    //5.1.2 NCQ error recovery from the NCQ Command Error log and SMART data cache timeout until registry settings are read.
+    ChannelExtension->NcqAutosense.Enabled = TRUE;
+    ChannelExtension->SmartCache.Timeout = AHCI_SMART_CACHE_DEFAULT_TIMEOUT;
+
+    //5.1.3 link exit latencies from SATA spec until they are measured, see AhciLpmAdaptiveWakeComplete().
+    ChannelExtension->LpmStatistics.PartialExitLatency = AHCI_LPM_PARTIAL_EXIT_LATENCY_US;
+    ChannelExtension->LpmStatistics.SlumberExitLatency = AHCI_LPM_SLUMBER_EXIT_LATENCY_US;
+
+    //5.1.4 hybrid cache promotion until registry settings are read, reads are only tracked on hybrid devices.
+    ChannelExtension->HotLba.Budget = AHCI_HOT_LBA_DEFAULT_BUDGET;
+    ChannelExtension->HotLba.Interval = AHCI_HOT_LBA_DEFAULT_INTERVAL;
+    ChannelExtension->HotLba.Priority = AHCI_HOT_LBA_DEFAULT_PRIORITY;
+
     if (!IsDumpMode(adapterExtension)) {
         if (AdapterResetInInit(adapterExtension)) {
             P_NotRunning(ChannelExtension, ChannelExtension->Px);
@@ -516,6 +538,13 @@ Return Values:
 --*/
     ChannelExtension->StateFlags.PowerDown = TRUE;
 
+    // port registers may not survive the power transition, the port is started again when powered up.
+    ChannelExtension->ShadowStarted = FALSE;
+
+    // idle period across device power transition doesn't tell about link idle pattern, drop it.
+    ChannelExtension->LpmAdaptivePolicy.IdleStartTime = 0;
+    ChannelExtension->LpmAdaptivePolicy.WakeStartTime = 0;
+
     //
     // Cancel the StartPortTimer since we're going into a lower power state.
     //
@@ -608,6 +637,13 @@ ReportLunsComplete(
         }
     }
 
+    // Storport before Windows 8 doesn't call AhciHwUnitControl(ScsiUnitStart), the device is started once it's enumerated.
+    if ( (lunCount != 0) &&
+         !IsDumpMode(ChannelExtension->AdapterExtension) &&
+         (ChannelExtension->AdapterExtension->StateFlags.UnitControlSupported == 0) ) {
+        AhciDeviceStartWithoutUnitControl(ChannelExtension);
+    }
+
     return;
 }
 
@@ -679,6 +715,22 @@ Return Values:
     ChannelExtension->DeviceExtension->QueryLogPages.LogPage[*index].FeatureField = 0;
     *index = *index + 1;
 
+    // read Identify Device Data log - Supported Capabilities page
+    ChannelExtension->DeviceExtension->QueryLogPages.LogPage[*index].Query = TRUE;
+    ChannelExtension->DeviceExtension->QueryLogPages.LogPage[*index].LogAddress = IDE_GP_LOG_IDENTIFY_DEVICE_DATA_ADDRESS;
+    ChannelExtension->DeviceExtension->QueryLogPages.LogPage[*index].PageNumber = IDE_GP_LOG_IDENTIFY_DEVICE_DATA_SUPPORTED_CAPABILITIES_PAGE;
+    ChannelExtension->DeviceExtension->QueryLogPages.LogPage[*index].BlockCount = 1;
+    ChannelExtension->DeviceExtension->QueryLogPages.LogPage[*index].FeatureField = 0;
+    *index = *index + 1;
+
+    // read Identify Device Data log - Current Settings page
+    ChannelExtension->DeviceExtension->QueryLogPages.LogPage[*index].Query = TRUE;
+    ChannelExtension->DeviceExtension->QueryLogPages.LogPage[*index].LogAddress = IDE_GP_LOG_IDENTIFY_DEVICE_DATA_ADDRESS;
+    ChannelExtension->DeviceExtension->QueryLogPages.LogPage[*index].PageNumber = IDE_GP_LOG_IDENTIFY_DEVICE_DATA_CURRENT_SETTINGS_PAGE;
+    ChannelExtension->DeviceExtension->QueryLogPages.LogPage[*index].BlockCount = 1;
+    ChannelExtension->DeviceExtension->QueryLogPages.LogPage[*index].FeatureField = 0;
+    *index = *index + 1;
+
     // read Saved Device Internal log
     ChannelExtension->DeviceExtension->QueryLogPages.LogPage[*index].Query = TRUE;
     ChannelExtension->DeviceExtension->QueryLogPages.LogPage[*index].LogAddress = IDE_GP_LOG_SAVED_DEVICE_INTERNAL_STATUS;
@@ -713,6 +765,14 @@ Return Values:
     ChannelExtension->DeviceExtension->QueryLogPages.LogPage[*index].FeatureField = 0;
     *index = *index + 1;
 
+    // read Command Duration Limits log, only if Supported Capabilities page reports the feature.
+    ChannelExtension->DeviceExtension->QueryLogPages.LogPage[*index].Query = TRUE;
+    ChannelExtension->DeviceExtension->QueryLogPages.LogPage[*index].LogAddress = IDE_GP_LOG_COMMAND_DURATION_LIMITS;
+    ChannelExtension->DeviceExtension->QueryLogPages.LogPage[*index].PageNumber = 0;
+    ChannelExtension->DeviceExtension->QueryLogPages.LogPage[*index].BlockCount = 1;
+    ChannelExtension->DeviceExtension->QueryLogPages.LogPage[*index].FeatureField = 0;
+    *index = *index + 1;
+
     NT_ASSERT(*index <= ATA_GPL_PAGES_QUERY_COUNT);
 
     return;
@@ -903,6 +963,9 @@ LogPageDiscoveryCompletion (
         Device Statistics Log - General Statistics
         Identify Device Data Log - Supported Pages
         Identify Device Data Log - SATA Page
+        Identify Device Data Log - Supported Capabilities, Current Settings
+        Saved Device Internal Status, NCQ Non-Data, NCQ Send Receive
+        Command Duration Limits Log
 
 
 */
@@ -941,6 +1004,9 @@ LogPageDiscoveryCompletion (
             if (ChannelExtension->DeviceExtension->SupportedGPLPages.IdentifyDeviceData.LogAddressSupported == 0) {
                 UpdateQueryLogPageSupportive(ChannelExtension, IDE_GP_LOG_IDENTIFY_DEVICE_DATA_ADDRESS, IDE_GP_LOG_SUPPORTED_PAGES, FALSE);
                 UpdateQueryLogPageSupportive(ChannelExtension, IDE_GP_LOG_IDENTIFY_DEVICE_DATA_ADDRESS, IDE_GP_LOG_IDENTIFY_DEVICE_DATA_SATA_PAGE, FALSE);
+                UpdateQueryLogPageSupportive(ChannelExtension, IDE_GP_LOG_IDENTIFY_DEVICE_DATA_ADDRESS, IDE_GP_LOG_IDENTIFY_DEVICE_DATA_SUPPORTED_CAPABILITIES_PAGE, FALSE);
+                UpdateQueryLogPageSupportive(ChannelExtension, IDE_GP_LOG_IDENTIFY_DEVICE_DATA_ADDRESS, IDE_GP_LOG_IDENTIFY_DEVICE_DATA_CURRENT_SETTINGS_PAGE, FALSE);
+                UpdateQueryLogPageSupportive(ChannelExtension, IDE_GP_LOG_COMMAND_DURATION_LIMITS, 0, FALSE);
             }
 
             ChannelExtension->DeviceExtension->SupportedGPLPages.SinglePage.NcqCommandError = (ChannelExtension->DeviceExtension->ReadLogExtPageData[IDE_GP_LOG_NCQ_COMMAND_ERROR_ADDRESS] > 0) ? 1 : 0;
@@ -957,6 +1023,10 @@ LogPageDiscoveryCompletion (
 
             ChannelExtension->DeviceExtension->SupportedGPLPages.SinglePage.HybridInfo = (ChannelExtension->DeviceExtension->ReadLogExtPageData[IDE_GP_LOG_HYBRID_INFO_ADDRESS] > 0) ? 1 : 0;
 
+            ChannelExtension->DeviceExtension->SupportedGPLPages.SinglePage.CommandDurationLimits = (ChannelExtension->DeviceExtension->ReadLogExtPageData[IDE_GP_LOG_COMMAND_DURATION_LIMITS] > 0) ? 1 : 0;
+            if (ChannelExtension->DeviceExtension->SupportedGPLPages.SinglePage.CommandDurationLimits == 0) {
+                UpdateQueryLogPageSupportive(ChannelExtension, IDE_GP_LOG_COMMAND_DURATION_LIMITS, 0, FALSE);
+            }
 
         } else {
             // Log Directory can be optional. Preset supportive info, they will be updated if the actual command fails later.
@@ -967,8 +1037,11 @@ LogPageDiscoveryCompletion (
             UpdateQueryLogPageSupportive(ChannelExtension, IDE_GP_LOG_DEVICE_STATISTICS_ADDRESS, IDE_GP_LOG_DEVICE_STATISTICS_GENERAL_PAGE, FALSE);
             UpdateQueryLogPageSupportive(ChannelExtension, IDE_GP_LOG_IDENTIFY_DEVICE_DATA_ADDRESS, IDE_GP_LOG_SUPPORTED_PAGES, FALSE);
             UpdateQueryLogPageSupportive(ChannelExtension, IDE_GP_LOG_IDENTIFY_DEVICE_DATA_ADDRESS, IDE_GP_LOG_IDENTIFY_DEVICE_DATA_SATA_PAGE, FALSE);
+            UpdateQueryLogPageSupportive(ChannelExtension, IDE_GP_LOG_IDENTIFY_DEVICE_DATA_ADDRESS, IDE_GP_LOG_IDENTIFY_DEVICE_DATA_SUPPORTED_CAPABILITIES_PAGE, FALSE);
+            UpdateQueryLogPageSupportive(ChannelExtension, IDE_GP_LOG_IDENTIFY_DEVICE_DATA_ADDRESS, IDE_GP_LOG_IDENTIFY_DEVICE_DATA_CURRENT_SETTINGS_PAGE, FALSE);
             UpdateQueryLogPageSupportive(ChannelExtension, IDE_GP_LOG_NCQ_NON_DATA_ADDRESS, 0, FALSE);
             UpdateQueryLogPageSupportive(ChannelExtension, IDE_GP_LOG_NCQ_SEND_RECEIVE_ADDRESS, 0, FALSE);
+            UpdateQueryLogPageSupportive(ChannelExtension, IDE_GP_LOG_COMMAND_DURATION_LIMITS, 0, FALSE);
         }
 
     } else if ( (completedLogAddress == IDE_GP_LOG_DEVICE_STATISTICS_ADDRESS) && (completedPageNumber == IDE_GP_LOG_SUPPORTED_PAGES) ) {
@@ -1039,9 +1112,14 @@ LogPageDiscoveryCompletion (
                 int i;
                 for (i = 1; i <= pageCount; i++) {
                     // if the page number is shown in supported list, mark it's supported.
-                    if (*(pageSupported + sizeof(IDENTIFY_DEVICE_DATA_LOG_PAGE_HEADER) + i) == IDE_GP_LOG_IDENTIFY_DEVICE_DATA_SATA_PAGE) {
+                    UCHAR pageNumber = *(pageSupported + sizeof(IDENTIFY_DEVICE_DATA_LOG_PAGE_HEADER) + i);
+
+                    if (pageNumber == IDE_GP_LOG_IDENTIFY_DEVICE_DATA_SATA_PAGE) {
                         ChannelExtension->DeviceExtension->SupportedGPLPages.IdentifyDeviceData.SATA = 1;
-                        break;
+                    } else if (pageNumber == IDE_GP_LOG_IDENTIFY_DEVICE_DATA_SUPPORTED_CAPABILITIES_PAGE) {
+                        ChannelExtension->DeviceExtension->SupportedGPLPages.IdentifyDeviceData.SupportedCapabilities = 1;
+                    } else if (pageNumber == IDE_GP_LOG_IDENTIFY_DEVICE_DATA_CURRENT_SETTINGS_PAGE) {
+                        ChannelExtension->DeviceExtension->SupportedGPLPages.IdentifyDeviceData.CurrentSettings = 1;
                     }
                 }
             }
@@ -1049,9 +1127,19 @@ LogPageDiscoveryCompletion (
             if (ChannelExtension->DeviceExtension->SupportedGPLPages.IdentifyDeviceData.SATA == 0) {
                 UpdateQueryLogPageSupportive(ChannelExtension, IDE_GP_LOG_IDENTIFY_DEVICE_DATA_ADDRESS, IDE_GP_LOG_IDENTIFY_DEVICE_DATA_SATA_PAGE, FALSE);
             }
+            if (ChannelExtension->DeviceExtension->SupportedGPLPages.IdentifyDeviceData.SupportedCapabilities == 0) {
+                UpdateQueryLogPageSupportive(ChannelExtension, IDE_GP_LOG_IDENTIFY_DEVICE_DATA_ADDRESS, IDE_GP_LOG_IDENTIFY_DEVICE_DATA_SUPPORTED_CAPABILITIES_PAGE, FALSE);
+                UpdateQueryLogPageSupportive(ChannelExtension, IDE_GP_LOG_COMMAND_DURATION_LIMITS, 0, FALSE);
+            }
+            if (ChannelExtension->DeviceExtension->SupportedGPLPages.IdentifyDeviceData.CurrentSettings == 0) {
+                UpdateQueryLogPageSupportive(ChannelExtension, IDE_GP_LOG_IDENTIFY_DEVICE_DATA_ADDRESS, IDE_GP_LOG_IDENTIFY_DEVICE_DATA_CURRENT_SETTINGS_PAGE, FALSE);
+            }
         } else {
             ChannelExtension->DeviceExtension->SupportedGPLPages.IdentifyDeviceData.LogAddressSupported = 0;
             UpdateQueryLogPageSupportive(ChannelExtension, IDE_GP_LOG_IDENTIFY_DEVICE_DATA_ADDRESS, IDE_GP_LOG_IDENTIFY_DEVICE_DATA_SATA_PAGE, FALSE);
+            UpdateQueryLogPageSupportive(ChannelExtension, IDE_GP_LOG_IDENTIFY_DEVICE_DATA_ADDRESS, IDE_GP_LOG_IDENTIFY_DEVICE_DATA_SUPPORTED_CAPABILITIES_PAGE, FALSE);
+            UpdateQueryLogPageSupportive(ChannelExtension, IDE_GP_LOG_IDENTIFY_DEVICE_DATA_ADDRESS, IDE_GP_LOG_IDENTIFY_DEVICE_DATA_CURRENT_SETTINGS_PAGE, FALSE);
+            UpdateQueryLogPageSupportive(ChannelExtension, IDE_GP_LOG_COMMAND_DURATION_LIMITS, 0, FALSE);
         }
 
     } else if ( (completedLogAddress == IDE_GP_LOG_IDENTIFY_DEVICE_DATA_ADDRESS) && (completedPageNumber == IDE_GP_LOG_IDENTIFY_DEVICE_DATA_SATA_PAGE) ) {
@@ -1062,6 +1150,70 @@ LogPageDiscoveryCompletion (
             ChannelExtension->DeviceExtension->SupportedGPLPages.IdentifyDeviceData.SATA = 0;
         }
 
+    } else if ( (completedLogAddress == IDE_GP_LOG_IDENTIFY_DEVICE_DATA_ADDRESS) && (completedPageNumber == IDE_GP_LOG_IDENTIFY_DEVICE_DATA_SUPPORTED_CAPABILITIES_PAGE) ) {
+        // the issued command was for getting Supported Capabilities page of identify device data log
+
+        if (Srb->SrbStatus == SRB_STATUS_SUCCESS) {
+            ULONGLONG supportedCapabilities;
+
+            // Supported Capabilities qword at offset 168: bit 63 - valid, bit 0 - Command Duration Limits supported.
+            StorPortCopyMemory(&supportedCapabilities, (PUCHAR)ChannelExtension->DeviceExtension->ReadLogExtPageData + 168, sizeof(ULONGLONG));
+
+            if ((supportedCapabilities & (1ULL << 63)) && (supportedCapabilities & 1)) {
+                ChannelExtension->DeviceExtension->SupportedCommands.CommandDurationLimits = 1;
+            }
+        } else {
+            ChannelExtension->DeviceExtension->SupportedGPLPages.IdentifyDeviceData.SupportedCapabilities = 0;
+        }
+
+        if (ChannelExtension->DeviceExtension->SupportedCommands.CommandDurationLimits == 0) {
+            UpdateQueryLogPageSupportive(ChannelExtension, IDE_GP_LOG_COMMAND_DURATION_LIMITS, 0, FALSE);
+        }
+
+    } else if ( (completedLogAddress == IDE_GP_LOG_IDENTIFY_DEVICE_DATA_ADDRESS) && (completedPageNumber == IDE_GP_LOG_IDENTIFY_DEVICE_DATA_CURRENT_SETTINGS_PAGE) ) {
+        // the issued command was for getting Current Settings page of identify device data log
+
+        if (Srb->SrbStatus == SRB_STATUS_SUCCESS) {
+            ULONGLONG currentSettings;
+
+            // Current Settings qword at offset 8: bit 63 - valid, bit 21 - Command Duration Limits enabled.
+            StorPortCopyMemory(&currentSettings, (PUCHAR)ChannelExtension->DeviceExtension->ReadLogExtPageData + 8, sizeof(ULONGLONG));
+
+            ChannelExtension->CommandDurationLimits.DeviceEnabled = (BOOLEAN)(((currentSettings & (1ULL << 63)) != 0) && ((currentSettings & (1ULL << 21)) != 0));
+        } else {
+            ChannelExtension->DeviceExtension->SupportedGPLPages.IdentifyDeviceData.CurrentSettings = 0;
+        }
+
+    } else if ( (completedLogAddress == IDE_GP_LOG_COMMAND_DURATION_LIMITS) && (completedPageNumber == 0) ) {
+        // the issued command was for getting Command Duration Limits log
+
+        if (Srb->SrbStatus == SRB_STATUS_SUCCESS) {
+            PUCHAR  logPage = (PUCHAR)ChannelExtension->DeviceExtension->ReadLogExtPageData;
+            ULONG   limits[3];
+            ULONG   i;
+
+            // 7 read descriptors from offset 64, 7 write descriptors from offset 288, 32 bytes each.
+            // A descriptor sets a limit if its max active time (offset 4), max inactive time (offset 8) or duration guideline (offset 16) is set.
+            ChannelExtension->CommandDurationLimits.ReadDescriptors = 0;
+            ChannelExtension->CommandDurationLimits.WriteDescriptors = 0;
+
+            for (i = 1; i <= AHCI_CDL_MAX_INDEX; i++) {
+                StorPortCopyMemory(&limits[0], logPage + 64 + (i - 1) * 32 + 4, 2 * sizeof(ULONG));
+                StorPortCopyMemory(&limits[2], logPage + 64 + (i - 1) * 32 + 16, sizeof(ULONG));
+                if ((limits[0] | limits[1] | limits[2]) != 0) {
+                    ChannelExtension->CommandDurationLimits.ReadDescriptors |= (UCHAR)(1 << i);
+                }
+
+                StorPortCopyMemory(&limits[0], logPage + 288 + (i - 1) * 32 + 4, 2 * sizeof(ULONG));
+                StorPortCopyMemory(&limits[2], logPage + 288 + (i - 1) * 32 + 16, sizeof(ULONG));
+                if ((limits[0] | limits[1] | limits[2]) != 0) {
+                    ChannelExtension->CommandDurationLimits.WriteDescriptors |= (UCHAR)(1 << i);
+                }
+            }
+        } else {
+            ChannelExtension->DeviceExtension->SupportedGPLPages.SinglePage.CommandDurationLimits = 0;
+        }
+
     } else if ( (completedLogAddress == IDE_GP_LOG_SAVED_DEVICE_INTERNAL_STATUS) && (completedPageNumber == 0) ) {
         // the issued command was for getting saved device internal data log
 
@@ -1148,6 +1300,7 @@ AhciPortIdentifyDevice(
     } else if (Srb->SrbStatus == SRB_STATUS_NO_DEVICE) {
         // command failed consider as no device
         ChannelExtension->DeviceExtension->DeviceParameters.AtaDeviceType = DeviceNotExist;
+        ChannelExtension->DeviceExtension->InquiryCache.Valid = FALSE;
     }
 
     // Identify Device can only be triggered from REPORT LUNS command or
@@ -1281,8 +1434,6 @@ AhciPortSmartCompletion(
     PAHCI_SRB_EXTENSION         srbExtension;
     PUCHAR                      buffer;//to make the pointer arithmatic easier
 
-    UNREFERENCED_PARAMETER(ChannelExtension);
-
     buffer       = (PUCHAR)SrbGetDataBuffer(Srb) + sizeof(SRB_IO_CONTROL);
     outParams    = (PSENDCMDOUTPARAMS) buffer;                          //26015: "Potential overflow using expression 'outParams->DriverStatus.bDriverError'  Buffer access is apparently unbounded by the buffer size.
     srbExtension = GetSrbExtension(Srb);
@@ -1293,6 +1444,8 @@ AhciPortSmartCompletion(
         outParams->DriverStatus.bDriverError = 0;
         outParams->DriverStatus.bIDEError = 0;
 
+        SmartCacheUpdate(ChannelExtension, Srb);
+
     } else  {
         // command failed
         outParams->DriverStatus.bDriverError = SMART_IDE_ERROR;
@@ -1349,6 +1502,258 @@ Affected Variables/Registers:
     return;
 }
 
+VOID
+SctErcUpdateCommands(
+    __in PAHCI_CHANNEL_EXTENSION ChannelExtension
+    )
+/*++
+    Decides which SCT Error Recovery Control timers are sent with the preserved settings.
+    SCT commands are sent by WRITE LOG EXT, so General Purpose Logging is required too.
+Called by:
+    AhciDeviceApplyRegistrySettings
+    PortSctErcIoctlProcess
+--*/
+{
+    USHORT sctCommandTransport;
+
+    ChannelExtension->SctErc.Commands = 0;
+
+    if (!IsDeviceGeneralPurposeLoggingSupported(ChannelExtension)) {
+        return;
+    }
+
+    sctCommandTransport = ((PUSHORT)ChannelExtension->DeviceExtension->IdentifyDeviceData)[IDENTIFY_WORD_SCT_COMMAND_TRANSPORT];
+
+    if ( ((sctCommandTransport & 0x1) == 0) || ((sctCommandTransport & 0x8) == 0) ) {
+        return;
+    }
+
+    if (ChannelExtension->SctErc.ReadTimeout != 0) {
+        ChannelExtension->SctErc.Commands |= AHCI_SCT_ERC_READ;
+    }
+
+    if (ChannelExtension->SctErc.WriteTimeout != 0) {
+        ChannelExtension->SctErc.Commands |= AHCI_SCT_ERC_WRITE;
+    }
+
+    return;
+}
+
+VOID
+SctErcCompletion(
+    __in PAHCI_CHANNEL_EXTENSION ChannelExtension,
+    __in_opt PSCSI_REQUEST_BLOCK_EX Srb
+  )
+/*++
+    Records the result of a SCT Error Recovery Control command, then continues with the preserved settings.
+Called by:
+    Local SRB completion
+--*/
+{
+    if ((Srb != NULL) && (Srb->SrbStatus == SRB_STATUS_SUCCESS)) {
+        ChannelExtension->SctErc.Applied |= ChannelExtension->SctErc.CommandInProgress;
+        AhciUlongIncrement(&ChannelExtension->SctErc.AppliedCount);
+    } else {
+        ChannelExtension->SctErc.Applied &= (UCHAR)~ChannelExtension->SctErc.CommandInProgress;
+        AhciUlongIncrement(&ChannelExtension->SctErc.FailedCount);
+
+        StorPortDebugPrint(3, "StorAHCI - SCT ERC: Port %02d - %s timer not accepted by device\n",
+                           ChannelExtension->PortNumber, (ChannelExtension->SctErc.CommandInProgress == AHCI_SCT_ERC_READ) ? "read" : "write");
+    }
+
+    ChannelExtension->SctErc.CommandInProgress = 0;
+
+    IssuePreservedSettingCommands(ChannelExtension, Srb);
+
+    return;
+}
+
+VOID
+IssueSctErcCommand(
+    __in PAHCI_CHANNEL_EXTENSION ChannelExtension
+    )
+/*++
+    Uses the local SRB to send the next SCT Error Recovery Control timer: WRITE LOG EXT of the SCT command key sector.
+It assumes:
+    Local SRB is not in use and SctErc.CommandsToSend is not 0
+Called by:
+    IssuePreservedSettingCommands
+
+It performs:
+    1 Pick the timer to send
+    2 Fill in the SCT command key sector
+    3 Fill in the local SRB with WRITE LOG EXT command
+
+Affected Variables/Registers:
+    none
+--*/
+{
+    ATA_TASK_FILE       taskFile = {0};
+    PAHCI_SRB_EXTENSION srbExtension;
+    USHORT              selectionCode;
+    USHORT              timeout;
+
+  //1 Pick the timer to send
+    if ((ChannelExtension->SctErc.CommandsToSend & AHCI_SCT_ERC_READ) != 0) {
+        ChannelExtension->SctErc.CommandInProgress = AHCI_SCT_ERC_READ;
+        selectionCode = IDE_SCT_ERC_SELECTION_READ_TIMER;
+        timeout = ChannelExtension->SctErc.ReadTimeout;
+    } else {
+        ChannelExtension->SctErc.CommandInProgress = AHCI_SCT_ERC_WRITE;
+        selectionCode = IDE_SCT_ERC_SELECTION_WRITE_TIMER;
+        timeout = ChannelExtension->SctErc.WriteTimeout;
+    }
+    ChannelExtension->SctErc.CommandsToSend &= (UCHAR)~ChannelExtension->SctErc.CommandInProgress;
+
+  //2 Fill in the SCT command key sector
+    AhciZeroMemory((PCHAR)ChannelExtension->SctErc.CommandData, ATA_BLOCK_SIZE);
+    ChannelExtension->SctErc.CommandData[0] = IDE_SCT_ACTION_ERROR_RECOVERY_CONTROL;
+    ChannelExtension->SctErc.CommandData[1] = IDE_SCT_ERC_FUNCTION_SET_TIMER;
+    ChannelExtension->SctErc.CommandData[2] = selectionCode;
+    ChannelExtension->SctErc.CommandData[3] = timeout;
+
+  //3 Fill in the local SRB with WRITE LOG EXT command, one block of log IDE_GP_LOG_SCT_COMMAND_STATUS
+    taskFile.Current.bSectorCountReg = 1;
+    taskFile.Current.bSectorNumberReg = IDE_GP_LOG_SCT_COMMAND_STATUS;
+    taskFile.Current.bDriveHeadReg = 0xA0 | IDE_LBA_MODE;
+    taskFile.Current.bCommandReg = IDE_COMMAND_WRITE_LOG_EXT;
+
+    BuildLocalCommand(ChannelExtension, &taskFile, SctErcCompletion);
+
+    srbExtension = ChannelExtension->Local.SrbExtension;
+    srbExtension->Flags |= ATA_FLAGS_DATA_OUT;
+    srbExtension->Flags |= ATA_FLAGS_48BIT_COMMAND;
+    srbExtension->DataBuffer = (PVOID)ChannelExtension->SctErc.CommandData;
+
+    srbExtension->LocalSgl.NumberOfElements = 1;
+    srbExtension->LocalSgl.List[0].PhysicalAddress.LowPart = ChannelExtension->SctErc.CommandDataPhysicalAddress.LowPart;
+    srbExtension->LocalSgl.List[0].PhysicalAddress.HighPart = ChannelExtension->SctErc.CommandDataPhysicalAddress.HighPart;
+    srbExtension->LocalSgl.List[0].Length = ATA_BLOCK_SIZE;
+    srbExtension->Sgl = &srbExtension->LocalSgl;
+    srbExtension->DataTransferLength = ATA_BLOCK_SIZE;
+
+    return;
+}
+
+VOID
+AhciStreamingInitialize(
+    __in PAHCI_CHANNEL_EXTENSION ChannelExtension
+    )
+/*++
+    Decides which streams are set up by CONFIGURE STREAM and converts the time limits to CCTL of the device.
+    LBA ranges of the streams are set by IOCTL, they are kept and apply again once the streams are set up.
+Called by:
+    AhciDeviceApplyRegistrySettings
+--*/
+{
+    PUSHORT identifyWords = (PUSHORT)ChannelExtension->DeviceExtension->IdentifyDeviceData;
+    UCHAR   i;
+
+    ChannelExtension->Streaming.Streams = 0;
+    ChannelExtension->Streaming.StreamsConfigured = 0;
+
+    if ( (ChannelExtension->Streaming.StreamCount == 0) ||
+         !IsDeviceSupportsStreaming(ChannelExtension) ) {
+        return;
+    }
+
+    ChannelExtension->Streaming.Granularity = identifyWords[IDENTIFY_WORD_STREAM_GRANULARITY] | ((ULONG)identifyWords[IDENTIFY_WORD_STREAM_GRANULARITY + 1] << 16);
+
+    if (ChannelExtension->Streaming.AllocationUnit == 0) {
+        ChannelExtension->Streaming.AllocationUnit = identifyWords[IDENTIFY_WORD_STREAM_MIN_REQUEST_SIZE];
+    }
+
+    ChannelExtension->Streaming.DefaultTimeLimit = GetStreamCommandTimeLimit(ChannelExtension, ChannelExtension->Streaming.TimeLimit * 1000);
+
+    InterlockedIncrement(&ChannelExtension->Streaming.SettingsGeneration);
+
+    for (i = 0; i < AHCI_STREAM_COUNT; i++) {
+        ChannelExtension->Streaming.CommandTimeLimit[i] = GetStreamCommandTimeLimit(ChannelExtension, ChannelExtension->Streaming.Settings[i].TimeLimit);
+    }
+
+    InterlockedIncrement(&ChannelExtension->Streaming.SettingsGeneration);
+
+    ChannelExtension->Streaming.Streams = (UCHAR)((1 << ChannelExtension->Streaming.StreamCount) - 1);
+
+    return;
+}
+
+VOID
+ConfigureStreamCompletion(
+    __in PAHCI_CHANNEL_EXTENSION ChannelExtension,
+    __in_opt PSCSI_REQUEST_BLOCK_EX Srb
+  )
+/*++
+    Records the result of a CONFIGURE STREAM command, then continues with the preserved settings.
+Called by:
+    Local SRB completion
+--*/
+{
+    UCHAR stream = (UCHAR)(1 << ChannelExtension->Streaming.StreamInProgress);
+
+    if ((Srb != NULL) && (Srb->SrbStatus == SRB_STATUS_SUCCESS)) {
+        ChannelExtension->Streaming.StreamsConfigured |= stream;
+    } else {
+        ChannelExtension->Streaming.StreamsConfigured &= (UCHAR)~stream;
+
+        StorPortDebugPrint(3, "StorAHCI - Streaming: Port %02d - stream %d not accepted by device\n",
+                           ChannelExtension->PortNumber, ChannelExtension->Streaming.StreamInProgress);
+    }
+
+    IssuePreservedSettingCommands(ChannelExtension, Srb);
+
+    return;
+}
+
+VOID
+IssueConfigureStreamCommand(
+    __in PAHCI_CHANNEL_EXTENSION ChannelExtension
+    )
+/*++
+    Uses the local SRB to send CONFIGURE STREAM for the next stream to set up.
+It assumes:
+    Local SRB is not in use and Streaming.StreamsToConfigure is not 0
+Called by:
+    IssuePreservedSettingCommands
+
+It performs:
+    1 Pick the stream to set up
+    2 Fill in the local SRB with CONFIGURE STREAM command, adding the stream with the default time limit and allocation unit
+
+Affected Variables/Registers:
+    none
+--*/
+{
+    ATA_TASK_FILE   taskFile = {0};
+    UCHAR           i;
+
+  //1 Pick the stream to set up
+    for (i = 0; i < AHCI_STREAM_COUNT; i++) {
+        if ((ChannelExtension->Streaming.StreamsToConfigure & (1 << i)) != 0) {
+            break;
+        }
+    }
+
+    NT_ASSERT(i < AHCI_STREAM_COUNT);
+
+    ChannelExtension->Streaming.StreamsToConfigure &= (UCHAR)~(1 << i);
+    ChannelExtension->Streaming.StreamInProgress = i;
+
+  //2 Fill in the local SRB with CONFIGURE STREAM command
+    taskFile.Current.bFeaturesReg = IDE_STREAM_CONFIGURE_ADD | i;
+    taskFile.Previous.bFeaturesReg = ChannelExtension->Streaming.DefaultTimeLimit;
+    taskFile.Current.bSectorCountReg = (UCHAR)(ChannelExtension->Streaming.AllocationUnit & 0xFF);
+    taskFile.Previous.bSectorCountReg = (UCHAR)(ChannelExtension->Streaming.AllocationUnit >> 8);
+    taskFile.Current.bDriveHeadReg = 0xA0 | IDE_LBA_MODE;
+    taskFile.Current.bCommandReg = IDE_COMMAND_CONFIGURE_STREAM;
+
+    BuildLocalCommand(ChannelExtension, &taskFile, ConfigureStreamCompletion);
+
+    ChannelExtension->Local.SrbExtension->Flags |= ATA_FLAGS_48BIT_COMMAND;
+
+    return;
+}
+
 VOID
 IssuePreservedSettingCommands(
     __in PAHCI_CHANNEL_EXTENSION ChannelExtension,
@@ -1373,15 +1778,12 @@ Affected Variables/Registers:
 --*/
 {
     UCHAR           i;
-    ULONG           allocated;
     ATA_TASK_FILE   taskFile = {0};
 
     UNREFERENCED_PARAMETER(Srb);
 
   //1 Verify local SRB is not in use
-    allocated = GetOccupiedSlots(ChannelExtension);
-
-    if ((allocated & (1 << 0)) > 0) {
+    if (IsLocalSrbInUse(ChannelExtension)) {
         // Already restoring preserved Settings
         return;
     }
@@ -1396,6 +1798,18 @@ Affected Variables/Registers:
 
     //perhaps there is none.  Done.
     if ( i >= MAX_SETTINGS_PRESERVED) {
+      // SCT Error Recovery Control timers follow the SET FEATURES commands
+        if (ChannelExtension->SctErc.CommandsToSend != 0) {
+            IssueSctErcCommand(ChannelExtension);
+            return;
+        }
+
+      // then the streams are set up
+        if (ChannelExtension->Streaming.StreamsToConfigure != 0) {
+            IssueConfigureStreamCommand(ChannelExtension);
+            return;
+        }
+
       // release active reference for process of restore preserved settings
         if (ChannelExtension->StateFlags.RestorePreservedSettingsActiveReferenced == 1) {
             PortReleaseActiveReference(ChannelExtension, NULL);
@@ -1440,15 +1854,12 @@ Affected Variables/Registers:
     none
 --*/
 {
-    ULONG           allocated;
     PATA_TASK_FILE  taskFile;
 
     UNREFERENCED_PARAMETER(Srb);
 
   // Verify local SRB is not in use
-    allocated = GetOccupiedSlots(ChannelExtension);
-
-    if ((allocated & (1 << 0)) > 0) {
+    if (IsLocalSrbInUse(ChannelExtension)) {
         // Already restoring preserved Settings
         return;
     }
@@ -1456,6 +1867,8 @@ Affected Variables/Registers:
   // if all Init commands have been sent, send Preserved Setting Commands
     if (ChannelExtension->DeviceInitCommands.CommandToSend >= ChannelExtension->DeviceInitCommands.ValidCommandCount) {
         ChannelExtension->PersistentSettings.SlotsToSend = ChannelExtension->PersistentSettings.Slots;
+        ChannelExtension->SctErc.CommandsToSend = ChannelExtension->SctErc.Commands;
+        ChannelExtension->Streaming.StreamsToConfigure = ChannelExtension->Streaming.Streams;
         IssuePreservedSettingCommands(ChannelExtension, NULL);
         return;
     }
@@ -1605,9 +2018,15 @@ AhciDeviceInitialize (
     //3.2 retrieve _GTF commands and add needed commands in list.
     AhciPortGetInitCommands(ChannelExtension);
 
+  //4.1 Apply settings read from registry, the commands are sent with the preserved settings.
+    AhciDeviceApplyRegistrySettings(ChannelExtension);
+
   //5.1 Configure device with init commands and persistent configuration commands
     AhciPortIssueInitCommands(ChannelExtension);
 
+  //5.2 Adaptive link power management is configured but OS didn't deliver LPM setting (e.g. no power setting notification before Windows 8).
+    AhciLpmAdaptiveDefaultModes(ChannelExtension);
+
     StorPortAcquireSpinLock(ChannelExtension->AdapterExtension, InterruptLock, NULL, &lockhandle);
     ActivateQueue(ChannelExtension, TRUE);
     StorPortReleaseSpinLock(ChannelExtension->AdapterExtension, &lockhandle);
@@ -1617,54 +2036,683 @@ AhciDeviceInitialize (
 }
 
 VOID
-AhciDeviceStart (
+AhciLpmAdaptiveDefaultModes (
     __in PAHCI_CHANNEL_EXTENSION ChannelExtension
     )
-/*
-    Running at PASSIVE_LEVEL
-
-    This function is called when IRP_MN_START_DEVICE is being processed.
-    device registry access, ACPI calls can be processed in this function.
-*/
+/*++
+    Adaptive link power management is configured but OS didn't deliver LPM setting (no power setting notification before Windows 8).
+    Allows HIPM and DIPM so that the adaptive policy has link states to choose from. DIPM command is sent with the preserved settings.
+Called by:
+    AhciDeviceInitialize
+    AhciDeviceStartWithoutUnitControl
+--*/
 {
-    if (ChannelExtension == NULL) {
+    AHCI_LPM_POWER_SETTINGS lpmMode;
+
+    if ( !IsAdaptiveLpmEnabled(ChannelExtension) ||
+         (ChannelExtension->StateFlags.LpmSettingReceived == 1) ) {
         return;
     }
 
-    AhciDeviceInitialize(ChannelExtension);
+    lpmMode.AsUlong = 0;
+    lpmMode.HipmEnabled = 1;
+    lpmMode.DipmEnabled = 1;
+
+    AhciLpmSettingsModes(ChannelExtension, lpmMode);    //ignore the returned value, the caller starts IO.
 
     return;
 }
 
-
-__inline
-BOOLEAN
-IsLpmModeSetting(
-    __in PSTOR_POWER_SETTING_INFO PowerInfo
+VOID
+AhciDeviceApplyRegistrySettings (
+    __in PAHCI_CHANNEL_EXTENSION ChannelExtension
     )
+/*++
+    Applies the port settings read by AhciPortReadRegistrySettings() to the device. Commands enabling features are added to
+    the preserved settings, the caller sends them.
+It assumes:
+    IDENTIFY DEVICE data has been digested by UpdateDeviceParameters()
+Called by:
+    AhciDeviceInitialize
+    AhciDeviceStartWithoutUnitControl
+
+It performs:
+    1 Enable DevSleep if it's configured and supported
+    2 SCT Error Recovery Control timers configured in registry
+    3 Enable Sense Data Reporting if it's supported but not enabled yet
+    4 Enable Command Duration Limits if it's configured and supported but not enabled yet
+    5 Set up streams if configured and supported
+--*/
 {
-    if (PowerInfo->PowerSettingGuid.Data1 == 0x0b2d69d7) {
-        if (PowerInfo->PowerSettingGuid.Data2 == 0xa2a1){
-            if (PowerInfo->PowerSettingGuid.Data3 == 0x449c){
-                if (PowerInfo->PowerSettingGuid.Data4[0] == 0x96){
-                    if (PowerInfo->PowerSettingGuid.Data4[1] == 0x80){
-                        if (PowerInfo->PowerSettingGuid.Data4[2] == 0xf9){
-                            if (PowerInfo->PowerSettingGuid.Data4[3] == 0x1c){
-                                if (PowerInfo->PowerSettingGuid.Data4[4] == 0x70){
-                                    if (PowerInfo->PowerSettingGuid.Data4[5] == 0x52){
-                                        if (PowerInfo->PowerSettingGuid.Data4[6] == 0x1c){
-                                            if (PowerInfo->PowerSettingGuid.Data4[7] == 0x60){
-                                                return TRUE;
-                                            }  }  }  }  }  }  } }  }  }  }
+  //1 Enable DevSleep if it's configured and supported.
+    if (IsAtaDevice(&ChannelExtension->DeviceExtension->DeviceParameters)) {
+        AhciDevSleepInitialize(ChannelExtension);
+    }
 
-    return FALSE;
-}
+  //2 SCT Error Recovery Control timers configured in registry are sent after the preserved settings.
+    SctErcUpdateCommands(ChannelExtension);
+    ChannelExtension->SctErc.Applied = 0;
 
-__inline
-BOOLEAN
-IsLpmAdaptiveSetting(
-    __in PSTOR_POWER_SETTING_INFO PowerInfo
-    )
+  //3 Enable Sense Data Reporting if it's supported but not enabled yet, a failed command then brings its sense data
+  //  (in the NCQ Command Error log for NCQ commands). The enable command is sent with the preserved settings.
+    if ( ChannelExtension->NcqAutosense.Enabled &&
+         IsDeviceSupportsSenseDataReporting(ChannelExtension) &&
+         !IsDeviceEnabledSenseDataReporting(ChannelExtension) ) {
+        UpdateSetFeatureCommands(ChannelExtension, IDE_FEATURE_INVALID, IDE_FEATURE_SENSE_DATA_REPORTING, 0, 1);
+    }
+
+  //4 Enable Command Duration Limits if it's configured and supported but not enabled yet, the enable command is sent with the preserved settings.
+    if ( IsAtaDevice(&ChannelExtension->DeviceExtension->DeviceParameters) &&
+         IsCommandDurationLimitsEnabled(ChannelExtension) &&
+         !ChannelExtension->CommandDurationLimits.DeviceEnabled ) {
+        UpdateSetFeatureCommands(ChannelExtension, IDE_FEATURE_INVALID, IDE_FEATURE_COMMAND_DURATION_LIMITS, 0, 1);
+    }
+
+  //5 Set up streams if configured and supported, CONFIGURE STREAM commands are sent after the preserved settings.
+    AhciStreamingInitialize(ChannelExtension);
+
+    return;
+}
+
+VOID
+AhciDeviceStartWithoutUnitControl (
+    __in PAHCI_CHANNEL_EXTENSION ChannelExtension
+    )
+/*++
+    Starts the device on Windows versions whose Storport doesn't call AhciHwUnitControl(ScsiUnitStart), AhciDeviceStart() is not
+    called there. Registry settings have been read by AhciHwPassiveInitialize(). ACPI _SDD and _GTF need PASSIVE_LEVEL and are not
+    evaluated, only the preserved settings are sent.
+It assumes:
+    Running at DISPATCH_LEVEL without InterruptLock held, in the completion routine of device enumeration.
+Called by:
+    ReportLunsComplete
+
+It performs:
+    1 Apply the registry settings and the adaptive link power management default modes
+    2 Send the preserved settings and start IO
+--*/
+{
+    STOR_LOCK_HANDLE lockhandle = {0};
+
+  //1 Apply the registry settings and the adaptive link power management default modes
+    AhciDeviceApplyRegistrySettings(ChannelExtension);
+    AhciLpmAdaptiveDefaultModes(ChannelExtension);
+
+  //2 Send the preserved settings and start IO
+    RestorePreservedSettings(ChannelExtension, FALSE);
+
+    StorPortAcquireSpinLock(ChannelExtension->AdapterExtension, InterruptLock, NULL, &lockhandle);
+    ActivateQueue(ChannelExtension, TRUE);
+    StorPortReleaseSpinLock(ChannelExtension->AdapterExtension, &lockhandle);
+
+    return;
+}
+
+VOID
+AhciPortReadRegistrySettings (
+    __in PAHCI_CHANNEL_EXTENSION ChannelExtension
+    )
+/*
+    Running at PASSIVE_LEVEL
+
+    Reads port settings from the miniport's "Parameters\Device" registry key, see AhciRegistryReadPortUlong().
+    Called by AhciHwPassiveInitialize() on every Windows version, and again by AhciDeviceStart() when Storport calls it.
+*/
+{
+    //1. Adaptive link power management: wake latency (in microseconds) the link may add to a command issued after idle.
+    //   Not set or 0 - adaptive policy is disabled.
+    ChannelExtension->LpmAdaptivePolicy.WakeLatencyBudget = AhciRegistryReadPortUlong(ChannelExtension, "LpmWakeLatencyBudget", 0);
+
+    if (IsAdaptiveLpmEnabled(ChannelExtension)) {
+        // start with Partial, the state HIPM uses without adaptive policy, until idle periods are learned.
+        if (ChannelExtension->LpmAdaptivePolicy.WakeLatencyBudget >= ChannelExtension->LpmStatistics.PartialExitLatency) {
+            ChannelExtension->LpmStatistics.PolicyState = LpmPolicyPartial;
+        } else {
+            ChannelExtension->LpmStatistics.PolicyState = LpmPolicyActive;
+        }
+    }
+
+    //2. DevSleep: idle time (in milliseconds) before the HBA asserts DEVSLP. Not set or 0 - DevSleep is not used.
+    //   DevSleep is part of the adaptive policy, it's entered only when the predicted idle time covers its exit cost.
+    ChannelExtension->LpmAdaptivePolicy.DevSleepIdleTimeout = AhciRegistryReadPortUlong(ChannelExtension, "DevSleepIdleTimeout", 0);
+
+    if (ChannelExtension->LpmAdaptivePolicy.DevSleepIdleTimeout > AHCI_DEVSLEEP_MAX_IDLE_TIMEOUT) {
+        ChannelExtension->LpmAdaptivePolicy.DevSleepIdleTimeout = AHCI_DEVSLEEP_MAX_IDLE_TIMEOUT;
+    }
+
+    if (ChannelExtension->LpmAdaptivePolicy.DevSleepIdleTimeout != 0) {
+        ULONG minAssertTime;
+        ULONG exitTimeout;
+
+        minAssertTime = AhciRegistryReadPortUlong(ChannelExtension, "DevSleepMinAssertTime", AHCI_DEVSLEEP_DEFAULT_MIN_ASSERT_TIME);
+        exitTimeout = AhciRegistryReadPortUlong(ChannelExtension, "DevSleepExitTimeout", AHCI_DEVSLEEP_DEFAULT_EXIT_TIMEOUT);
+
+        if ((minAssertTime == 0) || (minAssertTime > AHCI_DEVSLEEP_MAX_MIN_ASSERT_TIME)) {
+            minAssertTime = AHCI_DEVSLEEP_DEFAULT_MIN_ASSERT_TIME;
+        }
+
+        if ((exitTimeout == 0) || (exitTimeout > AHCI_DEVSLEEP_MAX_EXIT_TIMEOUT)) {
+            exitTimeout = AHCI_DEVSLEEP_DEFAULT_EXIT_TIMEOUT;
+        }
+
+        ChannelExtension->LpmAdaptivePolicy.DevSleepMinAssertTime = (UCHAR)minAssertTime;
+        ChannelExtension->LpmAdaptivePolicy.DevSleepExitTimeout = (UCHAR)exitTimeout;
+
+        // until it's measured, assume the device takes the whole exit timeout (DETO) to leave DevSleep.
+        ChannelExtension->LpmStatistics.DevSleepExitCost = exitTimeout * 1000;
+    }
+
+    //3. Non-queued command batching: time (in microseconds) a non-queued command may wait for others to share one drain of NCQ commands.
+    //   Not set or 0 - non-queued commands are issued as soon as outstanding NCQ commands complete.
+    ChannelExtension->NonQueuedScheduler.BatchWindow = AhciRegistryReadPortUlong(ChannelExtension, "NonQueuedBatchWindow", 0);
+    ChannelExtension->NonQueuedScheduler.BatchLimit = AhciRegistryReadPortUlong(ChannelExtension, "NonQueuedBatchLimit", AHCI_NONQUEUED_DEFAULT_BATCH_LIMIT);
+
+    if (ChannelExtension->NonQueuedScheduler.BatchWindow > AHCI_NONQUEUED_MAX_BATCH_WINDOW) {
+        ChannelExtension->NonQueuedScheduler.BatchWindow = AHCI_NONQUEUED_MAX_BATCH_WINDOW;
+    }
+
+    if (ChannelExtension->NonQueuedScheduler.BatchLimit == 0) {
+        ChannelExtension->NonQueuedScheduler.BatchLimit = AHCI_NONQUEUED_DEFAULT_BATCH_LIMIT;
+    }
+
+    //4. IO priority: which read/write requests are issued first and sent with NCQ PRIO high, see AHCI_IO_PRIORITY_CLASS.
+    //   Not set - requests with High or Critical IO priority hint.
+    ChannelExtension->IoPriorityClass = (AHCI_IO_PRIORITY_CLASS)AhciRegistryReadPortUlong(ChannelExtension, "NcqPriorityClass", AhciIoPriorityClassHint);
+
+    if (ChannelExtension->IoPriorityClass > AhciIoPriorityClassMax) {
+        ChannelExtension->IoPriorityClass = AhciIoPriorityClassHint;
+    }
+
+    //5. SRB queue weights: SRBs dequeued from each class per round of weighted round robin, see RemoveSrbQueue().
+    //   Not set or 0 - default weight.
+    {
+        PSTR    weightNames[AhciSrbQueueClassCount] = {"UrgentQueueWeight", "NormalQueueWeight", "BackgroundQueueWeight"};
+        ULONG   defaultWeights[AhciSrbQueueClassCount] = {AHCI_SRB_QUEUE_DEFAULT_WEIGHT_URGENT,
+                                                          AHCI_SRB_QUEUE_DEFAULT_WEIGHT_NORMAL,
+                                                          AHCI_SRB_QUEUE_DEFAULT_WEIGHT_BACKGROUND};
+        ULONG   weight;
+        ULONG   i;
+
+        for (i = 0; i < AhciSrbQueueClassCount; i++) {
+            weight = AhciRegistryReadPortUlong(ChannelExtension, weightNames[i], defaultWeights[i]);
+
+            if (weight == 0) {
+                weight = defaultWeights[i];
+            } else if (weight > AHCI_SRB_QUEUE_MAX_WEIGHT) {
+                weight = AHCI_SRB_QUEUE_MAX_WEIGHT;
+            }
+
+            ChannelExtension->SrbQueueScheduler.Weight[i] = weight;
+        }
+    }
+
+    //6. FUA opt-out: model numbers of devices whose FUA writes should not be used, see IsFuaOptOutDevice().
+    //   The device has been identified already, apply it now; UpdateDeviceParameters() applies it after later identify.
+    if (AhciRegistryReadMultiSz(ChannelExtension, "FuaOptOutDevices", ChannelExtension->FuaOptOutDevices, sizeof(ChannelExtension->FuaOptOutDevices)) &&
+        IsAtaDevice(&ChannelExtension->DeviceExtension->DeviceParameters) &&
+        IsFuaOptOutDevice(ChannelExtension)) {
+
+        STOR_LOCK_HANDLE lockhandle = {0};
+
+        StorPortAcquireSpinLock(ChannelExtension->AdapterExtension, InterruptLock, NULL, &lockhandle);
+        ChannelExtension->DeviceExtension->DeviceParameters.StateFlags.FuaSupported = 0;
+        ChannelExtension->DeviceExtension->DeviceParameters.StateFlags.NcqFuaSupported = 0;
+        StorPortReleaseSpinLock(ChannelExtension->AdapterExtension, &lockhandle);
+
+        StorPortDebugPrint(3, "StorAHCI - FUA: Port %02d - FUA writes disabled by FuaOptOutDevices\n", ChannelExtension->PortNumber);
+    }
+
+    //7. Throttle: read/write requests per second and KB per second of the port and of each SRB queue class, see AhciThrottleAdmit().
+    //   Not set or 0 - not limited. Can be changed at runtime by IOCTL_SCSI_MINIPORT_AHCI_PORT_THROTTLE.
+    {
+        PSTR                    iopsNames[AhciSrbQueueClassCount] = {"UrgentIopsLimit", "NormalIopsLimit", "BackgroundIopsLimit"};
+        PSTR                    bandwidthNames[AhciSrbQueueClassCount] = {"UrgentBandwidthLimit", "NormalBandwidthLimit", "BackgroundBandwidthLimit"};
+        AHCI_THROTTLE_LIMITS    limits = {0};
+        STOR_LOCK_HANDLE        lockhandle = {0};
+        ULONG                   i;
+
+        limits.IopsLimit = AhciRegistryReadPortUlong(ChannelExtension, "IopsLimit", 0);
+        limits.BandwidthLimit = AhciRegistryReadPortUlong(ChannelExtension, "BandwidthLimit", 0);
+
+        for (i = 0; i < AhciSrbQueueClassCount; i++) {
+            limits.ClassIopsLimit[i] = AhciRegistryReadPortUlong(ChannelExtension, iopsNames[i], 0);
+            limits.ClassBandwidthLimit[i] = AhciRegistryReadPortUlong(ChannelExtension, bandwidthNames[i], 0);
+        }
+
+        StorPortAcquireSpinLock(ChannelExtension->AdapterExtension, InterruptLock, NULL, &lockhandle);
+        AhciThrottleSetLimits(ChannelExtension, &limits);
+        StorPortReleaseSpinLock(ChannelExtension->AdapterExtension, &lockhandle);
+    }
+
+    //8. Adaptive queue depth: NCQ depth follows completion latency between MinQueueDepth and MaxQueueDepth, see AHCI_ADAPTIVE_QUEUE_DEPTH.
+    //   AdaptiveQueueDepth not set or 0 - the device's queue depth is used and MinQueueDepth/MaxQueueDepth are ignored.
+    //   With AdaptiveQueueDepth set, MinQueueDepth == MaxQueueDepth (above 1) pins the depth.
+    {
+        ULONG               enabled = AhciRegistryReadPortUlong(ChannelExtension, "AdaptiveQueueDepth", 0);
+        ULONG               minDepth = AhciRegistryReadPortUlong(ChannelExtension, "MinQueueDepth", AHCI_ADAPTIVE_QD_DEFAULT_FLOOR);
+        ULONG               maxDepth = AhciRegistryReadPortUlong(ChannelExtension, "MaxQueueDepth", ChannelExtension->MaxPortQueueDepth);
+        STOR_LOCK_HANDLE    lockhandle = {0};
+
+        if (maxDepth > ChannelExtension->MaxPortQueueDepth) {
+            maxDepth = ChannelExtension->MaxPortQueueDepth;
+        }
+        if (minDepth == 0) {
+            minDepth = 1;
+        }
+        if (minDepth > maxDepth) {
+            minDepth = maxDepth;
+        }
+
+        StorPortAcquireSpinLock(ChannelExtension->AdapterExtension, InterruptLock, NULL, &lockhandle);
+
+        AhciZeroMemory((PCHAR)&ChannelExtension->AdaptiveQueueDepth, sizeof(AHCI_ADAPTIVE_QUEUE_DEPTH));
+        ChannelExtension->AdaptiveQueueDepth.Floor = (UCHAR)minDepth;
+        ChannelExtension->AdaptiveQueueDepth.Ceiling = (UCHAR)maxDepth;
+        ChannelExtension->AdaptiveQueueDepth.QueueDepth = (UCHAR)maxDepth;
+        ChannelExtension->AdaptiveQueueDepth.Enabled = (BOOLEAN)((enabled != 0) && (maxDepth > 1));
+
+        ChannelExtension->AdaptiveQueueDepthStatistics.Enabled = ChannelExtension->AdaptiveQueueDepth.Enabled;
+        ChannelExtension->AdaptiveQueueDepthStatistics.Floor = minDepth;
+        ChannelExtension->AdaptiveQueueDepthStatistics.Ceiling = maxDepth;
+
+        StorPortReleaseSpinLock(ChannelExtension->AdapterExtension, &lockhandle);
+    }
+
+    //9. Set Device Bits FIS completion: NCQ completions are taken from the received FIS instead of PxCI/PxSACT/PxTFD, see AhciHwInterrupt().
+    //   Not set - enabled. 0 - disabled, for HBAs that don't post the SActive field of the FIS.
+    ChannelExtension->SdbFisCompletion = (AhciRegistryReadPortUlong(ChannelExtension, "SdbFisCompletion", 1) != 0) ? TRUE : FALSE;
+
+    //10. Hybrid polling: longest time (in microseconds) a single command issued to an idle port is polled before waiting for its interrupt.
+    //    Not set or 0 - not polled. Polling statistics tell if it pays off for the device, see AHCI_POLLING_STATISTICS.
+    ChannelExtension->PollingStatistics.BudgetLimit = min(AhciRegistryReadPortUlong(ChannelExtension, "PollingBudget", 0), AHCI_POLL_MAX_BUDGET);
+
+    //11. Command Duration Limits: "CommandDurationLimits" 1 - enable the feature on devices supporting it. Not set or 0 - not used.
+    //    Requests without DLD bits use descriptor "CdlHighPriorityDescriptor" with High/Critical IO priority hint and
+    //    "CdlLowPriorityDescriptor" with Low/Very Low hint, 1 to 7. Not set or 0 - no limit.
+    ChannelExtension->CommandDurationLimits.Configured = (AhciRegistryReadPortUlong(ChannelExtension, "CommandDurationLimits", 0) != 0) ? TRUE : FALSE;
+    ChannelExtension->CommandDurationLimits.HighPriorityIndex = (UCHAR)min(AhciRegistryReadPortUlong(ChannelExtension, "CdlHighPriorityDescriptor", 0), AHCI_CDL_MAX_INDEX);
+    ChannelExtension->CommandDurationLimits.LowPriorityIndex = (UCHAR)min(AhciRegistryReadPortUlong(ChannelExtension, "CdlLowPriorityDescriptor", 0), AHCI_CDL_MAX_INDEX);
+
+    //12. SCT Error Recovery Control: "SctErcReadTimeout" and "SctErcWriteTimeout" in units of 100 milliseconds, e.g. 70 for 7 seconds.
+    //    Sent to devices supporting it at device start and after every reset or resume. Not set or 0 - device keeps its own timer.
+    ChannelExtension->SctErc.ReadTimeout = (USHORT)min(AhciRegistryReadPortUlong(ChannelExtension, "SctErcReadTimeout", 0), 0xFFFF);
+    ChannelExtension->SctErc.WriteTimeout = (USHORT)min(AhciRegistryReadPortUlong(ChannelExtension, "SctErcWriteTimeout", 0), 0xFFFF);
+
+    //13. Streaming: "StreamCount" streams (up to 8) are set up on devices supporting the Streaming feature set. Not set or 0 - not used.
+    //    "StreamAllocationUnit" in logical sectors, not set or 0 - Stream Minimum Request Size of the device.
+    //    "StreamTimeLimit" in milliseconds, default completion time limit of stream commands. Not set or 0 - device default.
+    //    Requests go to a stream once its LBA range is set by IOCTL_SCSI_MINIPORT_AHCI_PORT_STREAMING.
+    ChannelExtension->Streaming.StreamCount = (UCHAR)min(AhciRegistryReadPortUlong(ChannelExtension, "StreamCount", 0), AHCI_STREAM_COUNT);
+    ChannelExtension->Streaming.AllocationUnit = (USHORT)min(AhciRegistryReadPortUlong(ChannelExtension, "StreamAllocationUnit", 0), 0xFFFF);
+    ChannelExtension->Streaming.TimeLimit = min(AhciRegistryReadPortUlong(ChannelExtension, "StreamTimeLimit", 0), 0xFFFFFFFF / 1000);
+
+    //14. Sense Data Reporting: "SenseDataReporting" not set or non-zero - enabled on devices supporting it. An NCQ command error is then
+    //    recovered by reading the NCQ Command Error log, which names the failed command and its sense data, instead of COMRESET. 0 - not used.
+    ChannelExtension->NcqAutosense.Enabled = (AhciRegistryReadPortUlong(ChannelExtension, "SenseDataReporting", 1) != 0);
+
+    //15. SMART cache: "SmartCacheTimeout" in milliseconds, SMART READ DATA, SMART READ THRESHOLDS and IDENTIFY DEVICE data of
+    //    SMART IOCTLs is returned without sending the non-queued command again within this time. Not set - 5 seconds, 0 - not cached.
+    ChannelExtension->SmartCache.Timeout = AhciRegistryReadPortUlong(ChannelExtension, "SmartCacheTimeout", AHCI_SMART_CACHE_DEFAULT_TIMEOUT);
+
+    //16. Hybrid cache promotion: "HybridPromoteBudget" hottest read extents of a hybrid device are promoted to its caching medium
+    //    by HYBRID CHANGE BY LBA RANGE every "HybridPromoteInterval" seconds (not set or 0 - 60), with hybrid priority
+    //    "HybridPromotePriority" (not set - 1, limited to the maximum level of the device). Budget not set - 4, 0 - reads are not tracked.
+    ChannelExtension->HotLba.Budget = min(AhciRegistryReadPortUlong(ChannelExtension, "HybridPromoteBudget", AHCI_HOT_LBA_DEFAULT_BUDGET), AHCI_HOT_LBA_TOP_COUNT);
+    ChannelExtension->HotLba.Interval = AhciRegistryReadPortUlong(ChannelExtension, "HybridPromoteInterval", AHCI_HOT_LBA_DEFAULT_INTERVAL);
+    ChannelExtension->HotLba.Priority = (UCHAR)min(AhciRegistryReadPortUlong(ChannelExtension, "HybridPromotePriority", AHCI_HOT_LBA_DEFAULT_PRIORITY), 0xF);
+
+    if (ChannelExtension->HotLba.Interval == 0) {
+        ChannelExtension->HotLba.Interval = AHCI_HOT_LBA_DEFAULT_INTERVAL;
+    }
+
+    return;
+}
+
+BOOLEAN
+AhciDevSleepProgramTiming (
+    __in PAHCI_CHANNEL_EXTENSION ChannelExtension
+    )
+/*++
+    Programs PxDEVSLP.DITO/DM/MDAT/DETO with PxDEVSLP.ADSE cleared. AHCI 1.3.1 section 3.3.17 requires PxCMD.ST to be cleared
+    when these fields are changed. The port is never stopped here, a running port is handled by AhciDevSleepTimingCallback().
+
+It assumes:
+    Called with InterruptLock held, or from port start process before PxCMD.ST is set.
+
+Called by:
+    AhciDevSleepInitialize, AhciDevSleepTimingCallback, P_Running_WaitOnBSYDRQ
+
+Return Value:
+    TRUE if the timing is programmed. FALSE if the port is running, it will be programmed when the port is started next time.
+--*/
+{
+    PAHCI_ADAPTER_EXTENSION adapterExtension = ChannelExtension->AdapterExtension;
+    AHCI_COMMAND            cmd;
+    AHCI_DEVICE_SLEEP       devslp;
+    ULONG                   idleTimeout = ChannelExtension->LpmAdaptivePolicy.DevSleepIdleTimeout;
+    ULONG                   multiplier;
+
+    if ( (adapterExtension->CAP2.SDS == 0) || (idleTimeout == 0) ) {
+        return FALSE;
+    }
+
+  //1 Command processing must be stopped.
+    cmd.AsUlong = StorPortReadRegisterUlong(adapterExtension, &ChannelExtension->Px->CMD.AsUlong);
+
+    if ( (cmd.ST == 1) || (cmd.CR == 1) ) {
+        return FALSE;
+    }
+
+  //2 DITO * (DM + 1) is the idle timeout, use the smallest multiplier that makes DITO fit in 10 bits.
+    multiplier = (idleTimeout - 1) / 1023;
+    if (multiplier > 15) {
+        multiplier = 15;
+    }
+
+    devslp.AsUlong = StorPortReadRegisterUlong(adapterExtension, &ChannelExtension->Px->DEVSLP.AsUlong);
+    devslp.ADSE = 0;
+    StorPortWriteRegisterUlong(adapterExtension, &ChannelExtension->Px->DEVSLP.AsUlong, devslp.AsUlong);
+
+    devslp.DM = multiplier;
+    devslp.DITO = (idleTimeout + multiplier) / (multiplier + 1);
+    devslp.MDAT = ChannelExtension->LpmAdaptivePolicy.DevSleepMinAssertTime;
+    devslp.DETO = ChannelExtension->LpmAdaptivePolicy.DevSleepExitTimeout;
+    StorPortWriteRegisterUlong(adapterExtension, &ChannelExtension->Px->DEVSLP.AsUlong, devslp.AsUlong);
+
+    ChannelExtension->StateFlags.DevSleepTimingSet = 1;
+    ChannelExtension->LpmAdaptivePolicy.DevSleepTimingStep = AHCI_DEVSLEEP_TIMING_IDLE;
+
+  //3 Allow DevSleep again if adaptive policy chose it before the port was restarted.
+    AhciDevSleepSetAggressive(ChannelExtension,
+                              (ChannelExtension->LastUserLpmPowerSetting != 0) && (ChannelExtension->LpmStatistics.PolicyState == LpmPolicyDevSleep));
+
+    return TRUE;
+}
+
+VOID
+AhciDevSleepRestartPort (
+    __in PAHCI_CHANNEL_EXTENSION ChannelExtension
+    )
+/*++
+    Sets PxCMD.ST again after PxDEVSLP has been programmed or PxCMD.CR didn't clear, and programs the IO that waited meanwhile.
+
+It assumes:
+    Called with InterruptLock held
+--*/
+{
+    AHCI_COMMAND cmd;
+
+    cmd.AsUlong = StorPortReadRegisterUlong(ChannelExtension->AdapterExtension, &ChannelExtension->Px->CMD.AsUlong);
+    cmd.ST = 1;
+    StorPortWriteRegisterUlong(ChannelExtension->AdapterExtension, &ChannelExtension->Px->CMD.AsUlong, cmd.AsUlong);
+    ChannelExtension->ShadowStarted = TRUE;
+
+    ChannelExtension->LpmAdaptivePolicy.DevSleepTimingStep = AHCI_DEVSLEEP_TIMING_IDLE;
+
+    AhciGetNextIos(ChannelExtension, TRUE);
+
+    return;
+}
+
+VOID
+AhciDevSleepTimingCallback (
+    __in PVOID AdapterExtension,
+    __in_opt PVOID ChannelExtension
+    )
+/*++
+    StartPortTimer callback, programs PxDEVSLP of a running port without stalling while InterruptLock is held.
+
+It assumes:
+    Requested by AhciDevSleepInitialize or by itself, only while the port is started.
+
+It performs:
+    1 Leave if the port has been restarted meanwhile, the port start process programs PxDEVSLP
+    2 Wait for the port to be idle, then clear PxCMD.ST. ActivateQueue doesn't program IO while ShadowStarted is FALSE
+    3 Check PxCMD.CR every 5ms, program PxDEVSLP once it's cleared and start the port again
+--*/
+{
+    PAHCI_CHANNEL_EXTENSION     channelExtension = (PAHCI_CHANNEL_EXTENSION)ChannelExtension;
+    PAHCI_LPM_ADAPTIVE_POLICY   policy;
+    STOR_LOCK_HANDLE            lockhandle = {0};
+    AHCI_COMMAND                cmd;
+    ULONG                       interval = 0;
+    ULONG                       status;
+
+    if (channelExtension == NULL) {
+        NT_ASSERT(FALSE);
+        return;
+    }
+
+    UNREFERENCED_PARAMETER(AdapterExtension);
+
+    policy = &channelExtension->LpmAdaptivePolicy;
+
+    StorPortAcquireSpinLock(channelExtension->AdapterExtension, InterruptLock, NULL, &lockhandle);
+
+  //1 Leave if the port has been restarted meanwhile
+    if ( (channelExtension->StartState.ChannelNextStartState != StartComplete) ||
+         (channelExtension->StateFlags.DevSleepEnabled == 0) ||
+         (channelExtension->StateFlags.DevSleepTimingSet == 1) ) {
+
+        policy->DevSleepTimingStep = AHCI_DEVSLEEP_TIMING_IDLE;
+
+    } else if (policy->DevSleepTimingStep == AHCI_DEVSLEEP_TIMING_WAIT_PORT_IDLE) {
+  //2 Wait for the port to be idle, then clear PxCMD.ST
+        if (channelExtension->SlotManager.CommandsIssued != 0) {
+            interval = AHCI_DEVSLEEP_TIMING_IDLE_INTERVAL;
+        } else {
+            cmd.AsUlong = StorPortReadRegisterUlong(channelExtension->AdapterExtension, &channelExtension->Px->CMD.AsUlong);
+            cmd.ST = 0;
+            StorPortWriteRegisterUlong(channelExtension->AdapterExtension, &channelExtension->Px->CMD.AsUlong, cmd.AsUlong);
+            channelExtension->ShadowStarted = FALSE;
+
+            policy->DevSleepTimingStep = AHCI_DEVSLEEP_TIMING_WAIT_CR;
+            policy->DevSleepTimingPolls = 0;
+            interval = AHCI_DEVSLEEP_TIMING_CR_INTERVAL;
+        }
+
+    } else if (policy->DevSleepTimingStep == AHCI_DEVSLEEP_TIMING_WAIT_CR) {
+  //3 Check PxCMD.CR, program PxDEVSLP once it's cleared
+        if (AhciDevSleepProgramTiming(channelExtension)) {
+            AhciDevSleepRestartPort(channelExtension);
+        } else if (++policy->DevSleepTimingPolls < AHCI_DEVSLEEP_TIMING_CR_POLL_COUNT) {
+            interval = AHCI_DEVSLEEP_TIMING_CR_INTERVAL;
+        } else {
+            StorPortDebugPrint(3, "StorAHCI - LPM: Port %02d - DevSleep timing not programmed, PxCMD.CR didn't clear \n", channelExtension->PortNumber);
+            AhciDevSleepRestartPort(channelExtension);
+        }
+    }
+
+    if (interval != 0) {
+        status = StorPortRequestTimer(channelExtension->AdapterExtension, channelExtension->StartPortTimer, AhciDevSleepTimingCallback, channelExtension, interval, 0);
+
+        if ( (status != STOR_STATUS_SUCCESS) && (status != STOR_STATUS_BUSY) ) {
+            // no timer, PxDEVSLP is programmed when the port is started next time.
+            if (policy->DevSleepTimingStep == AHCI_DEVSLEEP_TIMING_WAIT_CR) {
+                AhciDevSleepRestartPort(channelExtension);
+            }
+            policy->DevSleepTimingStep = AHCI_DEVSLEEP_TIMING_IDLE;
+        }
+    }
+
+    StorPortReleaseSpinLock(channelExtension->AdapterExtension, &lockhandle);
+
+    return;
+}
+
+VOID
+AhciDevSleepSetAggressive (
+    __in PAHCI_CHANNEL_EXTENSION ChannelExtension,
+    __in BOOLEAN Enable
+    )
+/*++
+    Sets or clears PxDEVSLP.ADSE. When it's set, the HBA asserts DEVSLP after the port has been idle for PxDEVSLP.DITO * (DM + 1) ms.
+
+It assumes:
+    Called with InterruptLock held
+--*/
+{
+    AHCI_DEVICE_SLEEP devslp;
+    ULONG             adse = 0;
+
+    if (ChannelExtension->AdapterExtension->CAP2.SDS == 0) {
+        // PxDEVSLP is reserved.
+        return;
+    }
+
+    if ( Enable &&
+         (ChannelExtension->StateFlags.DevSleepEnabled == 1) &&
+         (ChannelExtension->StateFlags.DevSleepTimingSet == 1) ) {
+        adse = 1;
+    }
+
+    devslp.AsUlong = StorPortReadRegisterUlong(ChannelExtension->AdapterExtension, &ChannelExtension->Px->DEVSLP.AsUlong);
+    if (devslp.ADSE != adse) {
+        devslp.ADSE = adse;
+        StorPortWriteRegisterUlong(ChannelExtension->AdapterExtension, &ChannelExtension->Px->DEVSLP.AsUlong, devslp.AsUlong);
+
+        StorPortDebugPrint(3, "StorAHCI - LPM: Port %02d - DevSleep %s \n", ChannelExtension->PortNumber, adse ? "allowed" : "disallowed");
+    }
+
+    return;
+}
+
+VOID
+AhciDevSleepInitialize (
+    __in PAHCI_CHANNEL_EXTENSION ChannelExtension
+    )
+/*++
+    Enables DevSleep when it's configured (registry "DevSleepIdleTimeout"), adaptive link power management is enabled and
+    DevSleep is supported by the HBA (CAP2.SDS, CAP2.SADM), the platform (PxDEVSLP.DSP) and the device (IDENTIFY word 78 bit 8).
+
+    Running at PASSIVE_LEVEL
+
+Called by:
+    AhciDeviceInitialize
+--*/
+{
+    STOR_LOCK_HANDLE    lockhandle = {0};
+    AHCI_DEVICE_SLEEP   devslp;
+    BOOLEAN             deviceSupport;
+    BOOLEAN             enable = FALSE;
+
+    if (ChannelExtension->AdapterExtension->CAP2.SDS == 0) {
+        // PxDEVSLP is reserved.
+        return;
+    }
+
+    deviceSupport = IsDeviceSupportsDevSleep(ChannelExtension->DeviceExtension[0].IdentifyDeviceData);
+
+    devslp.AsUlong = StorPortReadRegisterUlong(ChannelExtension->AdapterExtension, &ChannelExtension->Px->DEVSLP.AsUlong);
+
+    if ( deviceSupport &&
+         (devslp.DSP == 1) &&
+         (ChannelExtension->AdapterExtension->CAP2.SADM == 1) &&
+         (ChannelExtension->LpmAdaptivePolicy.DevSleepIdleTimeout != 0) &&
+         IsAdaptiveLpmEnabled(ChannelExtension) ) {
+        enable = TRUE;
+    }
+
+  //1 Program PxDEVSLP, ADSE is set later by adaptive policy.
+    StorPortAcquireSpinLock(ChannelExtension->AdapterExtension, InterruptLock, NULL, &lockhandle);
+
+    ChannelExtension->StateFlags.DevSleepEnabled = enable ? 1 : 0;
+
+    if (enable) {
+        // a running port is stopped from StartPortTimer, not while InterruptLock is held.
+        if ( (ChannelExtension->StateFlags.DevSleepTimingSet == 0) &&
+             !AhciDevSleepProgramTiming(ChannelExtension) &&
+             (ChannelExtension->StartState.ChannelNextStartState == StartComplete) &&
+             (ChannelExtension->LpmAdaptivePolicy.DevSleepTimingStep == AHCI_DEVSLEEP_TIMING_IDLE) ) {
+            ULONG status;
+
+            status = StorPortRequestTimer(ChannelExtension->AdapterExtension, ChannelExtension->StartPortTimer, AhciDevSleepTimingCallback, ChannelExtension, AHCI_DEVSLEEP_TIMING_CR_INTERVAL, 0);
+
+            if ( (status == STOR_STATUS_SUCCESS) || (status == STOR_STATUS_BUSY) ) {
+                ChannelExtension->LpmAdaptivePolicy.DevSleepTimingStep = AHCI_DEVSLEEP_TIMING_WAIT_PORT_IDLE;
+            }
+        }
+    } else {
+        AhciDevSleepSetAggressive(ChannelExtension, FALSE);
+    }
+
+    StorPortReleaseSpinLock(ChannelExtension->AdapterExtension, &lockhandle);
+
+  //2 Device Sleep feature is reset to disabled upon COMRESET, keep it in persistent settings.
+    if (deviceSupport) {
+        if (enable) {
+            UpdateSetFeatureCommands(ChannelExtension,
+                                    IDE_FEATURE_DISABLE_SATA_FEATURE,
+                                    IDE_FEATURE_ENABLE_SATA_FEATURE,
+                                    IDE_SATA_FEATURE_DEVICE_SLEEP,
+                                    IDE_SATA_FEATURE_DEVICE_SLEEP);
+        } else {
+            UpdateSetFeatureCommands(ChannelExtension,
+                                    IDE_FEATURE_ENABLE_SATA_FEATURE,
+                                    IDE_FEATURE_DISABLE_SATA_FEATURE,
+                                    IDE_SATA_FEATURE_DEVICE_SLEEP,
+                                    IDE_SATA_FEATURE_DEVICE_SLEEP);
+        }
+    }
+
+    StorPortDebugPrint(3, "StorAHCI - LPM: Port %02d - DevSleep %s, idle timeout: %ums \n",
+                       ChannelExtension->PortNumber, enable ? "enabled" : "not used", ChannelExtension->LpmAdaptivePolicy.DevSleepIdleTimeout);
+
+    return;
+}
+
+VOID
+AhciDeviceStart (
+    __in PAHCI_CHANNEL_EXTENSION ChannelExtension
+    )
+/*
+    Running at PASSIVE_LEVEL
+
+    This function is called when IRP_MN_START_DEVICE is being processed (AhciHwUnitControl, Windows 8 and later).
+    device registry access, ACPI calls can be processed in this function.
+    Registry settings were read by AhciHwPassiveInitialize(), they are read again here to pick up changes.
+*/
+{
+    if (ChannelExtension == NULL) {
+        return;
+    }
+
+    AhciPortReadRegistrySettings(ChannelExtension);
+
+    AhciDeviceInitialize(ChannelExtension);
+
+    return;
+}
+
+
+__inline
+BOOLEAN
+IsLpmModeSetting(
+    __in PSTOR_POWER_SETTING_INFO PowerInfo
+    )
+{
+    if (PowerInfo->PowerSettingGuid.Data1 == 0x0b2d69d7) {
+        if (PowerInfo->PowerSettingGuid.Data2 == 0xa2a1){
+            if (PowerInfo->PowerSettingGuid.Data3 == 0x449c){
+                if (PowerInfo->PowerSettingGuid.Data4[0] == 0x96){
+                    if (PowerInfo->PowerSettingGuid.Data4[1] == 0x80){
+                        if (PowerInfo->PowerSettingGuid.Data4[2] == 0xf9){
+                            if (PowerInfo->PowerSettingGuid.Data4[3] == 0x1c){
+                                if (PowerInfo->PowerSettingGuid.Data4[4] == 0x70){
+                                    if (PowerInfo->PowerSettingGuid.Data4[5] == 0x52){
+                                        if (PowerInfo->PowerSettingGuid.Data4[6] == 0x1c){
+                                            if (PowerInfo->PowerSettingGuid.Data4[7] == 0x60){
+                                                return TRUE;
+                                            }  }  }  }  }  }  } }  }  }  }
+
+    return FALSE;
+}
+
+__inline
+BOOLEAN
+IsLpmAdaptiveSetting(
+    __in PSTOR_POWER_SETTING_INFO PowerInfo
+    )
 {
     if (PowerInfo->PowerSettingGuid.Data1 == 0xDAB60367) {
         if (PowerInfo->PowerSettingGuid.Data2 == 0x53FE){
@@ -1700,6 +2748,15 @@ SetAllowedLpmStates(
     if ((ChannelExtension->LastUserLpmPowerSetting == 0) ||
         !IsLPMCapablePort(ChannelExtension)) {
         lpm = 0x03; // slumber and partial disallowed
+    } else if (IsAdaptiveLpmEnabled(ChannelExtension)) {
+        // adaptive policy allows the link states that pay off for the observed idle periods.
+        if (ChannelExtension->LpmStatistics.PolicyState == LpmPolicyActive) {
+            lpm = 0x03; // slumber and partial disallowed
+        } else if (ChannelExtension->LpmStatistics.PolicyState == LpmPolicyPartial) {
+            lpm = 0x02; // partial allowed; slumber disallowed
+        } else {
+            lpm = 0x00; // partial allowed; slumber allowed
+        }
     } else {
         AHCI_COMMAND cmd;
         cmd.AsUlong = StorPortReadRegisterUlong(ChannelExtension->AdapterExtension, &ChannelExtension->Px->CMD.AsUlong);
@@ -1732,9 +2789,53 @@ SetAllowedLpmStates(
     sctl.IPM = lpm;
     StorPortWriteRegisterUlong(ChannelExtension->AdapterExtension, &ChannelExtension->Px->SCTL.AsUlong, sctl.AsUlong);
 
+    //DevSleep is only allowed with the link states below it.
+    if (ChannelExtension->StateFlags.DevSleepEnabled == 1) {
+        AhciDevSleepSetAggressive(ChannelExtension,
+                                  (lpm == 0x00) && (ChannelExtension->LpmStatistics.PolicyState == LpmPolicyDevSleep));
+    }
+
     return lpm;
 }
 
+VOID
+SetHostAutoPartialToSlumber(
+    __in PAHCI_CHANNEL_EXTENSION ChannelExtension
+    )
+/*
+    Sets PxCMD.APSTE when the HBA supports Automatic Partial to Slumber Transitions (CAP2.APST) and
+    Slumber after Partial is wanted. The HBA then does the transition, AhciAutoPartialToSlumber timer is not used.
+    Adaptive LPM policy enters Slumber directly (PxCMD.ASP) and doesn't need it.
+
+    NOTE: call before SetAllowedLpmStates(), which allows Slumber according to PxCMD.APSTE.
+*/
+{
+    AHCI_COMMAND cmd;
+    ULONG        apste = 0;
+
+    if (ChannelExtension->AdapterExtension->CAP2.APST == 0) {
+        // PxCMD.APSTE is reserved.
+        return;
+    }
+
+    if ( (ChannelExtension->LastUserLpmPowerSetting != 0) &&
+         (ChannelExtension->AutoPartialToSlumberInterval != 0) &&
+         (ChannelExtension->AdapterExtension->CAP.SSC == 1) &&
+         !IsAdaptiveLpmEnabled(ChannelExtension) ) {
+        apste = 1;
+    }
+
+    cmd.AsUlong = StorPortReadRegisterUlong(ChannelExtension->AdapterExtension, &ChannelExtension->Px->CMD.AsUlong);
+    if (cmd.APSTE != apste) {
+        cmd.APSTE = apste;
+        StorPortWriteRegisterUlong(ChannelExtension->AdapterExtension, &ChannelExtension->Px->CMD.AsUlong, cmd.AsUlong);
+    }
+
+    ChannelExtension->StateFlags.HostAutoPartialToSlumber = apste;
+
+    return;
+}
+
 BOOLEAN
 AhciLpmSettingsModes(
     __in PAHCI_CHANNEL_EXTENSION ChannelExtension,
@@ -1758,6 +2859,9 @@ Return Value:
 
     ChannelExtension->LastUserLpmPowerSetting = (UCHAR)LpmMode.AsUlong;
 
+    //Let the HBA perform Partial to Slumber transition if it's capable.
+    SetHostAutoPartialToSlumber(ChannelExtension);
+
     if (LpmMode.AsUlong == 0) {
         // Active Mode.
         //Turn LPM off as Active is chosen
@@ -1805,6 +2909,12 @@ Return Value:
             cmd.AsUlong = StorPortReadRegisterUlong(ChannelExtension->AdapterExtension, &ChannelExtension->Px->CMD.AsUlong);
             cmd.ALPE = 1;
             cmd.ASP = 0; //0 = partial, 1 = slumber
+
+            if (IsAdaptiveLpmEnabled(ChannelExtension) && (sctlIpm == 0x00)) {
+                // adaptive policy expects idle periods long enough for Slumber, let the host enter it directly.
+                cmd.ASP = 1;
+            }
+
             StorPortWriteRegisterUlong(ChannelExtension->AdapterExtension, &ChannelExtension->Px->CMD.AsUlong, cmd.AsUlong);
 
         } else if (ChannelExtension->AdapterExtension->CAP.SALP == 1) {
@@ -1895,6 +3005,9 @@ AhciPortPowerSettingNotification(
         if (interval <= 300000) {
             ChannelExtension->AutoPartialToSlumberInterval = interval;
 
+            //Let the HBA perform Partial to Slumber transition if it's capable.
+            SetHostAutoPartialToSlumber(ChannelExtension);
+
             //Set PxSCTL.IPM register for LPM allowed states.
             SetAllowedLpmStates(ChannelExtension);
         }
@@ -1905,6 +3018,7 @@ AhciPortPowerSettingNotification(
 
         userLpmPowerSettings.AsUlong = (ULONG)*((PULONG)PowerInfo->Value);
 
+        ChannelExtension->StateFlags.LpmSettingReceived = 1;
         needRestartIo = AhciLpmSettingsModes(ChannelExtension, userLpmPowerSettings);
 
         if (needRestartIo) {
@@ -2056,6 +3170,345 @@ AhciAutoPartialToSlumber(
     return;
 }
 
+UCHAR
+AhciLpmEvaluateAdaptivePolicy (
+    __in PAHCI_CHANNEL_EXTENSION ChannelExtension
+    )
+/*++
+    Chooses the deepest link state that pays off for most idle periods and whose exit latency fits in the wake latency budget.
+
+    Predicted idle time is the lower bound of the histogram bucket where the shortest quarter of idle periods ends,
+    so 3 of 4 idle periods are at least that long. The histogram reaches 2^31 us, enough to predict idle periods for DevSleep.
+    Exit latencies of Partial and Slumber are the measured ones, see AhciLpmAdaptiveWakeComplete().
+
+Return Value:
+    AHCI_LPM_POLICY_STATE
+--*/
+{
+    PAHCI_LPM_ADAPTIVE_POLICY policy = &ChannelExtension->LpmAdaptivePolicy;
+    ULONG   total = 0;
+    ULONG   count = 0;
+    ULONG   predictedIdleTime = 0;
+    ULONG   i;
+
+    for (i = 0; i < AHCI_LPM_IDLE_HISTOGRAM_BUCKETS; i++) {
+        total += policy->IdleHistogram[i];
+    }
+
+    if (total == 0) {
+        return (UCHAR)ChannelExtension->LpmStatistics.PolicyState;
+    }
+
+    for (i = 0; i < AHCI_LPM_IDLE_HISTOGRAM_BUCKETS; i++) {
+        count += policy->IdleHistogram[i];
+        if ((count * 4) > total) {
+            predictedIdleTime = (i == 0) ? 0 : ((ULONG)1 << i);
+            break;
+        }
+    }
+
+    ChannelExtension->LpmStatistics.PredictedIdleTime = predictedIdleTime;
+
+    // DevSleep pays off only if the device stays in it for longer than it takes to leave it.
+    if ( (ChannelExtension->StateFlags.DevSleepEnabled == 1) &&
+         (ChannelExtension->AdapterExtension->CAP.SSC == 1) &&
+         (policy->WakeLatencyBudget >= ChannelExtension->LpmStatistics.DevSleepExitCost) &&
+         ((ULONGLONG)predictedIdleTime > (((ULONGLONG)policy->DevSleepIdleTimeout * 1000) + ChannelExtension->LpmStatistics.DevSleepExitCost)) ) {
+        return LpmPolicyDevSleep;
+    }
+
+    if ( (policy->WakeLatencyBudget >= ChannelExtension->LpmStatistics.SlumberExitLatency) &&
+         (predictedIdleTime >= AhciLpmIdleThreshold(AHCI_LPM_SLUMBER_BREAK_EVEN_US, AHCI_LPM_SLUMBER_EXIT_LATENCY_US, ChannelExtension->LpmStatistics.SlumberExitLatency)) &&
+         (ChannelExtension->AdapterExtension->CAP.SSC == 1) ) {
+        return LpmPolicySlumber;
+    }
+
+    if ( (policy->WakeLatencyBudget >= ChannelExtension->LpmStatistics.PartialExitLatency) &&
+         (predictedIdleTime >= AhciLpmIdleThreshold(AHCI_LPM_PARTIAL_BREAK_EVEN_US, AHCI_LPM_PARTIAL_EXIT_LATENCY_US, ChannelExtension->LpmStatistics.PartialExitLatency)) ) {
+        return LpmPolicyPartial;
+    }
+
+    return LpmPolicyActive;
+}
+
+VOID
+AhciLpmApplyAdaptivePolicy (
+    __in PAHCI_CHANNEL_EXTENSION ChannelExtension
+    )
+/*++
+    Programs PxSCTL.IPM and PxCMD.ALPE/ASP for the link state chosen by adaptive policy.
+    With HIPM the host enters Slumber directly (PxCMD.ASP = 1), the software Partial to Slumber transition is not used.
+
+It assumes:
+    Called with InterruptLock held
+--*/
+{
+    AHCI_COMMAND cmd;
+    UCHAR        sctlIpm;
+
+    if ( NoLpmSupport(ChannelExtension) ||
+         !IsLPMCapablePort(ChannelExtension) ||
+         (ChannelExtension->LastUserLpmPowerSetting == 0) ) {
+        // LPM is not allowed, nothing to adapt.
+        return;
+    }
+
+    sctlIpm = SetAllowedLpmStates(ChannelExtension);
+
+    if ( ((ChannelExtension->LastUserLpmPowerSetting & 0x1) != 0) &&
+         (ChannelExtension->AdapterExtension->CAP.SALP == 1) &&
+         IsDeviceSupportsHIPM(ChannelExtension->DeviceExtension[0].IdentifyDeviceData) ) {
+
+        cmd.AsUlong = StorPortReadRegisterUlong(ChannelExtension->AdapterExtension, &ChannelExtension->Px->CMD.AsUlong);
+
+        if (sctlIpm == 0x03) {
+            cmd.ALPE = 0;
+            cmd.ASP = 0;
+        } else {
+            cmd.ALPE = 1;
+            cmd.ASP = (sctlIpm == 0x00) ? 1 : 0;    //0 = partial, 1 = slumber
+        }
+
+        StorPortWriteRegisterUlong(ChannelExtension->AdapterExtension, &ChannelExtension->Px->CMD.AsUlong, cmd.AsUlong);
+    }
+
+    return;
+}
+
+VOID
+AhciLpmAdaptiveIdleBegin (
+    __in PAHCI_CHANNEL_EXTENSION ChannelExtension
+    )
+/*++
+    Port has no command outstanding. Remember when the idle period started,
+    re-evaluate the link power policy once enough idle periods have been collected.
+
+It assumes:
+    Called with InterruptLock held
+
+Called by:
+    AhciHwInterrupt
+--*/
+{
+    PAHCI_LPM_ADAPTIVE_POLICY policy = &ChannelExtension->LpmAdaptivePolicy;
+    LARGE_INTEGER   perfCounter = {0};
+    LARGE_INTEGER   perfFrequency = {0};
+    UCHAR           policyState;
+    ULONG           i;
+
+    if (policy->IdleStartTime != 0) {
+        // idle period already started
+        return;
+    }
+
+  //1 Re-evaluate the policy and age the histogram so that it follows workload changes.
+    if ( IsAdaptiveLpmEnabled(ChannelExtension) &&
+         (policy->IdleSampleCount >= AHCI_LPM_IDLE_SAMPLE_WINDOW) ) {
+
+        policyState = AhciLpmEvaluateAdaptivePolicy(ChannelExtension);
+
+        for (i = 0; i < AHCI_LPM_IDLE_HISTOGRAM_BUCKETS; i++) {
+            policy->IdleHistogram[i] >>= 1;
+        }
+        policy->IdleSampleCount = 0;
+
+        if (policyState != ChannelExtension->LpmStatistics.PolicyState) {
+            StorPortDebugPrint(3, "StorAHCI - LPM: Port %02d - Adaptive policy changed from %u to %u, predicted idle time: %uus \n",
+                               ChannelExtension->PortNumber, ChannelExtension->LpmStatistics.PolicyState, policyState, ChannelExtension->LpmStatistics.PredictedIdleTime);
+
+            ChannelExtension->LpmStatistics.PolicyState = policyState;
+            AhciUlongIncrement(&(ChannelExtension->LpmStatistics.PolicyChangeCount));
+
+            AhciLpmApplyAdaptivePolicy(ChannelExtension);
+        }
+    }
+
+  //2 Start the idle period. Counter value stays 0 if performance counter is not available, idle periods are not collected then.
+    StorPortQueryPerformanceCounter((PVOID)ChannelExtension->AdapterExtension, &perfFrequency, &perfCounter);
+
+    policy->IdleStartTime = (ULONGLONG)perfCounter.QuadPart;
+    policy->CounterFrequency = (ULONGLONG)perfFrequency.QuadPart;
+
+    // a wake not measured by AhciLpmAdaptiveWakeComplete() (e.g. commands completed by port reset) is over.
+    policy->WakeStartTime = 0;
+
+    return;
+}
+
+VOID
+AhciLpmAdaptiveIdleEnd (
+    __in PAHCI_CHANNEL_EXTENSION ChannelExtension
+    )
+/*++
+    Command is going to be issued to an idle port. Record the idle period and account it
+    to the link state the port is leaving.
+
+It assumes:
+    Called with InterruptLock held, before PxCI is written.
+
+Called by:
+    ActivateQueue
+--*/
+{
+    PAHCI_LPM_ADAPTIVE_POLICY policy = &ChannelExtension->LpmAdaptivePolicy;
+    PAHCI_LPM_STATISTICS      statistics = &ChannelExtension->LpmStatistics;
+    LARGE_INTEGER             perfCounter = {0};
+    AHCI_SERIAL_ATA_STATUS    ssts;
+    ULONGLONG                 elapsed;
+    ULONGLONG                 idleTime;
+    ULONG                     bucket;
+
+    if ( (policy->IdleStartTime == 0) ||
+         (policy->CounterFrequency == 0) ) {
+        return;
+    }
+
+  //1 Get the length of idle period in microseconds
+    StorPortQueryPerformanceCounter((PVOID)ChannelExtension->AdapterExtension, NULL, &perfCounter);
+
+    if ((ULONGLONG)perfCounter.QuadPart < policy->IdleStartTime) {
+        policy->IdleStartTime = 0;
+        return;
+    }
+
+    elapsed = (ULONGLONG)perfCounter.QuadPart - policy->IdleStartTime;
+    policy->IdleStartTime = 0;
+
+    idleTime = (elapsed / policy->CounterFrequency) * 1000000;
+    idleTime += ((elapsed % policy->CounterFrequency) * 1000000) / policy->CounterFrequency;
+
+  //2 Add it into histogram, bucket n: [2^n, 2^(n+1)) microseconds
+    for (bucket = 0; (bucket < (AHCI_LPM_IDLE_HISTOGRAM_BUCKETS - 1)) && ((idleTime >> (bucket + 1)) != 0); bucket++) {
+        ;
+    }
+
+    AhciUlongIncrement(&(policy->IdleHistogram[bucket]));
+    policy->IdleSampleCount++;
+    AhciUlongIncrement(&(statistics->IdlePeriodCount));
+
+  //3 Account residency and wake penalty to the link state the port is leaving.
+  //  The first completion of the commands being issued measures the wake, see AhciLpmAdaptiveWakeComplete().
+    ssts.AsUlong = StorPortReadRegisterUlong(ChannelExtension->AdapterExtension, &ChannelExtension->Px->SSTS.AsUlong);
+
+    policy->WakeStartTime = (ULONGLONG)perfCounter.QuadPart;
+    policy->WakeLinkState = (UCHAR)ssts.IPM;
+
+    switch (ssts.IPM) {
+    case 0x2:   // Partial
+        statistics->PartialResidency += idleTime;
+        statistics->WakePenalty += statistics->PartialExitLatency;
+        AhciUlongIncrement(&(statistics->PartialWakeCount));
+        break;
+
+    case 0x6:   // Slumber
+        statistics->SlumberResidency += idleTime;
+        statistics->WakePenalty += statistics->SlumberExitLatency;
+        AhciUlongIncrement(&(statistics->SlumberWakeCount));
+
+        if (ChannelExtension->StateFlags.HostAutoPartialToSlumber == 1) {
+            // HBA did the transition, keep the software transition statistics meaningful.
+            AhciUlongIncrement(&(ChannelExtension->AutoPartialToSlumberDbgStats.SlumberSuccessCount));
+        }
+        break;
+
+    case 0x8:   // DevSleep
+        statistics->DevSleepResidency += idleTime;
+        statistics->WakePenalty += statistics->DevSleepExitCost;
+        AhciUlongIncrement(&(statistics->DevSleepWakeCount));
+        break;
+
+    default:
+        statistics->ActiveIdleTime += idleTime;
+        break;
+    }
+
+    return;
+}
+
+VOID
+AhciLpmAdaptiveWakeComplete (
+    __in PAHCI_CHANNEL_EXTENSION ChannelExtension
+    )
+/*++
+    The first command issued to the idle port completed. Its response time with an active link is the base line,
+    the response time after Partial, Slumber or DevSleep less the base line is the exit latency of that state.
+    The measured latencies replace the SATA spec worst case (DETO for DevSleep) in wake penalty and in the adaptive policy.
+    For DevSleep it's the time from DEVSLP deassert, when the command is issued, until the device is ready and has
+    completed the command, without the command processing time.
+
+It assumes:
+    Called with InterruptLock held, policy->WakeStartTime is not 0
+
+Called by:
+    AhciHwInterrupt
+--*/
+{
+    PAHCI_LPM_ADAPTIVE_POLICY policy = &ChannelExtension->LpmAdaptivePolicy;
+    PAHCI_LPM_STATISTICS      statistics = &ChannelExtension->LpmStatistics;
+    LARGE_INTEGER             perfCounter = {0};
+    ULONGLONG                 elapsed;
+    ULONGLONG                 responseTime;
+    ULONG                     exitLatency;
+    PULONG                    averageExitLatency;
+
+  //1 Get the response time in microseconds
+    StorPortQueryPerformanceCounter((PVOID)ChannelExtension->AdapterExtension, NULL, &perfCounter);
+
+    if ( (policy->CounterFrequency == 0) ||
+         ((ULONGLONG)perfCounter.QuadPart < policy->WakeStartTime) ) {
+        policy->WakeStartTime = 0;
+        return;
+    }
+
+    elapsed = (ULONGLONG)perfCounter.QuadPart - policy->WakeStartTime;
+    policy->WakeStartTime = 0;
+
+    responseTime = (elapsed / policy->CounterFrequency) * 1000000;
+    responseTime += ((elapsed % policy->CounterFrequency) * 1000000) / policy->CounterFrequency;
+
+    if (responseTime > AHCI_LPM_WAKE_SAMPLE_LIMIT_US) {
+        return;
+    }
+
+  //2 Active link updates the base line, running average.
+    switch (policy->WakeLinkState) {
+    case 0x2:   // Partial
+        averageExitLatency = &statistics->PartialExitLatency;
+        break;
+
+    case 0x6:   // Slumber
+        averageExitLatency = &statistics->SlumberExitLatency;
+        break;
+
+    case 0x8:   // DevSleep
+        averageExitLatency = &statistics->DevSleepExitCost;
+        break;
+
+    default:
+        if (statistics->ActiveResponseTime == 0) {
+            statistics->ActiveResponseTime = (ULONG)responseTime;
+        } else {
+            statistics->ActiveResponseTime = (ULONG)(((ULONGLONG)statistics->ActiveResponseTime * 3 + responseTime) / 4);
+        }
+        return;
+    }
+
+  //3 Partial, Slumber or DevSleep: the exit latency can only be told apart once the base line is known. Keep a running average.
+    if (statistics->ActiveResponseTime == 0) {
+        return;
+    }
+
+    if ((ULONG)responseTime > statistics->ActiveResponseTime) {
+        exitLatency = (ULONG)responseTime - statistics->ActiveResponseTime;
+    } else {
+        exitLatency = 0;
+    }
+
+    *averageExitLatency = (ULONG)(((ULONGLONG)*averageExitLatency * 3 + exitLatency) / 4);
+
+    return;
+}
+
 BOOLEAN
 AhciAdapterPowerSettingNotification(
     __in PAHCI_ADAPTER_EXTENSION AdapterExtension,
@@ -133,6 +133,16 @@ AhciPortAcpiDSMControl(
   );
 
 
+VOID
+SctErcUpdateCommands(
+    __in PAHCI_CHANNEL_EXTENSION ChannelExtension
+    );
+
+VOID
+AhciStreamingInitialize(
+    __in PAHCI_CHANNEL_EXTENSION ChannelExtension
+    );
+
 VOID
 IssuePreservedSettingCommands(
     __in PAHCI_CHANNEL_EXTENSION ChannelExtension,
@@ -173,6 +183,68 @@ AhciLpmSettingsModes(
     __in AHCI_LPM_POWER_SETTINGS LpmMode
     );
 
+VOID
+AhciLpmAdaptiveIdleBegin (
+    __in PAHCI_CHANNEL_EXTENSION ChannelExtension
+    );
+
+VOID
+AhciLpmAdaptiveIdleEnd (
+    __in PAHCI_CHANNEL_EXTENSION ChannelExtension
+    );
+
+VOID
+AhciLpmAdaptiveWakeComplete (
+    __in PAHCI_CHANNEL_EXTENSION ChannelExtension
+    );
+
+BOOLEAN
+AhciDevSleepProgramTiming (
+    __in PAHCI_CHANNEL_EXTENSION ChannelExtension
+    );
+
+VOID
+AhciDevSleepSetAggressive (
+    __in PAHCI_CHANNEL_EXTENSION ChannelExtension,
+    __in BOOLEAN Enable
+    );
+
+VOID
+AhciDevSleepRestartPort (
+    __in PAHCI_CHANNEL_EXTENSION ChannelExtension
+    );
+
+VOID
+AhciDevSleepTimingCallback (
+    __in PVOID AdapterExtension,
+    __in_opt PVOID ChannelExtension
+    );
+
+VOID
+AhciDevSleepInitialize (
+    __in PAHCI_CHANNEL_EXTENSION ChannelExtension
+    );
+
+VOID
+AhciPortReadRegistrySettings (
+    __in PAHCI_CHANNEL_EXTENSION ChannelExtension
+    );
+
+VOID
+AhciLpmAdaptiveDefaultModes (
+    __in PAHCI_CHANNEL_EXTENSION ChannelExtension
+    );
+
+VOID
+AhciDeviceApplyRegistrySettings (
+    __in PAHCI_CHANNEL_EXTENSION ChannelExtension
+    );
+
+VOID
+AhciDeviceStartWithoutUnitControl (
+    __in PAHCI_CHANNEL_EXTENSION ChannelExtension
+    );
+
 
 #if _MSC_VER >= 1200
 #pragma warning(pop)
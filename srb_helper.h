@@ -715,6 +715,29 @@ SrbGetSrbFlags(
 }
 
 
+FORCEINLINE ULONG
+SrbGetRequestPriority(
+    __in PVOID Srb
+    )
+{
+    PSTORAGE_REQUEST_BLOCK srb = Srb;
+    PSCSI_REQUEST_BLOCK_EX srbLegacy = Srb;
+    ULONG priority = IoPriorityNormal;
+
+    if (srb->Function == SRB_FUNCTION_STORAGE_REQUEST_BLOCK)
+    {
+        priority = srb->RequestPriority;
+    }
+    else if (((srbLegacy->SrbFlags & SRB_FLAGS_QUEUE_ACTION_ENABLE) != 0) &&
+             (srbLegacy->QueueAction == SRB_HEAD_OF_QUEUE_TAG_REQUEST))
+    {
+        // legacy SRB has no priority hint, head of queue request is the closest to it.
+        priority = IoPriorityHigh;
+    }
+    return priority;
+}
+
+
 FORCEINLINE PSRBEX_DATA
 SrbGetSrbExDataByType(
     __in PSTORAGE_REQUEST_BLOCK Srb,
@@ -22,6 +22,7 @@
 #define IDE_GP_LOG_NCQ_SEND_RECEIVE_ADDRESS         0x13
 #define IDE_GP_LOG_HYBRID_INFO_ADDRESS              0x14
 #define IDE_GP_LOG_REBUILD_ASSIST                   0x15
+#define IDE_GP_LOG_COMMAND_DURATION_LIMITS          0x18
 #define IDE_GP_LOG_LBA_STATUS                       0x19
 
 #define IDE_GP_LOG_WRITE_STREAM_ERROR               0x21
@@ -57,6 +58,65 @@
 
 #define IDE_SATA_FEATURE_HYBRID_INFORMATION                 0xa
 
+#ifndef MINIPORT_REG_MULTI_SZ
+#define MINIPORT_REG_MULTI_SZ                               7
+#endif
+
+#ifndef IDE_SATA_FEATURE_DEVICE_SLEEP
+#define IDE_SATA_FEATURE_DEVICE_SLEEP                       0x9
+#endif
+
+// pages of IDE_GP_LOG_IDENTIFY_DEVICE_DATA_ADDRESS
+#define IDE_GP_LOG_IDENTIFY_DEVICE_DATA_SUPPORTED_CAPABILITIES_PAGE     0x03
+#define IDE_GP_LOG_IDENTIFY_DEVICE_DATA_CURRENT_SETTINGS_PAGE           0x04
+
+// SET FEATURES - Command Duration Limits, sector count 1: enable, 0: disable
+#define IDE_FEATURE_COMMAND_DURATION_LIMITS                 0x0D
+
+// SET FEATURES - Sense Data Reporting, sector count 1: enable, 0: disable
+#define IDE_FEATURE_SENSE_DATA_REPORTING                    0xC3
+
+// NCQ Command Error log (IDE_GP_LOG_NCQ_COMMAND_ERROR_ADDRESS), byte offsets. Sense key, ASC and ASCQ are filled in by devices supporting NCQ Autosense.
+#define IDE_NCQ_ERROR_LOG_TAG                               0       // bits 4:0 - tag of the failed command
+#define IDE_NCQ_ERROR_LOG_TAG_MASK                          0x1F
+#define IDE_NCQ_ERROR_LOG_NQ                                0x80    // in byte IDE_NCQ_ERROR_LOG_TAG: the error is not for an NCQ command
+#define IDE_NCQ_ERROR_LOG_STATUS                            2
+#define IDE_NCQ_ERROR_LOG_ERROR                             3
+#define IDE_NCQ_ERROR_LOG_SENSE_KEY                         14
+#define IDE_NCQ_ERROR_LOG_ASC                               15
+#define IDE_NCQ_ERROR_LOG_ASCQ                              16
+
+#ifndef IDE_COMMAND_WRITE_LOG_EXT
+#define IDE_COMMAND_WRITE_LOG_EXT                           0x3F
+#endif
+
+// SCT Command Transport: key sector written to log IDE_GP_LOG_SCT_COMMAND_STATUS, values are in words.
+#define IDE_SCT_ACTION_ERROR_RECOVERY_CONTROL               0x0003
+#define IDE_SCT_ERC_FUNCTION_SET_TIMER                      0x0001
+#define IDE_SCT_ERC_SELECTION_READ_TIMER                    0x0001
+#define IDE_SCT_ERC_SELECTION_WRITE_TIMER                   0x0002
+#define IDE_SCT_ACTION_WRITE_SAME                           0x0002
+#define IDE_SCT_WRITE_SAME_FUNCTION_FOREGROUND_PATTERN      0x0101
+
+#ifndef IDE_COMMAND_READ_STREAM_DMA_EXT
+#define IDE_COMMAND_READ_STREAM_DMA_EXT                     0x2A
+#endif
+
+#ifndef IDE_COMMAND_WRITE_STREAM_DMA_EXT
+#define IDE_COMMAND_WRITE_STREAM_DMA_EXT                    0x3A
+#endif
+
+#ifndef IDE_COMMAND_CONFIGURE_STREAM
+#define IDE_COMMAND_CONFIGURE_STREAM                        0x51
+#endif
+
+// Streaming feature set: FEATURE 7:0 of CONFIGURE STREAM and READ/WRITE STREAM DMA EXT, FEATURE 15:8 carries the time limit (CCTL).
+#define IDE_STREAM_ID_MASK                                  0x07
+#define IDE_STREAM_CONFIGURE_ADD                            0x80    // CONFIGURE STREAM: add or replace the stream
+#define IDE_STREAM_CONTINUOUS                               0x40    // RC/WC: complete within the time limit even if data is in error
+#define IDE_STREAM_FLUSH                                    0x20    // WRITE STREAM DMA EXT: flush the stream's data to media before completion
+#define IDE_STATUS_STREAM_ERROR                             0x20    // SE, Status of streaming commands: data may be in error
+
 #define HYBRID_STATUS_ENABLE_REFCOUNT_HOLD                0x10
 
 
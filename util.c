@@ -426,6 +426,167 @@ Return Value:
     return matches;
 }
 
+ULONG
+AhciRegistryReadPortUlong (
+    __in PAHCI_CHANNEL_EXTENSION ChannelExtension,
+    __in PSTR   ValueName,
+    __in ULONG  DefaultValue
+    )
+/*++
+    Reads a REG_DWORD value from the miniport's "Parameters\Device" key.
+    A port specific value "Port<nn><ValueName>" (e.g. Port02LpmWakeLatencyBudget) takes precedence over "<ValueName>".
+
+It assumes:
+    Running at PASSIVE_LEVEL
+
+Return Value:
+    Value read from registry, DefaultValue if neither value exists.
+--*/
+{
+    UCHAR   portValueName[64];
+    PUCHAR  valueNames[2];
+    PUCHAR  buffer;
+    ULONG   bufferLength = sizeof(ULONG);
+    ULONG   nameLength;
+    ULONG   value = DefaultValue;
+    ULONG   i;
+
+    if (IsDumpMode(ChannelExtension->AdapterExtension)) {
+        return DefaultValue;
+    }
+
+    nameLength = GetStringLength(ValueName, sizeof(portValueName) - 7);
+    if (nameLength == sizeof(portValueName) - 7) {
+        // name too long to build port specific value name
+        NT_ASSERT(FALSE);
+        return DefaultValue;
+    }
+
+    //1 build port specific value name: "Port" + 2 decimal digits + ValueName
+    portValueName[0] = 'P';
+    portValueName[1] = 'o';
+    portValueName[2] = 'r';
+    portValueName[3] = 't';
+    portValueName[4] = (UCHAR)('0' + ((ChannelExtension->PortNumber / 10) % 10));
+    portValueName[5] = (UCHAR)('0' + (ChannelExtension->PortNumber % 10));
+    StorPortCopyMemory(&portValueName[6], ValueName, nameLength);
+    portValueName[6 + nameLength] = '\0';
+
+    valueNames[0] = portValueName;
+    valueNames[1] = (PUCHAR)ValueName;
+
+    //2 read value, port specific one first
+    buffer = StorPortAllocateRegistryBuffer(ChannelExtension->AdapterExtension, &bufferLength);
+
+    if ( (buffer == NULL) || (bufferLength < sizeof(ULONG)) ) {
+        if (buffer != NULL) {
+            StorPortFreeRegistryBuffer(ChannelExtension->AdapterExtension, buffer);
+        }
+        return DefaultValue;
+    }
+
+    for (i = 0; i < 2; i++) {
+        bufferLength = sizeof(ULONG);
+        AhciZeroMemory((PCHAR)buffer, sizeof(ULONG));
+
+        if ( StorPortRegistryRead(ChannelExtension->AdapterExtension,
+                                  valueNames[i],
+                                  1,                // Global: Parameters\Device
+                                  MINIPORT_REG_DWORD,
+                                  buffer,
+                                  &bufferLength) &&
+             (bufferLength == sizeof(ULONG)) ) {
+
+            value = *((PULONG)buffer);
+            break;
+        }
+    }
+
+    StorPortFreeRegistryBuffer(ChannelExtension->AdapterExtension, buffer);
+
+    return value;
+}
+
+BOOLEAN
+AhciRegistryReadMultiSz (
+    __in PAHCI_CHANNEL_EXTENSION ChannelExtension,
+    __in PSTR   ValueName,
+    __out_bcount(BufferLength) PCHAR Buffer,
+    __in ULONG  BufferLength
+    )
+/*++
+    Reads a REG_MULTI_SZ value from the miniport's "Parameters\Device" key as ASCII strings.
+    Buffer is always terminated by two NULL characters, strings not fitting in it are dropped.
+
+It assumes:
+    Running at PASSIVE_LEVEL
+
+Return Value:
+    TRUE if the value was read.
+--*/
+{
+    PUCHAR  buffer;
+    ULONG   bufferLength = BufferLength;
+    BOOLEAN result = FALSE;
+
+    AhciZeroMemory(Buffer, BufferLength);
+
+    if (IsDumpMode(ChannelExtension->AdapterExtension) || (BufferLength < 2)) {
+        return FALSE;
+    }
+
+    buffer = StorPortAllocateRegistryBuffer(ChannelExtension->AdapterExtension, &bufferLength);
+
+    if (buffer == NULL) {
+        return FALSE;
+    }
+
+    bufferLength = min(bufferLength, BufferLength);
+    AhciZeroMemory((PCHAR)buffer, bufferLength);
+
+    if (StorPortRegistryRead(ChannelExtension->AdapterExtension,
+                             (PUCHAR)ValueName,
+                             1,                // Global: Parameters\Device
+                             MINIPORT_REG_MULTI_SZ,
+                             buffer,
+                             &bufferLength)) {
+
+        // keep the last two characters as terminator of the list.
+        StorPortCopyMemory(Buffer, buffer, min(bufferLength, BufferLength - 2));
+        result = TRUE;
+    }
+
+    StorPortFreeRegistryBuffer(ChannelExtension->AdapterExtension, buffer);
+
+    return result;
+}
+
+BOOLEAN
+IsFuaOptOutDevice (
+    __in PAHCI_CHANNEL_EXTENSION ChannelExtension
+    )
+/*++
+    Checks the model number of the device against registry "FuaOptOutDevices", read by AhciPortReadRegistrySettings().
+    Each string is a model number, '?' matches any character and a trailing '*' matches the rest. e.g. "ST3000DM001*"
+
+Return Value:
+    TRUE if FUA writes should not be used for the device.
+--*/
+{
+    PATA_DEVICE_PARAMETERS deviceParameters = &ChannelExtension->DeviceExtension->DeviceParameters;
+
+    if ( (ChannelExtension->FuaOptOutDevices[0] == '\0') ||
+         (deviceParameters->VendorId[0] == '\0') ) {
+        return FALSE;
+    }
+
+    return CompareId((PSTR)deviceParameters->VendorId,
+                     sizeof(deviceParameters->VendorId) - 1,
+                     ChannelExtension->FuaOptOutDevices,
+                     sizeof(ChannelExtension->FuaOptOutDevices),
+                     NULL);
+}
+
 
 VOID
 AhciBusChangeCallback(
@@ -480,8 +641,11 @@ PortBusChangeProcess (
         StorPortWriteRegisterUlong(ChannelExtension->AdapterExtension, &ChannelExtension->Px->SCTL.AsUlong, sctl.AsUlong);
     }
 
-  //2 Kicks off the Start Channel state machine
+  //2 Kicks off the Start Channel state machine. The device may have been switched, cached INQUIRY, VPD and SMART data is dropped.
     StorPortAcquireSpinLock(ChannelExtension->AdapterExtension, InterruptLock, NULL, &lockhandle);
+    ChannelExtension->DeviceExtension->InquiryCache.Valid = FALSE;
+    SmartCacheInvalidate(ChannelExtension);
+    HotLbaReset(ChannelExtension);
     AhciPortReset(ChannelExtension, TRUE);    // all requests should be completed
     StorPortReleaseSpinLock(ChannelExtension->AdapterExtension, &lockhandle);
 
@@ -640,9 +804,11 @@ Affected Variables/Registers:
       //2.2.1 Handle everything else's marshalling
         srbToRelease = slotContent->Srb;
 
-        //Record error and status
-        srbExtension->AtaStatus = ChannelExtension->TaskFileData.STS.AsUchar;
-        srbExtension->AtaError = ChannelExtension->TaskFileData.ERR;
+        //Record error and status, unless they were taken from the NCQ Command Error log
+        if ((srbExtension->Flags & ATA_FLAGS_NCQ_ERROR_LOG) == 0) {
+            srbExtension->AtaStatus = ChannelExtension->TaskFileData.STS.AsUchar;
+            srbExtension->AtaError = ChannelExtension->TaskFileData.ERR;
+        }
 
         //2.2.2 If this was marked as needing return data, fill in the return Task File.
         if( IsReturnResults(srbExtension->Flags) ) {
@@ -754,6 +920,8 @@ Affected Variables/Registers:
     if (retrySrb) {
         srbToRelease->SrbStatus = SRB_STATUS_PENDING;
         srbExtension->RetryCount++;
+        //status and error of the retry are its own, not the ones from the NCQ Command Error log
+        srbExtension->Flags &= ~ATA_FLAGS_NCQ_ERROR_LOG;
         AhciProcessIo(ChannelExtension, srbToRelease, AtDIRQL);
     } else {
         // otherwise, complete it.
@@ -904,6 +1072,7 @@ It performs:
     1.1 Initialize variables
     2.1 Special case the slot for the local SRB
     2.2 Chose the slot circularly starting with CurrentCommandSlot
+    2.3 Lend slot 0 if all other slots are in use
     3.1 Update CurrentCommandSlot
 
 Affected Variables/Registers:
@@ -929,6 +1098,7 @@ Return Value:
   //2.1 Use slot 0 for internal commands, don't increment CCS
     if (Srb == &ChannelExtension->Local.Srb ) {
         if ((allocated & (1 << 0)) > 0) {
+            // slot 0 is lent to an IO from Storport, the caller lets the local Srb wait for it.
             srbExtension->QueueTag = 0xFF;
         } else {
             srbExtension->QueueTag = 0;
@@ -951,6 +1121,12 @@ Return Value:
         }
     }
 
+  //2.3 Slot 0 is only used as the last one, so that an internal command rarely has to wait for it.
+    if ( ((allocated & (1 << 0)) == 0) &&
+         IsReservedSlotLendable(ChannelExtension) ) {
+        srbExtension->QueueTag = 0;
+    }
+
 getout:
   //3.1 Update CurrentCommandSlot
     if (IsRequestSenseSrb(srbExtension->AtaFunction)) {
@@ -1065,6 +1241,8 @@ Affected Variables/Registers:
 
   //1 Reinitialize all the commands to send
     ChannelExtension->PersistentSettings.SlotsToSend = ChannelExtension->PersistentSettings.Slots;
+    ChannelExtension->SctErc.CommandsToSend = ChannelExtension->SctErc.Commands;
+    ChannelExtension->Streaming.StreamsToConfigure = ChannelExtension->Streaming.Streams;
     reservedSlotInUse = InterlockedBitTestAndSet((LONG*)&ChannelExtension->StateFlags, 3);    //ReservedSlotInUse field is at bit 3
 
     if (reservedSlotInUse == 1) {
@@ -1072,6 +1250,9 @@ Affected Variables/Registers:
         return;
     }
 
+    // no process owned the local Srb, a local Srb waiting for slot 0 is stale.
+    ChannelExtension->StateFlags.LocalSrbWaitingForSlot = 0;
+
   // acquire active reference for process of restore preserved settings
     if (!AtDIRQL) {
       // this is only needed if function is called at lower level than DIRQL.
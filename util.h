@@ -342,6 +342,8 @@ Return Value:
         (srbExtension->TaskFile.Current.bCommandReg == IDE_COMMAND_WRITE_MULTIPLE_EXT) ||
         (srbExtension->TaskFile.Current.bCommandReg == IDE_COMMAND_WRITE_MULTIPLE_FUA_EXT) ||
         (srbExtension->TaskFile.Current.bCommandReg == IDE_COMMAND_WRITE_DMA_QUEUED) ||
+        (srbExtension->TaskFile.Current.bCommandReg == IDE_COMMAND_READ_STREAM_DMA_EXT) ||
+        (srbExtension->TaskFile.Current.bCommandReg == IDE_COMMAND_WRITE_STREAM_DMA_EXT) ||
         (srbExtension->AtaFunction == ATA_FUNCTION_ATAPI_COMMAND) ) {
         return TRUE;
     } else {
@@ -388,13 +390,29 @@ Return Value:
         (command == IDE_COMMAND_READ_MULTIPLE_EXT) ||
         (command == IDE_COMMAND_WRITE_MULTIPLE_EXT) ||
         (command == IDE_COMMAND_WRITE_MULTIPLE_FUA_EXT) ||
-        (command == IDE_COMMAND_WRITE_DMA_QUEUED) ) {
+        (command == IDE_COMMAND_WRITE_DMA_QUEUED) ||
+        (command == IDE_COMMAND_READ_STREAM_DMA_EXT) ||
+        (command == IDE_COMMAND_WRITE_STREAM_DMA_EXT) ) {
         return TRUE;
     } else {
         return FALSE;
     }
 }    
 
+__inline
+BOOLEAN
+IsStreamingCommand (
+    __in PAHCI_SRB_EXTENSION SrbExtension
+    )
+/*++
+    Determine if a command is READ STREAM DMA EXT or WRITE STREAM DMA EXT, set by AtaSetStreamCommand().
+--*/
+{
+    return ( IsAtaCommand(SrbExtension->AtaFunction) &&
+             ((SrbExtension->TaskFile.Current.bCommandReg == IDE_COMMAND_READ_STREAM_DMA_EXT) ||
+              (SrbExtension->TaskFile.Current.bCommandReg == IDE_COMMAND_WRITE_STREAM_DMA_EXT)) );
+}
+
 __inline
 BOOLEAN
 NeedRequestSense (
@@ -424,6 +442,29 @@ IsDeviceSupportsTrim (
     return (ChannelExtension->DeviceExtension[0].IdentifyDeviceData->DataSetManagementFeature.SupportsTrim == 1);
 }
 
+BOOLEAN
+__inline
+IsDeviceSupportsWriteSameUnmap (
+    __in PAHCI_CHANNEL_EXTENSION ChannelExtension
+    )
+{
+    // WRITE SAME with UNMAP can be trimmed when trimmed blocks deterministically read as zero (word 69: bits 14 and 5).
+    return ( IsDeviceSupportsTrim(ChannelExtension) &&
+             (ChannelExtension->DeviceExtension[0].IdentifyDeviceData->AdditionalSupported.DeterministicReadAfterTrimSupported == 1) &&
+             (ChannelExtension->DeviceExtension[0].IdentifyDeviceData->AdditionalSupported.ReadZeroAfterTrimSupported == 1) );
+}
+
+BOOLEAN
+__inline
+IsZacDevice (
+    __in PAHCI_CHANNEL_EXTENSION ChannelExtension
+    )
+{
+    // host aware and host managed devices support the ZAC commands; device managed ones hide their zones.
+    return ( (ChannelExtension->DeviceExtension[0].DeviceParameters.StateFlags.ZonedModel == ATA_ZONED_MODEL_HOST_AWARE) ||
+             (ChannelExtension->DeviceExtension[0].DeviceParameters.StateFlags.ZonedModel == ATA_ZONED_MODEL_HOST_MANAGED) );
+}
+
 
 __inline
 BOOLEAN
@@ -528,6 +569,157 @@ IsDeviceGeneralPurposeLoggingSupported(
     return FALSE;
 }
 
+BOOLEAN
+__inline
+IsDeviceSupportsStreaming (
+    __in PAHCI_CHANNEL_EXTENSION ChannelExtension
+    )
+{
+    // word 84: bit 4 -- Streaming feature set. Streaming commands are 48bit commands, the device must be addressed by 48bit LBA.
+    return ( IsAtaDevice(&ChannelExtension->DeviceExtension->DeviceParameters) &&
+             Support48Bit(&ChannelExtension->DeviceExtension->DeviceParameters) &&
+             ((((PUSHORT)ChannelExtension->DeviceExtension->IdentifyDeviceData)[IDENTIFY_WORD_COMMAND_SET_SUPPORT_EXT] & 0x10) != 0) );
+}
+
+__inline
+UCHAR
+GetStreamCommandTimeLimit (
+    __in PAHCI_CHANNEL_EXTENSION ChannelExtension,
+    __in ULONG                   TimeLimit
+    )
+/*++
+    Converts a time limit in microseconds to CCTL, in units of the streaming granularity, rounded up.
+Return Value:
+    0 if there is no limit or the device doesn't report its granularity
+--*/
+{
+    ULONG granularity = ChannelExtension->Streaming.Granularity;
+
+    if ((TimeLimit == 0) || (granularity == 0)) {
+        return 0;
+    }
+
+    return (UCHAR)min((TimeLimit - 1) / granularity + 1, 0xFF);
+}
+
+__inline
+UCHAR
+GetStreamForRequest (
+    __in PAHCI_CHANNEL_EXTENSION ChannelExtension,
+    __in ULONG64                 StartingLba,
+    __in ULONG                   SectorCount,
+    __out PUCHAR                 Features,
+    __out PUCHAR                 CommandTimeLimit
+    )
+/*++
+    Finds the stream whose LBA range holds the whole request. Only streams the device accepted are used.
+    Requests are translated without InterruptLock, while PortStreamingIoctlProcess() changes the settings with it held.
+    The settings are read again if Streaming.SettingsGeneration shows they changed meanwhile.
+Return Value:
+    stream ID, AHCI_STREAM_ID_NONE if the request is not part of a stream
+    Features - FEATURE 7:0 of READ/WRITE STREAM DMA EXT: stream ID and Read/Write Continuous
+    CommandTimeLimit - FEATURE 15:8 of READ/WRITE STREAM DMA EXT (CCTL)
+--*/
+{
+    PAHCI_STREAMING streaming = &ChannelExtension->Streaming;
+    LONG            generation;
+    UCHAR           streams;
+    UCHAR           streamId;
+    UCHAR           i;
+
+    do {
+        // odd while the settings are being changed. InterlockedCompareExchange() orders the reads below after it.
+        generation = InterlockedCompareExchange(&streaming->SettingsGeneration, 0, 0);
+
+        streamId = AHCI_STREAM_ID_NONE;
+        *Features = 0;
+        *CommandTimeLimit = 0;
+
+        if ((generation & 1) != 0) {
+            continue;
+        }
+
+        streams = streaming->StreamsBound & streaming->StreamsConfigured;
+
+        for (i = 0; (i < AHCI_STREAM_COUNT) && (streams != 0); i++) {
+            if ( ((streams & (1 << i)) != 0) &&
+                 (StartingLba >= streaming->Settings[i].StartingLba) &&
+                 ((StartingLba + SectorCount) <= (streaming->Settings[i].StartingLba + streaming->Settings[i].LbaCount)) ) {
+                streamId = i;
+                *Features = i;
+                if ((streaming->Settings[i].Flags & AHCI_STREAM_FLAG_CONTINUOUS) != 0) {
+                    *Features |= IDE_STREAM_CONTINUOUS;
+                }
+                *CommandTimeLimit = streaming->CommandTimeLimit[i];
+                break;
+            }
+        }
+
+    } while ( ((generation & 1) != 0) ||
+              (generation != InterlockedCompareExchange(&streaming->SettingsGeneration, 0, 0)) );
+
+    return streamId;
+}
+
+BOOLEAN
+__inline
+IsDeviceSupportsSenseDataReporting (
+    __in PAHCI_CHANNEL_EXTENSION ChannelExtension
+    )
+{
+    // word 119: bits 15:14 -- 01b if the word is valid, bit 6 -- Sense Data Reporting feature set.
+    USHORT commandSetSupport = ((PUSHORT)ChannelExtension->DeviceExtension->IdentifyDeviceData)[IDENTIFY_WORD_COMMAND_SET_SUPPORT_EXT2];
+
+    return ( IsAtaDevice(&ChannelExtension->DeviceExtension->DeviceParameters) &&
+             ((commandSetSupport & 0xC000) == 0x4000) &&
+             ((commandSetSupport & 0x40) != 0) );
+}
+
+BOOLEAN
+__inline
+IsDeviceEnabledSenseDataReporting (
+    __in PAHCI_CHANNEL_EXTENSION ChannelExtension
+    )
+{
+    // word 120: bit 6 -- Sense Data Reporting feature set enabled.
+    return ( IsDeviceSupportsSenseDataReporting(ChannelExtension) &&
+             ((((PUSHORT)ChannelExtension->DeviceExtension->IdentifyDeviceData)[IDENTIFY_WORD_COMMAND_SET_ENABLED_EXT2] & 0x40) != 0) );
+}
+
+BOOLEAN
+__inline
+IsDeviceSupportsNcqAutosense (
+    __in PAHCI_CHANNEL_EXTENSION ChannelExtension
+    )
+{
+    // word 78: bit 7 -- NCQ Autosense, sense data of a failed NCQ command is in the NCQ Command Error log.
+    return ( IsDeviceSupportsSenseDataReporting(ChannelExtension) &&
+             ((((PUSHORT)ChannelExtension->DeviceExtension->IdentifyDeviceData)[IDENTIFY_WORD_SATA_FEATURES_SUPPORTED] & 0x80) != 0) );
+}
+
+BOOLEAN
+__inline
+IsDeviceSupportsSctWriteSame (
+    __in PAHCI_CHANNEL_EXTENSION ChannelExtension
+    )
+{
+    // word 206: bit 0 -- SCT Command Transport, bit 2 -- SCT Write Same. SCT commands are sent by WRITE LOG EXT.
+    return ( IsDeviceGeneralPurposeLoggingSupported(ChannelExtension) &&
+             ((((PUSHORT)ChannelExtension->DeviceExtension[0].IdentifyDeviceData)[IDENTIFY_WORD_SCT_COMMAND_TRANSPORT] & 0x5) == 0x5) );
+}
+
+__inline
+ULONG
+GetWriteSameMaxBlockCount (
+    __in PAHCI_CHANNEL_EXTENSION ChannelExtension
+    )
+{
+    // the limit is in bytes, a device with larger logical sectors fills the same amount per command.
+    ULONG bytesPerSector = BytesPerLogicalSector(&ChannelExtension->DeviceExtension[0].DeviceParameters);
+
+    return AHCI_WRITE_SAME_MAX_BYTES / max(bytesPerSector, ATA_BLOCK_SIZE);
+}
+
 __inline
 BOOLEAN
 IsD3ColdAllowed(
@@ -829,6 +1021,11 @@ IsFuaSupported(
     __in PAHCI_CHANNEL_EXTENSION ChannelExtension
     )
 {
+    // FUA bit in FPDMA QUEUED command while NCQ is activated, WRITE DMA FUA EXT after falling back to non-NCQ commands.
+    if (ChannelExtension->StateFlags.NCQ_Activated == 1) {
+        return (ChannelExtension->DeviceExtension->DeviceParameters.StateFlags.NcqFuaSupported == 1);
+    }
+
     return (ChannelExtension->DeviceExtension->DeviceParameters.StateFlags.FuaSupported == 1);
 }
 
@@ -850,6 +1047,15 @@ IsDeviceSupportsDIPM(
     return (IdentifyDeviceData->SerialAtaFeaturesSupported.DIPM == TRUE);
 }
 
+__inline
+BOOLEAN
+IsDeviceSupportsDevSleep(
+    __in PIDENTIFY_DEVICE_DATA IdentifyDeviceData
+    )
+{
+    return (IdentifyDeviceData->SerialAtaFeaturesSupported.DEVSLP == TRUE);
+}
+
 __inline
 BOOLEAN
 NoLpmSupport(
@@ -941,12 +1147,134 @@ IsNCQSupported(
          (ChannelExtension->AdapterExtension->CAP.SNCQ == 1) &&
          (ChannelExtension->DeviceExtension->IdentifyDeviceData->SerialAtaCapabilities.NCQ == 1) &&
          (ChannelExtension->DeviceExtension->IdentifyDeviceData->QueueDepth > 1) ) {
-        //Queue Depth is a 0 based value (i.e. 0x0 == 1). StorAHCI reserves slot 0 for internal use.
+        //Queue Depth is a 0 based value (i.e. 0x0 == 1).
         return TRUE;
     }
     return FALSE;
 }
 
+__inline
+UCHAR
+GetEffectiveQueueDepth(
+    __in PAHCI_CHANNEL_EXTENSION ChannelExtension
+    )
+{
+    // number of NCQ commands the device may have outstanding: the device's limit, lowered by adaptive queue depth.
+    UCHAR queueDepth = ChannelExtension->DeviceExtension[0].DeviceParameters.MaxDeviceQueueDepth;
+
+    if ( ChannelExtension->AdaptiveQueueDepth.Enabled &&
+         (ChannelExtension->AdaptiveQueueDepth.QueueDepth < queueDepth) ) {
+        queueDepth = ChannelExtension->AdaptiveQueueDepth.QueueDepth;
+    }
+
+    return queueDepth;
+}
+
+__inline
+BOOLEAN
+IsNcqPrioritySupported(
+    __in PAHCI_CHANNEL_EXTENSION ChannelExtension
+    )
+{
+    return ( (ChannelExtension->StateFlags.NCQ_Activated == 1) &&
+             (ChannelExtension->DeviceExtension->IdentifyDeviceData->SerialAtaCapabilities.NcqPriority == 1) );
+}
+
+__inline
+BOOLEAN
+IsHighPriorityIo(
+    __in PAHCI_CHANNEL_EXTENSION ChannelExtension,
+    __in PSCSI_REQUEST_BLOCK_EX  Srb,
+    __in BOOLEAN                 ReadRequest
+    )
+/*++
+    Maps the IO priority hint of a read/write request to the high priority class, according to the port's IoPriorityClass.
+--*/
+{
+    ULONG priority = SrbGetRequestPriority(Srb);
+
+    switch (ChannelExtension->IoPriorityClass) {
+    case AhciIoPriorityClassHint:
+        return (priority >= IoPriorityHigh);
+
+    case AhciIoPriorityClassReads:
+        return ( (priority >= IoPriorityHigh) ||
+                 (ReadRequest && (priority == IoPriorityNormal)) );
+
+    default:
+        return FALSE;
+    }
+}
+
+__inline
+BOOLEAN
+IsCommandDurationLimitsEnabled (
+    __in PAHCI_CHANNEL_EXTENSION ChannelExtension
+    )
+{
+    // configured by registry "CommandDurationLimits", reported by the device and used with NCQ commands only.
+    // AhciDeviceInitialize() enables the feature on the device.
+    return ( ChannelExtension->CommandDurationLimits.Configured &&
+             (ChannelExtension->DeviceExtension->SupportedCommands.CommandDurationLimits == 1) &&
+             (ChannelExtension->StateFlags.NCQ_Activated == 1) );
+}
+
+__inline
+UCHAR
+GetCommandDurationLimitIndex (
+    __in PAHCI_CHANNEL_EXTENSION ChannelExtension,
+    __in PSCSI_REQUEST_BLOCK_EX  Srb,
+    __in PCDB                    Cdb,
+    __in ULONG                   CdbLength
+    )
+/*++
+    Returns the Command Duration Limits descriptor index (1-7) for an NCQ read or write, 0 for no limit.
+    The DLD bits of READ(16)/WRITE(16) take precedence over the descriptor configured for the IO priority hint.
+--*/
+{
+    PUCHAR  cdb = (PUCHAR)Cdb;
+    UCHAR   index = 0;
+    ULONG   priority;
+
+    if (!IsCommandDurationLimitsEnabled(ChannelExtension)) {
+        return 0;
+    }
+
+    if (CdbLength == 16) {
+        // DLD2 is bit 0 of byte 1, DLD1 and DLD0 are bits 7:6 of byte 14.
+        index = (UCHAR)(((cdb[1] & 0x1) << 2) | ((cdb[14] >> 6) & 0x3));
+    }
+
+    if (index == 0) {
+        priority = SrbGetRequestPriority(Srb);
+
+        if (priority >= IoPriorityHigh) {
+            index = ChannelExtension->CommandDurationLimits.HighPriorityIndex;
+        } else if (priority < IoPriorityNormal) {
+            index = ChannelExtension->CommandDurationLimits.LowPriorityIndex;
+        }
+    }
+
+    return index;
+}
+
+__inline
+BOOLEAN
+IsCommandDurationLimitExceeded (
+    __in PAHCI_SRB_EXTENSION SrbExtension
+    )
+/*++
+    A command sent with a descriptor index that the device aborted with sense data available was stopped by the
+    policy of its limit descriptor.
+--*/
+{
+    return ( IsNcqReadWriteCommand(SrbExtension) &&
+             (SrbExtension->CommandDurationLimitIndex != 0) &&
+             ((SrbExtension->AtaError & IDE_ERROR_COMMAND_ABORTED) != 0) &&
+             ((SrbExtension->AtaStatus & ATA_STATUS_SENSE_DATA_AVAILABLE) != 0) );
+}
+
+
 __inline
 ULONG
 GetOccupiedSlots (
@@ -960,6 +1288,30 @@ GetOccupiedSlots (
              ChannelExtension->SlotManager.CommandsToComplete );
 }
 
+__inline
+BOOLEAN
+IsReservedSlotLendable (
+    __in PAHCI_CHANNEL_EXTENSION ChannelExtension
+    )
+{
+    // slot 0 is reserved for the local Srb. It's lent to IO from Storport when the port queue depth counts it
+    // and no internal command (init commands, preserved settings) is in process.
+    return ( (ChannelExtension->MaxPortQueueDepth > ChannelExtension->AdapterExtension->CAP.NCS) &&
+             (ChannelExtension->StateFlags.ReservedSlotInUse == 0) &&
+             (ChannelExtension->StateFlags.LocalSrbWaitingForSlot == 0) );
+}
+
+__inline
+BOOLEAN
+IsLocalSrbInUse (
+    __in PAHCI_CHANNEL_EXTENSION ChannelExtension
+    )
+{
+    // slot 0 being occupied doesn't mean the local Srb is in use, it may be lent to IO from Storport.
+    return ( (ChannelExtension->StateFlags.LocalSrbWaitingForSlot == 1) ||
+             (ChannelExtension->Slot[0].Srb == &ChannelExtension->Local.Srb) );
+}
+
 __inline
 BOOLEAN
 ErrorRecoveryIsPending (
@@ -968,7 +1320,50 @@ ErrorRecoveryIsPending (
 {
     return ( (ChannelExtension->StateFlags.CallAhciReset == 1) ||
              (ChannelExtension->StateFlags.CallAhciReportBusChange == 1) ||
-             (ChannelExtension->StateFlags.CallAhciNonQueuedErrorRecovery == 1) );
+             (ChannelExtension->StateFlags.CallAhciNonQueuedErrorRecovery == 1) ||
+             (ChannelExtension->StateFlags.CallAhciNcqErrorRecovery == 1) );
+}
+
+__inline
+BOOLEAN
+IsNcqErrorRecoveryAllowed (
+    __in PAHCI_CHANNEL_EXTENSION ChannelExtension
+    )
+/*++
+    An NCQ error can be recovered by reading the NCQ Command Error log instead of COMRESET:
+    the log is supported, NCQ has worked on the device and the Sense SRB is free to read the log.
+--*/
+{
+    return ( ChannelExtension->NcqAutosense.Enabled &&
+             !IsDumpMode(ChannelExtension->AdapterExtension) &&
+             (ChannelExtension->DeviceExtension->SupportedGPLPages.SinglePage.NcqCommandError == 1) &&
+             (ChannelExtension->StateFlags.NCQ_Succeeded == 1) &&
+             (ChannelExtension->StateFlags.NcqErrorLogPending == 0) &&
+             (ChannelExtension->Sense.SrbExtension != NULL) &&
+             (ChannelExtension->Sense.SrbExtension->AtaFunction == 0) );
+}
+
+__inline
+BOOLEAN
+IsSdbFisCompletionAllowed (
+    __in PAHCI_CHANNEL_EXTENSION ChannelExtension,
+    __in AHCI_INTERRUPT_STATUS   PxIS
+    )
+{
+    AHCI_INTERRUPT_STATUS sdbsOnly;
+    ULONG                 issued = ChannelExtension->SlotManager.CommandsIssued;
+
+    // only a plain Set Device Bits interrupt without error, while only NCQ commands are outstanding.
+    sdbsOnly.AsUlong = 0;
+    sdbsOnly.SDBS = 1;
+
+    return ( (ChannelExtension->SdbFisCompletion == TRUE) &&
+             (PxIS.AsUlong == sdbsOnly.AsUlong) &&
+             (issued != 0) &&
+             ((issued & ~ChannelExtension->ShadowNcqIssued) == 0) &&
+             (ChannelExtension->ReceivedFIS->SetDeviceBitsFis.Error == 0) &&
+             ((ChannelExtension->ReceivedFIS->SetDeviceBitsFis.Status_Lo & 0x1) == 0) &&
+             !ErrorRecoveryIsPending(ChannelExtension) );
 }
 
 __inline
@@ -993,6 +1388,38 @@ PortClearPendingInterrupt (
     StorPortWriteRegisterUlong(ChannelExtension->AdapterExtension, ChannelExtension->AdapterExtension->IS, (1 << ChannelExtension->PortNumber));
 }
 
+__inline
+BOOLEAN
+IsAdaptiveLpmEnabled (
+    __in PAHCI_CHANNEL_EXTENSION ChannelExtension
+    )
+{
+    return (ChannelExtension->LpmAdaptivePolicy.WakeLatencyBudget != 0);
+}
+
+__inline
+ULONG
+AhciLpmIdleThreshold (
+    __in ULONG BreakEven,
+    __in ULONG SpecExitLatency,
+    __in ULONG MeasuredExitLatency
+    )
+{
+    // break even idle time of a link state with its measured exit latency instead of the SATA spec one it was figured with.
+    return (BreakEven - SpecExitLatency + MeasuredExitLatency);
+}
+
+__inline
+BOOLEAN
+IsLinkIdleAccountingEnabled (
+    __in PAHCI_CHANNEL_EXTENSION ChannelExtension
+    )
+{
+    // link state changes are not driven by software, residency is sampled from PxSSTS when port leaves idle.
+    return ( IsAdaptiveLpmEnabled(ChannelExtension) ||
+             (ChannelExtension->StateFlags.HostAutoPartialToSlumber == 1) );
+}
+
 __inline
 BOOLEAN
 PartialToSlumberTransitionIsAllowed (
@@ -1017,6 +1444,16 @@ PartialToSlumberTransitionIsAllowed (
         return FALSE;
     }
 
+    if (IsAdaptiveLpmEnabled(ChannelExtension)) {
+        //Adaptive policy lets the host enter Slumber directly (PxCMD.ASP) when idle periods are long enough.
+        return FALSE;
+    }
+
+    if ( (ChannelExtension->AdapterExtension->CAP2.APST != 0) && (CMD.APSTE != 0) ) {
+        //Host performs Partial to Slumber transition, for both host and device initiated Partial.
+        return FALSE;
+    }
+
     if (ChannelExtension->StartState.ChannelNextStartState != StartComplete) {
         //port is not started yet
         return FALSE;
@@ -1152,6 +1589,26 @@ GetStringLength (
     __in ULONG  MaxLength
     );
 
+ULONG
+AhciRegistryReadPortUlong (
+    __in PAHCI_CHANNEL_EXTENSION ChannelExtension,
+    __in PSTR   ValueName,
+    __in ULONG  DefaultValue
+    );
+
+BOOLEAN
+AhciRegistryReadMultiSz (
+    __in PAHCI_CHANNEL_EXTENSION ChannelExtension,
+    __in PSTR   ValueName,
+    __out_bcount(BufferLength) PCHAR Buffer,
+    __in ULONG  BufferLength
+    );
+
+BOOLEAN
+IsFuaOptOutDevice (
+    __in PAHCI_CHANNEL_EXTENSION ChannelExtension
+    );
+
 __inline
 VOID
 AhciUlongIncrement(
@@ -1164,3 +1621,43 @@ AhciUlongIncrement(
     }
 }
 
+__inline
+VOID
+SmartCacheInvalidate(
+    __in PAHCI_CHANNEL_EXTENSION ChannelExtension
+    )
+{
+    // the device may return different SMART data now, read it from device next time.
+    ULONG   i;
+    BOOLEAN cached = FALSE;
+
+    for (i = 0; i < AhciSmartCacheEntryCount; i++) {
+        if (ChannelExtension->SmartCache.Entry[i].Timestamp != 0) {
+            ChannelExtension->SmartCache.Entry[i].Timestamp = 0;
+            cached = TRUE;
+        }
+    }
+
+    if (cached) {
+        AhciUlongIncrement(&ChannelExtension->SmartCacheStatistics.InvalidateCount);
+    }
+}
+
+__inline
+VOID
+HotLbaReset(
+    __in PAHCI_CHANNEL_EXTENSION ChannelExtension
+    )
+{
+    // the device may have been switched, start the heat map over. A promotion in progress stops at its next completion.
+    PAHCI_HOT_LBA hotLba = &ChannelExtension->HotLba;
+
+    hotLba->CandidateCount = 0;
+    hotLba->NextCandidate = 0;
+    hotLba->PromotedCount = 0;
+    hotLba->IntervalStart = 0;
+
+    AhciZeroMemory((PCHAR)hotLba->Top, sizeof(hotLba->Top));
+    AhciZeroMemory((PCHAR)hotLba->Sketch, sizeof(hotLba->Sketch));
+}
+